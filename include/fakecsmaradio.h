@@ -12,14 +12,19 @@
 #include <time.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <assert.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
 int filter_and_enqueue_packet_for_client(int from,int to, long long delivery_time,
 					 uint8_t *packet_in,int packet_len);
 long long gettime_ms();
 
 #include "fec-3.0.1/fixed.h"
-void encode_rs_8(data_t *data, data_t *parity,int pad);
-int decode_rs_8(data_t *data, int *eras_pos, int no_eras, int pad);
+#include "virtualclock.h"
+#include "rs_fast.h"
 #define FEC_LENGTH 32
 #define FEC_MAX_BYTES 223
 
@@ -43,13 +48,32 @@ struct client {
   unsigned char buffer[CLIENT_BUFFER_SIZE];
   int buffer_count;
 
-  // Buffer holding received packet ready for sending when transmission
-  // time actually expires.
-  unsigned char rx_queue[CLIENT_BUFFER_SIZE];
-  int rx_queue_len;
-  long long rx_embargo;
-  int rx_colission;
-  
+  // Our own handle on the slave side of the pty, so that we can see how much
+  // the LBARD has yet to read, and so that the master doesn't see a hangup
+  // whenever LBARD closes the port.
+  int tty_fd;
+  // When virtual clock mode last saw the LBARD make progress reading
+  int tty_queued;
+  long long tty_progress_time;
+
+  // The radio is receiving until this time, and a packet that arrives before
+  // then collides with the one we were already receiving.
+  long long rx_busy_until;
+  struct radio_event *rx_busy_event;
+};
+
+// A packet on its way from one radio to another, delivered when its
+// transmission time has elapsed.
+struct radio_event {
+  long long time;
+  // Breaks ties between events due at the same time, so that they are
+  // delivered in the order they were sent
+  long long sequence;
+  int from;
+  int to;
+  int colission;
+  int packet_len;
+  unsigned char packet[512];
 };
 
 #define MAX_CLIENTS 1024
@@ -57,7 +81,9 @@ extern struct client clients[MAX_CLIENTS];
 extern int client_count;
 
 int rfd900_setbitrate(char *b);
-int release_pending_packets(int i);
+// Whether HF calls and AMDs that overlap are lost
+extern int hf_collisions;
+int release_pending_packets(void);
 
 int rfd900_read_byte(int client,unsigned char byte);
 int hfcodan_read_byte(int client,unsigned char c);
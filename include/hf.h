@@ -15,19 +15,33 @@ struct hf_station {
   int link_time_target; // minutes
   int line_time_interval; // hours
 
-  // Next target link time
+  // Next target link time (ms, on the monotonic clock like now_ms)
   // (calculated using a pro-rata extension of line_time_interval based on the
   // duration of the last link).
-  time_t next_link_time;
+  long long next_link_time;
 
   // Time for next hangup, based on aiming for a call to have a maximum duration of
   // linke_time_target.
-  time_t hangup_time;
+  long long hangup_time;
 
   // How many successive failures in connecting to this station
   // (used to condition the selection of which station to talk to.  Basically if we
   // keep failing to connect, then we will be more likely to try other stations first)
   int consecutive_connection_failures;
+
+  // How long our links with this station last (ms, a running average, 0 until
+  // we have seen one end)
+  long long link_duration;
+
+  // How long they take to answer our turn, and to send each next fragment of
+  // theirs, once we start waiting for them (ms, smoothed, and their mean
+  // deviations), and how many times in a row we have talked over each other
+  // (see hf_turnaround_wait())
+  long long response_latency;
+  long long response_deviation;
+  long long fragment_interval;
+  long long fragment_deviation;
+  int collisions;
 };
 
 #define MAX_HF_STATIONS 1024
@@ -35,12 +49,13 @@ struct hf_station {
 extern int hf_state;
 extern int hf_link_partner;
 
-extern time_t hf_next_call_time;
+// These are all in ms, on the monotonic clock (see now_ms)
+extern long long hf_next_call_time;
 
-extern time_t last_link_probe_time;
+extern long long last_link_probe_time;
 
-extern time_t hf_next_packet_time;
-extern time_t last_outbound_call;
+extern long long hf_next_packet_time;
+extern long long last_outbound_call;
 
 extern int hf_callout_duty_cycle;
 extern int hf_callout_interval; // minutes
@@ -50,7 +65,7 @@ extern int hf_station_count;
 
 extern int has_hf_plan;
 
-extern time_t last_ready_report_time;
+extern long long last_ready_report_time;
 
 extern int ale_inprogress;
 extern char hf_response_line[1024];
@@ -58,12 +73,175 @@ extern int hf_rl_len;
 
 extern int hf_message_sequence_number;
 
+// A packet being sent a fragment at a time.  ALE messages take seconds each
+// to go out, so rather than waiting for each in turn, the driver's service
+// loop steps this along, and we get on with everything else in between.
+struct hf_tx {
+  int state;
+  unsigned char packet[256];
+  int len;
+  // The fragment we are sending
+  int offset;
+  int pieces;
+  // How the fragments are encoded, and so how much of the packet each holds
+  int ascii64;
+  int fragment_bytes;
+  // When the next step is due, and when we give up on the whole packet
+  long long due;
+  long long deadline;
+  // The command that sends the current fragment, in case it must be repeated
+  char message[8192];
+  // What the radio has said about it so far
+  int accepted;
+  int rejected;
+  // Whether we will send another packet straight after this one
+  int more;
+  long long started;
+  // Whether we have heard someone else sending while we were
+  int collided;
+};
+#define HF_TX_IDLE 0
+// Waiting to hand the next fragment to the radio
+#define HF_TX_PRESEND 1
+// Waiting for the radio to confirm the fragment
+#define HF_TX_SENDING 2
+
+// Bytes of packet per fragment.  ALE messages are limited to 90 characters,
+// of which 3 are the fragment header, so hex fits 43 bytes.  ASCII-64
+// fragments have a 4th header character, with the number of bytes in the
+// fragment, then fit 21 groups of 3 bytes in 4 characters, and 1 more byte in
+// 2 characters.
+#define HF_FRAGMENT_BYTES 43
+#define HF_FRAGMENT_BYTES_ASCII64 64
+// The byte count of an ASCII-64 fragment, from 1 to 64, is sent as this plus
+// the count, so that it stays in the ASCII-64 character set
+#define HF_ASCII64_COUNT_BASE (0x20-1)
+// Appended to hex fragments to say we can receive ASCII-64 ones.  Old LBARDs
+// only look at pairs of hex digits, so ignore it.  It also tells us that a
+// fragment wasn't cut short.
+#define HF_ASCII64_CAPABLE '+'
+// ASCII-64 fragments use the 8 sequence characters after the hex ones
+#define HF_SEQUENCE_ASCII64 8
+// How long we give a whole packet to get through
+#define HF_TX_TIMEOUT_MS 90000
+// Pause before each fragment, to let the radio finish whatever it was saying
+#define HF_TX_PRESEND_DELAY_MS 100
+
+extern struct hf_tx hf_tx;
+
+// Setting up a link and turning it around cost far more airtime than a
+// packet, so we send several packets back to back in each turn, as many as
+// we expect to have time for in the link.
+struct hf_batch {
+  // Packets to send this turn, and how many we have sent
+  int size;
+  int sent;
+  // When the current link came up (0 if there isn't one)
+  long long link_start;
+  // Running averages of how long links last (with any station), and how long
+  // each packet takes to send (ms)
+  long long link_duration;
+  long long packet_airtime;
+};
+#define HF_BATCH_MAX 6
+// Each turn takes no more than this share of what we expect is left of the
+// link, so that the other side gets a go
+#define HF_BATCH_SHARE 2
+// Until we have seen some
+#define HF_LINK_DURATION_GUESS_MS (5*60000LL)
+#define HF_PACKET_AIRTIME_GUESS_MS 60000
+// Added to the number of pieces in the fragment header when another packet
+// follows in the same turn.  We only batch packets to stations that can take
+// ASCII-64, which know to look for it.
+#define HF_PIECES_MORE 8
+
+extern struct hf_batch hf_batch;
+// Most packets to send in a turn (1 to send them one at a time, as we used to)
+extern int hf_batch_limit;
+
+// How long we wait for the other side is measured, rather than fixed, unless
+// the plan says "fixed turnaround"
+extern int hf_turnaround_fixed;
+extern long long hf_wait_start;
+extern int hf_awaiting_answer;
+extern int hf_their_turn;
+// Who we have heard on the current link, as they may all be wanting a turn
+#define HF_LINK_SENDERS_MAX 16
+extern char hf_link_senders[HF_LINK_SENDERS_MAX][16];
+extern int hf_link_sender_count;
+extern struct hf_station hf_unknown_station;
+// We wait at least this long, so as not to jump in while they are still
+// turning around, and at most this long, in case they have gone quiet
+#define HF_TURNAROUND_MIN_MS 1000
+#define HF_TURNAROUND_MAX_MS 60000
+// After each collision we back off for a random number of slots, up to
+// 2^collisions (but no more than 2^HF_BACKOFF_MAX_EXPONENT).  A slot is the
+// time between their fragments, as that is about how long one takes to send.
+#define HF_BACKOFF_MAX_EXPONENT 4
+// (and for calls, which take about this long)
+#define HF_CALL_BACKOFF_SLOT_MS 5000
+
+// Set once the station at the other end of the current link has shown that
+// it can receive ASCII-64 fragments.  Until then we send hex.
+extern int hf_peer_ascii64;
+
 
 int hf_radio_check_if_ready(void);
 int hf_radio_mark_ready(void);
 int hf_next_station_to_call(void);
 int hf_radio_pause_for_turnaround(void);
-int hf_process_fragment(char *fragment);
+int hf_process_fragment(char *sender,char *fragment);
+int hf_link_established(void);
+int hf_link_closed(void);
+int hf_batch_choose(void);
+long long hf_turnaround_wait(void);
+int hf_call_failed(void);
+int hf_station_by_name(char *name);
+
+// Packets being put back together from their fragments (see reassembly.c)
+struct hf_reassembly {
+  int in_use;
+  // Who sent it, and its sequence number (0-15, i.e., including whether it
+  // is in ASCII-64), which together say which packet it is
+  char sender[16];
+  int peer_radio;
+  int sequence;
+  int pieces;
+  // Bit mask of the pieces we have
+  int received;
+  int delivered;
+  // Not known until we get the last piece
+  int length;
+  // The sender ends its hex fragments with HF_ASCII64_CAPABLE, and whether
+  // the last piece we have did (if not, it may have been cut short)
+  int marked;
+  int last_marked;
+  long long last_fragment_time;
+  unsigned char packet[256];
+  // Bytes that arrived garbled
+  unsigned char erased[256];
+};
+#define HF_REASSEMBLY_SLOTS 8
+// How long after the last fragment of a packet we give up on the rest.
+// (Each fragment takes seconds, and the other side may be retrying, or
+// have let another station have a turn)
+#define HF_REASSEMBLY_TIMEOUT_MS (2*HF_TX_TIMEOUT_MS)
+
+extern struct hf_reassembly hf_reassembly[HF_REASSEMBLY_SLOTS];
+// Called with each reassembled packet, and the bytes of it that are missing
+extern int (*hf_packet_handler)(unsigned char *packet,int len,
+				int *erasures,int erasure_count);
+
+int hf_fragment_sender(char c,int *peer_radio,int *sequence,int *ascii64);
+int hf_fragment_pieces(char c,int *more);
+int hf_fragment_decode(char *fragment,unsigned char *packet,int packet_len,
+		       unsigned char *erased);
+int hf_reassembly_add(char *sender,char *fragment);
+int hf_reassembly_expire(void);
+int hf_tx_start(unsigned char *packet,int len);
+int hf_tx_fragment(char *fragment,char sequence_base);
+int hf_tx_fragment_sent(void);
+int hf_tx_abort(char *reason);
 char *radio_type_name(int radio_type);
 char *radio_type_description(int radio_type);
 
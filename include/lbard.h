@@ -43,11 +43,32 @@ extern int target_transmissions_per_4seconds;
 // 1 byte : size and meshms flag byte
 #define BAR_LENGTH (8+8+4+1)
 
-struct segment_list {
+/*
+  Reassembly state for the manifest or body of a bundle we are receiving.
+  Pieces are copied straight into place in a flat buffer, and we keep a bitmap
+  of which 64 byte blocks we have in their entirety.  The odd block that we have
+  only some of (e.g., from a piece that doesn't start or end on a 64 byte boundary)
+  is tracked byte-by-byte in the small fringe list until it fills up.
+*/
+#define PARTIAL_BLOCK_SIZE 64
+#define PARTIAL_MAX_FRINGE 16
+// Refuse to reassemble anything bigger than this, so that a bogus length or
+// offset can't make us allocate silly amounts of memory.
+#define PARTIAL_MAX_STREAM_LENGTH (16*1024*1024)
+
+struct partial_fringe {
+  int block;
+  unsigned long long mask; // bit n = byte n of the block
+};
+
+struct partial_stream {
   unsigned char *data;
-  int start_offset;
-  int length;
-  struct segment_list *prev,*next;
+  int alloc;                // bytes allocated for data
+  unsigned char *received;  // one bit per complete 64 byte block
+  int blocks_received;
+  int first_missing_block;  // all blocks before this one are complete
+  int fringe_count;
+  struct partial_fringe fringe[PARTIAL_MAX_FRINGE];
 };
 
 struct recent_sender {
@@ -67,10 +88,10 @@ struct partial_bundle {
 
   int recent_bytes;
   
-  struct segment_list *manifest_segments;
+  struct partial_stream manifest_stream;
   int manifest_length;
 
-  struct segment_list *body_segments;
+  struct partial_stream body_stream;
   int body_length;
 
   struct recent_senders senders;
@@ -104,6 +125,11 @@ struct peer_state {
   int rssi_counter;
   // Used to show number of missed packets in the stats display
   int missed_packet_count;
+  // The above for the last complete status interval, which is what the
+  // status pages show
+  int status_rssi_accumulator;
+  int status_rssi_counter;
+  int status_missed_packet_count;
   
 #ifdef SYNC_BY_BAR
   // BARs we have seen from them.
@@ -121,6 +147,8 @@ struct peer_state {
   int tx_bundle_priority;
   int tx_bundle_manifest_offset;
   int tx_bundle_body_offset;
+  // Pick a random manifest start point once the manifest is in the cache
+  int tx_bundle_manifest_offset_pending;
 
   // These get set to offsets provided in an ACK('A') packet,
   // so that we avoid resending stuff that has been definitively acknowledged by
@@ -197,6 +225,7 @@ extern long long last_message_update_time;
 extern long long congestion_update_time;
 extern int message_update_interval;
 extern int message_update_interval_randomness;
+extern int load_rhizome_db_socket;
 extern long long last_message_update_time;
 extern long long congestion_update_time;
 
@@ -307,9 +336,12 @@ extern unsigned int my_instance_id;
 extern struct peer_state *peer_records[MAX_PEERS];
 extern int peer_count;
 
+#ifndef MAX_BUNDLES
 #define MAX_BUNDLES 10000
+#endif
 extern struct bundle_record bundles[MAX_BUNDLES];
 extern int bundle_count;
+extern int bid_sorted[MAX_BUNDLES];
 
 extern char *bid_of_cached_bundle;
 extern long long cached_version;
@@ -319,6 +351,12 @@ extern int cached_manifest_encoded_len;
 extern unsigned char *cached_manifest_encoded;
 extern int cached_body_len;
 extern unsigned char *cached_body;
+extern int bundle_cache_max_entries;
+extern long long bundle_cache_max_bytes;
+extern int bundle_cache_hits;
+extern int bundle_cache_misses;
+extern int bundle_cache_evictions;
+int bundle_cache_report_json(FILE *f);
 
 extern unsigned int option_flags;
 #define FLAG_NO_RANDOMIZE_REDIRECT_OFFSET 1
@@ -375,15 +413,33 @@ int parse_json_line(char *line,char fields[][8192],int num_fields);
 int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
 			  unsigned char *body_data,int body_length,
 			  char *servald_server,char *credential);
+int rhizome_queue_import(unsigned char *manifest_data,int manifest_length,
+			 unsigned char *body,int body_length,
+			 char *servald_server,char *credential);
+int rhizome_import_service(void);
+int rhizome_import_pending(void);
+int rhizome_import_report_json(FILE *f);
 int prime_bundle_cache(int bundle_number,char *prefix,
 		       char *servald_server, char *credential);
 int hex_byte_value(char *hexstring);
 int find_highest_priority_bundle(void);
+int find_highest_priority_bundle_linear(void);
+void bundle_priorities_invalidate(void);
+void bundle_priority_update(int i);
+long long bundle_priority(int i);
 int find_highest_priority_bar(void);
 int find_peer_by_prefix(char *peer_prefix);
 int clear_partial(struct partial_bundle *p);
 int dump_partial(struct partial_bundle *p);
-int merge_segments(struct segment_list **s);
+int partial_stream_set_length(struct partial_stream *s,int length);
+int partial_stream_add(struct partial_stream *s,int length,
+		       int offset,int bytes,unsigned char *data);
+int partial_stream_have_byte(struct partial_stream *s,int offset);
+int partial_stream_have_block(struct partial_stream *s,int block);
+int partial_stream_complete(struct partial_stream *s,int length);
+int partial_stream_first_missing_byte(struct partial_stream *s,int length);
+int partial_stream_bytes_received(struct partial_stream *s,int length);
+void partial_stream_free(struct partial_stream *s);
 int free_peer(struct peer_state *p);
 int peer_note_bar(struct peer_state *p,
 		  char *bid_prefix,long long version, char *recipient_prefix,
@@ -402,6 +458,9 @@ ssize_t write_all(int fd, const void *buf, size_t len);
 int radio_read_bytes(int serialfd, int monitor_mode);
 ssize_t read_nonblock(int fd, void *buf, size_t len);
 
+int http_get_memory(char *server_and_port, char *auth_token,
+		    char *path, unsigned char **out, int *out_len, int max_len,
+		    int timeout_ms);
 int http_get_simple(char *server_and_port, char *auth_token,
 		    char *path, FILE *outfile, int timeout_ms,
 		    long long *last_read_time);
@@ -412,12 +471,27 @@ int http_post_bundle(char *server_and_port, char *auth_token,
 		     int timeout_ms);
 long long gettime_ms(void);
 long long gettime_us(void);
+long long monotime_ms(void);
+long long clock_update(void);
+extern long long now_ms;
+extern long long wall_clock_step_ms;
+
+typedef void (*timer_function)(void);
+int timer_register(char *name,timer_function function);
+int timer_schedule(int timer,long long due);
+int timer_cancel(int timer);
+long long timer_next_due(void);
+int timers_run(void);
+struct pollfd;
+int timers_poll(struct pollfd *fds,int nfds,int timeout);
+int virtual_clock_attach(char *filename,char *serial_port);
+extern volatile long long *virtual_clock_offset;
 int generate_progress_string(struct partial_bundle *partial,
 			     char *progress,int progress_size);
 int show_progress(FILE *f,int verbose);
 int show_progress_json(FILE *f,int verbose);
 int request_wanted_content_from_peers(int *offset,int mtu, unsigned char *msg_out);
-int dump_segment_list(struct segment_list *s);
+int dump_partial_stream(struct partial_stream *s,int length);
 
 int energy_experiment(char *port, char *interface_name,char *broadcast_address);
 int energy_experiment_master(char *broadcast_address,
@@ -427,6 +501,22 @@ int energy_experiment_calibrate(char *port, char *broadcast_address,char *exp_st
 int serial_setup_port_with_speed(int fd,int speed);
 int status_dump(void);
 int status_log(char *msg);
+void status_changed(void);
+void status_bundles_changed(void);
+int status_export_files(void);
+extern int status_file_interval;
+
+// A status page rendered in memory (see status_dump.c)
+struct status_page {
+  char *data;
+  size_t len;
+  // status_generation when this was rendered
+  unsigned int generation;
+  long long rendered;
+};
+#define STATUS_PAGE_JSON 4
+extern struct status_page status_page_bodies[STATUS_PAGE_JSON];
+struct status_page *status_page_get(int page);
 
 long long calculate_bundle_intrinsic_priority(char *bid,
 					      long long length,
@@ -468,16 +558,23 @@ int manifest_get_field(unsigned char *manifest, int manifest_len,
 int monitor_log(char *sender_prefix, char *recipient_prefix,char *msg);
 int bytes_to_prefix(unsigned char *bytes_in,char *prefix_out);
 int saw_timestamp(char *sender_prefix,int stratum, struct timeval *tv);
-int http_process(struct sockaddr *cliaddr,
-		 char *servald_server,char *credential,
-		 char *my_sid_hex,
-		 int socket);
+// HTTP server, see src/http/httpd.c
+#define HTTPD_MAX_CONNECTIONS 64
+struct httpd_connection;
+struct pollfd;
+int http_process(struct httpd_connection *c);
+int http_respond(struct httpd_connection *c,char *data,int len);
+int httpd_pollfds(int listen_socket,struct pollfd *fds,int max);
+int httpd_service(int listen_socket,struct pollfd *fds,int nfds);
+int http_queue_helpdesk_message(char *location,char *message);
 int chartohex(int c);
 int random_active_peer(void);
 int append_bytes(int *offset,int mtu,unsigned char *msg_out,
 		 unsigned char *data,int count);
 int sync_tree_receive_message(struct peer_state *p, unsigned char *msg);
 int lookup_bundle_by_sync_key(uint8_t bundle_sync_key[KEY_LEN]);
+int lookup_bundle_by_bid_bin(unsigned char bid_bin[32]);
+int bundle_prefix_range(const unsigned char *prefix,int len,int *first);
 int peer_queue_bundle_tx(struct peer_state *p,struct bundle_record *b, int priority);
 int sync_parse_ack(struct peer_state *p,unsigned char *msg,
 		   char *sid_prefix_hex,
@@ -507,6 +604,10 @@ int http_meshmb_read(char *server_and_port,
 		     char *id_hex,int timeout_ms);
 
 int sync_setup(void);
+int sync_tree_bulk_start(void);
+int sync_tree_bulk_finish(void);
+int sync_tree_add_bundle(int bundle_number);
+int sync_tree_populate_with_our_bundles(void);
 int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
 			      char *sid_prefix_hex,
 			      char *servald_server,char *credential);
@@ -526,6 +627,7 @@ int active_peer_count(void);
 int sync_dequeue_bundle(struct peer_state *p,int bundle);
 int meshms_parse_command(int argc,char **argv);
 int meshmb_parse_command(int argc,char **argv);
+int benchmark_parse_command(int argc,char **argv);
 int http_list_meshms_conversations(char *server_and_port, char *auth_token,
 				   char *participant,int timeout_ms);
 int http_list_meshms_messages(char *server_and_port, char *auth_token,
@@ -545,6 +647,80 @@ int progress_log_bundle_receipt(char *bid_prefix, long long version);
 
 int http_get_async(char *server_and_port, char *auth_token,
 		   char *path, int timeout_ms);
+
+// Non-blocking HTTP client, see src/http/httpasync.c
+#define HTTP_MAX_SERVER 256
+#define HTTP_MAX_HEADER 4096
+struct http_request;
+typedef void (*http_callback)(struct http_request *r);
+struct http_request {
+  char server[HTTP_MAX_SERVER];
+  char *path;
+
+  // The complete request, headers and all
+  unsigned char *message;
+  int message_len;
+  int message_sent;
+  long long timeout_time;
+  // When the request was made, for the latency metrics
+  long long start_time;
+
+  // The response body goes into body (up to max_len bytes), unless outfile
+  // is set, in which case it is written there instead.
+  int max_len;
+  FILE *outfile;
+  long long last_read_time;
+
+  http_callback callback;
+  void *context;
+
+  int state;
+  int connection;
+  int reused;
+  int retried;
+  int response_bytes;
+
+  char header[HTTP_MAX_HEADER];
+  int header_len;
+  int response_code;
+  int content_length;
+  int body_mode;
+  int keep_alive;
+  int chunk_state;
+  int chunk_remaining;
+  char chunk_line[32];
+  int chunk_line_len;
+  int body_complete;
+
+  unsigned char *body;
+  int body_len;
+  int body_size;
+
+  struct http_request *next;
+};
+struct pollfd;
+struct http_request *http_request_new(char *server_and_port,char *path,
+				      int timeout_ms);
+struct http_request *http_request_simple(char *server_and_port,char *auth_token,
+					 char *method,char *path,int timeout_ms);
+void http_request_free(struct http_request *r);
+int http_request_start(struct http_request *r,http_callback callback,
+		       void *context);
+int http_request_wait(struct http_request *r);
+struct http_request *http_post_meshms_request(char *server_and_port, char *auth_token,
+					      char *message,char *sender,char *recipient,
+					      int timeout_ms,int meshmsP);
+int http_request_pending(void);
+int http_client_pollfds(struct pollfd *fds,int max);
+int http_client_service(void);
+int http_client_report_json(FILE *f);
+int base64_append(char *out,int *out_offset,unsigned char *bytes,int count);
+int connect_to_port(char *host,int port);
+struct http_request *http_post_bundle_request(char *server_and_port, char *auth_token,
+					      char *path,
+					      unsigned char *manifest_data, int manifest_length,
+					      unsigned char *body_data, int body_length,
+					      int timeout_ms);
 int http_read_next_line(int sock, char *line, int *len, int maxlen);
 int load_rhizome_db_async(char *servald_server,
 			  char *credential, char *token);
@@ -572,21 +748,33 @@ int radio_send_message_barretthf(int serialfd,unsigned char *out, int len);
 int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
 	       char *my_sid_hex,char *prefix,
 	       char *servald_server,char *credential);
+// Most bytes of a packet we will ask the RS decoder to fill in, which leaves
+// 8 of the 32 parity bytes to check that it got them right.
+#define RS_MAX_ERASURES 24
+int rs_decode_packet(unsigned char *packet_data,int packet_bytes,
+		     int *erasures,int erasure_count);
+int saw_packet_with_erasures(unsigned char *packet_data,int packet_bytes,int rssi,
+			     int *erasures,int erasure_count,
+			     char *my_sid_hex,char *prefix,
+			     char *servald_server,char *credential);
 int radio_ready(void);
 int hf_radio_ready(void);
 int hf_radio_pause_for_turnaround(void);
 int hf_radio_send_now(void);
 int eeprom_read(int fd);
-int http_report_network_status(int socket,int flags);
-int http_report_network_status_json(int socket);
-int http_send_file(int socket,char *filename,char *mime_type);
+int http_report_network_status(struct httpd_connection *c,int flags);
+int http_report_network_status_json(struct httpd_connection *c);
+int http_send_file(struct httpd_connection *c,char *filename,char *mime_type);
+int http_send_buffer(struct httpd_connection *c,char *data,int len,char *mime_type);
+int http_report_metrics(struct httpd_connection *c);
 char *timestamp_str(void);
 int _report_file(const char *filename,const char *file,
 		 const int line,const char *function);
 #define report_file(X) _report_file(X,__FILE__,__LINE__,__FUNCTION__)
 int partial_update_recent_senders(struct partial_bundle *p,char *sender_prefix_hex);
 int partial_update_request_bitmap(struct partial_bundle *p);
-int partial_find_missing_byte(struct segment_list *s,int *isFirstMissingByte);
+int partial_find_missing_byte(struct partial_stream *s,int length,
+			      int *isFirstMissingByte);
 int hex_to_val(int c);
 int sync_parse_progress_bitmap(struct peer_state *p,unsigned char *msg,int *offset);
 int dump_progress_bitmap(FILE *f, unsigned char *b,int blocks);
@@ -615,3 +803,5 @@ int append_generationid(unsigned char *msg_out,int *offset);
 
 
 #include "util.h"
+#include "log.h"
+#include "metrics.h"
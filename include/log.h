@@ -0,0 +1,59 @@
+/*
+  Leveled logging for LBARD.
+
+  Each subsystem has its own level, which can be changed at run time.  Messages
+  that pass it are kept in an in-memory ring buffer, which is cheap enough for
+  the packet paths, and can be written out on demand with log_flush() (e.g.,
+  when we get SIGUSR2).  Only messages at or above log_echo_level are written
+  to stderr straight away, as on a mesh extender stderr ends up in a slow flash
+  backed log.
+
+  Messages below LOG_FLOOR are compiled out entirely, e.g.:
+
+    make LOGFLAGS=-DLOG_FLOOR=LOGLEVEL_WARN
+*/
+
+#ifndef __LBARD_LOG_H
+#define __LBARD_LOG_H
+
+#include <stdio.h>
+
+#define LOGLEVEL_OFF 0
+#define LOGLEVEL_ERROR 1
+#define LOGLEVEL_WARN 2
+#define LOGLEVEL_INFO 3
+#define LOGLEVEL_DEBUG 4
+
+#ifndef LOG_FLOOR
+#define LOG_FLOOR LOGLEVEL_DEBUG
+#endif
+
+#define LOG_GENERAL 0
+#define LOG_PIECES 1
+#define LOG_BITMAP 2
+#define LOG_SYNC 3
+#define LOG_RADIO 4
+#define LOG_BUNDLES 5
+#define LOG_HTTP 6
+#define LOG_SUBSYSTEMS 7
+
+extern unsigned char log_levels[LOG_SUBSYSTEMS];
+extern int log_echo_level;
+extern volatile int log_flush_requested;
+
+#define LOG(SUB,LEVEL,...) do {						\
+    if (((LEVEL)<=LOG_FLOOR)&&((LEVEL)<=log_levels[SUB]))		\
+      log_message((SUB),(LEVEL),__VA_ARGS__);				\
+  } while(0)
+#define LOG_ERROR(SUB,...) LOG(SUB,LOGLEVEL_ERROR,__VA_ARGS__)
+#define LOG_WARN(SUB,...) LOG(SUB,LOGLEVEL_WARN,__VA_ARGS__)
+#define LOG_INFO(SUB,...) LOG(SUB,LOGLEVEL_INFO,__VA_ARGS__)
+#define LOG_DEBUG(SUB,...) LOG(SUB,LOGLEVEL_DEBUG,__VA_ARGS__)
+
+void log_message(int subsystem,int level,const char *fmt,...)
+  __attribute__((format(printf,3,4)));
+int log_flush(FILE *f);
+int log_set_level(char *subsystem,int level);
+int log_parse_level(char *name);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+  Counters for the /metrics endpoint (see src/status/metrics.c).
+
+  These are bumped on the radio and piece paths, so they are just plain
+  64-bit counters in one global struct: we are single threaded, and an
+  increment is all it costs.  Everything here only ever goes up, so that a
+  scraper can work out rates for itself.
+*/
+
+#ifndef __LBARD_METRICS_H
+#define __LBARD_METRICS_H
+
+#include <stdio.h>
+
+// Upper bounds (ms) of the servald request latency histogram buckets
+#define METRICS_LATENCY_BUCKETS 11
+#define METRICS_LATENCY_BOUNDS {5,10,25,50,100,250,500,1000,2500,5000,10000}
+
+struct metrics {
+  unsigned long long packets_sent;
+  unsigned long long packet_bytes_sent;
+  unsigned long long packets_received;
+  // Packets that the Reed-Solomon code couldn't correct (or that needed
+  // too many corrections to be trusted)
+  unsigned long long packets_rejected;
+  unsigned long long rs_corrected_symbols;
+
+  // Indexed by the message type byte
+  unsigned long long tx_bytes_by_type[256];
+
+  unsigned long long partials_completed;
+  unsigned long long insert_failures;
+  unsigned long long tx_queue_overflows;
+  unsigned long long tx_queue_overflow_resyncs;
+
+  unsigned long long servald_requests_ok;
+  unsigned long long servald_requests_failed;
+  unsigned long long servald_latency_buckets[METRICS_LATENCY_BUCKETS];
+  unsigned long long servald_latency_sum_ms;
+};
+
+extern struct metrics metrics;
+
+#define METRIC_INC(NAME) (metrics.NAME++)
+#define METRIC_ADD(NAME,N) (metrics.NAME+=(N))
+// Count the message section of the given type that we have just added
+#define METRIC_TX_SECTION(TYPE,BYTES) (metrics.tx_bytes_by_type[(unsigned char)(TYPE)]+=(BYTES))
+
+void metrics_observe_servald_latency(long long ms,int ok);
+int metrics_report(FILE *f);
+
+#endif
@@ -0,0 +1,10 @@
+#include "radio_type.h"
+
+#define RADIOTYPE_HFBARRETT 0
+#define RADIOTYPE_HFCODAN 1
+#define RADIOTYPE_RFD900 2
+
+#include "drivers/drv_hfbarrett.h"
+#include "drivers/drv_hfcodan.h"
+#include "drivers/drv_rfd900.h"
+
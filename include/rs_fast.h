@@ -0,0 +1,26 @@
+/*
+  Faster versions of the fec-3.0.1 RS(255,223) encode_rs_8() and
+  decode_rs_8() (see src/fec/rs_fast.c).  They take the same arguments and
+  give bit-identical results, so can be used in place of them.
+*/
+
+#ifndef __LBARD_RS_FAST_H
+#define __LBARD_RS_FAST_H
+
+// Implementations, for rs_fast_set_mode()
+#define RS_MODE_AUTO 0
+#define RS_MODE_PORT 1
+#define RS_MODE_SSSE3 2
+#define RS_MODE_AVX2 3
+#define RS_MODE_NEON 4
+#define RS_MODES 5
+
+// (fec-3.0.1/fixed.h has no include guard, so these don't use its data_t)
+void encode_rs_8_fast(unsigned char *data, unsigned char *parity,int pad);
+int decode_rs_8_fast(unsigned char *data, int *eras_pos, int no_eras, int pad);
+
+int rs_fast_set_mode(int mode);
+int rs_fast_get_mode(void);
+char *rs_fast_mode_name(int mode);
+
+#endif
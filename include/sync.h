@@ -8,6 +8,8 @@ Synchronize two sets of keys, which are likely to contain many common values
 */
 
 #define KEY_LEN 8
+// The stride our trees start with.  syncstride=2, 4 or 8 asks for a wider one
+// (sync_set_step_bits()), which we only use if all of our peers can.
 #define PREFIX_STEP_BITS 1
 #define SYNC_MAX_RETRIES 1
 
@@ -30,8 +32,19 @@ void sync_free_peer_state(struct sync_state *state, void *peer_context);
 // tell the sync process that we now have key, with callback context
 // if the key is already present, the context will be updated
 void sync_add_key(struct sync_state *state, const sync_key_t *key, void *key_context);
+// add many keys at once, which is much quicker than one at a time (contexts may be NULL)
+void sync_add_keys(struct sync_state *state, const sync_key_t *keys, void * const *contexts, unsigned count);
 int sync_key_exists(const struct sync_state *state, const sync_key_t *key);
 int sync_has_transmit_queued(const struct sync_state *state);
+// how many tree nodes (in our tree and all peer trees) are in use
+unsigned sync_nodes_in_use(const struct sync_state *state);
+// and how many of them are branches
+unsigned sync_branches_in_use(const struct sync_state *state);
+
+// ask to use a different stride, if all of our peers can, returns -1 if step_bits isn't 1, 2, 4 or 8
+int sync_set_step_bits(struct sync_state *state, uint8_t step_bits);
+// the stride we are actually using
+uint8_t sync_step_bits(const struct sync_state *state);
 
 // ask for a message to be inserted into buff, returns packet length
 size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len);
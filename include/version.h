@@ -0,0 +1,4 @@
+#define VERSION_STRING "ee53cb0b472260b90fd01ad5228037b5"
+#define GIT_VERSION_STRING "93925dabba+DIRTY"
+#define GIT_BRANCH "master"
+#define BUILD_DATE "Fri Oct 16 20:43:07 UTC 2026"
@@ -0,0 +1,42 @@
+/*
+  The virtual clock that fakecsmaradio shares with the LBARDs attached to it.
+
+  fakecsmaradio creates a file holding this structure, and each LBARD that is
+  given the virtualclock=<file> option maps it, and adds offset to the time it
+  reads from the wall clock.  Each LBARD says when it next needs to run, and
+  whether it is waiting for that (or for input), so that fakecsmaradio can skip
+  ahead whenever nobody has anything to do.  When it skips ahead to the time
+  an LBARD is waiting for, it wakes it up with SIGUSR1.  In turn, the last
+  LBARD to go back to waiting sends fakecsmaradio SIGUSR1, so that it doesn't
+  have to keep looking to see if they are all done.
+*/
+
+#ifndef __LBARD_VIRTUALCLOCK_H
+#define __LBARD_VIRTUALCLOCK_H
+
+#define VIRTUAL_CLOCK_MAX_NODES 1024
+
+struct virtual_clock_node {
+  // The serial port of this node, as written to the tty file
+  char tty[64];
+  // Set once an LBARD is following the virtual clock on this port
+  volatile int attached;
+  volatile int pid;
+  // Set while the LBARD is waiting in poll(), and wake_time is when its next
+  // timer is due
+  volatile int idle;
+  volatile long long wake_time;
+  // Incremented every time the LBARD wakes up
+  volatile unsigned int wakeups;
+};
+
+struct virtual_clock {
+  volatile long long offset;
+  // fakecsmaradio, and how many LBARDs following it are not waiting
+  volatile int pid;
+  volatile int busy;
+  int node_count;
+  struct virtual_clock_node nodes[VIRTUAL_CLOCK_MAX_NODES];
+};
+
+#endif
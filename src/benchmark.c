@@ -0,0 +1,1796 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015 Serval Project Inc.
+
+Micro-benchmarks for the various data structures inside LBARD, so that we
+can see how they scale with the number of bundles on the larger gateway
+nodes, without having to populate a real Rhizome store.
+
+Run as: lbard benchmark <what> [count]
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <poll.h>
+#include <assert.h>
+#include <stdint.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "sync.h"
+#include "lbard.h"
+#include "util.h"
+#include "serial.h"
+#include "radios.h"
+#include "hf.h"
+#include "rs_fast.h"
+#include "utils/testutil.h"
+
+static void benchmark_report(char *what,int count,long long start_us)
+{
+  long long elapsed=gettime_us()-start_us;
+  printf("%-36s %6d in %8lldus = %8.2fus each\n",
+	 what,count,elapsed,count?elapsed*1.0/count:0.0);
+}
+
+int benchmark_bundles(int count)
+{
+  char bid[65],filehash[129],version[32];
+  long long start;
+
+  if (count>MAX_BUNDLES) count=MAX_BUNDLES;
+
+  char **bids=calloc(count,sizeof(char *));
+  for(int i=0;i<count;i++) {
+    random_hex(bid,32);
+    bids[i]=strdup(bid);
+  }
+
+  quiet();
+  start=gettime_us();
+  for(int i=0;i<count;i++) {
+    random_hex(filehash,64);
+    snprintf(version,32,"%lld",1500000000000LL+i);
+    register_bundle("MeshMS2",bids[i],version,"","0",1024,filehash,"","");
+  }
+  unquiet();
+  benchmark_report("register_bundle (new)",count,start);
+
+  quiet();
+  start=gettime_us();
+  for(int i=0;i<count;i++) {
+    random_hex(filehash,64);
+    snprintf(version,32,"%lld",1600000000000LL+i);
+    register_bundle("MeshMS2",bids[i],version,"","0",1024,filehash,"","");
+  }
+  unquiet();
+  benchmark_report("register_bundle (update)",count,start);
+
+  int found=0;
+  start=gettime_us();
+  for(int i=0;i<count;i++) {
+    char prefix[17];
+    strncpy(prefix,bids[i],16); prefix[16]=0;
+    found+=we_have_this_bundle_or_newer(prefix,1600000000000LL+i);
+  }
+  benchmark_report("we_have_this_bundle_or_newer",count,start);
+  if (found!=count) printf("ERROR: Only found %d of %d bundles\n",found,count);
+
+  found=0;
+  start=gettime_us();
+  for(int i=0;i<bundle_count;i++)
+    if (lookup_bundle_by_sync_key(bundles[i].sync_key.key)==i) found++;
+  benchmark_report("lookup_bundle_by_sync_key",bundle_count,start);
+  if (found!=bundle_count)
+    printf("ERROR: Only found %d of %d sync keys\n",found,bundle_count);
+
+  for(int i=0;i<count;i++) free(bids[i]);
+  free(bids);
+  return 0;
+}
+
+// The old linear lookup, to check that the prefix index gives the same answers
+static int benchmark_linear_prefix_lookup(const unsigned char *prefix,int len)
+{
+  int best_bundle=-1;
+  for(int bundle=0;bundle<bundle_count;bundle++)
+    if (!memcmp(prefix,bundles[bundle].bid_bin,len))
+      if ((best_bundle==-1)||(bundles[bundle].version>bundles[best_bundle].version))
+	best_bundle=bundle;
+  return best_bundle;
+}
+
+int benchmark_prefix(int count)
+{
+  int sizes[]={1000,10000,50000,-1};
+  char bid[65],filehash[129];
+  int lookups=100000;
+  long long start;
+
+  if (count>0&&count!=10000) { sizes[0]=count; sizes[1]=-1; }
+  
+  for(int s=0;sizes[s]>0;s++) {
+    int size=sizes[s];
+    if (size>MAX_BUNDLES) {
+      printf("Skipping %d bundles (MAX_BUNDLES=%d, rebuild with -DMAX_BUNDLES=%d)\n",
+	     size,MAX_BUNDLES,size);
+      continue;
+    }
+    quiet();
+    while(bundle_count<size) {
+      random_hex(bid,32);
+      random_hex(filehash,64);
+      register_bundle("MeshMS2",bid,"1500000000000","","0",1024,filehash,"","");
+    }
+    unquiet();
+
+    int mismatches=0;
+    for(int i=0;i<1000;i++) {
+      unsigned char *prefix=bundles[random()%bundle_count].bid_bin;
+      int len=1+(random()%8);
+      if (lookup_bundle_by_prefix(prefix,len)!=benchmark_linear_prefix_lookup(prefix,len))
+	mismatches++;
+    }
+    if (mismatches) printf("ERROR: %d prefix lookups differ from linear search\n",mismatches);
+
+    int ambiguous=0;
+    start=gettime_us();
+    for(int i=0;i<lookups;i++) {
+      unsigned char *prefix=bundles[i%bundle_count].bid_bin;
+      if (lookup_bundle_by_prefix(prefix,8)<0) mismatches++;
+      if (bundle_prefix_range(prefix,2,NULL)>1) ambiguous++;
+    }
+    long long elapsed=gettime_us()-start;
+    printf("%6d bundles: %d prefix lookups in %lldus = %.0f lookups/sec"
+	   " (%d 2-byte prefixes ambiguous)\n",
+	   bundle_count,lookups,elapsed,elapsed?lookups*1000000.0/elapsed:0.0,
+	   ambiguous);
+  }
+  return 0;
+}
+
+// Check that the incremental priority queue picks exactly the same bundle as
+// the old linear scan, over randomised bundle and peer sets, and time both.
+int benchmark_priority(int count)
+{
+  char *services[]={"MeshMS1","MeshMS2","meshmb","file","MeshMS2",NULL};
+  char hex[65];
+  long long linear_us=0,queue_us=0;
+  int rounds=200;
+
+  if (count>MAX_BUNDLES) count=MAX_BUNDLES;
+
+  // A pool of recipients, some of whom will be peers
+  char *recipients[64];
+  for(int i=0;i<64;i++) {
+    random_hex(hex,32);
+    recipients[i]=strdup(hex);
+  }
+
+  for(int i=0;i<count;i++) {
+    memset(&bundles[i],0,sizeof(struct bundle_record));
+    random_hex(hex,32);
+    bundles[i].bid_hex=strdup(hex);
+    bundles[i].service=services[random()%5];
+    bundles[i].recipient=(random()&3)?recipients[random()%64]:"";
+    bundles[i].length=1+(random()%(1<<(random()%24)));
+    bundles[i].version=random();
+    bundles[i].last_announced_time=random()%100;
+    bundles[i].index=i;
+  }
+  bundle_count=count;
+  peer_count=0;
+  bundle_priorities_invalidate();
+
+  for(int round=0;round<rounds;round++) {
+    // Perturb things a little each round, as would happen in practice
+    switch(random()%4) {
+    case 0:
+      // A peer arrives (or is replaced)
+      {
+	struct peer_state *p=calloc(1,sizeof(struct peer_state));
+	p->sid_prefix=strndup(recipients[random()%64],16);
+	if (peer_count<MAX_PEERS) peer_records[peer_count++]=p;
+	else peer_records[random()%peer_count]=p;
+	bundle_priorities_invalidate();
+      }
+      break;
+    case 1:
+      // A bundle gets updated
+      {
+	int b=random()%count;
+	bundles[b].length=1+(random()%(1<<(random()%24)));
+	bundles[b].service=services[random()%5];
+	bundle_priority_update(b);
+      }
+      break;
+    default:
+      // Some bundles get announced
+      for(int j=0;j<10;j++)
+	bundles[random()%count].last_announced_time=100+round;
+    }
+
+    long long start=gettime_us();
+    find_highest_priority_bundle_linear();
+    linear_us+=gettime_us()-start;
+    start=gettime_us();
+    find_highest_priority_bundle();
+    queue_us+=gettime_us()-start;
+  }
+
+  printf("%d bundles, %d peers: linear scan %.2fus, priority queue %.2fus per selection\n",
+	 count,peer_count,linear_us*1.0/rounds,queue_us*1.0/rounds);
+  return 0;
+}
+
+// A trivial stand-in for servald's RESTful interface: serves a small manifest
+// for *.rhm, and body_len bytes for anything else.
+static void benchmark_http_server(int listen_sock,int body_len)
+{
+  unsigned char *body=malloc(body_len+1);
+  assert(body);
+  for(int i=0;i<body_len;i++) body[i]=random();
+  char *manifest="service=file\nversion=1\nfilesize=1024\n";
+  
+  while(1) {
+    int s=accept(listen_sock,NULL,NULL);
+    if (s<0) continue;
+    char request[4096];
+    int len=0;
+    while(len<4095) {
+      int r=read(s,&request[len],4095-len);
+      if (r<1) break;
+      len+=r; request[len]=0;
+      if (strstr(request,"\n\n")||strstr(request,"\r\n\r\n")) break;
+    }
+    int is_manifest=strstr(request,".rhm ")?1:0;
+    char header[1024];
+    snprintf(header,1024,"HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n",
+	     is_manifest?(int)strlen(manifest):body_len);
+    write_all(s,header,strlen(header));
+    if (is_manifest) write_all(s,manifest,strlen(manifest));
+    else write_all(s,body,body_len);
+    close(s);
+  }
+}
+
+// The way prime_bundle_cache() used to fetch things: to a file, and then
+// into a 5MB buffer.
+static int benchmark_fetch_via_file(char *server,char *path,int is_body)
+{
+  char filename[1024];
+  snprintf(filename,1024,"%d.benchmark",getpid());
+  unlink(filename);
+  FILE *f=fopen(filename,"w");
+  if (!f) return -1;
+  int result_code=http_get_simple(server,"lbard:lbard",path,f,5000,NULL);
+  fclose(f);
+  if (result_code!=200) return -1;
+  f=fopen(filename,"r");
+  if (!f) return -1;
+  int max=is_body?5*1024*1024:8192;
+  unsigned char *buffer=malloc(max);
+  assert(buffer);
+  int len=fread(buffer,1,max,f);
+  buffer=realloc(buffer,len);
+  fclose(f);
+  unlink(filename);
+  free(buffer);
+  return len;
+}
+
+static int benchmark_fetch_via_memory(char *server,char *path,int is_body)
+{
+  unsigned char *buffer=NULL;
+  int len=0;
+  int result_code=http_get_memory(server,"lbard:lbard",path,&buffer,&len,
+				  is_body?5*1024*1024:8192,5000);
+  free(buffer);
+  if (result_code!=200) return -1;
+  return len;
+}
+
+int benchmark_httpfetch(int count)
+{
+  int sizes[]={1024,65536,1024*1024,4*1024*1024,-1};
+  if (count>0&&count!=10000) { sizes[0]=count; sizes[1]=-1; }
+  int iterations=20;
+  
+  for(int s=0;sizes[s]>0;s++) {
+    int listen_sock=socket(AF_INET,SOCK_STREAM,0);
+    struct sockaddr_in addr;
+    socklen_t addr_len=sizeof(addr);
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family=AF_INET;
+    addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    addr.sin_port=0;
+    if (bind(listen_sock,(struct sockaddr *)&addr,sizeof(addr))
+	||listen(listen_sock,10)
+	||getsockname(listen_sock,(struct sockaddr *)&addr,&addr_len)) {
+      perror("Could not start HTTP stand-in for servald");
+      return -1;
+    }
+    pid_t pid=fork();
+    if (!pid) { benchmark_http_server(listen_sock,sizes[s]); exit(0); }
+    close(listen_sock);
+
+    char server[1024];
+    snprintf(server,1024,"127.0.0.1:%d",ntohs(addr.sin_port));
+    char *manifest_path="/restful/rhizome/0000.rhm";
+    char *body_path="/restful/rhizome/0000/raw.bin";
+    
+    long long file_us=0,memory_us=0;
+    int errors=0;
+    for(int i=0;i<iterations;i++) {
+      long long start=gettime_us();
+      if (benchmark_fetch_via_file(server,manifest_path,0)<0) errors++;
+      if (benchmark_fetch_via_file(server,body_path,1)!=sizes[s]) errors++;
+      file_us+=gettime_us()-start;
+      start=gettime_us();
+      if (benchmark_fetch_via_memory(server,manifest_path,0)<0) errors++;
+      if (benchmark_fetch_via_memory(server,body_path,1)!=sizes[s]) errors++;
+      memory_us+=gettime_us()-start;
+    }
+    kill(pid,SIGTERM);
+    waitpid(pid,NULL,0);
+
+    printf("%8d byte body: cache miss via temp file %8.0fus, via memory %8.0fus%s\n",
+	   sizes[s],file_us*1.0/iterations,memory_us*1.0/iterations,
+	   errors?" (ERRORS)":"");
+  }
+  return 0;
+}
+
+// A stand-in for servald that, unlike benchmark_http_server(), keeps
+// connections open between requests, as an HTTP/1.1 server should.  It
+// writes a byte to count_fd each time it accepts a connection, so that we
+// can see how many connections the client opened.  Imports take
+// import_delay_ms to answer, and the first import_failures of them fail, as
+// if servald were busy.
+#define BENCHMARK_MAX_CLIENTS 32
+struct benchmark_client {
+  int fd;
+  char request[65536];
+  int len;
+};
+
+static void benchmark_keepalive_server(int listen_sock,int count_fd,int body_len,
+				       int import_delay_ms,int import_failures)
+{
+  unsigned char *body=malloc(body_len+1);
+  assert(body);
+  for(int i=0;i<body_len;i++) body[i]=random();
+  struct benchmark_client *clients=calloc(BENCHMARK_MAX_CLIENTS,
+					  sizeof(struct benchmark_client));
+  assert(clients);
+  for(int i=0;i<BENCHMARK_MAX_CLIENTS;i++) clients[i].fd=-1;
+
+  while(1) {
+    struct pollfd fds[BENCHMARK_MAX_CLIENTS+1];
+    int slot[BENCHMARK_MAX_CLIENTS+1];
+    int n=0;
+    fds[n].fd=listen_sock; fds[n].events=POLLIN; slot[n++]=-1;
+    for(int i=0;i<BENCHMARK_MAX_CLIENTS;i++)
+      if (clients[i].fd>=0) {
+	fds[n].fd=clients[i].fd; fds[n].events=POLLIN; slot[n++]=i;
+      }
+    if (poll(fds,n,-1)<1) continue;
+
+    for(int f=0;f<n;f++) {
+      if (!fds[f].revents) continue;
+      if (slot[f]==-1) {
+	int s=accept(listen_sock,NULL,NULL);
+	if (s<0) continue;
+	int i;
+	for(i=0;i<BENCHMARK_MAX_CLIENTS;i++) if (clients[i].fd<0) break;
+	if (i==BENCHMARK_MAX_CLIENTS) { close(s); continue; }
+	clients[i].fd=s; clients[i].len=0;
+	if (write(count_fd,"c",1)!=1) perror("write");
+	continue;
+      }
+      struct benchmark_client *c=&clients[slot[f]];
+      int r=read(c->fd,&c->request[c->len],sizeof(c->request)-1-c->len);
+      if (r<1) { close(c->fd); c->fd=-1; continue; }
+      c->len+=r;
+      c->request[c->len]=0;
+
+      // Answer each complete request we have
+      while(1) {
+	char *end=strstr(c->request,"\r\n\r\n");
+	if (!end) break;
+	int header_len=end+4-c->request;
+	int content_length=0;
+	char *cl=strcasestr(c->request,"Content-Length: ");
+	if (cl&&cl<end) content_length=atoi(cl+16);
+	if (c->len<header_len+content_length) break;
+	int closing=strcasestr(c->request,"Connection: close")?1:0;
+	int is_import=!strncmp(c->request,"POST",4);
+	char *status=is_import?"201 Created":"200 OK";
+	if (is_import) {
+	  usleep(import_delay_ms*1000);
+	  if (import_failures>0) { import_failures--; status="503 Busy"; }
+	}
+	char header[1024];
+	snprintf(header,1024,"HTTP/1.1 %s\r\nContent-Length: %d\r\n%s\r\n",
+		 status,is_import?2:body_len,
+		 closing?"Connection: close\r\n":"");
+	write_all(c->fd,header,strlen(header));
+	if (is_import) write_all(c->fd,"OK",2);
+	else write_all(c->fd,body,body_len);
+	int used=header_len+content_length;
+	memmove(c->request,&c->request[used],c->len-used+1);
+	c->len-=used;
+	if (closing) { close(c->fd); c->fd=-1; break; }
+      }
+    }
+  }
+}
+
+// How we used to do it: a new connection for every request
+static int benchmark_one_shot_get(char *host,int port,char *path)
+{
+  int sock=connect_to_port(host,port);
+  if (sock<0) return -1;
+  char request[1024];
+  snprintf(request,1024,"GET %s HTTP/1.1\r\nHost: %s:%d\r\nAccept: */*\r\n"
+	   "Connection: close\r\n\r\n",path,host,port);
+  write_all(sock,request,strlen(request));
+  char response[8192];
+  int len=0,r;
+  while((r=read(sock,&response[len],sizeof(response)-1-len))>0) len+=r;
+  close(sock);
+  response[len]=0;
+  int code=-1;
+  if (sscanf(response,"HTTP/1.1 %d",&code)!=1) return -1;
+  return code;
+}
+
+static int benchmark_connections_seen(int count_fd)
+{
+  char buf[1024];
+  int count=0,r;
+  while((r=read(count_fd,buf,sizeof(buf)))>0) count+=r;
+  return count;
+}
+
+int benchmark_async_done=0;
+int benchmark_async_errors=0;
+
+static void benchmark_async_callback(struct http_request *r)
+{
+  benchmark_async_done++;
+  int expected=(long)r->context;
+  if (r->response_code!=expected) benchmark_async_errors++;
+}
+
+static void benchmark_async_run(void)
+{
+  while(http_request_pending()) {
+    struct pollfd fds[16];
+    int n=http_client_pollfds(fds,16);
+    poll(fds,n,100);
+    http_client_service();
+  }
+}
+
+// Fork a benchmark_keepalive_server() on a free port, returning its pid (or -1),
+// with its address in server, and the read end of its connection counting
+// pipe in *count_fd.
+static pid_t benchmark_start_keepalive_server(int body_len,int import_delay_ms,
+					      int import_failures,
+					      char *server,int *port,int *count_fd)
+{
+  int listen_sock=socket(AF_INET,SOCK_STREAM,0);
+  struct sockaddr_in addr;
+  socklen_t addr_len=sizeof(addr);
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  addr.sin_port=0;
+  if (bind(listen_sock,(struct sockaddr *)&addr,sizeof(addr))
+      ||listen(listen_sock,64)
+      ||getsockname(listen_sock,(struct sockaddr *)&addr,&addr_len)) {
+    perror("Could not start HTTP stand-in for servald");
+    return -1;
+  }
+  int count_pipe[2];
+  if (pipe(count_pipe)) { perror("pipe"); return -1; }
+  fflush(stdout);
+  pid_t pid=fork();
+  if (!pid) {
+    close(count_pipe[0]);
+    benchmark_keepalive_server(listen_sock,count_pipe[1],body_len,
+			       import_delay_ms,import_failures);
+    exit(0);
+  }
+  close(listen_sock);
+  close(count_pipe[1]);
+  set_nonblock(count_pipe[0]);
+  *count_fd=count_pipe[0];
+  *port=ntohs(addr.sin_port);
+  snprintf(server,1024,"127.0.0.1:%d",*port);
+  return pid;
+}
+
+// How many requests a second can we make of servald, and how many connections
+// does it take?
+int benchmark_httpclient(int count)
+{
+  if (count<1) count=10000;
+  int body_len=1024;
+
+  char server[1024];
+  int port,count_fd;
+  pid_t pid=benchmark_start_keepalive_server(body_len,0,0,server,&port,&count_fd);
+  if (pid<0) return -1;
+  char *path="/restful/rhizome/0000/raw.bin";
+  int errors=0;
+  long long start;
+  double rate;
+
+  printf("%d requests for a %d byte body each:\n",count,body_len);
+
+  // A new connection for each request
+  start=gettime_us();
+  for(int i=0;i<count;i++)
+    if (benchmark_one_shot_get("127.0.0.1",port,path)!=200) errors++;
+  rate=count*1000000.0/(gettime_us()-start);
+  usleep(10000);
+  printf("  connection per request:   %8.0f requests/sec, %5d connections\n",
+	 rate,benchmark_connections_seen(count_fd));
+
+  // The same requests, waiting for each, but reusing the connection
+  start=gettime_us();
+  for(int i=0;i<count;i++) {
+    unsigned char *body=NULL;
+    int len=0;
+    if ((http_get_memory(server,"lbard:lbard",path,&body,&len,8192,5000)!=200)
+	||(len!=body_len)) errors++;
+    free(body);
+  }
+  rate=count*1000000.0/(gettime_us()-start);
+  usleep(10000);
+  int waited_connections=benchmark_connections_seen(count_fd);
+  printf("  keep-alive, one at a time:%8.0f requests/sec, %5d connections\n",
+	 rate,waited_connections);
+
+  // Queue them all, as the main loop would
+  benchmark_async_done=0; benchmark_async_errors=0;
+  start=gettime_us();
+  for(int i=0;i<count;i++)
+    http_request_start(http_request_simple(server,"lbard:lbard","GET",path,30000),
+		       benchmark_async_callback,(void *)200L);
+  benchmark_async_run();
+  rate=count*1000000.0/(gettime_us()-start);
+  usleep(10000);
+  int queued_connections=benchmark_connections_seen(count_fd);
+  printf("  keep-alive, queued:       %8.0f requests/sec, %5d connections\n",
+	 rate,queued_connections);
+  errors+=benchmark_async_errors+(count-benchmark_async_done);
+
+  // And some imports
+  int imports=count/10+1;
+  unsigned char manifest[256],bundle_body[4096];
+  memset(manifest,'m',sizeof(manifest));
+  memset(bundle_body,'b',sizeof(bundle_body));
+  benchmark_async_done=0; benchmark_async_errors=0;
+  start=gettime_us();
+  for(int i=0;i<imports;i++)
+    http_request_start(http_post_bundle_request(server,"lbard:lbard","/rhizome/import",
+						manifest,sizeof(manifest),
+						bundle_body,sizeof(bundle_body),
+						30000),
+		       benchmark_async_callback,(void *)201L);
+  benchmark_async_run();
+  rate=imports*1000000.0/(gettime_us()-start);
+  usleep(10000);
+  int import_connections=benchmark_connections_seen(count_fd);
+  printf("  imports, queued:          %8.0f requests/sec, %5d connections\n",
+	 rate,import_connections);
+  errors+=benchmark_async_errors+(imports-benchmark_async_done);
+
+  kill(pid,SIGTERM);
+  waitpid(pid,NULL,0);
+  close(count_fd);
+
+  if (errors||(waited_connections>1)||(queued_connections>8)||(import_connections>8)) {
+    printf("FAIL: %d errors, or connections were not reused\n",errors);
+    return -1;
+  }
+  printf("PASS: all requests answered, with connections reused\n");
+  return 0;
+}
+
+/* Check that importing a bundle into a slow servald doesn't stop us reading
+   from the radio.  A child process stands in for the radio, sending a 64 byte
+   packet every 5ms (about what an RFD900 at 115200 manages) into a datagram
+   socket with only a small buffer, and dropping packets if we don't keep up,
+   as the radio would.  Each packet carries a sequence number, so we can count
+   how many we missed.
+*/
+#define BENCHMARK_RADIO_PACKET 64
+#define BENCHMARK_RADIO_INTERVAL_US 5000
+
+static void benchmark_radio_feed(int fd,int duration_ms)
+{
+  long long end=gettime_ms()+duration_ms;
+  unsigned char packet[BENCHMARK_RADIO_PACKET];
+  memset(packet,0,sizeof(packet));
+  int sequence=0;
+  while(gettime_ms()<end) {
+    bcopy(&sequence,packet,sizeof(int));
+    // Send it if there is room, else it is lost
+    send(fd,packet,sizeof(packet),MSG_DONTWAIT);
+    sequence++;
+    usleep(BENCHMARK_RADIO_INTERVAL_US);
+  }
+  // Tell the reader we are done, with sequence -1
+  sequence=-1;
+  bcopy(&sequence,packet,sizeof(int));
+  send(fd,packet,sizeof(packet),0);
+}
+
+struct benchmark_rx {
+  int expected;
+  int received;
+  int lost;
+  int finished;
+  long long last_read;
+  long long max_gap;
+};
+
+static void benchmark_radio_read(int fd,struct benchmark_rx *rx)
+{
+  unsigned char packet[BENCHMARK_RADIO_PACKET];
+  while(recv(fd,packet,sizeof(packet),MSG_DONTWAIT)==sizeof(packet)) {
+    int sequence;
+    bcopy(packet,&sequence,sizeof(int));
+    long long now=gettime_ms();
+    if (rx->last_read&&(now-rx->last_read>rx->max_gap)) rx->max_gap=now-rx->last_read;
+    rx->last_read=now;
+    if (sequence==-1) { rx->finished=1; return; }
+    if (sequence>rx->expected) rx->lost+=sequence-rx->expected;
+    rx->expected=sequence+1;
+    rx->received++;
+  }
+}
+
+static pid_t benchmark_start_radio(int *fd,int duration_ms)
+{
+  int pair[2];
+  if (socketpair(AF_UNIX,SOCK_DGRAM,0,pair)) { perror("socketpair"); return -1; }
+  // A radio only has a few KB of buffer
+  int size=4096;
+  setsockopt(pair[1],SOL_SOCKET,SO_SNDBUF,&size,sizeof(size));
+  setsockopt(pair[0],SOL_SOCKET,SO_RCVBUF,&size,sizeof(size));
+  fflush(stdout);
+  pid_t pid=fork();
+  if (!pid) {
+    close(pair[0]);
+    benchmark_radio_feed(pair[1],duration_ms);
+    exit(0);
+  }
+  close(pair[1]);
+  *fd=pair[0];
+  return pid;
+}
+
+int benchmark_import(int count)
+{
+  int import_delay_ms=1500;
+  int duration_ms=7000;
+  if (count>0&&count!=10000) import_delay_ms=count;
+
+  // The first import fails, so that we see it retried
+  char server[1024];
+  int port,count_fd;
+  pid_t server_pid=benchmark_start_keepalive_server(1024,import_delay_ms,1,
+						    server,&port,&count_fd);
+  if (server_pid<0) return -1;
+
+  char manifest[1024];
+  snprintf(manifest,1024,"id=%064d\nversion=1\nfilesize=16384\nservice=file\n",0);
+  int body_len=16384;
+  unsigned char *body=malloc(body_len);
+  assert(body);
+  for(int i=0;i<body_len;i++) body[i]=random();
+
+  printf("Importing a bundle into a servald that takes %dms to answer,"
+	 " while receiving a packet every %dms:\n",
+	 import_delay_ms,BENCHMARK_RADIO_INTERVAL_US/1000);
+
+  // The way we do it now: the import is queued, and the main loop carries on
+  struct benchmark_rx queued;
+  bzero(&queued,sizeof(queued));
+  int radio_fd;
+  pid_t radio_pid=benchmark_start_radio(&radio_fd,duration_ms);
+  if (radio_pid<0) return -1;
+  long long start=gettime_ms();
+  int import_queued=0;
+  quiet();
+  while(!queued.finished||rhizome_import_pending()) {
+    if ((!import_queued)&&(gettime_ms()-start>500)) {
+      unsigned char *copy=malloc(body_len);
+      assert(copy);
+      bcopy(body,copy,body_len);
+      rhizome_queue_import((unsigned char *)manifest,strlen(manifest),copy,body_len,
+			   server,"lbard:lbard");
+      import_queued=1;
+    }
+    struct pollfd fds[16];
+    int n=0;
+    fds[n].fd=radio_fd; fds[n++].events=POLLIN;
+    n+=http_client_pollfds(&fds[n],16-n);
+    int timeout=100;
+    long long next_due=timer_next_due();
+    if (next_due>=0&&next_due-monotime_ms()<timeout) timeout=next_due-monotime_ms();
+    if (timeout<0) timeout=0;
+    poll(fds,n,timeout);
+    clock_update();
+    benchmark_radio_read(radio_fd,&queued);
+    http_client_service();
+    timers_run();
+  }
+  unquiet();
+  waitpid(radio_pid,NULL,0);
+  close(radio_fd);
+  extern int rhizome_imports_succeeded,rhizome_imports_retried;
+  printf("  queued import:   %4d packets received, %4d lost, longest gap %4lldms,"
+	 " import %s after %d retries\n",
+	 queued.received,queued.lost,queued.max_gap,
+	 rhizome_imports_succeeded?"succeeded":"FAILED",rhizome_imports_retried);
+
+  // The way we used to do it, waiting for servald to answer
+  struct benchmark_rx waited;
+  bzero(&waited,sizeof(waited));
+  radio_pid=benchmark_start_radio(&radio_fd,duration_ms);
+  if (radio_pid<0) return -1;
+  start=gettime_ms();
+  int import_result=0;
+  while(!waited.finished) {
+    if ((!import_result)&&(gettime_ms()-start>500)) {
+      quiet();
+      import_result=http_post_bundle(server,"lbard:lbard","/rhizome/import",
+				     (unsigned char *)manifest,strlen(manifest),
+				     body,body_len,15000);
+      unquiet();
+    }
+    struct pollfd fd={radio_fd,POLLIN,0};
+    poll(&fd,1,100);
+    benchmark_radio_read(radio_fd,&waited);
+  }
+  waitpid(radio_pid,NULL,0);
+  close(radio_fd);
+  printf("  waiting import:  %4d packets received, %4d lost, longest gap %4lldms,"
+	 " http result %d\n",
+	 waited.received,waited.lost,waited.max_gap,import_result);
+
+  kill(server_pid,SIGTERM);
+  waitpid(server_pid,NULL,0);
+  close(count_fd);
+  free(body);
+
+  if (queued.lost||(!rhizome_imports_succeeded)||(!rhizome_imports_retried)) {
+    printf("FAIL: packets were lost, or the import didn't complete\n");
+    return -1;
+  }
+  printf("PASS: no packets lost while importing\n");
+  return 0;
+}
+
+// Reassemble a bundle body from shuffled, duplicated and partly overlapping
+// pieces, in the way that saw_piece() does, including refreshing the request
+// bitmap and working out where to ask for more from after every piece.
+struct benchmark_piece {
+  int offset;
+  int bytes;
+};
+
+int benchmark_reassembly(int count)
+{
+  int length=5*1024*1024;
+  if (count>0&&count!=10000) length=count;
+  if (length>PARTIAL_MAX_STREAM_LENGTH) length=PARTIAL_MAX_STREAM_LENGTH;
+
+  unsigned char *body=malloc(length);
+  assert(body);
+  for(int i=0;i<length;i++) body[i]=random();
+
+  // Cut the body up as a sender would, into 64 byte aligned pieces of a few
+  // blocks each, and then add some unaligned pieces (as sent with
+  // FLAG_NO_BITMAP_PROGRESS) and duplicates of a quarter of them.
+  int max_pieces=length/64*2+16;
+  struct benchmark_piece *pieces=malloc(sizeof(struct benchmark_piece)*max_pieces);
+  assert(pieces);
+  int piece_count=0;
+  for(int offset=0;offset<length;) {
+    int bytes=64*(1+random()%3);
+    if (offset+bytes>length) bytes=length-offset;
+    pieces[piece_count].offset=offset;
+    pieces[piece_count++].bytes=bytes;
+    offset+=bytes;
+  }
+  int unique=piece_count;
+  for(int i=0;i<unique/10;i++) {
+    int offset=random()%length;
+    int bytes=1+random()%200;
+    if (offset+bytes>length) bytes=length-offset;
+    pieces[piece_count].offset=offset;
+    pieces[piece_count++].bytes=bytes;
+  }
+  int with_extras=piece_count;
+  for(int i=0;i<unique/4&&piece_count<max_pieces;i++)
+    pieces[piece_count++]=pieces[random()%with_extras];
+  for(int i=piece_count-1;i>0;i--) {
+    int j=random()%(i+1);
+    struct benchmark_piece t=pieces[i]; pieces[i]=pieces[j]; pieces[j]=t;
+  }
+
+  struct partial_bundle p;
+  bzero(&p,sizeof(p));
+  p.manifest_length=-1;
+  p.body_length=-1;
+
+  long long start=gettime_us();
+  for(int i=0;i<piece_count;i++) {
+    struct benchmark_piece *pc=&pieces[i];
+    int end=pc->offset+pc->bytes;
+    if (end==length) {
+      // The end piece tells us the length
+      p.body_length=length;
+      partial_stream_set_length(&p.body_stream,length);
+    }
+    partial_stream_add(&p.body_stream,p.body_length,pc->offset,pc->bytes,
+		       &body[pc->offset]);
+    partial_update_request_bitmap(&p);
+    int isFirst;
+    partial_find_missing_byte(&p.body_stream,p.body_length,&isFirst);
+    partial_stream_complete(&p.body_stream,p.body_length);
+  }
+  long long elapsed=gettime_us()-start;
+
+  printf("%d byte body from %d pieces (%d unique aligned): %lldus = %.2fus per piece\n",
+	 length,piece_count,unique,elapsed,elapsed*1.0/piece_count);
+  partial_stream_free(&p.body_stream);
+  free(pieces); free(body);
+  return 0;
+}
+
+// How much of the heap is in use, so that we can see what the sync trees cost
+static long long benchmark_heap_used(void)
+{
+#ifdef __GLIBC__
+  struct mallinfo2 m=mallinfo2();
+  return m.uordblks+m.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+// Tell the sync tree about a peer that has all of the given keys
+static void benchmark_sync_peer_learns(struct sync_state *state,void *peer,
+				       sync_key_t *keys,int count)
+{
+  uint8_t msg[10*20];
+  int len=0;
+  for(int i=0;i<count;i++) {
+    msg[len+0]=0x80; // stored, min_prefix_len=0
+    msg[len+1]=KEY_LEN*8;
+    memcpy(&msg[len+2],keys[i].key,KEY_LEN);
+    len+=2+KEY_LEN;
+    if ((len==sizeof(msg))||(i==count-1)) {
+      sync_recv_message(state,peer,msg,len);
+      len=0;
+    }
+  }
+}
+
+int benchmark_sync(int count)
+{
+  int peers=100;
+  long long start,heap_before;
+
+  sync_key_t *keys=calloc(count,sizeof(sync_key_t));
+  assert(keys);
+  for(int i=0;i<count;i++)
+    for(int j=0;j<KEY_LEN;j++) keys[i].key[j]=random();
+
+  heap_before=benchmark_heap_used();
+  struct sync_state *state=sync_alloc_state(NULL,NULL,NULL,NULL);
+
+  start=gettime_us();
+  for(int p=0;p<peers;p++)
+    benchmark_sync_peer_learns(state,(void *)(intptr_t)(p+1),keys,count);
+  benchmark_report("peer trees: keys learnt",count*peers,start);
+  printf("%d peer trees of %d keys use %u nodes (%u branches), %lld bytes of heap (%lld bytes/key)\n",
+	 peers,count,sync_nodes_in_use(state),sync_branches_in_use(state),
+	 benchmark_heap_used()-heap_before,
+	 (benchmark_heap_used()-heap_before)/(count*peers));
+
+  start=gettime_us();
+  for(int p=0;p<peers;p++)
+    sync_free_peer_state(state,(void *)(intptr_t)(p+1));
+  benchmark_report("sync_free_peer_state",peers,start);
+
+  for(int p=0;p<peers;p++)
+    benchmark_sync_peer_learns(state,(void *)(intptr_t)(p+1),keys,count);
+
+  // Now we get all those keys ourselves, so they come out of every peer tree
+  quiet();
+  start=gettime_us();
+  for(int i=0;i<count;i++)
+    sync_add_key(state,&keys[i],NULL);
+  unquiet();
+  benchmark_report("sync_add_key (100 peer trees)",count,start);
+  // (freed nodes stay in the pool for reuse, so the heap doesn't shrink)
+  printf("our tree of %d keys uses %u nodes, peer trees are empty\n",
+	 count,sync_nodes_in_use(state));
+
+  start=gettime_us();
+  sync_free_state(state);
+  benchmark_report("sync_free_state",1,start);
+  free(keys);
+  return 0;
+}
+
+static void benchmark_syncstride_has(void *context,void *peer_context,
+				     const sync_key_t *key)
+{
+  (*(int *)context)++;
+}
+
+/* Two nodes that share count keys, plus 0.5% more each that the other
+   doesn't have, take turns sending each other sync messages of the size that
+   fits in a packet, until each has heard of all of the other's keys. */
+static void benchmark_syncstride_run(int count,uint8_t a_bits,uint8_t b_bits)
+{
+  int unique=count/200;
+  if (unique<1) unique=1;
+  int a_learnt=0,b_learnt=0;
+  struct sync_state *a=sync_alloc_state(&a_learnt,benchmark_syncstride_has,NULL,NULL);
+  struct sync_state *b=sync_alloc_state(&b_learnt,benchmark_syncstride_has,NULL,NULL);
+  sync_set_step_bits(a,a_bits);
+  sync_set_step_bits(b,b_bits);
+
+  quiet();
+  sync_key_t key;
+  for(int i=0;i<count+unique*2;i++) {
+    for(int j=0;j<KEY_LEN;j++) key.key[j]=random();
+    if (i>=count+unique) sync_add_key(b,&key,NULL);
+    else if (i>=count) sync_add_key(a,&key,NULL);
+    else { sync_add_key(a,&key,NULL); sync_add_key(b,&key,NULL); }
+  }
+
+  long long start=gettime_us();
+  int messages=0,bytes=0;
+  uint8_t msg[200];
+  while((a_learnt<unique||b_learnt<unique)&&messages<100000) {
+    size_t len=sync_build_message(a,msg,sizeof(msg));
+    sync_recv_message(b,(void *)1,msg,len);
+    messages++; bytes+=len;
+    if (a_learnt>=unique&&b_learnt>=unique) break;
+    len=sync_build_message(b,msg,sizeof(msg));
+    sync_recv_message(a,(void *)2,msg,len);
+    messages++; bytes+=len;
+  }
+  long long elapsed=gettime_us()-start;
+  unquiet();
+
+  // (synctest checks that they always get there)
+  int converged=(a_learnt>=unique)&&(b_learnt>=unique);
+  printf("stride %d/%d (using %d): %d keys, %d different: %d messages, %d bytes, %lldus CPU, %u nodes%s\n",
+	 a_bits,b_bits,sync_step_bits(a),count,unique*2,messages,bytes,elapsed,
+	 sync_nodes_in_use(a),converged?"":" (gave up)");
+  sync_free_state(a);
+  sync_free_state(b);
+}
+
+int benchmark_syncstride(int count)
+{
+  uint8_t strides[][2]={{1,1},{2,2},{4,4},{8,8},
+			// mixed: they both end up using the smaller stride
+			{4,1},{8,2}};
+  for(int i=0;i<sizeof(strides)/sizeof(strides[0]);i++)
+    benchmark_syncstride_run(count,strides[i][0],strides[i][1]);
+  return 0;
+}
+
+// Set up a sync state as we would have it when we have heard from some peers,
+// but not yet read our own bundle list
+static struct sync_state *benchmark_bulkload_state(sync_key_t *keys,int count,int peers)
+{
+  struct sync_state *state=sync_alloc_state(NULL,NULL,NULL,NULL);
+  sync_key_t theirs[100];
+  for(int p=0;p<peers;p++) {
+    // Each peer has told us about 1% of our keys, and some of its own
+    for(int i=0;i<100;i++)
+      if (i%2) theirs[i]=keys[random()%count];
+      else for(int j=0;j<KEY_LEN;j++) theirs[i].key[j]=random();
+    benchmark_sync_peer_learns(state,(void *)(intptr_t)(p+1),theirs,count/100<100?count/100:100);
+  }
+  return state;
+}
+
+static long long benchmark_bulkload_run(char *what,sync_key_t *keys,int count,
+					int already,int bulk,int peers)
+{
+  struct sync_state *state=benchmark_bulkload_state(keys,count,peers);
+  quiet();
+  for(int i=0;i<already;i++)
+    sync_add_key(state,&keys[i],NULL);
+  long long start=gettime_us();
+  if (bulk) sync_add_keys(state,&keys[already],NULL,count-already);
+  else
+    for(int i=already;i<count;i++)
+      sync_add_key(state,&keys[i],NULL);
+  long long elapsed=gettime_us()-start;
+  unquiet();
+  benchmark_report(what,count-already,start);
+  printf("%u nodes in use\n",sync_nodes_in_use(state));
+  sync_free_state(state);
+  return elapsed;
+}
+
+/* Compare adding keys to the sync tree one at a time, with adding them all
+   at once, both at startup (an empty tree), and when a few more arrive. */
+int benchmark_bulkload(int count)
+{
+  int peers=10;
+  sync_key_t *keys=calloc(count,sizeof(sync_key_t));
+  assert(keys);
+  for(int i=0;i<count;i++)
+    for(int j=0;j<KEY_LEN;j++) keys[i].key[j]=random();
+
+  long long seed=random();
+
+  // (each run sees the same peers)
+  srandom(seed);
+  long long one=benchmark_bulkload_run("startup: sync_add_key",keys,count,0,0,peers);
+  srandom(seed);
+  long long bulk=benchmark_bulkload_run("startup: sync_add_keys",keys,count,0,1,peers);
+  printf("bulk load is %.1fx faster\n",bulk?(double)one/bulk:0);
+
+  srandom(seed);
+  one=benchmark_bulkload_run("10% more: sync_add_key",keys,count,count*10/11,0,peers);
+  srandom(seed);
+  bulk=benchmark_bulkload_run("10% more: sync_add_keys",keys,count,count*10/11,1,peers);
+  printf("bulk load is %.1fx faster\n",bulk?(double)one/bulk:0);
+
+  free(keys);
+  return 0;
+}
+
+/* How many pieces a second we can push through the bitmap bookkeeping that
+   runs for every piece we send or hear, depending on what happens to the log
+   messages it makes. */
+static long long benchmark_logging_run(int count,int level,int echo)
+{
+  char tmpname[]="/tmp/lbard-benchmark-log-XXXXXX";
+  int fd=mkstemp(tmpname);
+  assert(fd>=0);
+  unlink(tmpname);
+  for(int i=0;i<LOG_SUBSYSTEMS;i++) log_levels[i]=level;
+  log_echo_level=echo;
+
+  // Anything echoed goes to a real file, as it would on a mesh extender
+  fflush(stderr);
+  int saved=dup(2);
+  dup2(fd,2);
+  close(fd);
+  peer_records[0]->request_bitmap_bundle=0;
+  bzero(peer_records[0]->request_bitmap,32);
+  long long start=gettime_us();
+  for(int i=0;i<count;i++) {
+    int offset=(i*128)%bundles[0].length;
+    LOG_DEBUG(LOG_PIECES,"I just sent %s piece [%d,%d) for %s*.",
+	      "body",offset,offset+128,peer_records[0]->sid_prefix);
+    peer_update_request_bitmaps_due_to_transmitted_piece(0,0,offset,128);
+  }
+  long long elapsed=gettime_us()-start;
+  fflush(stderr);
+  dup2(saved,2);
+  close(saved);
+  return elapsed;
+}
+
+static int benchmark_compare_double(const void *a,const void *b)
+{
+  double x=*(const double *)a,y=*(const double *)b;
+  return (x>y)-(x<y);
+}
+
+// The cases are closer together than one run is to the next, so each is run
+// several times, taking turns, and we report the median and the range.
+#define BENCHMARK_LOGGING_RUNS 7
+
+int benchmark_logging(int count)
+{
+  memset(&bundles[0],0,sizeof(struct bundle_record));
+  bundles[0].bid_hex="0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+  bundles[0].length=32*8*64;
+  bundle_count=1;
+  struct peer_state *p=calloc(1,sizeof(struct peer_state));
+  assert(p);
+  p->sid_prefix="be0c4be0c4be0c4b";
+  p->tx_bundle=0;
+  peer_records[0]=p;
+  peer_count=1;
+
+  FILE *devnull=fopen("/dev/null","w");
+  assert(devnull);
+  struct {
+    char *what;
+    int level;
+    int echo;
+    double rates[BENCHMARK_LOGGING_RUNS];
+    int kept;
+  } cases[]={
+    {"debug, written to stderr",LOGLEVEL_DEBUG,LOGLEVEL_DEBUG},
+    {"debug, in ring buffer",LOGLEVEL_DEBUG,LOGLEVEL_WARN},
+    {"default (info, in ring buffer)",LOGLEVEL_INFO,LOGLEVEL_WARN},
+    {"off",LOGLEVEL_OFF,LOGLEVEL_OFF},
+  };
+  int case_count=sizeof(cases)/sizeof(cases[0]);
+  for(int r=0;r<BENCHMARK_LOGGING_RUNS;r++)
+    for(int c=0;c<case_count;c++) {
+      long long elapsed=benchmark_logging_run(count,cases[c].level,cases[c].echo);
+      cases[c].rates[r]=elapsed?count*1000000.0/elapsed:0;
+      cases[c].kept=log_flush(devnull);
+    }
+  fclose(devnull);
+
+  printf("%d pieces, median of %d runs (slowest to fastest):\n",count,BENCHMARK_LOGGING_RUNS);
+  for(int c=0;c<case_count;c++) {
+    double *rates=cases[c].rates;
+    qsort(rates,BENCHMARK_LOGGING_RUNS,sizeof(double),benchmark_compare_double);
+    printf("  %-32s %10.0f pieces/sec (%.0f to %.0f), %d messages kept\n",
+	   cases[c].what,rates[BENCHMARK_LOGGING_RUNS/2],
+	   rates[0],rates[BENCHMARK_LOGGING_RUNS-1],cases[c].kept);
+  }
+  printf("default logging runs at %.0f%% of the speed of no logging\n",
+	 cases[3].rates[BENCHMARK_LOGGING_RUNS/2]
+	 ?cases[2].rates[BENCHMARK_LOGGING_RUNS/2]*100.0/cases[3].rates[BENCHMARK_LOGGING_RUNS/2]
+	 :0.0);
+
+  for(int i=0;i<LOG_SUBSYSTEMS;i++) log_levels[i]=LOGLEVEL_INFO;
+  log_echo_level=LOGLEVEL_WARN;
+  peer_records[0]=NULL;
+  peer_count=0;
+  bundle_count=0;
+  free(p);
+  return 0;
+}
+
+/* The status pages, with a big bundle store: writing them all out every few
+   seconds as we used to, against rendering them only when they are fetched.
+   The clock is driven by hand, so a minute of running takes as long as the
+   rendering does. */
+struct benchmark_usage {
+  long long cpu_us;
+  long long syscalls;
+  long long bytes_written;
+};
+
+static void benchmark_usage_get(struct benchmark_usage *u)
+{
+  struct rusage r;
+  getrusage(RUSAGE_SELF,&r);
+  u->cpu_us=r.ru_utime.tv_sec*1000000LL+r.ru_utime.tv_usec
+    +r.ru_stime.tv_sec*1000000LL+r.ru_stime.tv_usec;
+  // syscr and syscw only count read and write type calls, which is what
+  // the status files cost us
+  u->syscalls=0; u->bytes_written=0;
+  FILE *f=fopen("/proc/self/io","r");
+  if (f) {
+    char line[128];
+    long long v;
+    while(fgets(line,sizeof(line),f)) {
+      if (sscanf(line,"syscr: %lld",&v)==1) u->syscalls+=v;
+      if (sscanf(line,"syscw: %lld",&v)==1) u->syscalls+=v;
+      if (sscanf(line,"wchar: %lld",&v)==1) u->bytes_written=v;
+    }
+    fclose(f);
+  }
+}
+
+static void benchmark_status_run(char *what,struct benchmark_usage *used,
+				 int seconds,int file_interval,
+				 int fetch_page,int bundles_change)
+{
+  struct benchmark_usage before,after;
+  status_file_interval=file_interval;
+  benchmark_usage_get(&before);
+  // The main loop, waking every 100ms
+  for(int tick=0;tick<seconds*10;tick++) {
+    now_ms+=100;
+    // A packet from each peer
+    for(int i=0;i<peer_count;i++) {
+      peer_records[i]->last_message_time=now_ms/1000;
+      peer_records[i]->rssi_accumulator+=60;
+      peer_records[i]->rssi_counter++;
+    }
+    status_log("Announcing 01234567* version 1500000000000 payload segment [0,128)");
+    if (bundles_change) status_bundles_changed();
+    if (!(tick%30)) status_dump();
+    // A browser with the page open refreshes it every 2 seconds
+    if ((fetch_page>=0)&&!(tick%20)) status_page_get(fetch_page);
+  }
+  benchmark_usage_get(&after);
+  used->cpu_us=after.cpu_us-before.cpu_us;
+  used->syscalls=after.syscalls-before.syscalls;
+  used->bytes_written=after.bytes_written-before.bytes_written;
+  printf("%-44s %8.1fms CPU/min, %6lld read/write calls, %8lldKB written\n",
+	 what,used->cpu_us*60.0/seconds/1000,used->syscalls*60/seconds,
+	 used->bytes_written*60/seconds/1024);
+}
+
+int benchmark_status(int count)
+{
+  char bid[65],filehash[129],version[32];
+  int seconds=60;
+
+  if (count>MAX_BUNDLES) count=MAX_BUNDLES;
+  quiet();
+  for(int i=0;i<count;i++) {
+    random_hex(bid,32);
+    random_hex(filehash,64);
+    snprintf(version,32,"%lld",1500000000000LL+i);
+    register_bundle("MeshMS2",bid,version,"","0",1024,filehash,"","");
+  }
+  unquiet();
+
+  struct peer_state *p[2];
+  for(int i=0;i<2;i++) {
+    p[i]=calloc(1,sizeof(struct peer_state));
+    assert(p[i]);
+    p[i]->sid_prefix=i?"be0c4be0c4be0c4b":"0123456789abcdef";
+    p[i]->tx_bundle=-1;
+    peer_records[i]=p[i];
+  }
+  peer_count=2;
+
+  struct benchmark_usage old,idle,watched,watched_static;
+  benchmark_status_run("all pages written to /tmp every 3s",&old,
+		       seconds,3,-1,1);
+  benchmark_status_run("on demand, nobody looking",&idle,
+		       seconds,0,-1,1);
+  benchmark_status_run("on demand, /bn open, bundles changing",&watched,
+		       seconds,0,3,1);
+  benchmark_status_run("on demand, /bn open, bundles unchanged",&watched_static,
+		       seconds,0,3,0);
+
+  printf("on demand uses %.1f%% of the CPU of writing files with nobody looking, %.1f%% with /bn open\n",
+	 old.cpu_us?idle.cpu_us*100.0/old.cpu_us:0.0,
+	 old.cpu_us?watched.cpu_us*100.0/old.cpu_us:0.0);
+
+  status_file_interval=0;
+  peer_records[0]=NULL; peer_records[1]=NULL;
+  peer_count=0;
+  free(p[0]); free(p[1]);
+  clock_update();
+  return 0;
+}
+
+/* The /metrics counters: building packets full of length announcements, and
+   what the counter updates on that path cost on their own.  (metricstest
+   checks that the report adds up.) */
+int benchmark_metrics(int count)
+{
+  unsigned char msg[256];
+  unsigned char bid[8]={1,2,3,4,5,6,7,8};
+
+  bzero(&metrics,sizeof(metrics));
+  long long start=gettime_us();
+  for(int i=0;i<count;i++) {
+    // As many as will fit in a packet
+    int offset=0,last=-1;
+    while(offset!=last) {
+      last=offset;
+      announce_bundle_length(200,msg,&offset,bid,1500000000000LL+i,1024);
+    }
+  }
+  long long packets_us=gettime_us()-start;
+  int sections=metrics.tx_bytes_by_type['L']/21;
+
+  // The same number of counter updates on their own
+  volatile unsigned char type='L';
+  start=gettime_us();
+  for(int i=0;i<sections;i++) METRIC_TX_SECTION(type,21);
+  long long counters_us=gettime_us()-start;
+  bzero(&metrics,sizeof(metrics));
+
+  printf("%d packets, %d sections: %lldus, of which counters %lldus (%.1f%%)\n",
+	 count,sections,packets_us,counters_us,
+	 packets_us?counters_us*100.0/packets_us:0.0);
+  return 0;
+}
+
+// ALE 2G sends 3 characters per 392ms word, and each AMD message also has
+// TO and TIS address words.
+#define BENCHMARK_ALE_WORD_MS 392
+#define BENCHMARK_ALE_ADDRESS_WORDS 2
+
+// Send each packet over HF using hex or ASCII-64 fragments.  Returns the
+// number of fragments, and adds up the characters and airtime.
+// (hfencodingtest checks that the fragments decode again)
+static int benchmark_hf_send(unsigned char packets[][256],int *lengths,int count,
+			     int ascii64,int *chars,int *airtime_ms)
+{
+  int fragments=0;
+  *chars=0; *airtime_ms=0;
+  for(int n=0;n<count;n++) {
+    char fragment[1024];
+    hf_peer_ascii64=ascii64;
+    if (hf_tx_start(packets[n],lengths[n])) continue;
+    while(hf_tx.offset<hf_tx.len) {
+      hf_tx_fragment(fragment,'0');
+      int len=strlen(fragment);
+      fragments++;
+      *chars+=len;
+      *airtime_ms+=((len+2)/3+BENCHMARK_ALE_ADDRESS_WORDS)*BENCHMARK_ALE_WORD_MS;
+      hf_tx.offset+=hf_tx.fragment_bytes;
+    }
+    hf_tx.state=HF_TX_IDLE;
+  }
+  hf_peer_ascii64=0;
+  return fragments;
+}
+
+/* ASCII-64 vs hex for HF fragments: how fast we encode and decode, then the
+   fragments and airtime it takes to send a typical MeshMS bundle each way. */
+int benchmark_hfencoding(int count)
+{
+  unsigned char in[HF_FRAGMENT_BYTES_ASCII64],out[256];
+  char encoded[1024];
+  for(int i=0;i<sizeof(in);i++) in[i]=random();
+  long long start=gettime_us();
+  for(int n=0;n<count;n++)
+    ascii64_encode(in,encoded,sizeof(in),RADIOTYPE_HFBARRETT);
+  benchmark_report("ascii64_encode (65 bytes)",count,start);
+  start=gettime_us();
+  for(int n=0;n<count;n++)
+    ascii64_decode(encoded,out,sizeof(out),RADIOTYPE_HFBARRETT);
+  benchmark_report("ascii64_decode (65 bytes)",count,start);
+
+  // A MeshMS bundle with a 300 byte manifest and a 400 byte body (a handful
+  // of messages), cut into pieces as sync_append_some_bundle_bytes() does:
+  // an 8 byte packet header, then 23 byte piece headers and the pieces
+  // (64 byte aligned unless they end the manifest or body), then the RS parity.
+  unsigned char packets[16][256];
+  int lengths[16];
+  int packet_count=0;
+  int item_lengths[2]={300,400};
+  int item=0,item_offset=0;
+  while(item<2) {
+    int offset=8;
+    while((item<2)&&(LINK_MTU-offset-23>0)) {
+      int bytes=LINK_MTU-offset-23;
+      if (item_lengths[item]-item_offset<=bytes) bytes=item_lengths[item]-item_offset;
+      else bytes-=(item_offset+bytes)&63;
+      if (bytes<1) break;
+      offset+=23+bytes;
+      item_offset+=bytes;
+      if (item_offset==item_lengths[item]) { item++; item_offset=0; }
+    }
+    // (and 32 bytes of RS parity)
+    for(int i=0;i<offset+32;i++) packets[packet_count][i]=random();
+    lengths[packet_count++]=offset+32;
+  }
+
+  int hex_chars,hex_ms,a64_chars,a64_ms;
+  int hex_fragments=benchmark_hf_send(packets,lengths,packet_count,0,
+				      &hex_chars,&hex_ms);
+  int a64_fragments=benchmark_hf_send(packets,lengths,packet_count,1,
+				      &a64_chars,&a64_ms);
+  int total=0;
+  for(int i=0;i<packet_count;i++) total+=lengths[i];
+  printf("MeshMS bundle (%d+%d bytes) in %d packets of %d bytes:\n",
+	 item_lengths[0],item_lengths[1],packet_count,total);
+  printf("  hex:      %2d fragments, %5d characters, %6.1fs of ALE 2G airtime\n",
+	 hex_fragments,hex_chars,hex_ms/1000.0);
+  printf("  ASCII-64: %2d fragments, %5d characters, %6.1fs of ALE 2G airtime (%.0f%%)\n",
+	 a64_fragments,a64_chars,a64_ms/1000.0,hex_ms?a64_ms*100.0/hex_ms:0.0);
+
+  return 0;
+}
+
+// What the Codan radio does to the amd command before sending it
+static void benchmark_codan_unescape(char *text)
+{
+  int o=0;
+  for(char *c=text;*c;c++) {
+    if ((*c=='\\')&&c[1]) c++;
+    text[o++]=*c;
+  }
+  text[o]=0;
+}
+
+struct benchmark_fragment {
+  char sender[8];
+  char text[128];
+};
+
+static int benchmark_hf_reassembled=0;
+
+// Stands in for saw_packet()
+static int benchmark_hf_count_packets(unsigned char *packet,int len,int *erasures,int erasure_count)
+{
+  benchmark_hf_reassembled++;
+  return 0;
+}
+
+/* HF fragment reassembly: packets from 2 stations that are sending at once,
+   in hex and ASCII-64, so we hear their fragments alternately.  Measures
+   hf_reassembly_add() per fragment.  (hfreassemblytest checks what comes
+   out, with fragments lost, garbled and reordered.) */
+int benchmark_hfreassembly(int count)
+{
+  struct benchmark_fragment *stream=calloc(count*6,sizeof(struct benchmark_fragment));
+  assert(stream);
+  int fragments=0;
+  int saved_radio_type=radio_get_type();
+  int saved_batch_limit=hf_batch_limit;
+  radio_set_type(RADIOTYPE_HFBARRETT);
+  hf_batch_limit=1;
+
+  for(int n=0;n<count;n+=2) {
+    struct benchmark_fragment pair[2][6];
+    int pieces[2]={0,0};
+    for(int k=0;(k<2)&&(n+k<count);k++) {
+      // RS encoded as radio_send_message() does
+      unsigned char p[256];
+      int len=40+random()%(200+32-40+1);
+      for(int i=0;i<len-32;i++) p[i]=random();
+      encode_rs_8_fast(p,&p[len-32],223-(len-32));
+      hf_peer_ascii64=random()&1;
+      hf_message_sequence_number=n/2;
+      if (hf_tx_start(p,len)) continue;
+      while(hf_tx.offset<hf_tx.len) {
+	struct benchmark_fragment *f=&pair[k][pieces[k]++];
+	snprintf(f->sender,sizeof(f->sender),"%d",k+1);
+	hf_tx_fragment(f->text,'A');
+	hf_tx.offset+=hf_tx.fragment_bytes;
+      }
+      hf_tx.state=HF_TX_IDLE;
+    }
+    for(int i=0;(i<pieces[0])||(i<pieces[1]);i++)
+      for(int k=0;k<2;k++)
+	if (i<pieces[k]) stream[fragments++]=pair[k][i];
+  }
+  hf_peer_ascii64=0;
+  radio_set_type(saved_radio_type);
+  hf_batch_limit=saved_batch_limit;
+
+  // With the time passing as each fragment is sent
+  int (*saved_handler)(unsigned char *,int,int *,int)=hf_packet_handler;
+  hf_packet_handler=benchmark_hf_count_packets;
+  bzero(hf_reassembly,sizeof(hf_reassembly));
+  benchmark_hf_reassembled=0;
+  long long saved_now=now_ms;
+  quiet();
+  long long start=gettime_us();
+  for(int i=0;i<fragments;i++) {
+    int len=strlen(stream[i].text);
+    now_ms+=((len+2)/3+BENCHMARK_ALE_ADDRESS_WORDS)*BENCHMARK_ALE_WORD_MS;
+    hf_reassembly_add(stream[i].sender,stream[i].text);
+  }
+  unquiet();
+  benchmark_report("hf_reassembly_add",fragments,start);
+  now_ms=saved_now;
+  hf_packet_handler=saved_handler;
+  bzero(hf_reassembly,sizeof(hf_reassembly));
+
+  printf("%d of %d packets passed up\n",benchmark_hf_reassembled,count);
+  free(stream);
+  return 0;
+}
+
+// Swapping between sending and receiving, and getting back in sync
+#define BENCHMARK_HF_TURNAROUND_MS 3000
+
+// The two ends of a simulated HF link.  Each has its own copy of the HF
+// state, which we swap in and out of the globals as each takes its turn.
+struct benchmark_hf_station {
+  char name[8];
+  int state;
+  int link_partner;
+  int sequence_number;
+  int peer_ascii64;
+  long long next_packet_time;
+  struct hf_tx tx;
+  struct hf_batch batch;
+  struct hf_reassembly reassembly[HF_REASSEMBLY_SLOTS];
+  long long wait_start;
+  int awaiting_answer;
+  int their_turn;
+  char link_senders[HF_LINK_SENDERS_MAX][16];
+  int link_sender_count;
+  // The other station, as it is in our plan
+  struct hf_station peer;
+  // The fragment it has on the air, if any, and when that finishes
+  char fragment[1024];
+  long long on_air;
+  long long off_air;
+  int collided;
+};
+static struct benchmark_hf_station benchmark_hf_ends[2];
+static long long benchmark_hf_bytes;
+
+static void benchmark_hf_enter(struct benchmark_hf_station *s)
+{
+  hf_state=s->state;
+  hf_link_partner=s->link_partner;
+  hf_message_sequence_number=s->sequence_number;
+  hf_peer_ascii64=s->peer_ascii64;
+  hf_next_packet_time=s->next_packet_time;
+  hf_tx=s->tx;
+  hf_batch=s->batch;
+  memcpy(hf_reassembly,s->reassembly,sizeof(hf_reassembly));
+  hf_wait_start=s->wait_start;
+  hf_awaiting_answer=s->awaiting_answer;
+  hf_their_turn=s->their_turn;
+  memcpy(hf_link_senders,s->link_senders,sizeof(hf_link_senders));
+  hf_link_sender_count=s->link_sender_count;
+  hf_stations[0]=s->peer;
+  hf_station_count=1;
+}
+
+static void benchmark_hf_leave(struct benchmark_hf_station *s)
+{
+  s->state=hf_state;
+  s->link_partner=hf_link_partner;
+  s->sequence_number=hf_message_sequence_number;
+  s->peer_ascii64=hf_peer_ascii64;
+  s->next_packet_time=hf_next_packet_time;
+  s->tx=hf_tx;
+  s->batch=hf_batch;
+  memcpy(s->reassembly,hf_reassembly,sizeof(hf_reassembly));
+  s->wait_start=hf_wait_start;
+  s->awaiting_answer=hf_awaiting_answer;
+  s->their_turn=hf_their_turn;
+  memcpy(s->link_senders,hf_link_senders,sizeof(hf_link_senders));
+  s->link_sender_count=hf_link_sender_count;
+  s->peer=hf_stations[0];
+}
+
+// Count the data bytes of each packet that gets through
+static int benchmark_hf_count_bytes(unsigned char *packet,int len,int *erasures,int erasure_count)
+{
+  int rs_error_count=rs_decode_packet(packet,len,erasures,erasure_count);
+  if ((rs_error_count<0)||(rs_error_count>=8)) return -1;
+  benchmark_hf_bytes+=len-32;
+  return 0;
+}
+
+/* Run links of around mean_link_ms between two stations, each sending
+   full packets whenever the HF code says it may, over a channel where:
+   - fragments take as long as fakecsmaradio says they do,
+   - each time the other station starts sending, the link has to be turned
+     around, which takes BENCHMARK_HF_TURNAROUND_MS,
+   - 5% of fragments are lost, a station that can hear the other one waits
+     for it to finish, and fragments that start at the same moment collide,
+   - whatever is on the air when the link drops is lost.
+   Returns the data bytes delivered per minute of link time. */
+static double benchmark_hf_links(int links,long long mean_link_ms,
+				 int *packets,int *turns)
+{
+  long long link_time=0;
+  struct benchmark_hf_station *ends=benchmark_hf_ends;
+  bzero(ends,sizeof(benchmark_hf_ends));
+  for(int k=0;k<2;k++) {
+    snprintf(ends[k].name,sizeof(ends[k].name),"%d",k+1);
+    ends[k].state=HF_DISCONNECTED;
+    ends[k].link_partner=0;
+    // The plan says 5 minutes, whatever the links really do
+    ends[k].peer.name=k?"1":"2";
+    ends[k].peer.link_time_target=5;
+  }
+  benchmark_hf_bytes=0;
+  *packets=0; *turns=0;
+
+  for(int l=0;l<links;l++) {
+    // Between a quarter and 1.75 times the mean
+    long long duration=mean_link_ms/4+random()%(mean_link_ms*3/2);
+    long long close=now_ms+duration;
+    int last_sender=-1;
+
+    // Each end hears the link come up.  The one that called goes first.
+    for(int k=0;k<2;k++) {
+      benchmark_hf_enter(&ends[k]);
+      hf_link_established();
+      hf_state=HF_ALELINK;
+      if (k==(l&1)) hf_radio_mark_ready(); else hf_radio_pause_for_turnaround();
+      benchmark_hf_leave(&ends[k]);
+    }
+
+    while(1) {
+      // When does something next happen?
+      long long next=close;
+      for(int k=0;k<2;k++) {
+	struct benchmark_hf_station *s=&ends[k];
+	long long t;
+	if (s->on_air) t=s->off_air;
+	else if (s->tx.state==HF_TX_PRESEND) t=s->tx.due;
+	else if (s->tx.state==HF_TX_IDLE) t=s->next_packet_time;
+	else continue;
+	if (t<next) next=t;
+      }
+      if (next>=close) break;
+      if (next>now_ms) now_ms=next;
+
+      for(int k=0;k<2;k++) {
+	struct benchmark_hf_station *s=&ends[k];
+	struct benchmark_hf_station *other=&ends[k^1];
+	if (s->on_air&&(now_ms>=s->off_air)) {
+	  // The radio says AMD CALL FINISHED, and the other end hears it
+	  s->on_air=0;
+	  benchmark_hf_enter(s);
+	  int more=hf_tx.more;
+	  hf_tx_fragment_sent();
+	  if (hf_tx.state==HF_TX_IDLE) {
+	    (*packets)++;
+	    if (!more) (*turns)++;
+	  }
+	  benchmark_hf_leave(s);
+	  if ((!s->collided)&&(random()%100>=5)) {
+	    benchmark_hf_enter(other);
+	    hf_process_fragment(s->name,s->fragment);
+	    benchmark_hf_leave(other);
+	  }
+	} else if ((s->tx.state==HF_TX_PRESEND)&&(now_ms>=s->tx.due)) {
+	  benchmark_hf_enter(s);
+	  if (now_ms>hf_tx.deadline)
+	    hf_tx_abort("Failed to send packet in reasonable amount of time");
+	  else if (other->on_air&&(now_ms>other->on_air)) {
+	    // We can hear the other station, so wait for it to finish
+	    hf_tx.due=other->off_air;
+	  } else {
+	    hf_tx_fragment(s->fragment,'0');
+	    benchmark_codan_unescape(s->fragment);
+	    hf_tx.state=HF_TX_SENDING;
+	    s->on_air=now_ms;
+	    // (as long as fakecsmaradio's Codan takes)
+	    s->off_air=now_ms+1000+20*strlen(s->fragment);
+	    if ((last_sender>=0)&&(last_sender!=k)) s->off_air+=BENCHMARK_HF_TURNAROUND_MS;
+	    last_sender=k;
+	    s->collided=0;
+	    if (other->on_air) s->collided=other->collided=1;
+	  }
+	  benchmark_hf_leave(s);
+	} else if ((s->tx.state==HF_TX_IDLE)&&(now_ms>=s->next_packet_time)) {
+	  // A full packet, as update_my_message() would make
+	  benchmark_hf_enter(s);
+	  if (hf_radio_check_if_ready()) {
+	    unsigned char packet[LINK_MTU+32];
+	    for(int i=0;i<LINK_MTU;i++) packet[i]=random();
+	    encode_rs_8_fast(packet,&packet[LINK_MTU],223-LINK_MTU);
+	    hf_tx_start(packet,sizeof(packet));
+	  }
+	  benchmark_hf_leave(s);
+	}
+      }
+    }
+
+    // The link drops, with whatever was on the air
+    now_ms=close;
+    link_time+=duration;
+    for(int k=0;k<2;k++) {
+      benchmark_hf_enter(&ends[k]);
+      hf_tx_abort("Lost ALE link while sending packet");
+      hf_link_closed();
+      hf_state=HF_DISCONNECTED;
+      benchmark_hf_leave(&ends[k]);
+      ends[k].on_air=0;
+    }
+    // (and it is a while before the next one)
+    now_ms+=HF_REASSEMBLY_TIMEOUT_MS;
+  }
+  return benchmark_hf_bytes*60000.0/link_time;
+}
+
+// Bytes per minute of link time, sending one packet per turn, as we used to,
+// and then several, for links of different lengths.
+int benchmark_hfbatch(int links)
+{
+  long long mean_minutes[4]={2,5,10,20};
+  int saved_radio_type=radio_get_type();
+  int saved_batch_limit=hf_batch_limit;
+  long long saved_now=now_ms;
+  int (*saved_handler)(unsigned char *,int,int *,int)=hf_packet_handler;
+  radio_set_type(RADIOTYPE_HFCODAN);
+  hf_packet_handler=benchmark_hf_count_bytes;
+
+  printf("mean link   one packet per turn       batched               packets/turn\n");
+  for(int m=0;m<4;m++) {
+    double rate[2];
+    int packets[2],turns[2];
+    for(int batched=0;batched<2;batched++) {
+      // (the same links both ways)
+      srandom(m+1);
+      hf_batch_limit=batched?HF_BATCH_MAX:1;
+      quiet();
+      rate[batched]=benchmark_hf_links(links,mean_minutes[m]*60000,
+				       &packets[batched],&turns[batched]);
+      unquiet();
+    }
+    printf("%3lld minutes  %7.0f bytes/minute  %7.0f bytes/minute (%+.0f%%)  %.2f\n",
+	   mean_minutes[m],rate[0],rate[1],
+	   rate[0]?(rate[1]-rate[0])*100.0/rate[0]:0.0,
+	   turns[1]?packets[1]*1.0/turns[1]:0.0);
+  }
+
+  hf_packet_handler=saved_handler;
+  hf_batch_limit=saved_batch_limit;
+  radio_set_type(saved_radio_type);
+  now_ms=saved_now;
+  bzero(&hf_tx,sizeof(hf_tx));
+  bzero(&hf_batch,sizeof(hf_batch));
+  bzero(hf_reassembly,sizeof(hf_reassembly));
+  hf_wait_start=0;
+  hf_awaiting_answer=0;
+  hf_their_turn=0;
+  hf_link_sender_count=0;
+  hf_station_count=0;
+  return 0;
+}
+
+int benchmark_parse_command(int argc,char **argv)
+{
+  if (argc<3) {
+    fprintf(stderr,"usage: lbard benchmark <bundles|prefix|priority|httpfetch|httpclient|import|reassembly|sync|syncstride|bulkload|logging|status|metrics|hfencoding|hfreassembly|hfbatch> [count]\n");
+    return -1;
+  }
+  int count=10000;
+  if (argc>3) count=atoi(argv[3]);
+
+  clock_update();
+
+  // timestamp_str() needs a SID to show
+  if (!my_sid_hex) my_sid_hex="BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C";
+
+  if (!strcasecmp(argv[2],"bundles")) return benchmark_bundles(count);
+  if (!strcasecmp(argv[2],"prefix")) return benchmark_prefix(count);
+  if (!strcasecmp(argv[2],"priority")) return benchmark_priority(count);
+  if (!strcasecmp(argv[2],"httpfetch")) return benchmark_httpfetch(count);
+  if (!strcasecmp(argv[2],"import")) return benchmark_import(count);
+  if (!strcasecmp(argv[2],"httpclient")) return benchmark_httpclient(count==10000?2000:count);
+  if (!strcasecmp(argv[2],"reassembly")) return benchmark_reassembly(count);
+  if (!strcasecmp(argv[2],"sync")) return benchmark_sync(count);
+  if (!strcasecmp(argv[2],"syncstride")) return benchmark_syncstride(count);
+  if (!strcasecmp(argv[2],"bulkload")) return benchmark_bulkload(count);
+  if (!strcasecmp(argv[2],"logging")) return benchmark_logging(count==10000?100000:count);
+  if (!strcasecmp(argv[2],"status")) return benchmark_status(count);
+  if (!strcasecmp(argv[2],"metrics")) return benchmark_metrics(count);
+  if (!strcasecmp(argv[2],"hfencoding")) return benchmark_hfencoding(count);
+  if (!strcasecmp(argv[2],"hfreassembly")) return benchmark_hfreassembly(count==10000?2000:count);
+  if (!strcasecmp(argv[2],"hfbatch")) return benchmark_hfbatch(count==10000?50:count);
+
+  fprintf(stderr,"Unknown benchmark '%s'\n",argv[2]);
+  return -1;
+}
@@ -72,6 +72,40 @@ int hfbarrett_initialise(int serialfd)
   return 0;
 }
 
+// Hand the next fragment of the packet we are sending to the radio, and keep
+// offering it until the radio accepts it.
+int hfbarrett_tx_step(int serialfd)
+{
+  char fragment[1024];
+
+  if (hf_tx.state==HF_TX_IDLE) return 0;
+  if (hf_state!=HF_ALELINK)
+    return hf_tx_abort("Lost ALE link while sending packet");
+  if (now_ms>hf_tx.deadline)
+    return hf_tx_abort("Failed to send packet in reasonable amount of time");
+  if (now_ms<hf_tx.due) return 0;
+
+  if (hf_tx.state==HF_TX_PRESEND) {
+    // Indicate radio type in fragment header
+    hf_tx_fragment(fragment,0x41);
+    snprintf(hf_tx.message,sizeof(hf_tx.message),"AXNMSG%s%02d%s\r\n",
+	     barrett_link_partner_string,
+	     (int)strlen(fragment),fragment);
+    hf_tx.state=HF_TX_SENDING;
+  } else {
+    // Check that it got accepted for TX. If we see EV04, then something is still
+    // being sent, and we have to wait and try again.
+    if (hf_tx.accepted&&(!hf_tx.rejected)) return hf_tx_fragment_sent();
+  }
+
+  hf_tx.accepted=0;
+  hf_tx.rejected=0;
+  write_all(serialfd,hf_tx.message,strlen(hf_tx.message));
+  // Any ALE send will take at least a second, so we can safely wait that long
+  hf_tx.due=now_ms+1000;
+  return 0;
+}
+
 int hfbarrett_serviceloop(int serialfd)
 {
   char cmd[1024];
@@ -81,15 +115,18 @@ int hfbarrett_serviceloop(int serialfd)
     exit(-1);
   }
 
+  hfbarrett_tx_step(serialfd);
+  hf_reassembly_expire();
+
   switch(hf_state) {
   case HF_DISCONNECTED:
     // Currently disconnected. If the current time is later than the next scheduled
     // call-out time, then pick a hf station to call
 
     // Wait until we are allowed our first call before doing so
-    if (time(0)<last_outbound_call) return 0;
+    if (now_ms<last_outbound_call) return 0;
     
-    if ((hf_station_count>0)&&(time(0)>=hf_next_call_time)) {
+    if ((hf_station_count>0)&&(now_ms>=hf_next_call_time)) {
       int next_station = hf_next_station_to_call();
       if (next_station>-1) {
 	// Ensure we have a clear line for new command (we were getting some
@@ -108,19 +145,20 @@ int hfbarrett_serviceloop(int serialfd)
   case HF_CALLREQUESTED:
     // Probe periodically with AILTBL to get link table, because the modem doesn't
     // preemptively tell us when we get a link established
-    if (time(0)!=last_link_probe_time)  {
+    if (now_ms-last_link_probe_time>=1000)  {
       write(serialfd,"AILTBL\r\n",8);
-      last_link_probe_time=time(0);
+      last_link_probe_time=now_ms;
     }
     break;
   case HF_CONNECTING:
     break;
   case HF_ALELINK:
     // Probe periodically with AILTBL to get link table, because the modem doesn't
-    // preemptively tell us when we lose a link
-    if (time(0)!=last_link_probe_time)  {
+    // preemptively tell us when we lose a link.
+    // (but not while we are waiting for it to accept a fragment)
+    if ((hf_tx.state==HF_TX_IDLE)&&(now_ms-last_link_probe_time>=1000))  {
       write(serialfd,"AILTBL\r\n",8);
-      last_link_probe_time=time(0);
+      last_link_probe_time=now_ms;
     }
     break;
   case HF_DISCONNECTING:
@@ -151,14 +189,24 @@ int hfbarrett_process_line(char *l)
     return 0;
   }
 
+  if (hf_tx.state==HF_TX_SENDING) {
+    if (!strcmp(l,"OK")) hf_tx.accepted=1;
+    else if (!strncmp(l,"EV",2)) hf_tx.rejected=1;
+  }
+
   char tmp[8192];
 
-  if (sscanf(l,"AIAMDM%s",tmp)==1) {
-    fprintf(stderr,"Barrett radio saw ALE AMD message '%s'\n",&tmp[6]);
-    hf_process_fragment(&tmp[6]);
+  // (ASCII-64 fragments can contain spaces, so we take the rest of the line)
+  if ((!strncmp(l,"AIAMDM",6))&&(strlen(l)>12)) {
+    // (it starts with the address of the sending station)
+    char sender[5];
+    snprintf(sender,sizeof(sender),"%s",&l[6]);
+    fprintf(stderr,"Barrett radio saw ALE AMD message '%s' from %s\n",&l[12],sender);
+    hf_process_fragment(sender,&l[12]);
   }
   
   if ((!strcmp(l,"AILTBL"))&&(hf_state==HF_ALELINK)) {
+      hf_link_closed();
       if (hf_link_partner>-1) {
 	// Mark link partner as having been attempted now, so that we can
 	// round-robin better.  Basically we should probably mark the station we failed
@@ -168,6 +216,7 @@ int hfbarrett_process_line(char *l)
 		hf_link_partner,
 		hf_stations[hf_link_partner].name,
 		hf_stations[hf_link_partner].consecutive_connection_failures);
+	hf_call_failed();
       }
       hf_link_partner=-1;
       ale_inprogress=0;
@@ -181,6 +230,7 @@ int hfbarrett_process_line(char *l)
     barrett_link_partner_string[2]=tmp[2];
     barrett_link_partner_string[3]=tmp[3];
     barrett_link_partner_string[4]=0;
+    hf_link_established();
 
     int i;
     hf_link_partner=-1;
@@ -198,9 +248,9 @@ int hfbarrett_process_line(char *l)
     } else hf_radio_mark_ready();
 
     
-    fprintf(stderr,"ALE Link established with %s (station #%d), I will send a packet in %ld seconds\n",
+    fprintf(stderr,"ALE Link established with %s (station #%d), I will send a packet in %lld seconds\n",
 	    barrett_link_partner_string,hf_link_partner,
-	    hf_next_packet_time-time(0));
+	    (hf_next_packet_time-now_ms)/1000);
     
     hf_state=HF_ALELINK;
   }
@@ -229,80 +279,13 @@ int hfbarrett_send_packet(int serialfd,unsigned char *out, int len)
   // 22 groups of 3 bytes = 66 bytes raw and 88 encoded bytes.  We can use the first
   // two bytes for fragmentation, since we would still like to support 256-byte
   // messages.  This means we need upto 4 pieces for each message.
-  char message[8192];
-  char fragment[8192];
-
-  int i;
-
-  time_t absolute_timeout=time(0)+90;
+  // The fragments are sent by hfbarrett_tx_step() from the service loop.
 
   if (hf_state!=HF_ALELINK) return -1;
   if (ale_inprogress) return -1;
   if (!barrett_link_partner_string[0]) return -1;
-  
-  // How many pieces to send (1-6)
-  // This means we have 36 possible fragment indications, if we wish to imply the
-  // number of fragments in the fragment counter.
-  int pieces=len/43; if (len%43) pieces++;
+  if (hf_tx.state!=HF_TX_IDLE) return -1;
   
   fprintf(stderr,"Sending message of %d bytes via Barratt HF\n",len);
-  for(i=0;i<len;i+=43) {
-    // Indicate radio type in fragment header
-    fragment[0]=0x41+(hf_message_sequence_number&0x07);
-    fragment[1]=0x30+(i/43);
-    fragment[2]=0x30+pieces;
-    int frag_len=43; if (len-i<43) frag_len=len-i;
-    hex_encode(&out[i],&fragment[3],frag_len,radio_get_type());
-
-    unsigned char buffer[8192];
-    int count;
-
-    usleep(100000);
-    count = read_nonblock(serialfd,buffer,8192);
-    if (count) dump_bytes(stderr,"presend",buffer,count);
-    if (count) hfbarrett_receive_bytes(buffer,count);
-    
-    snprintf(message,8192,"AXNMSG%s%02d%s\r\n",
-	     barrett_link_partner_string,
-	     (int)strlen(fragment),fragment);
-
-    int not_accepted=1;
-    while (not_accepted) {
-      if (time(0)>absolute_timeout) {
-	fprintf(stderr,"Failed to send packet in reasonable amount of time. Aborting.\n");
-	hf_message_sequence_number++;
-	return -1;
-      }
-      
-      write_all(serialfd,message,strlen(message));
-
-      // Any ALE send will take at least a second, so we can safely wait that long
-      sleep(1);
-
-      // Check that it gets accepted for TX. If we see EV04, then something is still
-      // being sent, and we have to wait and try again.
-      count = read_nonblock(serialfd,buffer,8192);
-      // if (count) dump_bytes(stderr,"postsend",buffer,count);
-      if (count) hfbarrett_receive_bytes(buffer,count);
-      if (strstr((const char *)buffer,"OK")
-	  &&(!strstr((const char *)buffer,"EV"))) {
-	not_accepted=0;
-	char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
-	if (timestr[0]) timestr[strlen(timestr)-1]=0;
-	fprintf(stderr,"  [%s] Sent %s",timestr,message);
-
-      } else not_accepted=1;
-      
-    }    
-
-  }
-  hf_radio_pause_for_turnaround();
-  hf_message_sequence_number++;
-  char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
-  if (timestr[0]) timestr[strlen(timestr)-1]=0;
-  fprintf(stderr,"  [%s] Finished sending packet, next in %ld seconds.\n",
-	  timestr,hf_next_packet_time-time(0));
-  
-  return 0;
+  return hf_tx_start(out,len);
 }
-
@@ -62,17 +62,41 @@ int hfcodanbarrett_radio_detect(int fd)
       // Codan radio supports only ALE 2G (90 x 6-bit chars per message)
       radio_set_feature(RADIO_ALE_2G);
     radio_set_type(RADIOTYPE_HFCODAN);
-    return 0;
+    return 1;
   } else if (barrett_e0_seen) {
     fprintf(stderr,"Detected Barrett HF Radio.\n");
     radio_set_type(RADIOTYPE_HFBARRETT);
     radio_set_feature(RADIO_ALE_2G);
 
-    return hfbarrett_initialise(fd);
+    hfbarrett_initialise(fd);
+    return 1;
   }
   return -1;
 }
 
+// Hand the next fragment of the packet we are sending to the radio, once
+// it has finished with the last one.
+int hfcodan_tx_step(int serialfd)
+{
+  char fragment[1024];
+
+  if (hf_tx.state==HF_TX_IDLE) return 0;
+  if ((hf_state&0xff)!=HF_ALELINK)
+    return hf_tx_abort("Lost ALE link while sending packet");
+  if (now_ms>hf_tx.deadline)
+    return hf_tx_abort("Failed to send packet in reasonable amount of time");
+
+  if ((hf_tx.state==HF_TX_PRESEND)&&(now_ms>=hf_tx.due)) {
+    // Indicate radio type in fragment header
+    hf_tx_fragment(fragment,0x30);
+    snprintf(hf_tx.message,sizeof(hf_tx.message),"amd %s\r\n",fragment);
+    write_all(serialfd,hf_tx.message,strlen(hf_tx.message));
+    // The radio tells us AMD CALL FINISHED when it has gone
+    hf_tx.state=HF_TX_SENDING;
+  }
+  return 0;
+}
+
 int hfcodan_serviceloop(int serialfd)
 {
   char cmd[1024];
@@ -82,15 +106,18 @@ int hfcodan_serviceloop(int serialfd)
     exit(-1);
   }
 
+  hfcodan_tx_step(serialfd);
+  hf_reassembly_expire();
+
   switch(hf_state) {
   case HF_DISCONNECTED:
     // Currently disconnected. If the current time is later than the next scheduled
     // call-out time, then pick a hf station to call
 
     // Wait until we are allowed our first call before doing so
-    if (time(0)<last_outbound_call) return 0;
+    if (now_ms<last_outbound_call) return 0;
     
-    if ((hf_station_count>0)&&(time(0)>=hf_next_call_time)) {
+    if ((hf_station_count>0)&&(now_ms>=hf_next_call_time)) {
       int next_station = hf_next_station_to_call();
       if (next_station>-1) {
 	  snprintf(cmd,1024,"alecall %s \"!SERVAL,1,0,%s\"\r\n",
@@ -119,14 +146,24 @@ int hfcodan_serviceloop(int serialfd)
   return 0;
 }
 
+// The radio's prompt is a ">", after the time (e.g., "12:34:56.789> ")
+int hfcodan_is_prompt(char *l)
+{
+  int offset=0;
+  if (l[0]=='>') return 1;
+  sscanf(l,"%*d:%*d:%*d.%*d>%n",&offset);
+  return offset>0;
+}
+
 int hfcodan_process_line(char *l)
 {
   int channel,caller,callee,day,month,hour,minute;
+  int offset=0;
   
   //  fprintf(stderr,"Codan radio (state 0x%04x) says: %s\n",hf_state,l);
   if (hf_state&HF_COMMANDISSUED) {
     // Ignore echoed commands, and wait for ">" prompt
-    if (l[0]=='>') hf_state&=~HF_COMMANDISSUED;
+    if (hfcodan_is_prompt(l)) hf_state&=~HF_COMMANDISSUED;
     else if (!strcmp(l,"CALL STARTED")) {
       hf_state=HF_COMMANDISSUED|HF_CONNECTING;
     }
@@ -138,32 +175,50 @@ int hfcodan_process_line(char *l)
   else if (!strcmp(l,"CALL DETECTED")) {
     // Incoming ALE message -- so don't try sending anything for a little while
     hf_radio_pause_for_turnaround();
-  } else if (!strcmp(l,"AMD CALL FINISHED")) ale_inprogress=0;
-  else if (sscanf(l,"AMD-CALL: %d, %d, %d, %d/%d %d:%d, \"%[^\"]\"",
-		  &channel,&caller,&callee,&day,&month,&hour,&minute,fragment)==8) {
-    // Saw a fragment
-    hf_process_fragment(fragment);
+  } else if (!strcmp(l,"AMD CALL FINISHED")) {
+    ale_inprogress=0;
+    if (hf_tx.state==HF_TX_SENDING) hf_tx_fragment_sent();
+  } else if ((!strncmp(l,"ERROR",5))&&(hf_tx.state==HF_TX_SENDING)) {
+    // Something went wrong
+    hf_tx_abort("Error sending packet");
+  }
+  else if ((sscanf(l,"AMD-CALL: %d, %d, %d, %d/%d %d:%d, \"%n",
+		   &channel,&caller,&callee,&day,&month,&hour,&minute,&offset)==7)
+	   &&offset&&strrchr(&l[offset],'"')) {
+    // Saw a fragment.  ASCII-64 fragments can contain quotes, so it runs to the
+    // last one on the line.
+    snprintf(fragment,sizeof(fragment),"%s",&l[offset]);
+    *strrchr(fragment,'"')=0;
+    char sender[16];
+    snprintf(sender,sizeof(sender),"%d",caller);
+    hf_process_fragment(sender,fragment);
     // We must also by definition be connected
     hf_state=HF_ALELINK;
   } else if (sscanf(l,"ALE-LINK: %d, %d, %d, %d/%d %d:%d",
 	     &channel,&caller,&callee,&day,&month,&hour,&minute)==7) {
-    if (hf_link_partner>=-1)
+    if (hf_link_partner>-1)
       hf_stations[hf_link_partner].consecutive_connection_failures=0;
     ale_inprogress=0;
+    hf_link_established();
     if ((hf_state&0xff)!=HF_CONNECTING) {
       // We have a link, but without us asking for it.
       // So allow 10 seconds before trying to TX, else we start TXing immediately.
+      // (and remember who called, so that we can learn how they answer)
+      char name[16];
+      snprintf(name,sizeof(name),"%d",caller);
+      hf_link_partner=hf_station_by_name(name);
       hf_radio_pause_for_turnaround();
     } else hf_radio_mark_ready();
 
-    fprintf(stderr,"ALE Link from %d -> %d on channel %d, I will send a packet in %ld seconds\n",
+    fprintf(stderr,"ALE Link from %d -> %d on channel %d, I will send a packet in %lld seconds\n",
 	    caller,callee,channel,
-    	    hf_next_packet_time-time(0));
+    	    (hf_next_packet_time-now_ms)/1000);
 
     hf_state=HF_ALELINK;    
   } else if ((!strcmp(l,"ALE-LINK: FAILED"))||(!strcmp(l,"LINK: CLOSED"))) {
-    if (hf_state==HF_ALELINK) {
+    if ((hf_state&0xff)==HF_ALELINK) {
       // disconnected
+      hf_link_closed();
     }
     if ((!strcmp(l,"ALE-LINK: FAILED"))||(hf_state!=HF_CONNECTING)) {
       if (hf_link_partner>-1) {
@@ -175,6 +230,7 @@ int hfcodan_process_line(char *l)
 		hf_link_partner,
 		hf_stations[hf_link_partner].name,
 		hf_stations[hf_link_partner].consecutive_connection_failures);
+	hf_call_failed();
       }
       hf_link_partner=-1;
       ale_inprogress=0;
@@ -199,6 +255,11 @@ int hfcodan_receive_bytes(unsigned char *bytes,int count)
       if (hf_rl_len<1024) hf_response_line[hf_rl_len++]=bytes[i];
     }
   }
+  // The prompt doesn't end in a new line, so look out for it as it comes
+  if (hf_rl_len&&(hf_state&HF_COMMANDISSUED)) {
+    hf_response_line[hf_rl_len]=0;
+    if (hfcodan_is_prompt(hf_response_line)) hf_state&=~HF_COMMANDISSUED;
+  }
   
   return 0;
 }
@@ -209,11 +270,8 @@ int hfcodan_send_packet(int serialfd,unsigned char *out, int len)
   // 22 groups of 3 bytes = 66 bytes raw and 88 encoded bytes.  We can use the first
   // two bytes for fragmentation, since we would still like to support 256-byte
   // messages.  This means we need upto 4 pieces for each message.
-  char message[8192];
-  char fragment[8192];
-
-  int i;
-  time_t absolute_timeout=time(0)+90;
+  // The fragments are sent by hfcodan_tx_step() from the service loop, so that
+  // we don't sit here for the minute or more that they take to go out.
 
   if (hf_state!=HF_ALELINK) {
     fprintf(stderr,"Not sending packet, because we don't think we are in an ALE link.\n");
@@ -223,62 +281,14 @@ int hfcodan_send_packet(int serialfd,unsigned char *out, int len)
     fprintf(stderr,"Not sending packet, because we think an ALE transaction is already occurring.\n");
     return -1;
   }
+  if (hf_tx.state!=HF_TX_IDLE) {
+    fprintf(stderr,"Not sending packet, because we are still sending the last one.\n");
+    return -1;
+  }
 
-  // How many pieces to send (1-6)
-  // This means we have 36 possible fragment indications, if we wish to imply the
-  // number of fragments in the fragment counter.
-  int pieces=len/43; if (len%43) pieces++;
-  
   fprintf(stderr,"Sending message of %d bytes via Codan HF\n",len);
-  for(i=0;i<len;i+=43) {
-    // Indicate radio type in fragment header
-    fragment[0]=0x30+(hf_message_sequence_number&0x07);
-    fragment[1]=0x30+(i/43);
-    fragment[2]=0x30+pieces;
-    int frag_len=43; if (len-i<43) frag_len=len-i;
-    hex_encode(&out[i],&fragment[3],frag_len,radio_get_type());
-    
-    snprintf(message,8192,"amd %s\r\n",fragment);
-    write_all(serialfd,message,strlen(message));
-
-    int not_ready=1;
-    while (not_ready) {
-      if (time(0)>absolute_timeout) {
-	fprintf(stderr,"Failed to send packet in reasonable amount of time. Aborting.\n");
-	hf_message_sequence_number++;
-	return -1;
-      }
-
-      usleep(100000);
-
-      unsigned char buffer[8192];
-      int count = read_nonblock(serialfd,buffer,8192);
-      // if (count) dump_bytes(stderr,"postsend",buffer,count);
-      if (count) hfcodan_receive_bytes(buffer,count);
-      if (strstr((const char *)buffer,"AMD CALL FINISHED")) {
-	not_ready=0;
-	char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
-	if (timestr[0]) timestr[strlen(timestr)-1]=0;
-	fprintf(stderr,"  [%s] Sent %s",timestr,message);
-
-      } else not_ready=1;
-      if (strstr((const char *)buffer,"ERROR")) {
-	// Something went wrong
-	fprintf(stderr,"Error sending packet: Aborted.\n");
-	hf_message_sequence_number++;
-	return -1;
-      }
-      
-    }    
-  }
-  
-  hf_radio_pause_for_turnaround();
-  hf_message_sequence_number++;
-  char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
-  if (timestr[0]) timestr[strlen(timestr)-1]=0;
-  fprintf(stderr,"  [%s] Finished sending packet, next in %ld seconds.\n",
-	  timestr,hf_next_packet_time-time(0));
+  if (hf_tx_start(out,len)) return -1;
+  hfcodan_tx_step(serialfd);
   
   return 0;
 }
-
@@ -58,8 +58,15 @@ long long congestion_update_time=0;
 #define MAX_PACKET_SIZE 255
 
 // This need only be the maximum control header size + maximum packet size
-#define RADIO_RXBUFFER_SIZE 64+MAX_PACKET_SIZE
-unsigned char radio_rx_buffer[RADIO_RXBUFFER_SIZE];
+#define RADIO_RXBUFFER_SIZE (64+MAX_PACKET_SIZE)
+/* Received bytes go into a ring buffer, rather than shuffling the whole buffer
+   down for every byte.  Each byte is written twice, RADIO_RXBUFFER_SIZE bytes
+   apart, so that the most recent RADIO_RXBUFFER_SIZE bytes are always available
+   contiguously at &radio_rx_ring[radio_rx_head], and can be handed straight to
+   saw_packet() etc.  The code below refers to them as radio_rx_buffer[],
+   exactly as if it were the old shifting buffer. */
+unsigned char radio_rx_ring[RADIO_RXBUFFER_SIZE*2];
+int radio_rx_head=0;
 
 int radio_temperature=-1;
 int last_rx_rssi=-1;
@@ -82,11 +89,7 @@ int target_transmissions_per_4seconds=TARGET_TRANSMISSIONS_PER_4SECONDS;
 
 int rfd900_serviceloop(int serialfd)
 {
-  // Deal with clocks running backwards sometimes
-  if ((congestion_update_time-gettime_ms())>4000)
-    congestion_update_time=gettime_ms()+4000;
-  
-  if (gettime_ms()>congestion_update_time) {
+  if (now_ms>congestion_update_time) {
     /* Very 4 seconds count how many radio packets we have seen, so that we can
        dynamically adjust our packet rate based on our best estimate of the channel
        utilisation.  In other words, if there are only two devices on channel, we
@@ -157,7 +160,7 @@ int rfd900_serviceloop(int serialfd)
     printf("*** TXing every %d+1d%dms, ratio=%.3f (%d+%d)\n",
 	   message_update_interval,message_update_interval_randomness,ratio,
 	   radio_transmissions_seen,radio_transmissions_byus);
-    congestion_update_time=gettime_ms()+4000;
+    congestion_update_time=now_ms+4000;
     
     if (radio_transmissions_seen) {
       radio_silence_count=0;
@@ -185,9 +188,19 @@ int rfd900_receive_bytes(unsigned char *bytes,int count)
 {
   int i;
   for(i=0;i<count;i++) {
-      
-    bcopy(&radio_rx_buffer[1],&radio_rx_buffer[0],RADIO_RXBUFFER_SIZE-1);
-    radio_rx_buffer[RADIO_RXBUFFER_SIZE-1]=bytes[i];
+
+    radio_rx_ring[radio_rx_head]=bytes[i];
+    radio_rx_ring[radio_rx_head+RADIO_RXBUFFER_SIZE]=bytes[i];
+    radio_rx_head++;
+    if (radio_rx_head==RADIO_RXBUFFER_SIZE) radio_rx_head=0;
+    unsigned char *radio_rx_buffer=&radio_rx_ring[radio_rx_head];
+
+    // All of the frames we recognise are identified by their trailing bytes,
+    // so only bother looking closer when we see the last byte of one.
+    switch(bytes[i]) {
+    case 0xa4: case 0xdd: case 0x55: break;
+    default: continue;
+    }
 
     /*
       The revised RFD900+ firmware for the Mesh Extender 2.0 sends a little
@@ -345,10 +358,10 @@ int rfd900_set_tx_power(int serialfd)
   char *gpio_string=" gpio-18  (sw1                 ) in  lo";
 #endif
 
-  if (next_check_time<gettime_ms()) {
+  if (next_check_time<now_ms) {
     hipower_en=1;
     hipower_switch_set=0;
-    next_check_time=gettime_ms()+hi_power_timeout;
+    next_check_time=now_ms+hi_power_timeout;
 
     FILE *f=fopen(safety_file,"r");
     if (f) {
@@ -374,17 +387,17 @@ int rfd900_set_tx_power(int serialfd)
   }
 
   if ((hipower_switch_set&&hipower_en&&(txpower==-1))||txpower==24) {
-    printf("Setting radio to hipower\n");
+    LOG_DEBUG(LOG_RADIO,"Setting radio to hipower");
     if (write_all(serialfd,"!H",3)==-1) serial_errors++; else serial_errors=0;
   } else if (txpower==30) {
-    printf("Setting radio to maximum power (30dBm)\n");
+    LOG_DEBUG(LOG_RADIO,"Setting radio to maximum power (30dBm)");
     if (write_all(serialfd,"!M",3)==-1) serial_errors++; else serial_errors=0;
   } else if (txpower!=1&&txpower!=-1) {
     fprintf(stderr,"Unsupported TX power level selected: use 1, 24 or 30 dBm for RFD900/RFD868 radios.\n");
     exit(-1);
   }  else {
-    printf("Setting radio to lowpower mode (flags %d:%d) -- probably ok under Australian LIPD class license, but you should check.\n",
-	   hipower_switch_set,hipower_en);
+    LOG_DEBUG(LOG_RADIO,"Setting radio to lowpower mode (flags %d:%d) -- probably ok under Australian LIPD class license, but you should check.",
+	      hipower_switch_set,hipower_en);
     if (write_all(serialfd,"!L",3)==-1) serial_errors++; else serial_errors=0;
   }
 
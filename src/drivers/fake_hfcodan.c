@@ -2,6 +2,32 @@
 
 long long codan_starttime=0;
 
+// ALE calls and AMD messages take seconds to happen, so we remember what each
+// radio is in the middle of, and finish it off in hfcodan_heartbeat().
+long long codan_link_time[MAX_CLIENTS];
+long long codan_amd_time[MAX_CLIENTS];
+char codan_amd_message[MAX_CLIENTS][CLIENT_BUFFER_SIZE];
+int codan_callee[MAX_CLIENTS];
+// Set when someone else was on the air at the same time, in which case
+// nobody hears either of them (if we are simulating collisions)
+int hf_collisions=0;
+int codan_collided[MAX_CLIENTS];
+
+// Is anyone else calling or sending an AMD?  If so, we both collide.
+int codan_check_collision(int client)
+{
+  int collided=0;
+  if (!hf_collisions) return 0;
+  for(int i=0;i<client_count;i++)
+    if ((i!=client)&&(clients[i].radio_type==RADIO_HFCODAN)
+	&&(codan_link_time[i]||codan_amd_time[i])) {
+      codan_collided[i]=1;
+      collided=1;
+    }
+  if (collided) fprintf(stderr,"Codan HF Radio #%d collided with another radio\n",client);
+  return collided;
+}
+
 void codan_prompt(int client)
 {
   char prompt[1024];
@@ -45,10 +71,29 @@ int hfcodan_read_byte(int i,unsigned char c)
       fprintf(stderr,"Codan HF Radio #%d sent command '%s'\n",i,clients[i].buffer);
 
       // Process the command here
+      char station[1024];
       if (!strcasecmp("VER",(char *)clients[i].buffer)) {
 	// Claim to be an ALE 3G capable radio
 	write(clients[i].socket,"CICS: V3.37\r\n",
 	      strlen("CICS: V3.37\r\n"));
+      } else if (sscanf((char *)clients[i].buffer,"alecall %1000s",station)==1) {
+	// Linking takes a few seconds
+	write(clients[i].socket,"CALL STARTED\r\n",strlen("CALL STARTED\r\n"));
+	codan_callee[i]=atoi(station);
+	codan_link_time[i]=gettime_ms()+3000;
+	codan_collided[i]=codan_check_collision(i);
+      } else if (!strncasecmp("amd ",(char *)clients[i].buffer,4)) {
+	// ALE sends about 20ms per character
+	write(clients[i].socket,"AMD CALL STARTED\r\n",strlen("AMD CALL STARTED\r\n"));
+	// Spaces and backslashes are escaped on the command line, but not on air
+	int len=0;
+	for(unsigned char *c=&clients[i].buffer[4];*c;c++) {
+	  if ((*c=='\\')&&c[1]) c++;
+	  codan_amd_message[i][len++]=*c;
+	}
+	codan_amd_message[i][len]=0;
+	codan_amd_time[i]=gettime_ms()+1000+20*strlen(codan_amd_message[i]);
+	codan_collided[i]=codan_check_collision(i);
       } else {
 	// Complain about unknown commands
 	write(clients[i].socket,
@@ -67,8 +112,45 @@ int hfcodan_read_byte(int i,unsigned char c)
   return 0;
 }
 
+// Say something to a radio that it didn't ask for, on a line of its own.
+void codan_announce(int client,char *msg)
+{
+  write(clients[client].socket,"\r\n",2);
+  write(clients[client].socket,msg,strlen(msg));
+  codan_prompt(client);
+}
+
 int hfcodan_heartbeat(int client)
 {
+  char msg[CLIENT_BUFFER_SIZE+1024];
+  long long now=gettime_ms();
+  
+  if (codan_link_time[client]&&(now>=codan_link_time[client])) {
+    // Everyone else on the channel hears the link come up
+    codan_link_time[client]=0;
+    if (codan_collided[client]) {
+      fprintf(stderr,"Codan HF Radio #%d's call failed, because of a collision\n",client);
+      codan_announce(client,"ALE-LINK: FAILED\r\n");
+    } else {
+      snprintf(msg,sizeof(msg),"ALE-LINK: 1, %d, %d, 01/01 00:00\r\n",
+	       client,codan_callee[client]);
+      for(int i=0;i<client_count;i++)
+	if (clients[i].radio_type==RADIO_HFCODAN) codan_announce(i,msg);
+    }
+  }
+  if (codan_amd_time[client]&&(now>=codan_amd_time[client])) {
+    codan_amd_time[client]=0;
+    codan_announce(client,"AMD CALL FINISHED\r\n");
+    if (codan_collided[client]) {
+      fprintf(stderr,"Codan HF Radio #%d's AMD was lost, because of a collision\n",client);
+      return 0;
+    }
+    snprintf(msg,sizeof(msg),"AMD-CALL: 1, %d, %d, 01/01 00:00, \"%s\"\r\n",
+	     client,codan_callee[client],codan_amd_message[client]);
+    for(int i=0;i<client_count;i++)
+      if ((i!=client)&&(clients[i].radio_type==RADIO_HFCODAN))
+	codan_announce(i,msg);
+  }
   return 0;
 }
 
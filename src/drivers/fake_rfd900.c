@@ -71,9 +71,9 @@ int rfd900_read_byte(int client,unsigned char byte)
 	  if (j!=client) {
 	    filter_and_enqueue_packet_for_client(client,j,delivery_time,
 						 packet,packet_len);
-	    if (!transmission_time) release_pending_packets(j);
 	  }	  
 	}
+	if (!transmission_time) release_pending_packets();
       }
       break;
     case 'C':
@@ -136,7 +136,7 @@ int rfd900_encapsulate_packet(int from,int to,
 {
   // Append valid FEC
   unsigned char parity[FEC_LENGTH];
-  encode_rs_8(packet,parity,FEC_MAX_BYTES-(*packet_len));
+  encode_rs_8_fast(packet,parity,FEC_MAX_BYTES-(*packet_len));
   memcpy(&packet[(*packet_len)],parity,FEC_LENGTH);
   (*packet_len)+=FEC_LENGTH;
 
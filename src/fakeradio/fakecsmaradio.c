@@ -32,16 +32,16 @@ char timestamp_str_out[1024];
 char *timestamp_str(unsigned char *s)
 {
   struct tm tm;
-  time_t now=time(0);
+  // Use our idea of the time, so that the log makes sense in virtual clock mode
+  long long now_ms=gettime_ms();
+  time_t now=now_ms/1000;
   localtime_r(&now,&tm);
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
   if (!s)
     snprintf(timestamp_str_out,1024,"[%02d:%02d.%02d.%03d RADIO]",
-	     tm.tm_hour,tm.tm_min,tm.tm_sec,(int)tv.tv_usec/1000);
+	     tm.tm_hour,tm.tm_min,tm.tm_sec,(int)(now_ms%1000));
   else
     snprintf(timestamp_str_out,1024,"[%02d:%02d.%02d.%03d %02X%02X*]",
-	     tm.tm_hour,tm.tm_min,tm.tm_sec,(int)tv.tv_usec/1000,
+	     tm.tm_hour,tm.tm_min,tm.tm_sec,(int)(now_ms%1000),
 	     s[0],s[1]);
     
   return timestamp_str_out;
@@ -53,7 +53,44 @@ int set_nonblocking(int fd)
   return 0;
 }
 
-long long gettime_ms()
+/*
+  Virtual clock mode.
+
+  Normally we deliver each packet once its transmission time has passed on the
+  wall clock, which means that a simulation takes as long as the real thing
+  would, and most of that is spent waiting.  In virtual clock mode, we instead
+  keep our own clock, which runs at the same rate as the wall clock, except
+  that whenever all of the radios are quiet -- no LBARD has anything waiting
+  for us to read, and every LBARD has read everything that we have given it --
+  we skip straight ahead to the next thing that will happen.  Airtime,
+  colissions and channel utilisation are all worked out in this simulated
+  time, and we report how far ahead of the wall clock we got when we exit.
+
+  On its own, that only skips the time that packets spend in the air.  LBARDs
+  started with virtualclock=<tty file>.clock also follow our clock, and tell us
+  when their next timer is due, so that we can skip the time they spend waiting
+  to send, too (see include/virtualclock.h).
+*/
+int virtual_clock=0;
+long long virtual_clock_offset=0;
+// Stop after this many ms of simulated time (0 = run until we are killed)
+long long virtual_clock_limit=0;
+// How long we wait for the LBARDs to deal with what we have just given them.
+// The last one to finish wakes us up, so this is just in case one of them
+// isn't following our clock.  (Once they are all waiting for their next timer,
+// we only take a quick look for input before skipping ahead.)
+#define VIRTUAL_CLOCK_SETTLE_MS 10
+// An LBARD that hasn't read anything for this long has probably gone away, so
+// we stop waiting for it
+#define VIRTUAL_CLOCK_STALL_MS 2000
+
+struct virtual_clock *shared_clock=NULL;
+// The signal mask to use while we are waiting, i.e., with SIGUSR1 unblocked
+sigset_t virtual_clock_sigmask;
+
+volatile sig_atomic_t stop_requested=0;
+
+long long gettime_wall_ms()
 {
   struct timeval nowtv;
   // If gettimeofday() fails or returns an invalid value, all else is lost!
@@ -62,6 +99,111 @@ long long gettime_ms()
   return nowtv.tv_sec * 1000LL + nowtv.tv_usec / 1000;
 }
 
+long long gettime_ms()
+{
+  return gettime_wall_ms()+virtual_clock_offset;
+}
+
+static void virtual_clock_wakeup(int signal)
+{
+  // Nothing to do: we just need ppoll() to return
+}
+
+// Make a file holding our clock, that LBARDs can map to follow it
+int virtual_clock_share(char *filename)
+{
+  int fd=open(filename,O_RDWR|O_CREAT|O_TRUNC,0644);
+  if (fd<0) {
+    perror("Creating virtual clock file");
+    return -1;
+  }
+  if (ftruncate(fd,sizeof(struct virtual_clock))) {
+    perror("ftruncate");
+    close(fd);
+    return -1;
+  }
+  shared_clock=mmap(NULL,sizeof(struct virtual_clock),
+		    PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (shared_clock==MAP_FAILED) {
+    perror("Mapping virtual clock file");
+    shared_clock=NULL;
+    return -1;
+  }
+  // The LBARDs tell us when they have all gone quiet, so that we don't have to
+  // keep looking (see timers_poll())
+  sigset_t block;
+  sigemptyset(&block);
+  sigaddset(&block,SIGUSR1);
+  sigprocmask(SIG_BLOCK,&block,&virtual_clock_sigmask);
+  sigdelset(&virtual_clock_sigmask,SIGUSR1);
+  struct sigaction sa;
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler=virtual_clock_wakeup;
+  sigaction(SIGUSR1,&sa,NULL);
+  shared_clock->pid=getpid();
+
+  fprintf(stderr,"LBARDs can follow our clock with virtualclock=%s\n",filename);
+  return 0;
+}
+
+// Packets in flight, as a binary heap ordered by delivery time
+struct radio_event **event_queue=NULL;
+int event_count=0;
+int event_queue_size=0;
+long long event_sequence=0;
+
+int event_before(struct radio_event *a,struct radio_event *b)
+{
+  if (a->time!=b->time) return a->time<b->time;
+  return a->sequence<b->sequence;
+}
+
+int event_queue_push(struct radio_event *e)
+{
+  if (event_count>=event_queue_size) {
+    event_queue_size=event_queue_size?event_queue_size*2:1024;
+    event_queue=realloc(event_queue,event_queue_size*sizeof(struct radio_event *));
+    assert(event_queue);
+  }
+  e->sequence=event_sequence++;
+  int i=event_count++;
+  while(i) {
+    int parent=(i-1)/2;
+    if (!event_before(e,event_queue[parent])) break;
+    event_queue[i]=event_queue[parent];
+    i=parent;
+  }
+  event_queue[i]=e;
+  return 0;
+}
+
+struct radio_event *event_queue_pop(void)
+{
+  if (!event_count) return NULL;
+  struct radio_event *first=event_queue[0];
+  struct radio_event *last=event_queue[--event_count];
+  int i=0;
+  while(1) {
+    int child=i*2+1;
+    if (child>=event_count) break;
+    if ((child+1<event_count)&&event_before(event_queue[child+1],event_queue[child]))
+      child++;
+    if (!event_before(event_queue[child],last)) break;
+    event_queue[i]=event_queue[child];
+    i=child;
+  }
+  if (event_count) event_queue[i]=last;
+  return first;
+}
+
+// Returns the time of the next delivery, or -1 if nothing is in flight
+long long event_queue_next_time(void)
+{
+  if (!event_count) return -1;
+  return event_queue[0]->time;
+}
+
 int register_client(int client_socket, int radio_type)
 {
   if (client_count>=MAX_CLIENTS) {
@@ -666,7 +808,7 @@ int filter_and_enqueue_packet_for_client(int from,int to, long long delivery_tim
   fprintf(stderr,"Filter and enqueue %d bytes from %d -> %d\n",
 	  packet_len,from,to);
 
-  uint8_t packet[256];
+  uint8_t packet[512];
   memcpy(packet,packet_in,packet_len);
   
   filter_process_packet(from,to,packet,&packet_len);
@@ -698,16 +840,28 @@ int filter_and_enqueue_packet_for_client(int from,int to, long long delivery_tim
     return 0;
   }
   
-  bcopy(packet,clients[to].rx_queue,packet_len);
+  struct radio_event *e=calloc(1,sizeof(struct radio_event));
+  assert(e);
+  e->time=delivery_time;
+  e->from=from;
+  e->to=to;
+  e->packet_len=packet_len;
+  bcopy(packet,e->packet,packet_len);
+
+  // If the radio is still receiving another packet, then neither gets through.
   long long now=gettime_ms();
-  if (clients[to].rx_queue_len) {
-    printf("WARNING: RX colission for radio #%d (embargo time = T%+lldms, last packet = %d bytes)\n",
-	   to,clients[to].rx_embargo-now,clients[to].rx_queue_len);
-    clients[to].rx_colission=1;
+  if (clients[to].rx_busy_until>now) {
+    printf("WARNING: RX colission for radio #%d (busy until T%+lldms)\n",
+	   to,clients[to].rx_busy_until-now);
+    e->colission=1;
+    if (clients[to].rx_busy_event) clients[to].rx_busy_event->colission=1;
     tx_colissions++;
-  } else clients[to].rx_colission=0;
-  clients[to].rx_queue_len=packet_len;
-  clients[to].rx_embargo=delivery_time;
+  }
+  if (delivery_time>=clients[to].rx_busy_until) {
+    clients[to].rx_busy_until=delivery_time;
+    clients[to].rx_busy_event=e;
+  }
+  event_queue_push(e);
   return 0;
 }
 
@@ -809,37 +963,127 @@ int filter_rules_parse(char *text)
   return 0;
 }
 
-int release_pending_packets(int i)
+// Deliver every packet whose transmission time has elapsed.
+int release_pending_packets(void)
 {
+  int released=0;
   long long now = gettime_ms();
-  if (clients[i].rx_queue_len&&(clients[i].rx_embargo<=now))
+  while(event_count&&(event_queue_next_time()<=now))
     {
-      if (!clients[i].rx_colission) {
-	if ((random()&0x7fffffff)>=packet_drop_threshold) {
-	  write(clients[i].socket,
-		clients[i].rx_queue,
-		clients[i].rx_queue_len);
-	  printf("Radio #%d receives a packet of %d bytes\n",
-		 i,clients[i].rx_queue_len);
-	} else
-	  printf(">>> %s Radio #%d misses a packet of %d bytes due to simulated packet loss\n",
-		 timestamp_str(NULL),
-		 i,clients[i].rx_queue_len);
-	
-      }
-      printf("Radio #%d ready to receive.\n",i);
-      clients[i].rx_queue_len=0;
-      clients[i].rx_colission=0;
-      return 1;
-    } else {
-    if (clients[i].rx_embargo&&clients[i].rx_queue_len)
-      printf("Radio #%d WAITING until T+%lldms for a packet of %d bytes\n",
-	     i,clients[i].rx_embargo-now,clients[i].rx_queue_len);
-    
+      struct radio_event *e=event_queue_pop();
+      int i=e->to;
+      if (clients[i].rx_busy_event==e) clients[i].rx_busy_event=NULL;
+      if (e->colission)
+	printf("Radio #%d loses a packet of %d bytes from radio #%d to a colission\n",
+	       i,e->packet_len,e->from);
+      else if ((random()&0x7fffffff)>=packet_drop_threshold) {
+	write(clients[i].socket,e->packet,e->packet_len);
+	printf("Radio #%d receives a packet of %d bytes\n",
+	       i,e->packet_len);
+      } else
+	printf(">>> %s Radio #%d misses a packet of %d bytes due to simulated packet loss\n",
+	       timestamp_str(NULL),
+	       i,e->packet_len);
+      if (clients[i].rx_busy_until<=now)
+	printf("Radio #%d ready to receive.\n",i);
+      free(e);
+      released++;
+    }
+  return released;
+}
+
+// How many times each LBARD had woken up when we last looked
+unsigned int virtual_clock_wakeups[MAX_CLIENTS];
+// And when we last sent it SIGUSR1, so that we only do that once each time
+// its timer is due (+1, so that 0 means we haven't)
+unsigned int virtual_clock_signalled[MAX_CLIENTS];
+
+/* Note how many times each LBARD has woken up, before we look for input from
+   them.  Bytes an LBARD writes just before it goes idle can take a moment to
+   reach us through the pty, so it is only safe to skip ahead if nobody has
+   woken up since before we last waited for input.
+   Returns 1 if all of the LBARDs following our clock are waiting for their
+   next timer, with nothing from us still to read.
+*/
+int virtual_clock_snapshot(void)
+{
+  int attached=0,busy=0;
+  if (!shared_clock) return 0;
+  for(int i=0;i<client_count;i++) {
+    struct virtual_clock_node *node=&shared_clock->nodes[i];
+    virtual_clock_wakeups[i]=node->idle?node->wakeups:~node->wakeups;
+    if (!node->attached) continue;
+    attached++;
+    int queued=0;
+    if ((!node->idle)||(virtual_clock_signalled[i]==node->wakeups+1)) busy++;
+    else if ((clients[i].tty_fd>=0)&&(!ioctl(clients[i].tty_fd,FIONREAD,&queued))
+	     &&queued) busy++;
   }
-  return 0;
+  __sync_synchronize();
+  return attached&&(!busy);
 }
 
+/* Skip ahead to the next thing that will happen, if all of the radios are
+   quiet.  The main loop has already found that no LBARD has sent us anything,
+   so we just need to check that they have all read what we have sent them
+   (if they haven't, they might still be about to react to it), and that any
+   LBARDs following our clock are waiting for their next timer.
+*/
+int virtual_clock_advance(long long next_heartbeat)
+{
+  long long next=event_queue_next_time();
+  int attached=0;
+
+  if (shared_clock)
+    for(int i=0;i<client_count;i++) {
+      struct virtual_clock_node *node=&shared_clock->nodes[i];
+      if (!node->attached) continue;
+      // It's still busy with something
+      if ((!node->idle)||(node->wakeups!=virtual_clock_wakeups[i])) return 0;
+      // Or we have woken it, and it hasn't had a chance to run yet
+      if (virtual_clock_signalled[i]==node->wakeups+1) return 0;
+      if ((next<0)||(node->wake_time<next)) next=node->wake_time;
+      attached++;
+    }
+  // The LBARDs need heartbeats to know the radio is there, but there is no need
+  // to wait for them if the LBARDs aren't following our clock.
+  if (attached&&(next_heartbeat<next)) next=next_heartbeat;
+  if (next<0) return 0;
+
+  long long wall=gettime_wall_ms();
+  for(int i=0;i<client_count;i++) {
+    int queued=0;
+    if (clients[i].tty_fd<0) continue;
+    if (ioctl(clients[i].tty_fd,FIONREAD,&queued)) continue;
+    if ((!queued)||(queued<clients[i].tty_queued))
+      clients[i].tty_progress_time=wall;
+    clients[i].tty_queued=queued;
+    if (queued&&(wall-clients[i].tty_progress_time<VIRTUAL_CLOCK_STALL_MS))
+      return 0;
+  }
+
+  long long now=gettime_ms();
+  if (next>now) {
+    virtual_clock_offset+=next-now;
+    if (shared_clock) shared_clock->offset=virtual_clock_offset;
+    now=next;
+  }
+  // Wake up the LBARDs whose time has come
+  for(int i=0;attached&&(i<client_count);i++) {
+    struct virtual_clock_node *node=&shared_clock->nodes[i];
+    if (node->attached&&node->idle&&(node->wake_time<=now)&&node->pid) {
+      // (it can run as soon as we signal it)
+      virtual_clock_signalled[i]=node->wakeups+1;
+      kill(node->pid,SIGUSR1);
+    }
+  }
+  return 1;
+}
+
+void stop_handler(int signal)
+{
+  stop_requested=1;
+}
 
 int main(int argc,char **argv)
 {
@@ -856,26 +1100,35 @@ int main(int argc,char **argv)
   fprintf(stderr,"radio_count=%d\n",radio_count);
   
   if (argc>2) tty_file=fopen(argv[2],"w");
-  if ((argc<3)||(argc>4)||(!tty_file)||(radio_count<2)||(radio_count>=MAX_CLIENTS)) {
-    fprintf(stderr,"usage: fakecsmaradio <radio_type,...> <tty file> [packet drop probability|filter rules]\n");
+  if ((argc<3)||(argc>5)||(!tty_file)||(radio_count<2)||(radio_count>=MAX_CLIENTS)) {
+    fprintf(stderr,"usage: fakecsmaradio <radio_type,...> <tty file> [packet drop probability|filter rules|infinitespeed|hfcollisions] [virtualclock[=<seconds>]]\n");
     fprintf(stderr,"\nNumber of radios must be between 2 and %d.\n",MAX_CLIENTS-1);
     fprintf(stderr,"The name of each tty will be written to <tty file>\n");
     fprintf(stderr,"The optional packet drop probability allows the simulation of packet loss.\n");
     fprintf(stderr,"Filter rules take the form of:  \"drop <manifest|body> <from|to> <radio id>; ...\"\n");
+    fprintf(stderr,"hfcollisions makes Codan HF calls and AMDs that overlap fail.\n");
+    fprintf(stderr,"virtualclock skips ahead to the next packet delivery whenever the radios are quiet,\n"
+	    "optionally stopping after the given number of simulated seconds.\n");
     exit(-1);
   }
-  if (argc>3) 
+  for(int n=3;n<argc;n++)
     {
-      if (argv[3][0]=='d'||argv[3][0]=='a') {
+      if (!strncmp(argv[n],"virtualclock",12)) {
+	virtual_clock=1;
+	if (argv[n][12]=='=') virtual_clock_limit=atof(&argv[n][13])*1000;
+	fprintf(stderr,"Using virtual clock\n");
+      } else if (argv[n][0]=='d'||argv[n][0]=='a') {
 	// Filter rules
-	if (filter_rules_parse(argv[3])) {
+	if (filter_rules_parse(argv[n])) {
 	  fprintf(stderr,"Invalid filter rules.\n");
 	  exit(-1);
 	}
-      } else if (!strcmp(argv[3],"infinitespeed"))
+      } else if (!strcmp(argv[n],"infinitespeed"))
 	rfd900_setbitrate("1000000000");
+      else if (!strcmp(argv[n],"hfcollisions"))
+	hf_collisions=1;
       else {
-	float p=atof(argv[3]);
+	float p=atof(argv[n]);
 	if (p<0||p>1) {
 	  fprintf(stderr,"Packet drop probability must be in range [0..1]\n");
 	  exit(-1);
@@ -917,21 +1170,64 @@ int main(int argc,char **argv)
       exit(-1);
     }
     register_client(fd,radio_type_id);
+    clients[client_count-1].tty_fd=open(ptsname(fd),O_RDWR|O_NOCTTY|O_NONBLOCK);
+    if (clients[client_count-1].tty_fd<0) perror("Opening slave side of pty");
+  }
+
+  // (The clock must be ready before anyone sees the tty file)
+  if (virtual_clock) {
+    char clock_file[1024];
+    snprintf(clock_file,1024,"%s.clock",argv[2]);
+    if (virtual_clock_share(clock_file)) exit(-1);
+    for(int i=0;i<client_count;i++)
+      snprintf(shared_clock->nodes[i].tty,sizeof(shared_clock->nodes[i].tty),
+	       "%s",ptsname(clients[i].socket));
+    shared_clock->node_count=client_count;
   }
   fclose(tty_file);
+
+  signal(SIGINT,stop_handler);
+  signal(SIGTERM,stop_handler);
+  long long start_wall_time=gettime_wall_ms();
+  struct pollfd *fds=calloc(client_count,sizeof(struct pollfd));
+  assert(fds);
   
   long long last_heartbeat_time=0;
   
-  // look for new clients, and for traffic from each client.
-  while(1) {
-    int activity=0;
-      
-    for(int i=0;i<client_count;i++)
-      // Release any queued packet once we pass the embargo time
-      activity+=release_pending_packets(i);
+  // look for traffic from each client, and deliver packets as they arrive.
+  while(!stop_requested) {
+    // Release any queued packets once we pass their delivery time
+    int activity=release_pending_packets();
+
+    // Sleep until a client has something for us, or it is time to deliver the
+    // next packet or send the next heartbeat.
+    long long now = gettime_ms();
+    long long next = last_heartbeat_time+500;
+    long long next_delivery = event_queue_next_time();
+    if ((next_delivery>=0)&&(next_delivery<next)) next=next_delivery;
+    int timeout=next-now;
+    if (timeout<0) timeout=0;
+    if (timeout>500) timeout=500;
+    if (activity) timeout=0;
+    for(int i=0;i<client_count;i++) {
+      fds[i].fd=clients[i].socket; fds[i].events=POLLIN; fds[i].revents=0;
+    }
+    int ready;
+    if (virtual_clock) {
+      // In virtual clock mode we don't sleep until the next delivery, but skip
+      // ahead to it as soon as everyone is quiet.  The last LBARD to finish
+      // what it is doing sends us SIGUSR1, which we only let in here.
+      int settle=virtual_clock_snapshot()?0:VIRTUAL_CLOCK_SETTLE_MS;
+      if (timeout>settle) timeout=settle;
+      struct timespec ts={timeout/1000,(timeout%1000)*1000000};
+      ready=ppoll(fds,client_count,&ts,&virtual_clock_sigmask);
+    } else
+      ready=poll(fds,client_count,timeout);
+    if ((ready<0)&&(errno!=EINTR)) perror("poll");
     
     // Read input from each client.  This may cause packet transmission.
-    for(int i=0;i<client_count;i++) {
+    for(int i=0;(ready>0)&&(i<client_count);i++) {
+      if (!(fds[i].revents&POLLIN)) continue;
       unsigned char buffer[8192];
       int count = read(clients[i].socket,buffer,8192);
       if (count>0) {
@@ -946,7 +1242,7 @@ int main(int argc,char **argv)
       }
     }
 
-    long long now = gettime_ms();
+    now = gettime_ms();
     if (last_heartbeat_time<(now-500)) {
       for(int i=0;i<client_count;i++) {
 	switch(clients[i].radio_type) {
@@ -958,8 +1254,20 @@ int main(int argc,char **argv)
       last_heartbeat_time=now;
     }
 
-    // Sleep for 10ms if there has been no activity, else look for more activity
-    if (!activity) usleep(1000);      
+    if (virtual_clock&&(!activity)) virtual_clock_advance(last_heartbeat_time+500);
+    if (virtual_clock_limit&&(gettime_ms()-start_time>=virtual_clock_limit))
+      break;
   }
-  
+
+  long long simulated=gettime_ms()-start_time;
+  long long wall=gettime_wall_ms()-start_wall_time;
+  if (!simulated) simulated=1;
+  if (!wall) wall=1;
+  printf("Simulated time %.3fs, wall time %.3fs (%.2fx): %lld packets, %lld colissions, %.1f%% channel utilisation.\n",
+	 simulated/1000.0,wall/1000.0,simulated*1.0/wall,
+	 tx_log_transmitted_packets,tx_colissions,
+	 total_transmission_time*100.0/simulated);
+  fprintf(stderr,"Simulated time %.3fs, wall time %.3fs (%.2fx)\n",
+	  simulated/1000.0,wall/1000.0,simulated*1.0/wall);
+  return 0;
 }
@@ -20,6 +20,9 @@
  * PRIM - The primitive root of the generator poly. Integer variable or literal.
  * DEBUG - If set to 1 or more, do various internal consistency checking. Leave this
  *         undefined for production code
+ * SYNDROMES - Optional. An array of NROOTS syndromes (in poly form) that the caller
+ *             has already computed, which is then used instead of computing them here.
+ *             It is overwritten.
 
  * The memset(), memmove(), and memcpy() functions are used. The appropriate header
  * file declaring these functions (usually <string.h>) must be included by the calling
@@ -72,12 +75,17 @@
   int deg_lambda, el, deg_omega;
   int i, j, r,k;
   data_t u,q,tmp,num1,num2,den,discr_r;
-  data_t lambda[NROOTS+1], s[NROOTS];	/* Err+Eras Locator poly
-					 * and syndrome poly */
+  data_t lambda[NROOTS+1];	/* Err+Eras Locator poly */
+#ifdef SYNDROMES
+  data_t *s = SYNDROMES;	/* and syndrome poly */
+#else
+  data_t s[NROOTS];
+#endif
   data_t b[NROOTS+1], t[NROOTS+1], omega[NROOTS+1];
   data_t root[NROOTS], reg[NROOTS+1], loc[NROOTS];
   int syn_error, count;
 
+#ifndef SYNDROMES
   /* form the syndromes; i.e., evaluate data(x) at roots of g(x) */
   for(i=0;i<NROOTS;i++)
     s[i] = data[0];
@@ -91,6 +99,7 @@
       }
     }
   }
+#endif
 
   /* Convert syndromes to index form, checking for nonzero condition */
   syn_error = 0;
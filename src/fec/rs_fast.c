@@ -0,0 +1,351 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015 Serval Project Inc.
+
+Table driven RS(255,223) for the radio FEC path.
+
+Every packet we send or receive goes through the Reed-Solomon code, and the
+fec-3.0.1 versions do a log/antilog lookup and a mod 255 for every symbol
+times every root.  These give bit-identical results, but:
+
+ - The encoder looks up all 32 feedback terms for each data byte in one
+   256x32 table, so each byte is a shift and a 32 byte XOR of the parity
+   register (two SSE2 or NEON registers).
+
+ - The syndromes are computed by evaluating the received word 16 (SSSE3,
+   NEON) or 32 (AVX2) symbols at a time, using split-nibble tables to
+   multiply by each root: x*c = lo_c[x&0xf] ^ hi_c[x>>4], which is a pair
+   of byte shuffles.  The partial sums in each lane are then folded
+   together the same way.  Without SIMD, we use a 256 byte multiplication
+   table per root instead.
+
+ - Most packets arrive intact, and that is all we need to know for them.
+   If any syndrome is non-zero, the rest of the fec-3.0.1 decoder is run
+   with the syndromes we have already computed.
+
+The SIMD versions are chosen at run time on x86, so nothing special is needed
+in CFLAGS.  The NEON version has not yet been built or run on ARM, so it is
+left out unless -DRS_FAST_NEON is given; run fectest on the target before
+relying on it.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fec-3.0.1/fixed.h"
+#include "rs_fast.h"
+
+#if defined(__x86_64__)||defined(__i386__)
+#define RS_X86
+#include <immintrin.h>
+#endif
+#if defined(RS_FAST_NEON)&&(defined(__ARM_NEON)||defined(__ARM_NEON__))
+#define RS_NEON
+#include <arm_neon.h>
+#endif
+
+// Multiplying by root^1, ^2, ^4, ... ^32
+#define RS_POWERS 6
+
+static int rs_mode=RS_MODE_AUTO;
+static int rs_tables_ready=0;
+
+// Row f is f times the generator polynomial, lined up with the parity register
+static data_t rs_encode_table[256][NROOTS] __attribute__((aligned(32)));
+// x times root i (i.e., alpha^((FCR+i)*PRIM)) for each x
+static data_t rs_root_mul[NROOTS][256];
+// Split-nibble tables: [root][power][low nibble,high nibble][16]
+static data_t rs_nibble[NROOTS][RS_POWERS][2][16] __attribute__((aligned(16)));
+
+static data_t gf_mul(data_t a,data_t b)
+{
+  if (!a||!b) return 0;
+  return ALPHA_TO[MODNN(INDEX_OF[a]+INDEX_OF[b])];
+}
+
+static void rs_make_tables(void)
+{
+  for(int f=0;f<256;f++)
+    for(int k=0;k<NROOTS;k++)
+      rs_encode_table[f][k]=f?ALPHA_TO[MODNN(INDEX_OF[f]+GENPOLY[NROOTS-1-k])]:0;
+
+  for(int i=0;i<NROOTS;i++) {
+    data_t root=ALPHA_TO[MODNN((FCR+i)*PRIM)];
+    for(int x=0;x<256;x++) rs_root_mul[i][x]=gf_mul(x,root);
+    data_t c=root;
+    for(int p=0;p<RS_POWERS;p++) {
+      for(int x=0;x<16;x++) {
+	rs_nibble[i][p][0][x]=gf_mul(x,c);
+	rs_nibble[i][p][1][x]=gf_mul(x<<4,c);
+      }
+      c=gf_mul(c,c);
+    }
+  }
+  rs_tables_ready=1;
+}
+
+static int rs_mode_supported(int mode)
+{
+  switch(mode) {
+  case RS_MODE_PORT: return 1;
+#ifdef RS_X86
+  case RS_MODE_SSSE3: return __builtin_cpu_supports("ssse3");
+  case RS_MODE_AVX2: return __builtin_cpu_supports("avx2");
+#endif
+#ifdef RS_NEON
+  case RS_MODE_NEON: return 1;
+#endif
+  default: return 0;
+  }
+}
+
+// Use a particular implementation (for testing), or RS_MODE_AUTO for the
+// best one we have.  Returns -1 if this CPU can't do that one.
+int rs_fast_set_mode(int mode)
+{
+  if (!rs_tables_ready) rs_make_tables();
+  if (mode==RS_MODE_AUTO) {
+    for(mode=RS_MODES-1;mode>RS_MODE_PORT;mode--)
+      if (rs_mode_supported(mode)) break;
+  }
+  if (!rs_mode_supported(mode)) return -1;
+  rs_mode=mode;
+  return 0;
+}
+
+int rs_fast_get_mode(void)
+{
+  if (rs_mode==RS_MODE_AUTO) rs_fast_set_mode(RS_MODE_AUTO);
+  return rs_mode;
+}
+
+char *rs_fast_mode_name(int mode)
+{
+  char *names[RS_MODES]={"auto","portable","ssse3","avx2","neon"};
+  if (mode<0||mode>=RS_MODES) return "unknown";
+  return names[mode];
+}
+
+static void encode_rs_8_port(data_t *data, data_t *parity,int pad)
+{
+  memset(parity,0,NROOTS);
+  for(int i=0;i<NN-NROOTS-pad;i++) {
+    data_t *row=rs_encode_table[data[i]^parity[0]];
+    memmove(&parity[0],&parity[1],NROOTS-1);
+    parity[NROOTS-1]=0;
+    for(int k=0;k<NROOTS;k++) parity[k]^=row[k];
+  }
+}
+
+static void rs_syndromes_port(data_t *data,int len,data_t *s)
+{
+  // (Each symbol for all of the roots, so that the lookups don't have to
+  // wait for each other)
+  for(int i=0;i<NROOTS;i++) s[i]=data[0];
+  for(int j=1;j<len;j++) {
+    data_t d=data[j];
+    for(int i=0;i<NROOTS;i++) s[i]=rs_root_mul[i][s[i]]^d;
+  }
+}
+
+#ifdef RS_X86
+__attribute__((target("sse2")))
+static void encode_rs_8_sse2(data_t *data, data_t *parity,int pad)
+{
+  __m128i lo=_mm_setzero_si128(),hi=_mm_setzero_si128();
+  for(int i=0;i<NN-NROOTS-pad;i++) {
+    const __m128i *row=(const __m128i *)rs_encode_table[data[i]^(_mm_cvtsi128_si32(lo)&0xff)];
+    lo=_mm_or_si128(_mm_srli_si128(lo,1),_mm_slli_si128(hi,15));
+    hi=_mm_srli_si128(hi,1);
+    lo=_mm_xor_si128(lo,_mm_load_si128(&row[0]));
+    hi=_mm_xor_si128(hi,_mm_load_si128(&row[1]));
+  }
+  _mm_storeu_si128((__m128i *)&parity[0],lo);
+  _mm_storeu_si128((__m128i *)&parity[16],hi);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i rs_mul_ssse3(__m128i x,__m128i lo,__m128i hi)
+{
+  __m128i mask=_mm_set1_epi8(0x0f);
+  return _mm_xor_si128(_mm_shuffle_epi8(lo,_mm_and_si128(x,mask)),
+		       _mm_shuffle_epi8(hi,_mm_and_si128(_mm_srli_epi64(x,4),mask)));
+}
+
+#define RS_NIBBLES_SSE(I,P) \
+  _mm_load_si128((const __m128i *)rs_nibble[I][P][0]),	\
+    _mm_load_si128((const __m128i *)rs_nibble[I][P][1])
+
+// Fold the 16 lanes of a partial sum down to the syndrome in lane 0
+__attribute__((target("ssse3")))
+static inline data_t rs_fold_ssse3(__m128i acc,int i)
+{
+  acc=_mm_xor_si128(rs_mul_ssse3(acc,RS_NIBBLES_SSE(i,3)),_mm_srli_si128(acc,8));
+  acc=_mm_xor_si128(rs_mul_ssse3(acc,RS_NIBBLES_SSE(i,2)),_mm_srli_si128(acc,4));
+  acc=_mm_xor_si128(rs_mul_ssse3(acc,RS_NIBBLES_SSE(i,1)),_mm_srli_si128(acc,2));
+  acc=_mm_xor_si128(rs_mul_ssse3(acc,RS_NIBBLES_SSE(i,0)),_mm_srli_si128(acc,1));
+  return _mm_cvtsi128_si32(acc)&0xff;
+}
+
+// buf is the received word, with leading zeroes to make it a multiple of 16
+// bytes long
+__attribute__((target("ssse3")))
+static void rs_syndromes_ssse3(data_t *buf,int len,data_t *s)
+{
+  for(int i=0;i<NROOTS;i++) {
+    __m128i lo=_mm_load_si128((const __m128i *)rs_nibble[i][4][0]);
+    __m128i hi=_mm_load_si128((const __m128i *)rs_nibble[i][4][1]);
+    __m128i acc=_mm_load_si128((const __m128i *)buf);
+    for(int j=16;j<len;j+=16)
+      acc=_mm_xor_si128(rs_mul_ssse3(acc,lo,hi),_mm_load_si128((const __m128i *)&buf[j]));
+    s[i]=rs_fold_ssse3(acc,i);
+  }
+}
+
+// As above, but 32 bytes at a time
+__attribute__((target("avx2")))
+static void rs_syndromes_avx2(data_t *buf,int len,data_t *s)
+{
+  __m256i mask=_mm256_set1_epi8(0x0f);
+  for(int i=0;i<NROOTS;i++) {
+    __m256i lo=_mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)rs_nibble[i][5][0]));
+    __m256i hi=_mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)rs_nibble[i][5][1]));
+    __m256i acc=_mm256_load_si256((const __m256i *)buf);
+    for(int j=32;j<len;j+=32) {
+      __m256i x=_mm256_xor_si256(_mm256_shuffle_epi8(lo,_mm256_and_si256(acc,mask)),
+				 _mm256_shuffle_epi8(hi,_mm256_and_si256(_mm256_srli_epi64(acc,4),mask)));
+      acc=_mm256_xor_si256(x,_mm256_load_si256((const __m256i *)&buf[j]));
+    }
+    // The first 16 lanes are 16 powers of the root higher than the rest
+    __m128i acc16=_mm_xor_si128(rs_mul_ssse3(_mm256_castsi256_si128(acc),RS_NIBBLES_SSE(i,4)),
+				_mm256_extracti128_si256(acc,1));
+    s[i]=rs_fold_ssse3(acc16,i);
+  }
+}
+#endif
+
+#ifdef RS_NEON
+#ifdef __aarch64__
+#define rs_tbl(T,I) vqtbl1q_u8(T,I)
+#else
+static inline uint8x16_t rs_tbl(uint8x16_t t,uint8x16_t i)
+{
+  uint8x8x2_t tt={{vget_low_u8(t),vget_high_u8(t)}};
+  return vcombine_u8(vtbl2_u8(tt,vget_low_u8(i)),vtbl2_u8(tt,vget_high_u8(i)));
+}
+#endif
+
+static void encode_rs_8_neon(data_t *data, data_t *parity,int pad)
+{
+  uint8x16_t zero=vdupq_n_u8(0);
+  uint8x16_t lo=zero,hi=zero;
+  for(int i=0;i<NN-NROOTS-pad;i++) {
+    data_t *row=rs_encode_table[data[i]^vgetq_lane_u8(lo,0)];
+    lo=veorq_u8(vextq_u8(lo,hi,1),vld1q_u8(&row[0]));
+    hi=veorq_u8(vextq_u8(hi,zero,1),vld1q_u8(&row[16]));
+  }
+  vst1q_u8(&parity[0],lo);
+  vst1q_u8(&parity[16],hi);
+}
+
+static inline uint8x16_t rs_mul_neon(uint8x16_t x,int i,int p)
+{
+  uint8x16_t mask=vdupq_n_u8(0x0f);
+  return veorq_u8(rs_tbl(vld1q_u8(rs_nibble[i][p][0]),vandq_u8(x,mask)),
+		  rs_tbl(vld1q_u8(rs_nibble[i][p][1]),vshrq_n_u8(x,4)));
+}
+
+static void rs_syndromes_neon(data_t *buf,int len,data_t *s)
+{
+  uint8x16_t zero=vdupq_n_u8(0);
+  for(int i=0;i<NROOTS;i++) {
+    uint8x16_t acc=vld1q_u8(buf);
+    for(int j=16;j<len;j+=16)
+      acc=veorq_u8(rs_mul_neon(acc,i,4),vld1q_u8(&buf[j]));
+    acc=veorq_u8(rs_mul_neon(acc,i,3),vextq_u8(acc,zero,8));
+    acc=veorq_u8(rs_mul_neon(acc,i,2),vextq_u8(acc,zero,4));
+    acc=veorq_u8(rs_mul_neon(acc,i,1),vextq_u8(acc,zero,2));
+    acc=veorq_u8(rs_mul_neon(acc,i,0),vextq_u8(acc,zero,1));
+    s[i]=vgetq_lane_u8(acc,0);
+  }
+}
+#endif
+
+void encode_rs_8_fast(data_t *data, data_t *parity,int pad)
+{
+  switch(rs_fast_get_mode()) {
+#ifdef RS_X86
+  case RS_MODE_SSSE3:
+  case RS_MODE_AVX2:
+    encode_rs_8_sse2(data,parity,pad);
+    return;
+#endif
+#ifdef RS_NEON
+  case RS_MODE_NEON:
+    encode_rs_8_neon(data,parity,pad);
+    return;
+#endif
+  default:
+    encode_rs_8_port(data,parity,pad);
+    return;
+  }
+}
+
+int decode_rs_8_fast(data_t *data, int *eras_pos, int no_eras, int pad)
+{
+  int retval;
+  data_t syndromes[NROOTS];
+
+  if(pad < 0 || pad > 222){
+    return -1;
+  }
+
+  int mode=rs_fast_get_mode();
+  int len=NN-pad;
+  if (mode==RS_MODE_PORT) rs_syndromes_port(data,len,syndromes);
+  else {
+    // Leading zeroes don't change the syndromes, so line the word up with
+    // the end of a whole number of vectors
+    data_t buf[256] __attribute__((aligned(32)));
+    int width=(mode==RS_MODE_AVX2)?32:16;
+    int padded=(len+width-1)/width*width;
+    memset(buf,0,padded-len);
+    memcpy(&buf[padded-len],data,len);
+    switch(mode) {
+#ifdef RS_X86
+    case RS_MODE_SSSE3: rs_syndromes_ssse3(buf,padded,syndromes); break;
+    case RS_MODE_AVX2: rs_syndromes_avx2(buf,padded,syndromes); break;
+#endif
+#ifdef RS_NEON
+    case RS_MODE_NEON: rs_syndromes_neon(buf,padded,syndromes); break;
+#endif
+    default: rs_syndromes_port(data,len,syndromes); break;
+    }
+  }
+
+  int syn_error=0;
+  for(int i=0;i<NROOTS;i++) syn_error|=syndromes[i];
+  // A codeword, so nothing to correct (fec-3.0.1 doesn't touch eras_pos then
+  // either)
+  if (!syn_error) return 0;
+
+#define SYNDROMES syndromes
+#include "fec-3.0.1/decode_rs.h"
+#undef SYNDROMES
+
+  return retval;
+}
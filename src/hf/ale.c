@@ -44,12 +44,12 @@ extern char *prefix;
 int hf_state=HF_DISCONNECTED;
 int hf_link_partner=-1;
 
-time_t hf_next_call_time=0;
+long long hf_next_call_time=0;
 
-time_t last_link_probe_time=0;
+long long last_link_probe_time=0;
 
-time_t hf_next_packet_time=0;
-time_t last_outbound_call=0;
+long long hf_next_packet_time=0;
+long long last_outbound_call=0;
 
 int hf_callout_duty_cycle=0;
 int hf_callout_interval=5; // minutes
@@ -59,7 +59,7 @@ int hf_station_count=0;
 
 int has_hf_plan=0;
 
-time_t last_ready_report_time=0;
+long long last_ready_report_time=0;
 
 int ale_inprogress=0;
 int hf_rl_len=0;
@@ -67,6 +67,23 @@ char hf_response_line[1024];
 
 int hf_message_sequence_number=0;
 
+struct hf_tx hf_tx;
+int hf_peer_ascii64=0;
+
+struct hf_batch hf_batch;
+int hf_batch_limit=HF_BATCH_MAX;
+
+int hf_turnaround_fixed=0;
+// When we started waiting for the other side (0 if we aren't), and whether
+// that was for them to answer our turn, or for the rest of theirs
+long long hf_wait_start=0;
+int hf_awaiting_answer=0;
+int hf_their_turn=0;
+char hf_link_senders[HF_LINK_SENDERS_MAX][16];
+int hf_link_sender_count=0;
+// Turnaround measurements for when we don't know who is at the other end
+struct hf_station hf_unknown_station;
+
 char *radio_type_name(int radio_type)
 {
   for(int i=0;radio_types[i].id!=-1;i++)
@@ -81,26 +98,42 @@ char *radio_type_description(int radio_type)
  return "Unknown";
 }
 
+static struct hf_station *hf_turnaround_station(void);
+static long long hf_turnaround_backoff(struct hf_station *s,int contending);
+
 int hf_radio_check_if_ready(void)
 {
-  if (time(0)>=hf_next_packet_time) {
-    if (time(0)!=last_ready_report_time) {
+  // Still sending the last packet
+  if (hf_tx.state!=HF_TX_IDLE) return 0;
+
+  // (We only say so once a second)
+  int report=(now_ms-last_ready_report_time>=1000);
+  if (report) last_ready_report_time=now_ms;
+  if ((now_ms>=hf_next_packet_time)&&hf_awaiting_answer&&(!hf_turnaround_fixed)) {
+    // We didn't hear a thing after our turn, so probably someone talked over
+    // us.  Back off before trying again.
+    struct hf_station *s=hf_turnaround_station();
+    hf_awaiting_answer=0;
+    s->collisions++;
+    hf_next_packet_time=now_ms+hf_turnaround_backoff(s,0);
+    fprintf(stderr,"HF: No answer after our turn (%d collisions in a row), backing off %lld seconds.\n",
+	    s->collisions,(hf_next_packet_time-now_ms)/1000);
+  }
+  if (now_ms>=hf_next_packet_time) {
+    if (report&&(hf_state==HF_ALELINK)) {
       char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
       if (timestr[0]) timestr[strlen(timestr)-1]=0;
-      if (hf_state==HF_ALELINK)
-	fprintf(stderr,"  [%s] HF Radio cleared to transmit.\n",
-		timestr);
+      fprintf(stderr,"  [%s] HF Radio cleared to transmit.\n",
+	      timestr);
     }
-    last_ready_report_time=time(0);
     return 1;
   } else {
-    if (time(0)!=last_ready_report_time) {
+    if (report) {
       char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
       if (timestr[0]) timestr[strlen(timestr)-1]=0;
-      fprintf(stderr,"  [%s] Wait %ld more seconds to allow other side to send.\n",
-	      timestr,hf_next_packet_time-time(0));
+      fprintf(stderr,"  [%s] Wait %lld more seconds to allow other side to send.\n",
+	      timestr,(hf_next_packet_time-now_ms)/1000);
     }
-    last_ready_report_time=time(0);
     return 0;
   }
 }
@@ -109,14 +142,21 @@ int hf_next_station_to_call(void)
 {
   int i;
   for(i=0;i<hf_station_count;i++) {
-    if (time(0)>hf_stations[i].next_link_time) return i;
+    if (now_ms>hf_stations[i].next_link_time) return i;
   }
   if (hf_station_count) return random()%hf_station_count; else return -1;
 }
 
 int hf_radio_mark_ready(void)
 {
+  // (unless others may be wanting to take the turn too, or we have been
+  // talking over each other, when we back off first)
   hf_next_packet_time=0;
+  hf_wait_start=0;
+  hf_awaiting_answer=0;
+  hf_their_turn=0;
+  long long backoff=hf_turnaround_backoff(hf_turnaround_station(),1);
+  if (backoff) hf_next_packet_time=now_ms+backoff;
   char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
   if (timestr[0]) timestr[strlen(timestr)-1]=0;
   fprintf(stderr,"  [%s] It is our turn to send.\n",timestr);
@@ -129,66 +169,372 @@ int hf_radio_pause_for_turnaround(void)
   int radio_type=radio_get_type();
   if (radio_type<0) return 0;
 
+  hf_next_packet_time=now_ms+hf_turnaround_wait();
+  hf_wait_start=now_ms;
+
+  fprintf(stderr,"  [%s] Delaying %lld seconds to allow other side to send.\n",
+	  timestamp_str(),(hf_next_packet_time-now_ms)/1000);
+  
+  return 0;
+}
+
+int hf_station_by_name(char *name)
+{
+  for(int i=0;i<hf_station_count;i++)
+    if (!strcmp(hf_stations[i].name,name)) return i;
+  return -1;
+}
+
+// Whose turnaround we are measuring: the station at the other end of the
+// link, if we know who that is.
+static struct hf_station *hf_turnaround_station(void)
+{
+  if ((hf_link_partner>-1)&&(hf_link_partner<hf_station_count))
+    return &hf_stations[hf_link_partner];
+  return &hf_unknown_station;
+}
+
+// A random number of slots, from 0 to 2^collisions-1.  If we are about to
+// take the turn that someone else just finished, everyone else who has been
+// talking on the link may be about to do so too, so then there are that many
+// times as many slots to choose from.
+static long long hf_turnaround_backoff(struct hf_station *s,int contending)
+{
+  if (hf_turnaround_fixed) return 0;
+  int exponent=s->collisions;
+  if (exponent>HF_BACKOFF_MAX_EXPONENT) exponent=HF_BACKOFF_MAX_EXPONENT;
+  int slots=1<<exponent;
+  if (contending&&(hf_link_sender_count>1)) slots*=hf_link_sender_count;
+  if (slots<2) return 0;
+  long long slot=s->fragment_interval;
+  if (!slot) slot=s->response_latency;
+  if ((!slot)&&(radio_get_type()>-1))
+    slot=radio_types[radio_get_type()].hf_turnaround_delay*1000LL;
+  if (slot<HF_TURNAROUND_MIN_MS) slot=HF_TURNAROUND_MIN_MS;
+  return (random()%slots)*slot;
+}
+
+// Keep a smoothed average, and mean deviation, of how long they take
+static void hf_turnaround_measure(long long *average,long long *deviation,long long latency)
+{
+  if (latency>HF_TURNAROUND_MAX_MS) latency=HF_TURNAROUND_MAX_MS;
+  if (!*average) {
+    *average=latency;
+    *deviation=latency/2;
+  } else {
+    long long difference=latency-*average;
+    if (difference<0) difference=-difference;
+    *deviation=(*deviation*3+difference)/4;
+    *average=(*average*7+latency)/8;
+  }
+}
+
+// How long to wait for the other side before we send again: long enough for
+// nearly all of the answers (or next fragments, if they are part way through
+// their turn) we have seen them give, like TCP's retransmit timer, and then
+// some more if we have been colliding.  Until we have heard from them we wait
+// the radio's turnaround time, plus a random 0 - 9 seconds, as we used to.
+long long hf_turnaround_wait(void)
+{
+  int radio_type=radio_get_type();
+  if (radio_type<0) return 0;
+
   // We add a random 1 - 10 seconds to avoid lock-step failure modes,
   // e.g., where both radios keep trying to talk to each other at
   // the same time.
-  hf_next_packet_time=time(0)+radio_types[radio_get_type()].hf_turnaround_delay+(random()%10);
+  long long wait=(radio_types[radio_type].hf_turnaround_delay+(random()%10))*1000LL;
+  if (hf_turnaround_fixed) return wait;
+
+  struct hf_station *s=hf_turnaround_station();
+  if (hf_their_turn&&s->fragment_interval)
+    // (long enough for the one after next, in case we miss the next one, as
+    // waiting costs nothing if they are still going)
+    wait=2*s->fragment_interval+4*s->fragment_deviation;
+  else if ((!hf_their_turn)&&s->response_latency)
+    wait=s->response_latency+4*s->response_deviation;
+  wait+=hf_turnaround_backoff(s,0);
+  if (wait<HF_TURNAROUND_MIN_MS) wait=HF_TURNAROUND_MIN_MS;
+  if (wait>HF_TURNAROUND_MAX_MS) wait=HF_TURNAROUND_MAX_MS;
+  return wait;
+}
 
-  fprintf(stderr,"  [%s] Delaying %ld seconds to allow other side to send.\n",
-	  timestamp_str(),hf_next_packet_time-time(0));
-  
+// We have heard from the other side, so see how long they took, and whether
+// we were talking at the same time.
+static void hf_turnaround_heard(void)
+{
+  struct hf_station *s=hf_turnaround_station();
+  if (hf_tx.state!=HF_TX_IDLE) {
+    // (which counts once for each packet of ours they talk over)
+    if (!hf_tx.collided) {
+      hf_tx.collided=1;
+      s->collisions++;
+      fprintf(stderr,"HF: They were sending while we were (%d collisions in a row).\n",
+	      s->collisions);
+    }
+  } else if (hf_awaiting_answer&&s->collisions)
+    // They answered our turn, so we are taking turns more nicely.  (But
+    // with more than two stations on the link we will still be competing
+    // for the next turn, so we only back off a little less next time.)
+    s->collisions--;
+  hf_awaiting_answer=0;
+
+  if (!hf_wait_start) return;
+  if (hf_their_turn)
+    hf_turnaround_measure(&s->fragment_interval,&s->fragment_deviation,
+			  now_ms-hf_wait_start);
+  else
+    hf_turnaround_measure(&s->response_latency,&s->response_deviation,
+			  now_ms-hf_wait_start);
+  hf_wait_start=0;
+}
+
+// Remember who we have heard on this link
+static void hf_link_heard_from(char *sender)
+{
+  for(int i=0;i<hf_link_sender_count;i++)
+    if (!strcmp(hf_link_senders[i],sender)) return;
+  if (hf_link_sender_count>=HF_LINK_SENDERS_MAX) return;
+  snprintf(hf_link_senders[hf_link_sender_count++],sizeof(hf_link_senders[0]),"%s",sender);
+}
+
+// Our call didn't get through, so wait a random while before the next,
+// doubling how long that might be each time it happens, so that stations
+// calling at the same time don't keep doing so.
+int hf_call_failed(void)
+{
+  if (hf_turnaround_fixed||(hf_link_partner<0)) return 0;
+  int exponent=hf_stations[hf_link_partner].consecutive_connection_failures;
+  if (exponent>HF_BACKOFF_MAX_EXPONENT) exponent=HF_BACKOFF_MAX_EXPONENT;
+  hf_next_call_time=now_ms+(random()%(1<<exponent))*HF_CALL_BACKOFF_SLOT_MS;
   return 0;
 }
 
-int pieces_seen[6]={0,0,0,0,0,0};
-unsigned char accummulated_packet[256];
+// A new ALE link, so we don't know what the other end can receive yet
+int hf_link_established(void)
+{
+  hf_peer_ascii64=0;
+  hf_wait_start=0;
+  hf_awaiting_answer=0;
+  hf_their_turn=0;
+  hf_link_sender_count=0;
+  hf_batch.link_start=now_ms;
+  hf_batch.sent=0;
+  return 0;
+}
 
+static long long hf_average(long long average,long long value)
+{
+  if (!average) return value;
+  return (average*3+value)/4;
+}
 
-int hf_process_fragment(char *fragment)
+// The link has gone, so remember how long it lasted
+int hf_link_closed(void)
+{
+  if (!hf_batch.link_start) return 0;
+  long long duration=now_ms-hf_batch.link_start;
+  hf_batch.link_start=0;
+  hf_batch.sent=0;
+  hf_batch.link_duration=hf_average(hf_batch.link_duration,duration);
+  if (hf_link_partner>-1)
+    hf_stations[hf_link_partner].link_duration=
+      hf_average(hf_stations[hf_link_partner].link_duration,duration);
+  fprintf(stderr,"HF: Link lasted %lld seconds (on average %lld seconds).\n",
+	  duration/1000,hf_batch.link_duration/1000);
+  return 0;
+}
+
+// How many packets to send this turn: as many as fit in our share of what we
+// expect is left of the link, going by how long links with this station
+// (or failing that, any station) have lasted.
+int hf_batch_choose(void)
+{
+  long long link_duration=hf_batch.link_duration;
+  if (hf_link_partner>-1) {
+    if (hf_stations[hf_link_partner].link_duration)
+      link_duration=hf_stations[hf_link_partner].link_duration;
+    else if (!link_duration)
+      // (the plan says how long we hope to talk to them for)
+      link_duration=hf_stations[hf_link_partner].link_time_target*60000LL;
+  }
+  if (!link_duration) link_duration=HF_LINK_DURATION_GUESS_MS;
+  long long airtime=hf_batch.packet_airtime;
+  if (!airtime) airtime=HF_PACKET_AIRTIME_GUESS_MS;
+
+  long long left=link_duration;
+  if (hf_batch.link_start) left-=now_ms-hf_batch.link_start;
+  int size=left/(HF_BATCH_SHARE*airtime);
+  if (size>hf_batch_limit) size=hf_batch_limit;
+  if (size<1) size=1;
+  return size;
+}
+
+// Where reassembled packets go (the benchmarks catch them instead)
+int hf_saw_packet(unsigned char *packet,int len,int *erasures,int erasure_count)
+{
+  fprintf(stderr,"Passing reassembled packet of %d bytes (%d bytes missing) up for processing.\n",
+	  len,erasure_count);
+  return saw_packet_with_erasures(packet,len,0 /* RSSI unknown */,
+				  erasures,erasure_count,
+				  my_sid_hex,prefix,servald_server,credential);
+}
+int (*hf_packet_handler)(unsigned char *packet,int len,int *erasures,int erasure_count)
+  =hf_saw_packet;
+
+// sender is whatever the radio tells us identifies the calling station
+int hf_process_fragment(char *sender,char *fragment)
 {
   int peer_radio=-1;
   int sequence=-1;
-  if ((fragment[0]>='0')&&(fragment[0]<='7')) {
-    peer_radio=RADIOTYPE_HFCODAN;
-    sequence=fragment[0]-'0';
-  }
-  if ((fragment[0]>='A')&&(fragment[0]<='H')) {
-    peer_radio=RADIOTYPE_HFBARRETT;
-    sequence=fragment[0]-'A';
-  }
+  int ascii64=0;
+  hf_fragment_sender(fragment[0],&peer_radio,&sequence,&ascii64);
+  int more=0;
   int piece_number=(fragment[1]-'0');
-  int pieces=(fragment[2]-'0');
+  int pieces=hf_fragment_pieces(fragment[2],&more);
 
   fprintf(stderr,"Checking if message is a fragment (piece %d/%d, peer=%d).\n",
 	  piece_number,pieces,peer_radio);
   if (peer_radio<0) return -1;
   if (pieces<1||pieces>6) return -1;
-  if (piece_number<0||piece_number>5) return -1;
-  fprintf(stderr,"Received piece %d/%d of packet sequence #%d from a %s radio.\n",
-	  piece_number+1,pieces,sequence,radio_type_name(peer_radio));
+  if (piece_number<0||piece_number>=pieces) return -1;
+  hf_turnaround_heard();
+  hf_link_heard_from(sender);
+  fprintf(stderr,"Received piece %d/%d of packet sequence #%d from station %s on a %s radio (%s%s).\n",
+	  piece_number+1,pieces,sequence&0x07,sender,radio_type_name(peer_radio),
+	  ascii64?"ascii64":"hex",more?", more packets to follow":"");
+
+  // Either way, they can take ASCII-64 from us
+  if (ascii64||(fragment[strlen(fragment)-1]==HF_ASCII64_CAPABLE)) {
+    if (!hf_peer_ascii64)
+      fprintf(stderr,"HF: Other station can receive ASCII-64 fragments.\n");
+    hf_peer_ascii64=1;
+  }
 
-  int packet_offset=piece_number*43;
-  int i;
-  for(i=3;i<strlen(fragment);i+=2) {
-    if (ishex(fragment[i+0])&&ishex(fragment[i+1])) {
-      int v=(chartohexnybl(fragment[i+0])<<4)+chartohexnybl(fragment[i+1]);
-      accummulated_packet[packet_offset++]=v;
-    }
+  if (hf_reassembly_add(sender,fragment)<0) {
+    fprintf(stderr,"Could not decode fragment.\n");
+    return -1;
   }
-  if (piece_number==(pieces-1)) {
-    // We have a terminal piece: so assume we have the whole packet.
-    // (the FEC will reject it if it is incorrectly assembled).
-    fprintf(stderr,"Passing reassembled packet of %d bytes up for processing.\n",
-	    packet_offset);
-    saw_packet(accummulated_packet,packet_offset,0 /* RSSI unknown */,
-	       my_sid_hex,prefix,servald_server,credential);
-
-    // Now it is our turn to send
+  if ((piece_number==(pieces-1))&&(!more))
+    // That was the last piece, so now it is our turn to send
     hf_radio_mark_ready();
-  } else
-    // Not end of packet, wait 8+1d8 seconds before we try transmitting.
+  else {
+    // Not end of packet (or of their turn), so wait for the next piece
+    // before we try transmitting.
+    hf_their_turn=1;
     hf_radio_pause_for_turnaround();
+  }
+  if ((hf_tx.state==HF_TX_PRESEND)&&(!hf_tx.offset)&&(hf_tx.due<hf_next_packet_time)) {
+    // We were about to start sending a packet, but they got in first, so
+    // hold it until they have finished
+    hf_tx.due=hf_next_packet_time;
+    hf_tx.deadline=hf_tx.due+HF_TX_TIMEOUT_MS;
+  }
   
   return 0;
 }
 
+// Start sending a packet.  The driver's send_packet() calls this, and then
+// its service loop sends each fragment in turn.
+int hf_tx_start(unsigned char *packet,int len)
+{
+  if (hf_tx.state!=HF_TX_IDLE) return -1;
+  if ((len<1)||(len>sizeof(hf_tx.packet))) return -1;
+  memcpy(hf_tx.packet,packet,len);
+  hf_tx.len=len;
+  hf_tx.offset=0;
+  // Only use ASCII-64 if the other end has told us it understands it
+  hf_tx.ascii64=hf_peer_ascii64;
+  hf_tx.fragment_bytes=hf_tx.ascii64?HF_FRAGMENT_BYTES_ASCII64:HF_FRAGMENT_BYTES;
+  // How many pieces to send (1-6)
+  // This means we have 36 possible fragment indications, if we wish to imply the
+  // number of fragments in the fragment counter.
+  hf_tx.pieces=len/hf_tx.fragment_bytes; if (len%hf_tx.fragment_bytes) hf_tx.pieces++;
+  if (hf_tx.pieces>6) return -1;
+  // The first packet of our turn, so work out how many we will send.  The
+  // other side only knows to wait for the rest if it can take ASCII-64.
+  if (!hf_batch.sent) hf_batch.size=hf_batch_choose();
+  hf_tx.more=hf_tx.ascii64&&(hf_batch.sent+1<hf_batch.size);
+  hf_tx.started=now_ms;
+  hf_tx.deadline=now_ms+HF_TX_TIMEOUT_MS;
+  hf_tx.due=now_ms+HF_TX_PRESEND_DELAY_MS;
+  hf_tx.accepted=0;
+  hf_tx.rejected=0;
+  hf_tx.collided=0;
+  hf_tx.state=HF_TX_PRESEND;
+  return 0;
+}
+
+// Write out the current fragment, with its header.  sequence_base tells the
+// receiver which type of radio sent it.
+int hf_tx_fragment(char *fragment,char sequence_base)
+{
+  fragment[0]=sequence_base+(hf_message_sequence_number&0x07);
+  fragment[1]=0x30+(hf_tx.offset/hf_tx.fragment_bytes);
+  fragment[2]=0x30+hf_tx.pieces+(hf_tx.more?HF_PIECES_MORE:0);
+  int frag_len=hf_tx.fragment_bytes;
+  if (hf_tx.len-hf_tx.offset<frag_len) frag_len=hf_tx.len-hf_tx.offset;
+  if (hf_tx.ascii64) {
+    fragment[0]+=HF_SEQUENCE_ASCII64;
+    // Say how many bytes are in it, so that if it gets cut short, it can't be
+    // mistaken for the end of the packet
+    int n=3;
+    char count=HF_ASCII64_COUNT_BASE+frag_len;
+    if (((count==' ')||(count=='\\'))&&(radio_get_type()==RADIOTYPE_HFCODAN))
+      fragment[n++]='\\';
+    fragment[n++]=count;
+    ascii64_encode(&hf_tx.packet[hf_tx.offset],&fragment[n],frag_len,radio_get_type());
+  } else {
+    int n=hex_encode(&hf_tx.packet[hf_tx.offset],&fragment[3],frag_len,radio_get_type());
+    // Let the other end know we can take ASCII-64
+    fragment[3+n]=HF_ASCII64_CAPABLE;
+    fragment[3+n+1]=0;
+  }
+  return 0;
+}
+
+// The radio has sent the current fragment, so move on to the next, or if that
+// was the last, it is the other side's turn.
+int hf_tx_fragment_sent(void)
+{
+  char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
+  if (timestr[0]) timestr[strlen(timestr)-1]=0;
+  fprintf(stderr,"  [%s] Sent %s",timestr,hf_tx.message);
+
+  hf_tx.offset+=hf_tx.fragment_bytes;
+  hf_tx.accepted=0;
+  hf_tx.rejected=0;
+  if (hf_tx.offset<hf_tx.len) {
+    hf_tx.state=HF_TX_PRESEND;
+    hf_tx.due=now_ms+HF_TX_PRESEND_DELAY_MS;
+    return 0;
+  }
+
+  hf_tx.state=HF_TX_IDLE;
+  hf_message_sequence_number++;
+  hf_batch.packet_airtime=hf_average(hf_batch.packet_airtime,now_ms-hf_tx.started);
+  hf_batch.sent++;
+  if (hf_tx.more) {
+    // Straight on with the next one
+    hf_next_packet_time=now_ms;
+    fprintf(stderr,"  [%s] Finished sending packet %d of %d this turn.\n",
+	    timestr,hf_batch.sent,hf_batch.size);
+    return 0;
+  }
+  hf_batch.sent=0;
+  hf_their_turn=0;
+  hf_radio_pause_for_turnaround();
+  hf_awaiting_answer=1;
+  fprintf(stderr,"  [%s] Finished sending packet, next in %lld seconds.\n",
+	  timestr,(hf_next_packet_time-now_ms)/1000);
+  return 0;
+}
+
+int hf_tx_abort(char *reason)
+{
+  if (hf_tx.state==HF_TX_IDLE) return 0;
+  fprintf(stderr,"%s: Aborted sending packet.\n",reason);
+  hf_tx.state=HF_TX_IDLE;
+  hf_batch.sent=0;
+  hf_message_sequence_number++;
+  return 0;
+}
@@ -15,6 +15,10 @@ station "103" 5 minutes every 2 hours
   A 100% duty cycle will mean that this radio will never be able to receive calls,
   so a 50% duty cycle (or better 1/n) duty cycle is probably more appropriate.
 
+  "fixed turnaround" makes us wait the radio's turnaround time plus a random
+  0 - 9 seconds for the other side, as we used to, instead of working out how
+  long from how quickly they answer (and without backing off after collisions).
+
 */
 #include <unistd.h>
 #include <errno.h>
@@ -54,8 +58,8 @@ int hf_read_configuration(char *filename)
       // ignore blank lines and # comments
     } else if (sscanf(line,"wait %d seconds%n",&seconds,&offset)==1) {
       // Wait this long before making first call
-      last_outbound_call=time(0)+seconds;
-      hf_next_packet_time=time(0)+seconds;
+      last_outbound_call=monotime_ms()+seconds*1000LL;
+      hf_next_packet_time=monotime_ms()+seconds*1000LL;
     } else if (sscanf(line,"%d%% duty cycle%n",&hf_callout_duty_cycle,&offset)==1) {
       if (hf_callout_duty_cycle<0||hf_callout_duty_cycle>100) {
 	fprintf(stderr,"Invalid call out duty cycle: Must be between 0%% and 100%%\n");
@@ -68,6 +72,8 @@ int hf_read_configuration(char *filename)
 	fprintf(stderr,"  Offending line: %s\n",line);
 	exit(-1);
       }
+    } else if (!strncasecmp(line,"fixed turnaround",16)) {
+      hf_turnaround_fixed=1;
     } else if (sscanf(line,"station \"%[^\"]\" %d minutes every %d hours",
 		      station_name,&minutes,&hours)==3) {
       fprintf(stderr,"Registering station '%s' (%d minutes every %d hours)\n",
@@ -0,0 +1,338 @@
+/*
+  Put HF packets back together from their fragments.
+
+  Each ALE message carries one fragment of a packet, with a 3 character
+  header: the sequence number of the packet (which also says which type of
+  radio sent it, and how it is encoded), which piece this is, and how many
+  pieces there are.  Fragments can go missing, turn up twice, or arrive out
+  of order, and more than one station can be sending at once, so we keep a
+  few packets on the go, one for each sender and sequence number.
+
+  The last piece is the only thing that tells us how long the packet is, so
+  we must be sure it wasn't cut short.  ASCII-64 fragments say how many bytes
+  they hold, and LBARDs that send ASCII-64 end their hex fragments with
+  HF_ASCII64_CAPABLE.  Once we have seen that from a sender, we ignore a last
+  piece from it without one.  (Older LBARDs don't send it, so we have to take
+  their last pieces as they come.)
+
+  A packet is passed up once we have all of its pieces.  Any characters that
+  arrived garbled, or pieces that were cut short, are passed up as erasures,
+  so that the Reed-Solomon decoder can fill them in from the parity bytes.
+  If a packet sits incomplete for too long, we try the same with the missing
+  pieces as erasures, and then forget about it.  That only works if they add
+  up to no more than RS_MAX_ERASURES bytes, and only once the last piece has
+  arrived, as that is the only thing that tells us how long the packet is.
+  (The RS decoder can't: a packet that ends in 0s decodes just as well with
+  fewer of them.)
+*/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <strings.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "hf.h"
+#include "radios.h"
+
+#define FEC_LENGTH 32
+
+struct hf_reassembly hf_reassembly[HF_REASSEMBLY_SLOTS];
+
+// Work out which radio sent a fragment, and how it is encoded, from its first
+// character.  The sequence number includes whether it is ASCII-64 (0-15).
+int hf_fragment_sender(char c,int *peer_radio,int *sequence,int *ascii64)
+{
+  int seq=-1;
+  *peer_radio=-1;
+  if ((c>='0')&&(c<'0'+2*HF_SEQUENCE_ASCII64)) {
+    *peer_radio=RADIOTYPE_HFCODAN;
+    seq=c-'0';
+  }
+  if ((c>='A')&&(c<'A'+2*HF_SEQUENCE_ASCII64)) {
+    *peer_radio=RADIOTYPE_HFBARRETT;
+    seq=c-'A';
+  }
+  if (seq<0) return -1;
+  *ascii64=(seq>=HF_SEQUENCE_ASCII64);
+  *sequence=seq;
+  return 0;
+}
+
+// The number of pieces in a packet, from the third character of a fragment,
+// which also says whether another packet follows in the same turn.
+int hf_fragment_pieces(char c,int *more)
+{
+  int pieces=c-'0';
+  *more=0;
+  if (pieces>HF_PIECES_MORE) {
+    *more=1;
+    pieces-=HF_PIECES_MORE;
+  }
+  if (pieces<1||pieces>6) return -1;
+  return pieces;
+}
+
+// Put the bytes from a fragment into the packet it is a piece of.
+// Returns the offset of the end of the piece in the packet, or -1 if the
+// fragment is not valid.  If erased is not NULL, bytes that came from
+// garbled characters are marked in it (and are 0 in the packet).
+int hf_fragment_decode(char *fragment,unsigned char *packet,int packet_len,
+		       unsigned char *erased)
+{
+  int peer_radio,sequence,ascii64;
+  if (hf_fragment_sender(fragment[0],&peer_radio,&sequence,&ascii64)) return -1;
+  if ((!fragment[1])||(!fragment[2])) return -1;
+  int piece_number=(fragment[1]-'0');
+  if (piece_number<0||piece_number>5) return -1;
+
+  if (ascii64) {
+    int packet_offset=piece_number*HF_FRAGMENT_BYTES_ASCII64;
+    if (packet_offset>=packet_len) return -1;
+    int count=fragment[3]-HF_ASCII64_COUNT_BASE;
+    if ((count<1)||(count>HF_FRAGMENT_BYTES_ASCII64)) return -1;
+    if (packet_offset+count>packet_len) return -1;
+    char *text=&fragment[4];
+    // Replace any characters outside the ASCII-64 set, and mark the bytes
+    // they would have gone into.  (A character holds bits of the bytes
+    // either side of it, except the first and last of each group of 4)
+    char clean[1024];
+    unsigned char bad[1024];
+    int len=strlen(text);
+    if (len>=sizeof(clean)) return -1;
+    if ((len&3)==1) len--;
+    bzero(bad,len);
+    for(int i=0;i<len;i++) {
+      char c=text[i];
+      clean[i]=c;
+      if ((c>=0x20)&&(c<=0x5f)) continue;
+      clean[i]=0x20;
+      int group=(i/4)*3;
+      int first=group+((i&3)?(i&3)-1:0);
+      int last=group+(((i&3)==3)?2:(i&3));
+      for(int j=first;j<=last;j++) bad[j]=1;
+    }
+    clean[len]=0;
+    int bytes=ascii64_decode(clean,&packet[packet_offset],
+			     packet_len-packet_offset,peer_radio);
+    if ((bytes<0)||(bytes>count)) return -1;
+    for(int j=0;j<bytes;j++)
+      if (bad[j]) {
+	packet[packet_offset+j]=0;
+	if (erased) erased[packet_offset+j]=1;
+      }
+    // Anything that was cut off the end is erased too
+    if (bytes<count) {
+      if (!erased) return -1;
+      for(int j=bytes;j<count;j++) {
+	packet[packet_offset+j]=0;
+	erased[packet_offset+j]=1;
+      }
+    }
+    return packet_offset+count;
+  }
+
+  int packet_offset=piece_number*HF_FRAGMENT_BYTES;
+  int i;
+  for(i=3;fragment[i]&&fragment[i+1];i+=2) {
+    if (packet_offset>=packet_len) return -1;
+    if (ishex(fragment[i+0])&&ishex(fragment[i+1])) {
+      int v=(chartohexnybl(fragment[i+0])<<4)+chartohexnybl(fragment[i+1]);
+      packet[packet_offset++]=v;
+    } else if (erased) {
+      // Keep the rest of the piece in the right place
+      erased[packet_offset]=1;
+      packet[packet_offset++]=0;
+    }
+  }
+  return packet_offset;
+}
+
+static int hf_reassembly_fragment_bytes(struct hf_reassembly *r)
+{
+  return (r->sequence>=HF_SEQUENCE_ASCII64)?HF_FRAGMENT_BYTES_ASCII64:HF_FRAGMENT_BYTES;
+}
+
+// List the bytes of the packet we don't have, if it is length bytes long.
+// Returns how many, or -1 if that is too many to fill in.
+static int hf_reassembly_erasures(struct hf_reassembly *r,int length,int *erasures)
+{
+  int erasure_count=0;
+  int fragment_bytes=hf_reassembly_fragment_bytes(r);
+  for(int i=0;i<length;i++) {
+    int piece=i/fragment_bytes;
+    if (r->erased[i]||(!(r->received&(1<<piece)))) {
+      if (erasure_count>=RS_MAX_ERASURES) return -1;
+      r->packet[i]=0;
+      erasures[erasure_count++]=i;
+    }
+  }
+  return erasure_count;
+}
+
+// Pass the packet up, with the bytes we don't have as erasures.
+// Returns 0 if it was accepted.
+static int hf_reassembly_deliver(struct hf_reassembly *r)
+{
+  int erasures[RS_MAX_ERASURES];
+  int erasure_count;
+  int length=r->length;
+
+  // Without the last piece we don't know how long the packet is
+  if (length<0) return -1;
+  erasure_count=hf_reassembly_erasures(r,length,erasures);
+  if (erasure_count<0) return -1;
+
+  // (the RS decoder fixes up the data in our copy, which we then use to spot
+  // duplicates)
+  if (hf_packet_handler(r->packet,length,erasures,erasure_count)) {
+    fprintf(stderr,"HF: Packet #%d from %s did not decode.\n",
+	    r->sequence&0x07,r->sender);
+    return -1;
+  }
+  r->length=length;
+  r->received=(1<<r->pieces)-1;
+  r->delivered=1;
+  // (the decoder doesn't fix the parity bytes, so those stay erased)
+  memset(r->erased,0,length-FEC_LENGTH);
+  return 0;
+}
+
+// Try anything that has sat incomplete for too long, and then forget it.
+int hf_reassembly_expire(void)
+{
+  for(int i=0;i<HF_REASSEMBLY_SLOTS;i++) {
+    struct hf_reassembly *r=&hf_reassembly[i];
+    if (!r->in_use) continue;
+    if (now_ms-r->last_fragment_time<HF_REASSEMBLY_TIMEOUT_MS) continue;
+    if (!r->delivered) {
+      fprintf(stderr,"HF: Giving up waiting for the rest of packet #%d from %s (have pieces 0x%02x of %d).\n",
+	      r->sequence&0x07,r->sender,r->received,r->pieces);
+      hf_reassembly_deliver(r);
+    }
+    r->in_use=0;
+  }
+  return 0;
+}
+
+static struct hf_reassembly *hf_reassembly_find(char *sender,int peer_radio,
+						int sequence)
+{
+  struct hf_reassembly *oldest=NULL;
+  for(int i=0;i<HF_REASSEMBLY_SLOTS;i++) {
+    struct hf_reassembly *r=&hf_reassembly[i];
+    if (r->in_use&&(r->peer_radio==peer_radio)&&(r->sequence==sequence)
+	&&(!strcmp(r->sender,sender)))
+      return r;
+  }
+  for(int i=0;i<HF_REASSEMBLY_SLOTS;i++) {
+    struct hf_reassembly *r=&hf_reassembly[i];
+    if (!r->in_use) return r;
+    if ((!oldest)||(r->last_fragment_time<oldest->last_fragment_time)) oldest=r;
+  }
+  // All in use, so make way, giving the oldest one last chance
+  if (!oldest->delivered) hf_reassembly_deliver(oldest);
+  oldest->in_use=0;
+  return oldest;
+}
+
+static void hf_reassembly_reset(struct hf_reassembly *r,char *sender,int peer_radio,
+				int sequence,int pieces)
+{
+  bzero(r,sizeof(struct hf_reassembly));
+  r->in_use=1;
+  snprintf(r->sender,sizeof(r->sender),"%s",sender);
+  r->peer_radio=peer_radio;
+  r->sequence=sequence;
+  r->pieces=pieces;
+  r->length=-1;
+}
+
+// Add a received fragment to the packet it belongs to, and pass the packet
+// up if that completes it.  Returns -1 if the fragment is not valid.
+int hf_reassembly_add(char *sender,char *fragment)
+{
+  int peer_radio,sequence,ascii64;
+  unsigned char piece[256],erased[256];
+
+  if (hf_fragment_sender(fragment[0],&peer_radio,&sequence,&ascii64)) return -1;
+  if ((!fragment[1])||(!fragment[2])) return -1;
+  int more;
+  int piece_number=fragment[1]-'0';
+  int pieces=hf_fragment_pieces(fragment[2],&more);
+  if (pieces<1) return -1;
+  if (piece_number<0||piece_number>=pieces) return -1;
+
+  bzero(erased,sizeof(erased));
+  int end=hf_fragment_decode(fragment,piece,sizeof(piece),erased);
+  if (end<0) return -1;
+  int fragment_bytes=ascii64?HF_FRAGMENT_BYTES_ASCII64:HF_FRAGMENT_BYTES;
+  int start=piece_number*fragment_bytes;
+  if (piece_number<pieces-1) {
+    // Anything missing from the end of a piece is also erased
+    int full=start+fragment_bytes;
+    if (end>full) return -1;
+    for(int i=end;i<full;i++) { piece[i]=0; erased[i]=1; }
+    end=full;
+  }
+  int bad=0;
+  for(int i=start;i<end;i++) bad+=erased[i];
+  int last=(piece_number==pieces-1);
+  int marked=(!ascii64)&&(fragment[strlen(fragment)-1]==HF_ASCII64_CAPABLE);
+
+  hf_reassembly_expire();
+  struct hf_reassembly *r=hf_reassembly_find(sender,peer_radio,sequence);
+  if ((!r->in_use)||(r->pieces!=pieces))
+    hf_reassembly_reset(r,sender,peer_radio,sequence,pieces);
+  if (!ascii64) {
+    if (marked&&(!r->delivered)&&(r->received&(1<<(pieces-1)))&&(!r->last_marked)) {
+      // This sender marks its fragments, and the last piece we have wasn't
+      // marked, so it was cut short
+      r->received&=~(1<<(pieces-1));
+      r->length=-1;
+    }
+    if (last&&(!marked)&&r->marked) {
+      fprintf(stderr,"HF: Ignoring piece %d of packet #%d from %s, as it was cut short.\n",
+	      piece_number+1,sequence&0x07,sender);
+      r->last_fragment_time=now_ms;
+      return 0;
+    }
+  }
+  if (r->received&(1<<piece_number)) {
+    // We have seen this piece before.  If it is from the packet we already
+    // have, then it is a duplicate, else the sequence number has come round
+    // again, and this is a new packet.
+    int have_bad=0,differ=0;
+    for(int i=start;i<end;i++) {
+      have_bad+=r->erased[i];
+      if ((!erased[i])&&(!r->erased[i])&&(piece[i]!=r->packet[i])) differ++;
+    }
+    if (last&&end!=r->length) differ++;
+    if (differ) {
+      fprintf(stderr,"HF: Packet #%d from %s is a new packet.\n",sequence&0x07,sender);
+      hf_reassembly_reset(r,sender,peer_radio,sequence,pieces);
+    } else if (r->delivered||(bad>=have_bad)) {
+      fprintf(stderr,"HF: Ignoring duplicate piece %d of packet #%d from %s.\n",
+	      piece_number+1,sequence&0x07,sender);
+      r->last_fragment_time=now_ms;
+      return 0;
+    }
+    // (else this copy is better, so we use it instead, and try again)
+  }
+
+  memcpy(&r->packet[start],&piece[start],end-start);
+  memcpy(&r->erased[start],&erased[start],end-start);
+  if (marked) r->marked=1;
+  if (last) {
+    r->length=end;
+    r->last_marked=marked;
+  }
+  r->received|=1<<piece_number;
+  r->last_fragment_time=now_ms;
+
+  if ((!r->delivered)&&(r->received==(1<<pieces)-1)) hf_reassembly_deliver(r);
+  return 0;
+}
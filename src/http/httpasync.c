@@ -0,0 +1,780 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015 Serval Project Inc.
+
+Non-blocking HTTP/1.1 client for talking to servald.
+
+We used to open a fresh TCP connection to servald for every manifest, body
+and import, with a blocking connect(), and then read the response headers a
+byte at a time.  Each of those could stall the main loop, and with it the
+radio, for as long as servald took to answer.
+
+Instead, requests are now queued here, and advanced a step at a time from the
+main loop (see http_client_pollfds() and http_client_service()), calling a
+callback when each completes.  Connections to servald are kept open and
+reused for following requests where the server allows it.  Responses are
+read in large chunks, with the headers parsed out of a buffer, and bodies can
+be delimited by Content-Length, chunked encoding or the server closing the
+connection.
+
+For the few places that really do need to wait for an answer (and for the
+command line tools), http_request_wait() runs a single request to completion,
+using the same connection pool.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "serial.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define HTTP_MAX_CONNECTIONS 8
+// Queued requests may only use this many connections at once, so that there is
+// always a connection free for http_request_wait() to use, even if it is
+// called while the queue is busy.
+#define HTTP_MAX_QUEUE_CONNECTIONS (HTTP_MAX_CONNECTIONS-2)
+// Don't reuse connections that have been idle for longer than this, in case
+// servald has given up on them.
+#define HTTP_IDLE_TIMEOUT_MS 10000
+
+enum {
+  HTTP_STATE_QUEUED=0,
+  HTTP_STATE_CONNECTING,
+  HTTP_STATE_SENDING,
+  HTTP_STATE_HEADERS,
+  HTTP_STATE_BODY,
+  HTTP_STATE_DONE
+};
+
+// How the end of the response body is marked
+enum {
+  HTTP_BODY_LENGTH=0,   // Content-Length header
+  HTTP_BODY_CHUNKED,    // Transfer-Encoding: chunked
+  HTTP_BODY_UNTIL_CLOSE // neither, so the server closes the connection
+};
+
+enum {
+  HTTP_CHUNK_SIZE=0,
+  HTTP_CHUNK_DATA,
+  HTTP_CHUNK_DATA_END,
+  HTTP_CHUNK_TRAILER
+};
+
+struct http_connection {
+  int fd; // -1 if this slot is free
+  char server[HTTP_MAX_SERVER];
+  int busy;
+  long long last_used;
+  int requests;
+};
+
+struct http_connection http_connections[HTTP_MAX_CONNECTIONS];
+int http_connections_initialised=0;
+
+// Requests that have been queued with http_request_start()
+struct http_request *http_queue=NULL;
+
+int http_connections_opened=0;
+int http_connections_reused=0;
+int http_requests_completed=0;
+int http_requests_failed=0;
+
+static void http_connections_init(void)
+{
+  if (http_connections_initialised) return;
+  for(int i=0;i<HTTP_MAX_CONNECTIONS;i++) http_connections[i].fd=-1;
+  http_connections_initialised=1;
+}
+
+/* Look up servald's address.  This is almost always a numeric address, but if
+   it isn't, we remember the answer, so that we don't call the (blocking)
+   resolver for every request.
+*/
+#define HTTP_RESOLVER_CACHE 4
+struct http_resolved {
+  char host[HTTP_MAX_SERVER];
+  struct in_addr addr;
+};
+struct http_resolved http_resolver_cache[HTTP_RESOLVER_CACHE];
+int http_resolver_next=0;
+
+int http_resolve(char *host,int port,struct sockaddr_in *addr)
+{
+  bzero(addr,sizeof(struct sockaddr_in));
+  addr->sin_family=AF_INET;
+  addr->sin_port=htons(port);
+  if (inet_aton(host,&addr->sin_addr)) return 0;
+
+  for(int i=0;i<HTTP_RESOLVER_CACHE;i++)
+    if (!strcmp(http_resolver_cache[i].host,host)) {
+      addr->sin_addr=http_resolver_cache[i].addr;
+      return 0;
+    }
+
+  struct addrinfo hints,*result=NULL;
+  bzero(&hints,sizeof(hints));
+  hints.ai_family=AF_INET;
+  hints.ai_socktype=SOCK_STREAM;
+  if (getaddrinfo(host,NULL,&hints,&result)||!result) {
+    fprintf(stderr,"Could not resolve HTTP server '%s'\n",host);
+    return -1;
+  }
+  addr->sin_addr=((struct sockaddr_in *)result->ai_addr)->sin_addr;
+  freeaddrinfo(result);
+
+  struct http_resolved *c=&http_resolver_cache[http_resolver_next];
+  http_resolver_next=(http_resolver_next+1)%HTTP_RESOLVER_CACHE;
+  snprintf(c->host,HTTP_MAX_SERVER,"%s",host);
+  c->addr=addr->sin_addr;
+  return 0;
+}
+
+static void http_connection_close(int c)
+{
+  if (http_connections[c].fd>=0) close(http_connections[c].fd);
+  http_connections[c].fd=-1;
+  http_connections[c].busy=0;
+  http_connections[c].server[0]=0;
+}
+
+// Check that an idle connection hasn't been closed by the server.  An idle
+// connection should never have anything to read.
+static int http_connection_idle_ok(int c)
+{
+  if (monotime_ms()-http_connections[c].last_used>HTTP_IDLE_TIMEOUT_MS) return 0;
+  unsigned char b;
+  int r=recv(http_connections[c].fd,&b,1,MSG_PEEK|MSG_DONTWAIT);
+  if ((r<0)&&((errno==EAGAIN)||(errno==EWOULDBLOCK))) return 1;
+  return 0;
+}
+
+// Start a non-blocking connect to the server, returning the socket, or -1
+static int http_connect(char *server)
+{
+  char host[HTTP_MAX_SERVER];
+  int port=-1;
+  if (sscanf(server,"%[^:]:%d",host,&port)!=2) return -1;
+  struct sockaddr_in addr;
+  if (http_resolve(host,port,&addr)) return -1;
+
+  int sock=socket(AF_INET,SOCK_STREAM,0);
+  if (sock==-1) {
+    perror("Failed to create a socket.");
+    return -1;
+  }
+  set_nonblock(sock);
+  int one=1;
+  setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+#ifdef TCP_QUICKACK
+  // If servald writes its response in more than one piece, then Nagle on its
+  // end and delayed ACKs on ours can hold each response up for 40ms.
+  setsockopt(sock,IPPROTO_TCP,TCP_QUICKACK,&one,sizeof(one));
+#endif
+  if (connect(sock,(struct sockaddr *)&addr,sizeof(addr))&&(errno!=EINPROGRESS)) {
+    perror("connect() to HTTP server failed");
+    close(sock);
+    return -1;
+  }
+  http_connections_opened++;
+  return sock;
+}
+
+/* Find a connection to the request's server: preferably an idle one we can
+   reuse, otherwise a new one.  Returns -1 if all the connections we are allowed
+   to use are busy, or -2 if we couldn't connect.
+*/
+static int http_connection_acquire(struct http_request *r,int max_busy)
+{
+  http_connections_init();
+
+  int busy=0;
+  for(int c=0;c<HTTP_MAX_CONNECTIONS;c++)
+    if (http_connections[c].fd>=0&&http_connections[c].busy) busy++;
+  if (busy>=max_busy) return -1;
+
+  int slot=-1,lru=-1;
+  for(int c=0;c<HTTP_MAX_CONNECTIONS;c++) {
+    struct http_connection *h=&http_connections[c];
+    if (h->fd<0) { if (slot==-1) slot=c; continue; }
+    if (h->busy) continue;
+    if (!strcmp(h->server,r->server)) {
+      if (http_connection_idle_ok(c)) {
+	h->busy=1;
+	h->requests++;
+	http_connections_reused++;
+	r->reused=1;
+	return c;
+      }
+      http_connection_close(c);
+      if (slot==-1) slot=c;
+      continue;
+    }
+    if ((lru==-1)||(h->last_used<http_connections[lru].last_used)) lru=c;
+  }
+  if (slot==-1) {
+    // Close an idle connection to some other server to make room
+    if (lru==-1) return -1;
+    http_connection_close(lru);
+    slot=lru;
+  }
+
+  int fd=http_connect(r->server);
+  if (fd<0) return -2;
+  struct http_connection *h=&http_connections[slot];
+  h->fd=fd;
+  snprintf(h->server,HTTP_MAX_SERVER,"%s",r->server);
+  h->busy=1;
+  h->requests=1;
+  h->last_used=monotime_ms();
+  r->reused=0;
+  return slot;
+}
+
+static void http_connection_release(struct http_request *r,int reusable)
+{
+  if (r->connection<0) return;
+  struct http_connection *h=&http_connections[r->connection];
+  if (reusable) {
+    h->busy=0;
+    h->last_used=monotime_ms();
+  } else http_connection_close(r->connection);
+  r->connection=-1;
+}
+
+struct http_request *http_request_new(char *server_and_port,char *path,
+				      int timeout_ms)
+{
+  if (strlen(server_and_port)>=HTTP_MAX_SERVER) return NULL;
+  struct http_request *r=calloc(1,sizeof(struct http_request));
+  assert(r);
+  snprintf(r->server,HTTP_MAX_SERVER,"%s",server_and_port);
+  r->path=strdup(path);
+  assert(r->path);
+  r->start_time=monotime_ms();
+  r->timeout_time=r->start_time+timeout_ms;
+  r->max_len=8192;
+  r->connection=-1;
+  r->content_length=-1;
+  return r;
+}
+
+// Make a request with no body, e.g., GET, and the usual headers
+struct http_request *http_request_simple(char *server_and_port,char *auth_token,
+					 char *method,char *path,int timeout_ms)
+{
+  if (strlen(auth_token)>500) return NULL;
+  if (strlen(path)>500) return NULL;
+
+  struct http_request *r=http_request_new(server_and_port,path,timeout_ms);
+  if (!r) return NULL;
+
+  char authdigest[1024];
+  int zero=0;
+  bzero(authdigest,1024);
+  base64_append(authdigest,&zero,(unsigned char *)auth_token,strlen(auth_token));
+
+  char request[2048];
+  int len=snprintf(request,2048,
+		   "%s %s HTTP/1.1\r\n"
+		   "Authorization: Basic %s\r\n"
+		   "Host: %s\r\n"
+		   "Accept: */*\r\n"
+		   "\r\n",
+		   method,path,authdigest,server_and_port);
+  r->message=malloc(len);
+  assert(r->message);
+  bcopy(request,r->message,len);
+  r->message_len=len;
+  return r;
+}
+
+void http_request_free(struct http_request *r)
+{
+  if (!r) return;
+  http_connection_release(r,0);
+  free(r->path);
+  free(r->message);
+  free(r->body);
+  free(r);
+}
+
+// Hand some of the response body to wherever it is going
+static int http_request_deliver(struct http_request *r,unsigned char *bytes,int n)
+{
+  if (!n) return 0;
+  r->last_read_time=monotime_ms();
+  if (r->outfile) {
+    if (fwrite(bytes,1,n,r->outfile)!=n) {
+      fprintf(stderr,"Short write of HTTP data to file\n");
+      return -1;
+    }
+    r->body_len+=n;
+    return 0;
+  }
+  if (r->body_len+n>r->max_len) {
+    fprintf(stderr,"HTTP response too long (limit is %d bytes, URL: '%s')\n",
+	    r->max_len,r->path);
+    return -1;
+  }
+  if (r->body_len+n>r->body_size) {
+    int size=r->body_size?r->body_size:8192;
+    while(size<r->body_len+n) size*=2;
+    if (size>r->max_len) size=r->max_len;
+    r->body=realloc(r->body,size);
+    assert(r->body);
+    r->body_size=size;
+  }
+  bcopy(bytes,&r->body[r->body_len],n);
+  r->body_len+=n;
+  return 0;
+}
+
+static void http_request_finish(struct http_request *r,int response_code)
+{
+  r->response_code=response_code;
+  r->state=HTTP_STATE_DONE;
+  metrics_observe_servald_latency(monotime_ms()-r->start_time,response_code>0);
+  // We can only reuse the connection if the response ended cleanly, and the
+  // server hasn't said it is going to close it.
+  http_connection_release(r,(response_code>0)&&r->keep_alive
+			  &&(r->body_mode!=HTTP_BODY_UNTIL_CLOSE));
+  if (response_code>0) {
+    http_requests_completed++;
+    if (r->outfile) fflush(r->outfile);
+    else if (!r->body) {
+      // Callers expect a buffer, even if the body is empty
+      r->body=malloc(1);
+      assert(r->body);
+    }
+  } else
+    http_requests_failed++;
+}
+
+// Does a header value contain the given word, ignoring case?
+static int http_header_has(char *value,char *word)
+{
+  int len=strlen(word);
+  for(;*value;value++)
+    if (!strncasecmp(value,word,len)) return 1;
+  return 0;
+}
+
+// Parse the response line and headers, once we have all of them
+static int http_parse_headers(struct http_request *r)
+{
+  char *line=r->header;
+  int http_minor=1;
+  r->response_code=-999;
+  r->content_length=-1;
+  r->body_mode=HTTP_BODY_UNTIL_CLOSE;
+  r->keep_alive=1;
+  int first=1;
+  while(line&&*line) {
+    char *eol=strchr(line,'\n');
+    if (eol) *eol=0;
+    int len=strlen(line);
+    if (len&&line[len-1]=='\r') line[len-1]=0;
+
+    if (first) {
+      if (sscanf(line,"HTTP/1.%d %d",&http_minor,&r->response_code)!=2)
+	return -1;
+      // HTTP/1.0 connections close unless asked otherwise
+      if (!http_minor) r->keep_alive=0;
+      first=0;
+    } else if (!strncasecmp(line,"Content-Length:",15)) {
+      // A negative or oversized length would wrap around once we start
+      // counting down the body, so refuse anything but a plain number.
+      char *end=NULL;
+      errno=0;
+      long long length=strtoll(&line[15],&end,10);
+      while((*end==' ')||(*end=='\t')) end++;
+      if (errno||(end==&line[15])||*end||(length<0)||(length>INT_MAX)) {
+	fprintf(stderr,"HTTP response has an invalid Content-Length:%s\n",&line[15]);
+	return -1;
+      }
+      r->content_length=length;
+      if (r->body_mode!=HTTP_BODY_CHUNKED) r->body_mode=HTTP_BODY_LENGTH;
+    } else if (!strncasecmp(line,"Transfer-Encoding:",18)) {
+      if (http_header_has(&line[18],"chunked")) r->body_mode=HTTP_BODY_CHUNKED;
+    } else if (!strncasecmp(line,"Connection:",11)) {
+      if (http_header_has(&line[11],"close")) r->keep_alive=0;
+      if (http_header_has(&line[11],"keep-alive")) r->keep_alive=1;
+    }
+    line=eol?eol+1:NULL;
+  }
+  if ((r->response_code>=100&&r->response_code<200)
+      ||(r->response_code==204)||(r->response_code==304)) {
+    // No body
+    r->body_mode=HTTP_BODY_LENGTH;
+    r->content_length=0;
+  }
+  if ((r->body_mode==HTTP_BODY_LENGTH)&&(!r->outfile)
+      &&(r->content_length>r->max_len)) {
+    fprintf(stderr,"HTTP response too long (%d bytes, limit is %d)\n",
+	    r->content_length,r->max_len);
+    return -1;
+  }
+  return 0;
+}
+
+// Feed some of a chunked body through, returning how many bytes we used,
+// or -1 on error.  r->body_complete gets set when we reach the end.
+static int http_chunked_consume(struct http_request *r,unsigned char *bytes,int n)
+{
+  int used=0;
+  while(used<n&&!r->body_complete) {
+    switch(r->chunk_state) {
+    case HTTP_CHUNK_SIZE:
+    case HTTP_CHUNK_DATA_END:
+    case HTTP_CHUNK_TRAILER:
+      {
+	// These are all lines of text
+	int c=bytes[used++];
+	if (c=='\r') break;
+	if (c!='\n') {
+	  if (r->chunk_line_len<(int)sizeof(r->chunk_line)-1)
+	    r->chunk_line[r->chunk_line_len++]=c;
+	  break;
+	}
+	r->chunk_line[r->chunk_line_len]=0;
+	int line_len=r->chunk_line_len;
+	r->chunk_line_len=0;
+	if (r->chunk_state==HTTP_CHUNK_DATA_END) {
+	  r->chunk_state=HTTP_CHUNK_SIZE;
+	} else if (r->chunk_state==HTTP_CHUNK_TRAILER) {
+	  if (!line_len) r->body_complete=1;
+	} else {
+	  char *end=NULL;
+	  long size=strtol(r->chunk_line,&end,16);
+	  if ((end==r->chunk_line)||(size<0)||(size>INT_MAX)) return -1;
+	  r->chunk_remaining=size;
+	  r->chunk_state=size?HTTP_CHUNK_DATA:HTTP_CHUNK_TRAILER;
+	}
+      }
+      break;
+    case HTTP_CHUNK_DATA:
+      {
+	int count=n-used;
+	if (count>r->chunk_remaining) count=r->chunk_remaining;
+	if (http_request_deliver(r,&bytes[used],count)) return -1;
+	used+=count;
+	r->chunk_remaining-=count;
+	if (!r->chunk_remaining) r->chunk_state=HTTP_CHUNK_DATA_END;
+      }
+      break;
+    }
+  }
+  return used;
+}
+
+// Process bytes of response.  Returns 0 if we want more, 1 when the response is
+// complete, or -1 on error.
+static int http_response_consume(struct http_request *r,unsigned char *bytes,int n)
+{
+  r->response_bytes+=n;
+  if (r->state==HTTP_STATE_HEADERS) {
+    // Add to the header buffer, and see if we now have the end of the headers.
+    // We only copy as much as could be header, and then pass the rest on as
+    // body.
+    int room=HTTP_MAX_HEADER-1-r->header_len;
+    int count=n<room?n:room;
+    int search_from=r->header_len>3?r->header_len-3:0;
+    bcopy(bytes,&r->header[r->header_len],count);
+    r->header_len+=count;
+    r->header[r->header_len]=0;
+    int end=-1;
+    for(int i=search_from;i<r->header_len;i++) {
+      if (r->header[i]!='\n') continue;
+      if ((i>=1)&&(r->header[i-1]=='\n')) { end=i+1; break; }
+      if ((i>=2)&&(r->header[i-1]=='\r')&&(r->header[i-2]=='\n')) { end=i+1; break; }
+    }
+    if (end==-1) {
+      if (r->header_len>=HTTP_MAX_HEADER-1) {
+	fprintf(stderr,"HTTP response headers too long (URL: '%s')\n",r->path);
+	return -1;
+      }
+      return 0;
+    }
+    // Work out which of the bytes we were given are body
+    int body_start=end-(r->header_len-count);
+    r->header[end]=0;
+    r->header_len=end;
+    if (http_parse_headers(r)) return -1;
+    r->state=HTTP_STATE_BODY;
+    bytes+=body_start;
+    n-=body_start;
+  }
+
+  switch(r->body_mode) {
+  case HTTP_BODY_LENGTH:
+    {
+      int want=r->content_length-r->body_len;
+      if (n>want) {
+	// The server sent more than it said it would, so don't trust it with
+	// another request.
+	r->keep_alive=0;
+	n=want;
+      }
+      if (http_request_deliver(r,bytes,n)) return -1;
+      return r->body_len>=r->content_length;
+    }
+  case HTTP_BODY_CHUNKED:
+    {
+      int used=http_chunked_consume(r,bytes,n);
+      if (used<0) return -1;
+      if (used<n) r->keep_alive=0;
+      return r->body_complete;
+    }
+  default:
+    if (http_request_deliver(r,bytes,n)) return -1;
+    return 0;
+  }
+}
+
+// Put a request back to the start, after a reused connection turned out to
+// have been closed by the server.
+static int http_request_retry(struct http_request *r)
+{
+  if ((!r->reused)||r->retried||r->response_bytes) return -1;
+  http_connection_release(r,0);
+  r->retried=1;
+  r->message_sent=0;
+  r->header_len=0;
+  r->state=HTTP_STATE_QUEUED;
+  return 0;
+}
+
+static void http_request_fail(struct http_request *r,char *why)
+{
+  if (!http_request_retry(r)) return;
+  fprintf(stderr,"HTTP request failed: %s (URL: '%s')\n",why,r->path);
+  http_request_finish(r,-1);
+}
+
+/* Advance a request as far as we can without blocking.
+   max_busy is the number of connections it may use.
+*/
+static void http_request_step(struct http_request *r,int max_busy)
+{
+  if (r->state==HTTP_STATE_DONE) return;
+
+  if (monotime_ms()>r->timeout_time) {
+    fprintf(stderr,"HTTP request timed out (read %d of %d bytes, URL: '%s')\n",
+	    r->body_len,r->content_length,r->path);
+    http_request_finish(r,-1);
+    return;
+  }
+
+  if (r->state==HTTP_STATE_QUEUED) {
+    int c=http_connection_acquire(r,max_busy);
+    if (c==-1) return;
+    if (c<0) { http_request_finish(r,-1); return; }
+    r->connection=c;
+    r->state=r->reused?HTTP_STATE_SENDING:HTTP_STATE_CONNECTING;
+  }
+
+  int fd=http_connections[r->connection].fd;
+
+  if (r->state==HTTP_STATE_CONNECTING) {
+    int error=0;
+    socklen_t len=sizeof(error);
+    struct pollfd p={fd,POLLOUT,0};
+    if (poll(&p,1,0)<1) return;
+    if (getsockopt(fd,SOL_SOCKET,SO_ERROR,&error,&len)||error) {
+      errno=error;
+      perror("connect() to HTTP server failed");
+      http_request_finish(r,-1);
+      return;
+    }
+    r->state=HTTP_STATE_SENDING;
+  }
+
+  if (r->state==HTTP_STATE_SENDING) {
+    while(r->message_sent<r->message_len) {
+      int w=send(fd,&r->message[r->message_sent],r->message_len-r->message_sent,
+		 MSG_NOSIGNAL);
+      if (w>0) r->message_sent+=w;
+      else if ((w<0)&&((errno==EAGAIN)||(errno==EWOULDBLOCK))) return;
+      else if ((w<0)&&(errno==EINTR)) continue;
+      else { http_request_fail(r,"could not send request"); return; }
+    }
+    r->state=HTTP_STATE_HEADERS;
+  }
+
+  unsigned char buffer[16384];
+  while(1) {
+    int n=recv(fd,buffer,sizeof(buffer),0);
+    if (n<0) {
+      if ((errno==EAGAIN)||(errno==EWOULDBLOCK)) return;
+      if (errno==EINTR) continue;
+      http_request_fail(r,"connection reset");
+      return;
+    }
+    if (!n) {
+      // End of connection.  That's fine if we were reading until the end,
+      // otherwise the response was cut short.
+      if ((r->state==HTTP_STATE_BODY)&&(r->body_mode==HTTP_BODY_UNTIL_CLOSE))
+	http_request_finish(r,r->response_code);
+      else
+	http_request_fail(r,"connection closed before end of response");
+      return;
+    }
+    int result=http_response_consume(r,buffer,n);
+    if (result<0) { r->keep_alive=0; http_request_finish(r,-1); return; }
+    if (result) { http_request_finish(r,r->response_code); return; }
+  }
+}
+
+// Queue a request.  The callback is called from http_client_service() when it
+// completes (with response_code<0 if it failed), after which the request is
+// freed.  The callback can take ownership of the body by setting r->body to
+// NULL.
+int http_request_start(struct http_request *r,http_callback callback,
+		       void *context)
+{
+  if (!r) return -1;
+  r->callback=callback;
+  r->context=context;
+  r->next=NULL;
+  // Keep the queue in order, so that requests are sent in the order they
+  // were made.
+  struct http_request **p=&http_queue;
+  while(*p) p=&(*p)->next;
+  *p=r;
+  http_request_step(r,HTTP_MAX_QUEUE_CONNECTIONS);
+  return 0;
+}
+
+int http_request_pending(void)
+{
+  int count=0;
+  for(struct http_request *r=http_queue;r;r=r->next) count++;
+  return count;
+}
+
+// Add the sockets of queued requests to the set the main loop polls
+int http_client_pollfds(struct pollfd *fds,int max)
+{
+  int n=0;
+  for(struct http_request *r=http_queue;r&&n<max;r=r->next) {
+    if (r->connection<0) continue;
+    if (r->state==HTTP_STATE_DONE) continue;
+    fds[n].fd=http_connections[r->connection].fd;
+    fds[n].events=((r->state==HTTP_STATE_CONNECTING)||(r->state==HTTP_STATE_SENDING))
+      ?POLLOUT:POLLIN;
+    fds[n].revents=0;
+    n++;
+  }
+  return n;
+}
+
+// Advance all queued requests, and call the callbacks of any that finish
+int http_client_service(void)
+{
+  int finished=0;
+  for(struct http_request *r=http_queue;r;r=r->next)
+    http_request_step(r,HTTP_MAX_QUEUE_CONNECTIONS);
+
+  // Take the finished requests off the queue before calling their callbacks,
+  // as the callbacks might queue more requests.
+  struct http_request *done=NULL,**tail=&done;
+  struct http_request **p=&http_queue;
+  while(*p) {
+    struct http_request *r=*p;
+    if (r->state==HTTP_STATE_DONE) {
+      *p=r->next;
+      r->next=NULL;
+      *tail=r;
+      tail=&r->next;
+    } else p=&r->next;
+  }
+  while(done) {
+    struct http_request *r=done;
+    done=r->next;
+    if (r->callback) r->callback(r);
+    http_request_free(r);
+    finished++;
+  }
+
+  // Requests that finished may have freed connections for others
+  if (finished)
+    for(struct http_request *r=http_queue;r;r=r->next)
+      if (r->state==HTTP_STATE_QUEUED) http_request_step(r,HTTP_MAX_QUEUE_CONNECTIONS);
+
+  return finished;
+}
+
+// Run a request to completion, returning the HTTP response code, or -1 if it
+// failed.  The request is not freed.
+int http_request_wait(struct http_request *r)
+{
+  if (!r) return -1;
+  while(1) {
+    http_request_step(r,HTTP_MAX_CONNECTIONS);
+    if (r->state==HTTP_STATE_DONE) break;
+    long long remaining=r->timeout_time-monotime_ms();
+    if (remaining<0) remaining=0;
+    if (remaining>100) remaining=100;
+    if (r->connection<0) {
+      // Waiting for a connection to come free
+      usleep(remaining*1000);
+      continue;
+    }
+    struct pollfd p;
+    p.fd=http_connections[r->connection].fd;
+    p.events=((r->state==HTTP_STATE_CONNECTING)||(r->state==HTTP_STATE_SENDING))
+      ?POLLOUT:POLLIN;
+    p.revents=0;
+    poll(&p,1,remaining);
+  }
+  return r->response_code;
+}
+
+int http_client_report_json(FILE *f)
+{
+  int open=0,idle=0;
+  for(int c=0;c<HTTP_MAX_CONNECTIONS;c++)
+    if (http_connections_initialised&&http_connections[c].fd>=0) {
+      open++;
+      if (!http_connections[c].busy) idle++;
+    }
+  fprintf(f,"\"http_client\": { \"connections\": %d, \"idle\": %d,"
+	  " \"opened\": %d, \"reused\": %d, \"queued\": %d,"
+	  " \"completed\": %d, \"failed\": %d }",
+	  open,idle,http_connections_opened,http_connections_reused,
+	  http_request_pending(),http_requests_completed,http_requests_failed);
+  return 0;
+}
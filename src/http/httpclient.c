@@ -173,7 +173,7 @@ int json_body(int sock,long long timeout_time)
     if (r>0) {
       if (json_flatten(&parse_state,line,r)) break;
     } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
+    if (monotime_ms()>timeout_time) {
       // Quit on timeout
       close(sock);
       return -1;
@@ -184,19 +184,12 @@ int json_body(int sock,long long timeout_time)
   return 0;
 }
 
+int http_resolve(char *host,int port,struct sockaddr_in *addr);
+
 int connect_to_port(char *host,int port)
 {
-  struct hostent *hostent;
-  hostent = gethostbyname(host);
-  if (!hostent) {
-    return -1;
-  }
-
   struct sockaddr_in addr;  
-  addr.sin_family = AF_INET;     
-  addr.sin_port = htons(port);   
-  addr.sin_addr = *((struct in_addr *)hostent->h_addr);
-  bzero(&(addr.sin_zero),8);     
+  if (http_resolve(host,port,&addr)) return -1;
 
   int sock=socket(AF_INET, SOCK_STREAM, 0);
   if (sock==-1) {
@@ -256,155 +249,59 @@ int http_get_simple(char *server_and_port, char *auth_token,
 		    long long *last_read_time)
 {
   // Send simple HTTP request to server, and write result into outfile.
-
-  char server_name[1024];
-  int server_port=-1;
-
-  if (sscanf(server_and_port,"%[^:]:%d",server_name,&server_port)!=2) return -1;
-
-  long long timeout_time=gettime_ms()+timeout_ms;
-  
-  if (strlen(auth_token)>500) return -1;
-  if (strlen(path)>500) return -1;
-  
-  char request[2048];
-  char authdigest[1024];
-  int zero=0;
-  
-  bzero(authdigest,1024);
-  base64_append(authdigest,&zero,(unsigned char *)auth_token,strlen(auth_token));
-
-  // Build request
-  snprintf(request,2048,
-	   "GET %s HTTP/1.1\n"
-	   "Authorization: Basic %s\n"
-	   "Host: %s:%d\n"
-	   "Accept: */*\n"
-	   "\n",
-	   path,
-	   authdigest,
-	   server_name,server_port);
-
-  int sock=connect_to_port(server_name,server_port);
-  if (sock<0) return -1;
-
-  write_all(sock,request,strlen(request));
-
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response=-999;
-  #define LINE_BYTES 65536
-  char line[LINE_BYTES];
-  int len=0;
-  int empty_count=0;
-  int content_length=-1;
-  set_nonblock(sock);
-  int r;
-  while(len<1024) {
-    r=read_nonblock(sock,&line[len],1);
-    if (r==1) {
-      if ((line[len]=='\n')||(line[len]=='\r')) {
-	if (len) empty_count=0; else empty_count++;
-	line[len+1]=0;
-	if (sscanf(line,"Content-Length: %d",&content_length)==1) {
-	  // got content length
-	  // fprintf(stderr,"HTTP Content-Length = %d\n",content_length);
-	}
-	if (sscanf(line,"HTTP/1.0 %d",&http_response)==1) {
-	  // got http response
-	  // fprintf(stderr,"HTTP Response = %d\n",http_response);
-	}
-	if (sscanf(line,"HTTP/1.1 %d",&http_response)==1) {
-	  // got http response
-	  // fprintf(stderr,"HTTP Response = %d\n",http_response);
-	}
-	len=0;
-	// Have we found end of headers?
-	if (empty_count==3) break;
-      } else len++;
-    } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
-      // If still in header, just quit on timeout
-      close(sock);
-      return -1;
-    }
-  }
-
-  // Got headers, read body and write to file
-  // fprintf(stderr,"  reading body...\n");
-
-  int rxlen=0;
-  r=0;
-  while(r>-1) {
-    errno=0;
-    r=read_nonblock(sock,line,LINE_BYTES);
-    if (r>0) {
-      // fprintf(stderr,"read %d body bytes @ T%lld\n",r,timeout_time-gettime_ms());
-      if (last_read_time) *last_read_time=gettime_ms();
-      int written=fwrite(line,1,r,outfile);      
-      if (written!=r) {
-	fprintf(stderr,"Short write of HTTP data to file: %d of %d bytes\n",written,r);
-	close(sock);
-	return -1;
-      }
-      fflush(outfile);
-      rxlen+=r;
-      if (content_length>-1) {
-	if (rxlen>=content_length) break;
-      }
-    } else {
-      // If no error and no data, then it really is EOF
-      if (!errno) break;
-      // ... else, wait a little while, and try again.
-      usleep(10000);
-    }
-
-    if (gettime_ms()>timeout_time) {
-      fprintf(stderr,"HTTP read timeout (read %d of %d bytes)\n",
-	      rxlen,content_length);
-      close(sock);
-      return -1;
-    }
-    
-  }
-  
-  close(sock);
-  {
-    struct stat s;
-    int r=fstat(fileno(outfile),&s);
-    if (0) fprintf(stderr,"  HTTP download file: length=%lld, stat result=%d\n",
-		   (long long)s.st_size,r);
-    if (errno) perror("fstat");
-    if (s.st_size<content_length) {
-      fprintf(stderr,"  HTTP download file is too short. Returning error.\n");
-      return -1;
-    }
-
-  }
-  
+  struct http_request *r=http_request_simple(server_and_port,auth_token,
+					     "GET",path,timeout_ms);
+  if (!r) return -1;
+  r->outfile=outfile;
+  int http_response=http_request_wait(r);
+  if (last_read_time&&r->last_read_time) *last_read_time=r->last_read_time;
+  http_request_free(r);
   return http_response;
 }
 
-int http_post_bundle(char *server_and_port, char *auth_token,
-		     char *path,
-		     unsigned char *manifest_data, int manifest_length,
-		     unsigned char *body_data, int body_length,
+// Like http_get_simple(), but collects the response body into a malloc()'d
+// buffer, instead of going via a file.  The buffer is sized from the
+// Content-Length header if there is one, else it grows as required, up to
+// max_len bytes.  On success *out must be free()'d by the caller.
+int http_get_memory(char *server_and_port, char *auth_token,
+		    char *path, unsigned char **out, int *out_len, int max_len,
 		    int timeout_ms)
 {
+  *out=NULL; *out_len=0;
+
+  struct http_request *r=http_request_simple(server_and_port,auth_token,
+					     "GET",path,timeout_ms);
+  if (!r) return -1;
+  r->max_len=max_len;
+  int http_response=http_request_wait(r);
+  if (http_response>0) {
+    *out=r->body;
+    *out_len=r->body_len;
+    r->body=NULL;
+  }
+  http_request_free(r);
+  return http_response;
+}
 
-  char server_name[1024];
-  int server_port=-1;
-
+// Build a request that posts a bundle to servald as multipart/form-data, for
+// http_request_start() or http_request_wait().
+struct http_request *http_post_bundle_request(char *server_and_port, char *auth_token,
+					      char *path,
+					      unsigned char *manifest_data, int manifest_length,
+					      unsigned char *body_data, int body_length,
+					      int timeout_ms)
+{
   // Limit bundle size to 5MB via this transport, to limit memory consumption.
-  if (body_length>(5*1024*1024)) return -1;
+  if (body_length>(5*1024*1024)) return NULL;
   
-  if (sscanf(server_and_port,"%[^:]:%d",server_name,&server_port)!=2) return -1;
+  if (strlen(auth_token)>500) return NULL;
+  if (strlen(path)>500) return NULL;
 
-  long long timeout_time=gettime_ms()+timeout_ms;
+  struct http_request *r=http_request_new(server_and_port,path,timeout_ms);
+  if (!r) return NULL;
   
-  if (strlen(auth_token)>500) return -1;
-  if (strlen(path)>500) return -1;
-  
-  char request[8192+body_length];
+  char *request=malloc(8192+manifest_length+body_length);
+  assert(request);
   char authdigest[1024];
   int zero=0;
 
@@ -463,7 +360,7 @@ int http_post_bundle(char *server_and_port, char *auth_token,
   int header_length = snprintf(request,8192,
 			       "POST %s HTTP/1.1\r\n"
 			       "Authorization: Basic %s\r\n"
-			       "Host: %s:%d\r\n"
+			       "Host: %s\r\n"
 			       "Content-Length: %d\r\n"
 			       "Accept: */*\r\n"
 			       "%s"
@@ -471,7 +368,7 @@ int http_post_bundle(char *server_and_port, char *auth_token,
 			       "\r\n",
 			       path,
 			       authdigest,
-			       server_name,server_port,
+			       server_and_port,
 			       content_length,
 			       variable_length_string,
 			       boundary_string);
@@ -485,9 +382,8 @@ int http_post_bundle(char *server_and_port, char *auth_token,
   total_len=header_length+extra_length;
   bcopy(manifest_data,&request[total_len],manifest_length);
 
-  int subtotal_len=total_len;
   total_len=total_len+manifest_length;
-  total_len+=snprintf(&request[total_len],8192+body_length-total_len,  
+  total_len+=snprintf(&request[total_len],1024,
 			   "\r\n"
 			   "--%s\r\n"
 			   "%s",
@@ -495,78 +391,47 @@ int http_post_bundle(char *server_and_port, char *auth_token,
 			   body_header);
   bcopy(body_data,&request[total_len],body_length);
   total_len=total_len+body_length;
-  total_len+=snprintf(&request[total_len],8192+body_length-total_len,
+  total_len+=snprintf(&request[total_len],1024,
 	   "\r\n"
 	   "--%s--\r\n",
 	   boundary_string);
 
-  if (0) fprintf(stderr,"  content_length was calculated at %d bytes, total_len=%d\n",
-		 content_length,total_len);
-  int present_len=2+boundary_len+2+strlen(manifest_header);
-  if  (0) fprintf(stderr,
-		  "    subtotal_len=%d, difference+present=%d (should match content_length)\n",
-		  subtotal_len,total_len-subtotal_len+present_len);
-  
-  int sock=connect_to_port(server_name,server_port);
-  if (sock<0) return -1;
-
-  // Write request
-  write_all(sock,request,total_len);
+  r->message=(unsigned char *)request;
+  r->message_len=total_len;
+  return r;
+}
 
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response=-1;
-  char line[1024];
-  int len=0;
-  int empty_count=0;
-  set_nonblock(sock);
-  int r;
-  while(len<1024) {
-    r=read_nonblock(sock,&line[len],1);
-    if (r==1) {
-      if ((line[len]=='\n')||(line[len]=='\r')) {
-	if (len) empty_count=0; else empty_count++;
-	line[len+1]=0;
-	// if (len) printf("Line of response: %s\n",line);
-	if (sscanf(line,"HTTP/1.0 %d",&http_response)==1) {
-	  // got http response
-	  if (http_response<200 || http_response > 209)
-	    fprintf(stderr,"HTTP Error: %s\n     (URL: '%s')\n",line,path);
-	}
-	if (sscanf(line,"HTTP/1.1 %d",&http_response)==1) {
-	  // got http response
-	  if (http_response<200 || http_response > 209)
-	    fprintf(stderr,"HTTP Error: %s\n     (URL: '%s')\n",line,path);
-	}
-	len=0;
-	// Have we found end of headers?
-	if (empty_count==3) break;
-      } else len++;
-    } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
-      // If still in header, just quit on timeout
-      close(sock); 
-      return -1;
-    }
-  }
-  close(sock);
+int http_post_bundle(char *server_and_port, char *auth_token,
+		     char *path,
+		     unsigned char *manifest_data, int manifest_length,
+		     unsigned char *body_data, int body_length,
+		    int timeout_ms)
+{
+  struct http_request *r=http_post_bundle_request(server_and_port,auth_token,path,
+						  manifest_data,manifest_length,
+						  body_data,body_length,timeout_ms);
+  if (!r) return -1;
+  int http_response=http_request_wait(r);
+  if (http_response>0&&(http_response<200 || http_response > 209))
+    fprintf(stderr,"HTTP Error: %d\n     (URL: '%s')\n",http_response,path);
+  http_request_free(r);
   return http_response;  
 }
 
-int http_post_meshms_common(char *server_and_port, char *auth_token,
-			    char *message,char *sender,char *recipient,
-			    int timeout_ms,int meshmsP)
+// Build the request to post a MeshMS (or MeshMB, if !meshmsP) message, to be
+// run with http_request_start() or http_request_wait().
+struct http_request *http_post_meshms_request(char *server_and_port, char *auth_token,
+					      char *message,char *sender,char *recipient,
+					      int timeout_ms,int meshmsP)
 {
-  
   char server_name[1024];
   int server_port=-1;
 
   int message_length=strlen(message);
   
-  if (sscanf(server_and_port,"%[^:]:%d",server_name,&server_port)!=2) return -1;
+  if (sscanf(server_and_port,"%[^:]:%d",server_name,&server_port)!=2) return NULL;
 
-  long long timeout_time=gettime_ms()+timeout_ms;
-  
-  if (strlen(auth_token)>500) return -1;
+  if (strlen(auth_token)>500) return NULL;
   
   char request[8192+message_length];
   char authdigest[1024];
@@ -606,6 +471,8 @@ int http_post_meshms_common(char *server_and_port, char *auth_token,
 	   meshmsP?"/":"",
 	   meshmsP?recipient:"");
 	   
+  struct http_request *r=http_request_new(server_and_port,url,timeout_ms);
+  if (!r) return NULL;
   
   int total_len = snprintf(request,8192,
 			   "POST %s HTTP/1.1\r\n"
@@ -626,67 +493,32 @@ int http_post_meshms_common(char *server_and_port, char *auth_token,
 			   message_header);
   bcopy(message,&request[total_len],message_length);
 
-  int subtotal_len=total_len;
   total_len=total_len+message_length;
   total_len+=snprintf(&request[total_len],8192-total_len,
 	   "\r\n"
 	   "--%s--\r\n",
 	   boundary_string);
 
-  if (0) fprintf(stderr,"  content_length was calculated at %d bytes, total_len=%d\n",
-		 content_length,total_len);
-  int present_len=2+boundary_len+2+strlen(message_header);
-  if (0) fprintf(stderr,
-		 "    subtotal_len=%d, difference+present=%d (should match content_length)\n",
-		 subtotal_len,total_len-subtotal_len+present_len);
-
-  //  fprintf(stderr,"Request:\n%s\n",request);
-  
-  int sock=connect_to_port(server_name,server_port);
-  if (sock<0) return -1;
-
-  // Write request
-  write_all(sock,request,total_len);
+  r->message=malloc(total_len);
+  assert(r->message);
+  bcopy(request,r->message,total_len);
+  r->message_len=total_len;
+  return r;
+}
 
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response=-1;
-  char line[1024];
-  int len=0;
-  int empty_count=0;
-  set_nonblock(sock);
-  int r;
-  while(len<1024) {
-    r=read_nonblock(sock,&line[len],1);
-    if (r==1) {
-      if ((line[len]=='\n')||(line[len]=='\r')) {
-	if (len) empty_count=0; else empty_count++;
-	line[len+1]=0;
-	// if (len) printf("Line of response: %s\n",line);
-	if (sscanf(line,"HTTP/1.0 %d",&http_response)==1) {
-	  // got http response
-	  if (http_response<200 || http_response > 209)
-	    fprintf(stderr,"HTTP Error: %s\n     (URL: '%s')\n",line,url);
-	  
-	}
-	if (sscanf(line,"HTTP/1.1 %d",&http_response)==1) {
-	  // got http response
-	  if (http_response<200 || http_response > 209)
-	    fprintf(stderr,"HTTP Error: %s\n     (URL: '%s')\n",line,url);
-	}
-	len=0;
-	// Have we found end of headers?
-	if (empty_count==3) break;
-      } else len++;
-    } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
-      // If still in header, just quit on timeout
-      close(sock);
-      return -1;
-    }
-  }
-  close(sock);
+int http_post_meshms_common(char *server_and_port, char *auth_token,
+			    char *message,char *sender,char *recipient,
+			    int timeout_ms,int meshmsP)
+{
+  struct http_request *r=http_post_meshms_request(server_and_port,auth_token,
+						  message,sender,recipient,
+						  timeout_ms,meshmsP);
+  if (!r) return -1;
+  int http_response=http_request_wait(r);
+  if (http_response>0&&(http_response<200 || http_response > 209))
+    fprintf(stderr,"HTTP Error: %d\n     (URL: '%s')\n",http_response,r->path);
+  http_request_free(r);
   return http_response;
-  
 }
 
 int http_meshmb_post(char *server_and_port, char *auth_token,
@@ -721,7 +553,7 @@ int http_json_request(char *server_and_port, char *auth_token,
       return -1;
     }
 
-  long long timeout_time=gettime_ms()+timeout_ms;
+  long long timeout_time=monotime_ms()+timeout_ms;
   
   if (strlen(auth_token)>500)
     {
@@ -798,7 +630,7 @@ int http_json_request(char *server_and_port, char *auth_token,
 	if (empty_count==3) break;
       } else len++;
     } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
+    if (monotime_ms()>timeout_time) {
       // If still in header, just quit on timeout
       close(sock);
       fprintf(stderr,"Premature end of data while reading HTTP headers\n");
@@ -942,7 +774,7 @@ int http_get_async(char *server_and_port, char *auth_token,
 
   if (sscanf(server_and_port,"%[^:]:%d",server_name,&server_port)!=2) return -1;
 
-  long long timeout_time=gettime_ms()+timeout_ms;
+  long long timeout_time=monotime_ms()+timeout_ms;
   
   if (strlen(auth_token)>500) return -1;
   if (strlen(path)>500) return -1;
@@ -1001,7 +833,7 @@ int http_get_async(char *server_and_port, char *auth_token,
 	if (empty_count==3) break;
       } else len++;
     } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
+    if (monotime_ms()>timeout_time) {
       // If still in header, just quit on timeout
       close(sock);
       return -1;
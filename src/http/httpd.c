@@ -43,9 +43,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 #include "sync.h"
 #include "lbard.h"
+#include "serial.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 char *inreach_gateway_ip=NULL;
 time_t inreach_gateway_time=0;
@@ -79,17 +87,263 @@ int urldecode(char *s)
   
 }
 
-int http_process(struct sockaddr *cliaddr,
-		 char *servald_server,char *credential,
-		 char *my_sid_hex,
-		 int socket)
+/*
+  The httpd used to accept one connection each time around the main loop, and
+  then do a single blocking read() and hope that the whole request was in it,
+  before answering it (and, for /submitmessage, posting the message to
+  servald) there and then.  A few dashboards polling /status.json were enough
+  to hold up the radio.
+
+  Now each connection gets a slot here, and is read and written as poll() says
+  it can be, from the main loop (httpd_pollfds() and httpd_service()).  The
+  request is collected until the blank line that ends its headers, and the
+  response is built in memory and then sent as the socket will take it.  We
+  only ever speak HTTP/1.0, so the connection is closed once the response has
+  gone.
+*/
+#define HTTPD_MAX_REQUEST 8192
+// Drop connections that haven't sent or taken anything for this long
+#define HTTPD_IDLE_TIMEOUT_MS 10000
+
+struct httpd_connection {
+  int fd; // -1 if this slot is free
+  struct sockaddr_in addr;
+  long long last_activity;
+
+  char *request;
+  int request_len;
+
+  // Once we have the whole request, what we are sending back
+  int responding;
+  char *response;
+  int response_len;
+  int response_size;
+  int response_sent;
+};
+
+struct httpd_connection httpd_connections[HTTPD_MAX_CONNECTIONS];
+int httpd_connections_initialised=0;
+int httpd_connection_count=0;
+long long httpd_requests_served=0;
+
+static void httpd_connections_init(void)
+{
+  if (httpd_connections_initialised) return;
+  for(int i=0;i<HTTPD_MAX_CONNECTIONS;i++) {
+    bzero(&httpd_connections[i],sizeof(struct httpd_connection));
+    httpd_connections[i].fd=-1;
+  }
+  httpd_connections_initialised=1;
+}
+
+static void httpd_connection_close(struct httpd_connection *c)
+{
+  close(c->fd);
+  free(c->request);
+  free(c->response);
+  bzero(c,sizeof(struct httpd_connection));
+  c->fd=-1;
+  httpd_connection_count--;
+}
+
+// Add to the response we will send on this connection
+int http_respond(struct httpd_connection *c,char *data,int len)
 {
-  char buffer[8192];
+  if (c->response_len+len>c->response_size) {
+    int size=c->response_size?c->response_size:1024;
+    while(size<c->response_len+len) size*=2;
+    c->response=realloc(c->response,size);
+    assert(c->response);
+    c->response_size=size;
+  }
+  bcopy(data,&c->response[c->response_len],len);
+  c->response_len+=len;
+  return 0;
+}
+
+// Take as many new connections as we have room for
+static int httpd_accept(int listen_socket)
+{
+  int count=0;
+  while(httpd_connection_count<HTTPD_MAX_CONNECTIONS) {
+    struct sockaddr_in cliaddr;
+    socklen_t addrlen=sizeof(cliaddr);
+    int s=accept(listen_socket,(struct sockaddr *)&cliaddr,&addrlen);
+    if (s==-1) break;
+    set_nonblock(s);
+    struct httpd_connection *c=NULL;
+    for(int i=0;i<HTTPD_MAX_CONNECTIONS;i++)
+      if (httpd_connections[i].fd==-1) { c=&httpd_connections[i]; break; }
+    assert(c);
+    c->fd=s;
+    c->addr=cliaddr;
+    c->last_activity=now_ms;
+    c->request=malloc(HTTPD_MAX_REQUEST+1);
+    assert(c->request);
+    c->request[0]=0;
+    httpd_connection_count++;
+    count++;
+    LOG_DEBUG(LOG_HTTP,"HTTP connection from %s (%d open)",
+	      inet_ntoa(cliaddr.sin_addr),httpd_connection_count);
+  }
+  return count;
+}
+
+// Have we got as far as the blank line at the end of the headers?
+static int httpd_request_complete(struct httpd_connection *c)
+{
+  return strstr(c->request,"\r\n\r\n")||strstr(c->request,"\n\n");
+}
+
+static void httpd_connection_read(struct httpd_connection *c)
+{
+  int r=recv(c->fd,&c->request[c->request_len],
+	     HTTPD_MAX_REQUEST-c->request_len,0);
+  if (r==0||(r<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK&&errno!=EINTR)) {
+    // They have gone away before telling us what they wanted
+    httpd_connection_close(c);
+    return;
+  }
+  if (r<0) return;
+  c->request_len+=r;
+  c->request[c->request_len]=0;
+  c->last_activity=now_ms;
+  if (httpd_request_complete(c)) {
+    c->responding=1;
+    http_process(c);
+    httpd_requests_served++;
+  } else if (c->request_len>=HTTPD_MAX_REQUEST) {
+    char *m="HTTP/1.0 400 Request too long\nServer: Serval LBARD\n\n";
+    c->responding=1;
+    http_respond(c,m,strlen(m));
+  }
+}
+
+static void httpd_connection_write(struct httpd_connection *c)
+{
+  int r=send(c->fd,&c->response[c->response_sent],
+	     c->response_len-c->response_sent,MSG_NOSIGNAL);
+  if (r<0) {
+    if (errno==EAGAIN||errno==EWOULDBLOCK||errno==EINTR) return;
+    httpd_connection_close(c);
+    return;
+  }
+  c->response_sent+=r;
+  c->last_activity=now_ms;
+  if (c->response_sent>=c->response_len) httpd_connection_close(c);
+}
+
+// Add the listening socket (if we can take more connections), and those of our
+// connections, to the set the main loop polls.
+int httpd_pollfds(int listen_socket,struct pollfd *fds,int max)
+{
+  int n=0;
+  httpd_connections_init();
+  if ((listen_socket!=-1)&&(httpd_connection_count<HTTPD_MAX_CONNECTIONS)&&(n<max)) {
+    fds[n].fd=listen_socket;
+    fds[n].events=POLLIN;
+    fds[n].revents=0;
+    n++;
+  }
+  for(int i=0;i<HTTPD_MAX_CONNECTIONS&&n<max;i++) {
+    struct httpd_connection *c=&httpd_connections[i];
+    if (c->fd==-1) continue;
+    fds[n].fd=c->fd;
+    fds[n].events=c->responding?POLLOUT:POLLIN;
+    fds[n].revents=0;
+    n++;
+  }
+  return n;
+}
+
+// Accept, read and write whatever poll() said we could, given the same fds
+// that httpd_pollfds() filled in.
+int httpd_service(int listen_socket,struct pollfd *fds,int nfds)
+{
+  httpd_connections_init();
+  for(int n=0;n<nfds;n++) {
+    if (!fds[n].revents) continue;
+    if (fds[n].fd==listen_socket) {
+      httpd_accept(listen_socket);
+      continue;
+    }
+    for(int i=0;i<HTTPD_MAX_CONNECTIONS;i++) {
+      struct httpd_connection *c=&httpd_connections[i];
+      if (c->fd!=fds[n].fd) continue;
+      if (!c->responding) httpd_connection_read(c);
+      // (the response is often ready straight away, so try sending it now)
+      if ((c->fd!=-1)&&c->responding) httpd_connection_write(c);
+      break;
+    }
+  }
+
+  for(int i=0;i<HTTPD_MAX_CONNECTIONS;i++) {
+    struct httpd_connection *c=&httpd_connections[i];
+    if ((c->fd!=-1)&&((now_ms-c->last_activity)>HTTPD_IDLE_TIMEOUT_MS)) {
+      LOG_INFO(LOG_HTTP,"Closing idle HTTP connection from %s",
+	       inet_ntoa(c->addr.sin_addr));
+      httpd_connection_close(c);
+    }
+  }
+  return httpd_connection_count;
+}
+
+static void http_helpdesk_message_done(struct http_request *r)
+{
+  if ((r->response_code<200)||(r->response_code>209))
+    LOG_WARN(LOG_HTTP,"Could not post help desk message (HTTP %d, %s)",
+	     r->response_code,r->path);
+  else
+    LOG_INFO(LOG_HTTP,"Posted help desk message (%s)",r->path);
+}
+
+// Queue the message from message_form.html to each help desk SID.  Returns the
+// number of posts queued.
+int http_queue_helpdesk_message(char *location,char *message)
+{
+  // First: compose the string safely.  It might contain UTF-8 text, so we should
+  // try to be nice about that.
+  char combined[8192+8192+1024];
+  snprintf(combined,sizeof(combined),
+	   "Message from message_form.html: Location = %s,"
+	   " Message as follows: %s",
+	   location,message);
+
+  FILE *f=fopen("/dos/helpdesk.sid","r");
+  if (!f) {
+    LOG_WARN(LOG_HTTP,"No help desk SIDs in /dos/helpdesk.sid");
+    return -1;
+  }
+  int queued=0;
+  char recipient[1024];
+  recipient[0]=0; fgets(recipient,1024,f);
+  while(recipient[0]) {
+    // Trim new lines / carriage returns from end of lines.
+    while(recipient[0]&&(recipient[strlen(recipient)-1]<' '))
+      recipient[strlen(recipient)-1]=0;
+
+    if (recipient[0]) {
+      struct http_request *r=http_post_meshms_request(servald_server,credential,
+						      combined,my_sid_hex,recipient,
+						      5000,1);
+      if (r&&!http_request_start(r,http_helpdesk_message_done,NULL)) queued++;
+    }
+
+    recipient[0]=0; fgets(recipient,1024,f);
+  }
+  fclose(f);
+  return queued;
+}
+
+// Called once we have the whole of the request in c->request.  The response
+// is queued with http_respond(), and sent as the socket allows.
+int http_process(struct httpd_connection *c)
+{
+  char *buffer=c->request;
   char uri[8192];
   int version_major, version_minor;
   int offset;
-  int request_len = read(socket,buffer,8192);
-  if (debug_http) printf("Read %d bytes of request.\n",request_len);
+  if (debug_http) printf("Read %d bytes of request.\n",c->request_len);
   int r=sscanf(buffer,"GET %[^ ] HTTP/%d.%d\n%n",
 	       uri,&version_major,&version_minor,&offset);
   if (debug_http) {
@@ -112,60 +366,22 @@ int http_process(struct sockaddr *cliaddr,
 	  printf("    message=[%s]\n",message);
 	}
 	
-	char *m="HTTP/1.0 200 OK\nServer: Serval LBARD\n\nYour message has been submitted.";
-	
-	// Try to actually send meshms
-	// First: compose the string safely.  It might contain UTF-8 text, so we should
-	// try to be nice about that.
-	{
-	  unsigned char combined[8192+8192+1024];
-	  snprintf((char *)combined,sizeof(combined),
-		   "Message from message_form.html: Location = %s,"
-		   " Message as follows: %s",
-		   location,message);
-	  
-	  // XXX - Read recipient
-	  {
-	    int successful=0;
-	    int failed=0;
-	    char recipient[1024];
-	    
-	    FILE *f=fopen("/dos/helpdesk.sid","r");
-	    recipient[0]=0; fgets(recipient,1024,f);
-	    while(recipient[0]) {
-	      // Trim new lines / carriage returns from end of lines.
-	      while(recipient[0]&&(recipient[strlen(recipient)-1]<' '))
-		recipient[strlen(recipient)-1]=0;
-	      
-	      int res = http_post_meshms(servald_server,credential,
-					 (char *)combined,
-					 my_sid_hex,recipient,5000);
-	      
-	      if (res!=200) {
-		m="HTTP/1.0 500 ERROR\nServer: Serval LBARD\n\nYour message could not be submitted.";
-		failed++;
-	      } else successful++;
-	      
-	      recipient[0]=0; fgets(recipient,1024,f);
-	    }
-	    fclose(f);
-	  }
-	  
-	}
-	
-	write_all(socket,m,strlen(m));
-	close(socket);
+	// Posting to servald could take a while, so it is queued, and we don't
+	// wait to find out how it went.
+	char *m="HTTP/1.0 202 Accepted\nServer: Serval LBARD\n\nYour message has been submitted.";
+	if (http_queue_helpdesk_message(location,message)<=0)
+	  m="HTTP/1.0 500 ERROR\nServer: Serval LBARD\n\nYour message could not be submitted.";
+	http_respond(c,m,strlen(m));
 	return 0;      
       } else if (!strcasecmp(uri,"/inreachgateway/register")) {
 	if (inreach_gateway_ip) free(inreach_gateway_ip);
 	inreach_gateway_ip=NULL;
 	inreach_gateway_ip
-	  = strdup(inet_ntoa(((struct sockaddr_in *)cliaddr)->sin_addr));
+	  = strdup(inet_ntoa(c->addr.sin_addr));
 	inreach_gateway_time=time(0);
 	char m[1024];
 	snprintf(m,1024,"HTTP/1.0 201 OK\nServer: Serval LBARD\n\n");
-	write_all(socket,m,strlen(m));
-	close(socket);
+	http_respond(c,m,strlen(m));
 	return 0;	
       } else if (!strcasecmp(uri,"/inreachgateway/query")) {
 	char m[1024];
@@ -175,28 +391,23 @@ int http_process(struct sockaddr *cliaddr,
 		   (int)strlen(inreach_gateway_ip),inreach_gateway_ip);
 	else
 	  snprintf(m,1024,"HTTP/1.0 204 OK\nServer: Serval LBARD\n\n");
-	write_all(socket,m,strlen(m));
-	close(socket);
+	http_respond(c,m,strlen(m));
 	return 0;	
       } else if (!strcasecmp(uri,"/")) {
 	// Report on current peer status
-	http_report_network_status(socket,0);
-	close(socket);
+	http_report_network_status(c,0);
 	return 0;	
       } else if (!strcasecmp(uri,"/n")) {
 	// Report on current peer status
-	http_report_network_status(socket,1);
-	close(socket);
+	http_report_network_status(c,1);
 	return 0;	
       } else if (!strcasecmp(uri,"/b")) {
 	// Report on current peer status
-	http_report_network_status(socket,2);
-	close(socket);
+	http_report_network_status(c,2);
 	return 0;	
       } else if (!strcasecmp(uri,"/bn")) {
 	// Report on current peer status
-	http_report_network_status(socket,3);
-	close(socket);
+	http_report_network_status(c,3);
 	return 0;	
       } else if (!strcasecmp(uri,"/avacado/testmode1")) {
 	system("/sbin/ifconfig adhoc0 down");
@@ -210,8 +421,7 @@ int http_process(struct sockaddr *cliaddr,
 		 "\n"
 		 "Test Mode #1 selected\n"
 		 );
-	write_all(socket,m,strlen(m));
-	close(socket);
+	http_respond(c,m,strlen(m));
 	return 0;	
       } else if (!strncasecmp(uri,"/avacado/renamessid/",20)) {
 	char cmd[1024];
@@ -237,35 +447,36 @@ int http_process(struct sockaddr *cliaddr,
 		 "\n"
 		 "SSID Renamed\n"
 		 );
-	write_all(socket,m,strlen(m));
-	close(socket);
+	http_respond(c,m,strlen(m));
+	return 0;	
+      } else if (!strcasecmp(uri,"/metrics")) {
+	// Counters for scraping
+	http_report_metrics(c);
 	return 0;	
       } else if (!strcasecmp(uri,"/status.json")) {
 	// Report on current peer status
-	http_report_network_status_json(socket);
-	close(socket);
+	http_report_network_status_json(c);
 	return 0;	
       }
     }
   char *m="HTTP/1.0 400 Couldn't parse message\nServer: Serval LBARD\n\n";
-  write_all(socket,m,strlen(m));
-  close(socket);
+  http_respond(c,m,strlen(m));
   return 0;
 }
 
-int http_send_file(int socket,char *filename,char *mime_type)
+int http_send_file(struct httpd_connection *c,char *filename,char *mime_type)
 {
   char m[1024];
   FILE *f=fopen(filename,"r");
   if (!f) {
     snprintf(m,1024,"HTTP/1.0 404 File not found\nServer: Serval LBARD\n\nCould not read file '%s'\n",filename);
-    write_all(socket,m,strlen(m));
+    http_respond(c,m,strlen(m));
     return -1;
   }
   struct stat s;
   if (fstat(fileno(f),&s)) {
     snprintf(m,1024,"HTTP/1.0 404 File not found\nServer: Serval LBARD\n\nCould not read file '%s'\n",filename);
-    write_all(socket,m,strlen(m));
+    http_respond(c,m,strlen(m));
     return -1;
   }
 
@@ -280,15 +491,32 @@ int http_send_file(int socket,char *filename,char *mime_type)
 	   "Content-length: %d\n\n",
 	   mime_type,
 	   len);
-  write_all(socket,m,strlen(m));
+  http_respond(c,m,strlen(m));
 
   char buffer[1024+1];
   int count=fread(buffer,1,1024,f);
   while(count>0) {
-    write_all(socket,buffer,count);
+    http_respond(c,buffer,count);
     count=fread(buffer,1,1024,f);
   }
   fclose(f);
   return 0;
   
 }
+
+int http_send_buffer(struct httpd_connection *c,char *data,int len,char *mime_type)
+{
+  char m[1024];
+  snprintf(m,1024,
+	   "HTTP/1.0 200 OK\n"
+	   "Server: Serval LBARD\n"
+	   "Content-Type: %s\n"
+	   "Access-Control-Allow-Origin: *\n"
+	   "Access-Control-Allow-Methods: GET\n"
+	   "Content-length: %d\n\n",
+	   mime_type,
+	   len);
+  http_respond(c,m,strlen(m));
+  http_respond(c,data,len);
+  return 0;
+}
@@ -0,0 +1,144 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015 Serval Project Inc.
+
+Leveled logging (see log.h).
+
+Formatting the timestamp with localtime() and writing every line to stderr was
+costing us more than processing the packets the lines were about, so instead
+each line is formatted straight into a slot of a ring buffer, with just the
+time in ms.  The timestamps are only turned into something readable when the
+ring is flushed, or for the few messages that are echoed as they happen.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "log.h"
+
+long long gettime_ms(void);
+extern char *my_sid_hex;
+
+#define LOG_RING_ENTRIES 512
+#define LOG_LINE_MAX 200
+
+struct log_entry {
+  long long time_ms;
+  unsigned char subsystem;
+  unsigned char level;
+  char text[LOG_LINE_MAX];
+};
+
+char *log_subsystem_names[LOG_SUBSYSTEMS]={
+  "general","pieces","bitmap","sync","radio","bundles","http"
+};
+char *log_level_names[]={"off","error","warn","info","debug"};
+
+unsigned char log_levels[LOG_SUBSYSTEMS]={
+  LOGLEVEL_INFO,LOGLEVEL_INFO,LOGLEVEL_INFO,LOGLEVEL_INFO,
+  LOGLEVEL_INFO,LOGLEVEL_INFO,LOGLEVEL_INFO
+};
+int log_echo_level=LOGLEVEL_WARN;
+volatile int log_flush_requested=0;
+
+struct log_entry log_ring[LOG_RING_ENTRIES];
+// Total number of messages logged; the oldest one still in the ring is
+// log_ring_count-LOG_RING_ENTRIES, if more than that have been logged.
+unsigned long long log_ring_count=0;
+unsigned long long log_ring_flushed=0;
+
+// The same format as timestamp_str(), but for any time
+static char *log_time_str(long long time_ms,char *out,int len)
+{
+  struct tm tm;
+  time_t t=time_ms/1000;
+  localtime_r(&t,&tm);
+  snprintf(out,len,"[%02d:%02d.%02d.%03d %c%c%c%c*]",
+	   tm.tm_hour,tm.tm_min,tm.tm_sec,(int)(time_ms%1000),
+	   my_sid_hex?my_sid_hex[0]:'?',my_sid_hex?my_sid_hex[1]:'?',
+	   my_sid_hex?my_sid_hex[2]:'?',my_sid_hex?my_sid_hex[3]:'?');
+  return out;
+}
+
+static void log_write_entry(FILE *f,struct log_entry *e)
+{
+  char when[64];
+  fprintf(f,"%s %s/%s: %s\n",log_time_str(e->time_ms,when,sizeof(when)),
+	  log_subsystem_names[e->subsystem],log_level_names[e->level],e->text);
+}
+
+void log_message(int subsystem,int level,const char *fmt,...)
+{
+  struct log_entry *e=&log_ring[log_ring_count%LOG_RING_ENTRIES];
+  e->time_ms=gettime_ms();
+  e->subsystem=subsystem;
+  e->level=level;
+
+  va_list ap;
+  va_start(ap,fmt);
+  int len=vsnprintf(e->text,LOG_LINE_MAX,fmt,ap);
+  va_end(ap);
+  // Callers were all printf()s, so many still end with a new line
+  if (len>=LOG_LINE_MAX) len=LOG_LINE_MAX-1;
+  while(len>0&&e->text[len-1]=='\n') e->text[--len]=0;
+
+  log_ring_count++;
+  if (level<=log_echo_level) log_write_entry(stderr,e);
+}
+
+// Write out everything logged since the last flush that is still in the ring
+int log_flush(FILE *f)
+{
+  unsigned long long first=log_ring_flushed;
+  if (log_ring_count-first>LOG_RING_ENTRIES) {
+    fprintf(f,"(%llu log messages were lost before this flush)\n",
+	    log_ring_count-first-LOG_RING_ENTRIES);
+    first=log_ring_count-LOG_RING_ENTRIES;
+  }
+  for(unsigned long long i=first;i<log_ring_count;i++)
+    log_write_entry(f,&log_ring[i%LOG_RING_ENTRIES]);
+  fflush(f);
+  log_ring_flushed=log_ring_count;
+  log_flush_requested=0;
+  return log_ring_count-first;
+}
+
+// Returns the level with this name (or number), or -1 if there isn't one
+int log_parse_level(char *name)
+{
+  for(int i=0;i<=LOGLEVEL_DEBUG;i++)
+    if (!strcasecmp(name,log_level_names[i])) return i;
+  if (name[0]>='0'&&name[0]<='9'&&atoi(name)<=LOGLEVEL_DEBUG) return atoi(name);
+  return -1;
+}
+
+// Set the level of a subsystem by name, or of all of them
+int log_set_level(char *subsystem,int level)
+{
+  if ((level<LOGLEVEL_OFF)||(level>LOGLEVEL_DEBUG)) return -1;
+  int found=0;
+  for(int i=0;i<LOG_SUBSYSTEMS;i++)
+    if ((!strcasecmp(subsystem,"all"))||(!strcasecmp(subsystem,log_subsystem_names[i]))) {
+      log_levels[i]=level;
+      found++;
+    }
+  return found?0:-1;
+}
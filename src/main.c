@@ -41,6 +41,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <fcntl.h>
 #include <time.h>
 #include <sys/time.h>
+#include <poll.h>
 
 #include "sync.h"
 #include "lbard.h"
@@ -102,9 +103,6 @@ char *prefix="";
 
 char *token=NULL;
 
-time_t last_summary_time=0;
-time_t last_status_time=0;
-
 int monitor_mode=0;
 
 struct sync_state *sync_state=NULL;
@@ -147,14 +145,162 @@ long long start_time=0;
 void crash_handler(int signal)
 {
   fprintf(stderr,"SIGABORT intercepted. Exiting cleanly.\n");
+  // Whatever we logged just before is probably what will explain it
+  log_flush(stderr);
   exit(0);
 }
 
+void log_flush_handler(int signal)
+{
+  // Don't write it out here, but in the main loop
+  log_flush_requested=1;
+}
+
 unsigned int option_flags=0;
 
+/*
+  The main loop sleeps in poll() on the serial port and sockets, and everything
+  that happens periodically hangs off a timer (see timers.c).  The radio drivers'
+  service loops and the rhizome database loader still want to be called regularly,
+  so we never sleep for more than SERVICE_INTERVAL_MS at a time.
+*/
+#define SERVICE_INTERVAL_MS 100
+// How soon to try again if the radio isn't ready when we want to send
+#define RADIO_NOT_READY_RETRY_MS 100
+
+int serialfd=-1;
+int timesocket=-1;
+int httpsocket=-1;
+
+int tx_timer=-1;
+int status_timer=-1;
+int progress_timer=-1;
+int instance_timer=-1;
+
+// Set when we wanted to send, but the radio wasn't ready
+int tx_waiting_for_radio=0;
+
+void schedule_next_message(void)
+{
+  timer_schedule(tx_timer,last_message_update_time+message_update_interval);
+}
+
+void send_time_announcement(void)
+{
+  // Occassionally announce our time
+  // T + (our stratum) + (64 bit seconds since 1970) +
+  // + (24 bit microseconds)
+  // = 1+1+8+3 = 13 bytes
+  unsigned char msg_out[1024];
+  int offset=0;
+  append_timestamp(msg_out,&offset);
+	    
+  // Now broadcast on every interface to port 0x5401
+  // Oh that's right, UDP sockets don't have an easy way to do that.
+  // We could interrogate the OS to ask about all interfaces, but we
+  // can instead get away with having a single simple broadcast address
+  // supplied as part of the timeserver command line argument.
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr)); 
+  addr.sin_family = AF_INET; 
+  addr.sin_port = htons(0x5401);
+  int i;
+  for(i=0;time_broadcast_addrs[i];i++) {
+    addr.sin_addr.s_addr = inet_addr(time_broadcast_addrs[i]);
+    errno=0;
+    sendto(timesocket,msg_out,offset,
+	   MSG_DONTROUTE|MSG_DONTWAIT
+#ifdef MSG_NOSIGNAL
+	   |MSG_NOSIGNAL
+#endif	       
+	   ,(const struct sockaddr *)&addr,sizeof(addr));
+  }
+  // printf("--- Sent %d time announcement packets.\n",i);
+}
+
+void receive_time_packets(void)
+{
+  unsigned char msg[1024];
+  int r;
+  while((r=recvfrom(timesocket,msg,1024,0,NULL,0))>=0) {
+    if (r==(1+1+8+3)) {
+      // see rxmessages.c for more explanation
+      int offset=1;
+      int stratum=msg[offset++];
+      struct timeval tv;
+      bzero(&tv,sizeof (struct timeval));
+      for(int i=0;i<8;i++) tv.tv_sec|=msg[offset++]<<(i*8);
+      for(int i=0;i<3;i++) tv.tv_usec|=msg[offset++]<<(i*8);
+      // ethernet delay is typically 0.1 - 5ms, so assume 5ms
+      tv.tv_usec+=5000;
+      saw_timestamp("          UDP",stratum,&tv);
+    }
+  }
+}
+
+// Called when it is time to send our next message
+void tx_timer_expired(void)
+{
+  unsigned char msg_out[LINK_MTU];
+
+  if (!time_server) {
+    // Decay my time stratum slightly
+    if (my_time_stratum<0xffff)
+      my_time_stratum++;
+  } else my_time_stratum=0x0100;
+  // Send time packet
+  if (udp_time&&(timesocket!=-1)) send_time_announcement();
+
+  if ((!monitor_mode)&&(radio_ready())) {
+    update_my_message(serialfd,
+		      my_sid,my_sid_hex,
+		      LINK_MTU,msg_out,
+		      servald_server,credential);
+	
+    // Vary next update time by upto 250ms, to prevent radios getting lock-stepped.
+    if (message_update_interval_randomness)
+      last_message_update_time=now_ms+(random()%message_update_interval_randomness);
+    else
+      last_message_update_time=now_ms;
+    tx_waiting_for_radio=0;
+    schedule_next_message();
+  } else {
+    tx_waiting_for_radio=1;
+    timer_schedule(tx_timer,now_ms+RADIO_NOT_READY_RETRY_MS);
+  }
+}
+
+void status_timer_expired(void)
+{
+  // Roll over the peer RX stats shown on the status pages (the pages
+  // themselves are rendered when the httpd is asked for them)
+  status_dump();
+  timer_schedule(status_timer,now_ms+3000);
+}
+
+void progress_timer_expired(void)
+{
+  show_progress(stderr,0);
+  timer_schedule(progress_timer,now_ms+1000);
+}
+
+void instance_timer_expired(void)
+{
+  // Refresh our instance ID every four minutes, so that any bundle list sync bugs
+  // can only block transmission for a few minutes.
+  my_instance_id=0;
+  while(my_instance_id==0)
+    urandombytes((unsigned char *)&my_instance_id,sizeof(unsigned int));
+  last_instance_time=time(0);
+  timer_schedule(instance_timer,now_ms+240000);
+}
+
+// The test programs in src/utils bring their own main()
+#ifndef LBARD_NO_MAIN
 int main(int argc, char **argv)
 {  
   start_time = gettime_ms();
+  clock_update();
 
   /* Catch SIGABORT, for compatibility with test framework (expects return code 0
      on SIGSTOP */
@@ -167,6 +313,11 @@ int main(int argc, char **argv)
   sigemptyset(&sig.sa_mask); // Don't block any signals during handler
   sig.sa_flags = SA_NODEFER | SA_RESETHAND; // So the signal handler can kill the pro
   sigaction(SIGSTOP, &sig, NULL);
+  // kill -USR2 writes out the log ring buffer
+  sig.sa_handler = log_flush_handler;
+  sigemptyset(&sig.sa_mask);
+  sig.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &sig, NULL);
 
   
   // Setup random seed, so that multiple LBARD's started at the same time
@@ -197,6 +348,9 @@ int main(int argc, char **argv)
   if ((argc>1)&&!strcasecmp(argv[1],"meshmb")) {
     return(meshmb_parse_command(argc,argv));
   }
+  if ((argc>1)&&!strcasecmp(argv[1],"benchmark")) {
+    return(benchmark_parse_command(argc,argv));
+  }
 
   fprintf(stderr,"Version commit:%s branch:%s [MD5: %s] @ %s\n",
 	GIT_VERSION_STRING,GIT_BRANCH,VERSION_STRING,BUILD_DATE);
@@ -238,6 +392,7 @@ int main(int argc, char **argv)
       fprintf(stderr,"usage: lbard monitor <serial port>\n");
       fprintf(stderr,"usage: lbard meshms <meshms command>\n");
       fprintf(stderr,"usage: lbard meshmb <meshmb command>\n");
+      fprintf(stderr,"usage: lbard benchmark <benchmark> [count]\n");
       fprintf(stderr,"usage: energysamplecalibrate <args>\n");
       fprintf(stderr,"usage: energysamplemaster <broadcast addr> <backchannel addr> <gapusec=n,holdusec=n,packetbytes=n>\n");
       fprintf(stderr,"usage: energysample <port> <interface> <broadcast address>\n");
@@ -297,7 +452,6 @@ int main(int argc, char **argv)
   if (argc>2) credential=argv[2];
   if (argc>1) servald_server=argv[1];
   
-  int serialfd=-1;
   serialfd = open(serial_port,O_RDWR);
   if (serialfd<0) {
     perror("Opening serial port in main");
@@ -372,6 +526,45 @@ int main(int argc, char **argv)
 		 bundlelog_filename);
       } else if (!strcasecmp("nopriority",argv[n])) debug_noprioritisation=1;
       else if (!strcasecmp("nohttpd",argv[n])) http_server=0;
+      else if (!strncasecmp("virtualclock=",argv[n],13)) {
+	// Follow fakecsmaradio's clock, so that simulations can run faster than
+	// real time
+	if (virtual_clock_attach(&argv[n][13],serial_port)) exit(-1);
+      }
+      else if (!strncasecmp("syncstride=",argv[n],11)) {
+	// Use a wider sync tree, if all of our peers can
+	if (sync_set_step_bits(sync_state,atoi(&argv[n][11]))) {
+	  fprintf(stderr,"Sync tree stride must be 1, 2, 4 or 8 bits\n");
+	  exit(-1);
+	}
+      }
+      else if (!strncasecmp("loglevel=",argv[n],9)) {
+	// loglevel=<subsystem|all>:<off|error|warn|info|debug>
+	char subsystem[32];
+	char level[32];
+	if ((sscanf(&argv[n][9],"%31[^:]:%31s",subsystem,level)!=2)
+	    ||log_set_level(subsystem,log_parse_level(level))) {
+	  fprintf(stderr,"Could not set log level from '%s'\n",&argv[n][9]);
+	  exit(-1);
+	}
+      }
+      else if (!strncasecmp("logecho=",argv[n],8)) {
+	// Messages at this level or more severe also go straight to stderr
+	log_echo_level=log_parse_level(&argv[n][8]);
+	if (log_echo_level<0) {
+	  fprintf(stderr,"Unknown log level '%s'\n",&argv[n][8]);
+	  exit(-1);
+	}
+      }
+      else if (!strncasecmp("statusfiles=",argv[n],12)) {
+	// Also write the status pages to /tmp/lbard_status*.html this often,
+	// for anything that still reads them from there
+	status_file_interval=atoi(&argv[n][12]);
+      }
+      else if (!strncasecmp("bundlecache=",argv[n],12))
+	bundle_cache_max_entries=atoi(&argv[n][12]);
+      else if (!strncasecmp("bundlecachebytes=",argv[n],17))
+	bundle_cache_max_bytes=strtoll(&argv[n][17],NULL,10);
       else if (!strncasecmp("txpower=",argv[n],8)) {
 	txpower=atoi(&argv[n][8]);
 	if (txpower<1||txpower>90) {
@@ -420,9 +613,18 @@ int main(int argc, char **argv)
     n++;
   }
 
+  // The old debug options turn the matching subsystem all the way up
+  if (debug_pieces) log_set_level("pieces",LOGLEVEL_DEBUG);
+  if (debug_bitmap) log_set_level("bitmap",LOGLEVEL_DEBUG);
+  if (debug_sync) log_set_level("sync",LOGLEVEL_DEBUG);
+  if (debug_radio) log_set_level("radio",LOGLEVEL_DEBUG);
+  if (debug_bundles) log_set_level("bundles",LOGLEVEL_DEBUG);
+  if (debug_http) log_set_level("http",LOGLEVEL_DEBUG);
+  // In monitor mode, the whole point is to watch what is going on
+  if (monitor_mode) log_echo_level=LOGLEVEL_DEBUG;
+
   // Open UDP socket to listen for time updates from other LBARD instances
   // (poor man's NTP for LBARD nodes that lack internal clocks)
-  int timesocket=-1;
   if (udp_time) {
     timesocket=socket(AF_INET, SOCK_DGRAM, 0);
     if (timesocket!=-1) {
@@ -447,7 +649,6 @@ int main(int argc, char **argv)
   // HTTP Server socket for accepting MeshMS message submission via web form
   // (Used for sending anonymous messages to a help desk for a mesh network, and
   //  for providing simple web-based diagnostics).
-  int httpsocket=-1;
   if (http_server) {
     httpsocket=socket(AF_INET, SOCK_STREAM, 0);
     if (httpsocket!=-1) {
@@ -460,27 +661,80 @@ int main(int argc, char **argv)
       setsockopt(httpsocket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
       bind(httpsocket, (struct sockaddr *) &addr, sizeof(addr));
       set_nonblock(httpsocket);
-      listen(httpsocket,10);
+      listen(httpsocket,HTTPD_MAX_CONNECTIONS);
     }
     
   }
 
   char token[1024]="";
+
+  tx_timer=timer_register("tx",tx_timer_expired);
+  status_timer=timer_register("status",status_timer_expired);
+  progress_timer=timer_register("progress",progress_timer_expired);
+  instance_timer=timer_register("instance",instance_timer_expired);
+  schedule_next_message();
+  timer_schedule(status_timer,now_ms+3000);
+  timer_schedule(progress_timer,now_ms+1000);
+  timer_schedule(instance_timer,now_ms+240000);
+
+  // If the serial port hangs up (e.g., the fake radio has gone away), then poll()
+  // would keep waking us for it, so we just try reading it each time around.
+  int serial_eof=0;
   
   while(1) {
+#define MAX_POLLFDS (16+HTTPD_MAX_CONNECTIONS)
+    struct pollfd fds[MAX_POLLFDS];
+    int nfds=0;
+    int serial_slot=-1,time_slot=-1;
+
+    if (!serial_eof) {
+      serial_slot=nfds;
+      fds[nfds].fd=serialfd; fds[nfds++].events=POLLIN;
+    }
+    if (udp_time&&(timesocket!=-1)) {
+      time_slot=nfds;
+      fds[nfds].fd=timesocket; fds[nfds++].events=POLLIN;
+    }
+    // Wake up as soon as servald has more of the bundle list for us
+    if (load_rhizome_db_socket>=0) {
+      fds[nfds].fd=load_rhizome_db_socket; fds[nfds++].events=POLLIN;
+    }
+    // ... and for any requests we have waiting on servald
+    nfds+=http_client_pollfds(&fds[nfds],16-nfds);
+    // ... and for the dashboards and the like talking to our httpd
+    int httpd_first=nfds;
+    int httpd_nfds=httpd_pollfds(httpsocket,&fds[nfds],MAX_POLLFDS-nfds);
+    nfds+=httpd_nfds;
+
+    // Sleep until there is input, or the next timer is due
+    int timeout=SERVICE_INTERVAL_MS;
+    long long next_due=timer_next_due();
+    if (next_due>=0) {
+      long long until=next_due-monotime_ms();
+      if (until<0) until=0;
+      if (until<timeout) timeout=until;
+    }
+    for(int i=0;i<nfds;i++) fds[i].revents=0;
+    if (timers_poll(fds,nfds,timeout)<0) {
+      if (errno!=EINTR) perror("poll");
+    }
+    clock_update();
+    if (log_flush_requested) log_flush(stderr);
+
+    if ((serial_slot==-1)||(fds[serial_slot].revents)) {
+      // (radio_read_bytes() returns 0 if there was simply nothing to read)
+      int r=radio_read_bytes(serialfd,monitor_mode);
+      if (r>0) serial_eof=0;
+      else if ((r<0)||((serial_slot!=-1)
+		       &&(fds[serial_slot].revents&(POLLHUP|POLLERR|POLLNVAL))))
+	serial_eof=1;
+    }
+    if ((time_slot!=-1)&&(fds[time_slot].revents&POLLIN))
+      receive_time_packets();
+    httpd_service(httpsocket,&fds[httpd_first],httpd_nfds);
 
-    unsigned char msg_out[LINK_MTU];
+    http_client_service();
 
-    // Refresh our instance ID every four minutes, so that any bundle list sync bugs
-    // can only block transmission for a few minutes.
-    if ((time(0)-last_instance_time)>240) {
-      my_instance_id=0;
-      while(my_instance_id==0)
-	urandombytes((unsigned char *)&my_instance_id,sizeof(unsigned int));
-      last_instance_time=time(0);
-    }
-    
-    radio_read_bytes(serialfd,monitor_mode);
     load_rhizome_db_async(servald_server,
 			  credential, token);
 
@@ -499,127 +753,17 @@ int main(int argc, char **argv)
       exit(-1);
     }
 
-    // Deal gracefully with clocks that run backwards from time to time.
-    if (last_message_update_time>gettime_ms())
-      last_message_update_time=gettime_ms();
-    
-    if ((gettime_ms()-last_message_update_time)>=message_update_interval) {
-
-      if (!time_server) {
-	// Decay my time stratum slightly
-	if (my_time_stratum<0xffff)
-	  my_time_stratum++;
-      } else my_time_stratum=0x0100;
-      // Send time packet
-      if (udp_time&&(timesocket!=-1))
-	{
-	  {
-	    // Occassionally announce our time
-	    // T + (our stratum) + (64 bit seconds since 1970) +
-	    // + (24 bit microseconds)
-	    // = 1+1+8+3 = 13 bytes
-	    struct timeval tv;
-	    gettimeofday(&tv,NULL);    
-	    
-	    unsigned char msg_out[1024];
-	    int offset=0;
-	    append_timestamp(msg_out,&offset);
-	    
-	    // Now broadcast on every interface to port 0x5401
-	    // Oh that's right, UDP sockets don't have an easy way to do that.
-	    // We could interrogate the OS to ask about all interfaces, but we
-	    // can instead get away with having a single simple broadcast address
-	    // supplied as part of the timeserver command line argument.
-	    struct sockaddr_in addr;
-	    bzero(&addr, sizeof(addr)); 
-	    addr.sin_family = AF_INET; 
-	    addr.sin_port = htons(0x5401);
-	    int i;
-	    for(i=0;time_broadcast_addrs[i];i++) {
-	      addr.sin_addr.s_addr = inet_addr(time_broadcast_addrs[i]);
-	      errno=0;
-	      sendto(timesocket,msg_out,offset,
-		     MSG_DONTROUTE|MSG_DONTWAIT
-#ifdef MSG_NOSIGNAL
-		     |MSG_NOSIGNAL
-#endif	       
-		     ,(const struct sockaddr *)&addr,sizeof(addr));
-	    }
-	    // printf("--- Sent %d time announcement packets.\n",i);
-	  }
-	  
-	  // Check for time packet
-	if (timesocket!=-1)
-	  {
-	    unsigned char msg[1024];
-	    int offset=0;
-	    int r=recvfrom(timesocket,msg,1024,0,NULL,0);
-	    if (r==(1+1+8+3)) {
-	      // see rxmessages.c for more explanation
-	      offset++;
-	      int stratum=msg[offset++];
-	      struct timeval tv;
-	      bzero(&tv,sizeof (struct timeval));
-	      for(int i=0;i<8;i++) tv.tv_sec|=msg[offset++]<<(i*8);
-	      for(int i=0;i<3;i++) tv.tv_usec|=msg[offset++]<<(i*8);
-	      // ethernet delay is typically 0.1 - 5ms, so assume 5ms
-	      tv.tv_usec+=5000;
-	      saw_timestamp("          UDP",stratum,&tv);
-	    }
-	  }	
-	}
-      
-	if (httpsocket!=-1)
-	  {
-	    struct sockaddr cliaddr;
-	    socklen_t addrlen;
-	    int s=accept(httpsocket,&cliaddr,&addrlen);
-	    if (s!=-1) {
-	      // HTTP request socket
-	      printf("HTTP Socket connection\n");
-	      // Process socket
-	      // XXX This is synchronous to keep things simple,
-	      // which is part of why we only check every second or so
-	      // for one new connection.  We also don't allow the request
-	      // to linger: if it doesn't contain the request almost immediately,
-	      // we reject it with a timeout error.
-	      http_process(&cliaddr,servald_server,credential,my_sid_hex,s);
-	    }
-	  }
-
-	if ((!monitor_mode)&&(radio_ready())) {
-	  update_my_message(serialfd,
-			    my_sid,my_sid_hex,
-			    LINK_MTU,msg_out,
-			    servald_server,credential);
-	
-	  // Vary next update time by upto 250ms, to prevent radios getting lock-stepped.
-	  if (message_update_interval_randomness)
-	    last_message_update_time=gettime_ms()+(random()%message_update_interval_randomness);
-	  else
-	    last_message_update_time=gettime_ms();
-	}
-	
-	// Update the state file to help debug things
-	// (but not too often, since it is SLOW on the MR3020s
-	//  XXX fix all those linear searches, and it will be fine!)
-	if (time(0)>last_status_time) {
-	  last_status_time=time(0)+2;
-	  status_dump();
-	}
-    }
+    // The radio driver may have changed our message interval
+    if (!tx_waiting_for_radio) schedule_next_message();
+
+    timers_run();
+
     if ((serial_errors>20)&&reboot_when_stuck) {
       // If we are unable to write to the serial port repeatedly for a while,
       // we could be facing funny serial port behaviour bugs that we see on the MR3020.
       // In which case, if authorised, ask the MR3020 to reboot
       system("reboot");
     }
-    
-    usleep(10000);
-
-    if (time(0)>last_summary_time) {
-      last_summary_time=time(0);
-      show_progress(stderr,0);
-   }
   }
 }
+#endif
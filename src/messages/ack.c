@@ -57,7 +57,8 @@ int sync_schedule_progress_report(int peer, int partial, int randomJump)
   // Work out where we will request data to be sent from
   int isReallyFirstByte=0;
   int first_required_body_offset
-    =partial_find_missing_byte(partials[partial].body_segments,&isReallyFirstByte);
+    =partial_find_missing_byte(&partials[partial].body_stream,partials[partial].body_length,
+				&isReallyFirstByte);
   
   if (slot>=REPORT_QUEUE_LEN) slot=random()%REPORT_QUEUE_LEN;
 
@@ -258,6 +259,7 @@ int sync_parse_ack(struct peer_state *p,unsigned char *msg,
       fprintf(stderr,"SYNC ACK: %s* is asking for us to send from m=%d, p=%d\n",
 	      p->sid_prefix,manifest_offset,body_offset);
     p->tx_bundle_manifest_offset=manifest_offset;
+    p->tx_bundle_manifest_offset_pending=0;
     p->tx_bundle_body_offset=body_offset;      
   } else {
     fprintf(stderr,"SYNC ACK: Ignoring, because we are sending bundle #%d, and request is for bundle #%d\n",p->tx_bundle,bundle);
@@ -66,6 +66,7 @@ int append_bar(int bundle_number,int *offset,int mtu,unsigned char *msg_out)
   else
     size_byte|=0x80;
   msg_out[(*offset)++]=size_byte;
+  METRIC_TX_SECTION('B',1+8+8+4+1);
 
   char status_msg[1024];
   snprintf(status_msg,1024,"Announcing BAR %c%c%c%c%c%c%c%c* version %lld [%s]",
@@ -83,10 +83,10 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
 
   if (actual_bytes<0) return -1;
 
-  printf(">>> %s I just sent %s piece [%d,%d) for %s*.\n",
-	 timestamp_str(),is_manifest?"manifest":"body",
-	 start_offset,start_offset+actual_bytes,
-	 peer_records[target_peer]->sid_prefix);
+  LOG_DEBUG(LOG_PIECES,"I just sent %s piece [%d,%d) for %s*.",
+	    is_manifest?"manifest":"body",
+	    start_offset,start_offset+actual_bytes,
+	    peer_records[target_peer]->sid_prefix);
   peer_update_request_bitmaps_due_to_transmitted_piece(bundle_number,is_manifest,
 						       start_offset,actual_bytes);
   dump_peer_tx_bitmap(target_peer);
@@ -99,6 +99,7 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
   offset_compound|=((start_offset>>20LL)&0xffffLL)<<32LL;
 
   // Now write the 23/25 byte header and actual bytes into output message
+  int section_start=*offset;
   // BID prefix (8 bytes)
   if (start_offset>0xfffff)
     msg[(*offset)++]='P'+not_end_of_item;
@@ -123,6 +124,7 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
 
   bcopy(p,&msg[(*offset)],actual_bytes);
   (*offset)+=actual_bytes;
+  METRIC_TX_SECTION(msg[section_start],(*offset)-section_start);
 
   /* Advance the cursor for sending this bundle to all other peers if their cursor
      sits within the window we have just sent. */
@@ -136,12 +138,9 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
 	} else {
 	  if ((peer_records[pn]->tx_bundle_body_offset>=start_offset)
 	      &&(peer_records[pn]->tx_bundle_body_offset<(start_offset+actual_bytes))) {
-	    if (debug_pieces)
-	      printf(">>> %s Cursor advance from %d to %d, due to sending [%d..%d].\n",
-		     timestamp_str(),
-		     peer_records[pn]->tx_bundle_body_offset,(start_offset+actual_bytes),
-		     start_offset,(start_offset+actual_bytes)
-		     );
+	    LOG_DEBUG(LOG_PIECES,"Cursor advance from %d to %d, due to sending [%d..%d].",
+		      peer_records[pn]->tx_bundle_body_offset,(start_offset+actual_bytes),
+		      start_offset,(start_offset+actual_bytes));
 	    peer_records[pn]->tx_bundle_body_offset=(start_offset+actual_bytes);
 	  }
 	}
@@ -187,14 +186,13 @@ int saw_piece(char *peer_prefix,int for_me,
   
   int peer=find_peer_by_prefix(peer_prefix);
   if (peer<0) {
-    printf(">>> %s Saw a piece from unknown SID=%s* -- ignoring.\n",
-	 timestamp_str(),peer_prefix);
+    LOG_DEBUG(LOG_PIECES,"Saw a piece from unknown SID=%s* -- ignoring.",
+	      peer_prefix);
     return -1;
   }
 
-  if (debug_pieces)
-  printf(">>> %s Saw a piece of BID=%s* from SID=%s*: %s [%lld,%lld) %s\n",
-	 timestamp_str(),bid_prefix,peer_prefix,
+  LOG_DEBUG(LOG_PIECES,"Saw a piece of BID=%s* from SID=%s*: %s [%lld,%lld) %s",
+	    bid_prefix,peer_prefix,
 	 is_manifest_piece?"manifest":"body",
 	 piece_offset,piece_offset+piece_bytes,
 	 is_end_piece?"END PIECE":"");
@@ -212,17 +210,20 @@ int saw_piece(char *peer_prefix,int for_me,
     if (sync_is_bundle_recently_received(bid_prefix,version)) {
       // We have this version already: mark it for announcement to sender,
       // and then return immediately.
-      fprintf(stderr,
-	      "We recently received %s* version %lld - ignoring piece.\n",
-	      bid_prefix,version);
+      LOG_DEBUG(LOG_PIECES,
+		"We recently received %s* version %lld - ignoring piece.",
+		bid_prefix,version);
       sync_tell_peer_we_have_bundle_by_id(peer,bid_prefix_bin,version);
       return 0;      
     }
   }
-  for(int i=0;i<bundle_count;i++) {
+  int first_match;
+  int matches=bundle_prefix_range(bid_prefix_bin,strlen(bid_prefix)/2,&first_match);
+  for(int m=first_match;m<first_match+matches;m++) {
+    int i=bid_sorted[m];
     if (!strncasecmp(bid_prefix,bundles[i].bid_hex,strlen(bid_prefix))) {
-      if (debug_pieces) printf("We have version %lld of BID=%s*.  %s is offering us version %lld\n",
-	      bundles[i].version,bid_prefix,peer_prefix,version);
+      LOG_DEBUG(LOG_PIECES,"We have version %lld of BID=%s*.  %s is offering us version %lld",
+		bundles[i].version,bid_prefix,peer_prefix,version);
       if (version<=bundles[i].version) {
 	// We have this version already: mark it for announcement to sender,
 	// and then return immediately.
@@ -230,16 +231,15 @@ int saw_piece(char *peer_prefix,int for_me,
 	bundles[i].announce_bar_now=1;
 #endif
 	if (for_me) {
-	  fprintf(stderr,"We already have %s* version %lld - ignoring piece.\n",
-		  bid_prefix,version);
+	  LOG_DEBUG(LOG_PIECES,"We already have %s* version %lld - ignoring piece.",
+		    bid_prefix,version);
 	  sync_tell_peer_we_have_this_bundle(peer,i);
 	}
 
 	// Update progress bitmaps for all peers whenver we see a piece received that we
 	// think that they might want.  This stops us from resending the same piece later.
 	if (bundle_number>=0) {
-	  printf(">>> %s Examining transmitted piece for bitmap updates.\n",
-		 timestamp_str());
+	  LOG_DEBUG(LOG_BITMAP,"Examining transmitted piece for bitmap updates.");
 	  peer_update_request_bitmaps_due_to_transmitted_piece(bundle_number,is_manifest_piece,
 							       piece_offset,piece_bytes);
 	}
@@ -259,8 +259,7 @@ int saw_piece(char *peer_prefix,int for_me,
   // Update progress bitmaps for all peers whenver we see a piece received that we
   // think that they might want.  This stops us from resending the same piece later.
   if (bundle_number>=0) {
-    printf(">>> %s Examining transmitted piece for bitmap updates.\n",
-	   timestamp_str());
+    LOG_DEBUG(LOG_BITMAP,"Examining transmitted piece for bitmap updates.");
     peer_update_request_bitmaps_due_to_transmitted_piece(bundle_number,is_manifest_piece,
 							 piece_offset,piece_bytes);
   }
@@ -273,32 +272,24 @@ int saw_piece(char *peer_prefix,int for_me,
     } else {
       if (!strcasecmp(partials[i].bid_prefix,bid_prefix))
 	{
-	  if (debug_pieces) printf("Saw another piece for BID=%s* from SID=%s: ",
-			 bid_prefix,peer_prefix);
-	  if (debug_pieces) printf("[%lld..%lld)\n",
-			 piece_offset,piece_offset+piece_bytes);
+	  LOG_DEBUG(LOG_PIECES,"Saw another piece for BID=%s* from SID=%s: [%lld..%lld)",
+		    bid_prefix,peer_prefix,piece_offset,piece_offset+piece_bytes);
 
 	  break;
 	}
       else {
-	if (debug_pieces) {
-	  printf("  this isn't the partial we are looking for.\n");
-	  printf("  piece is of %s*, but slot #%d has %s*\n",
-		 bid_prefix,i,
-		 partials[i].bid_prefix);
-	}
+	LOG_DEBUG(LOG_PIECES,"Piece is of %s*, but slot #%d has %s*",
+		  bid_prefix,i,partials[i].bid_prefix);
       }
     }
   }
 
-  if (debug_pieces)
-    printf("Saw a piece of interesting bundle BID=%s*/%lld from SID=%s\n",
+  LOG_DEBUG(LOG_PIECES,"Saw a piece of interesting bundle BID=%s*/%lld from SID=%s",
 	    bid_prefix,version, peer_prefix);
   
   if (i==MAX_BUNDLES_IN_FLIGHT) {
     if (spare_record>0) i=spare_record;
-    if (debug_pieces)
-      printf("Didn't find bundle in partials for this peer. first spare slot =%d\n",spare_record);
+    LOG_DEBUG(LOG_PIECES,"Didn't find bundle in partials for this peer. first spare slot =%d",spare_record);
     // Didn't find bundle in the progress list.
     // Abort one of the ones in the list at random, and replace, unless there is
     // a spare record slot to use.
@@ -310,8 +301,7 @@ int saw_piece(char *peer_prefix,int for_me,
       // Clear it just to make sure.
       clear_partial(&partials[i]);
     }
-    if (debug_pieces)
-      printf("@@@   Using slot %d\n",i);
+    LOG_DEBUG(LOG_PIECES,"Using slot %d",i);
 
     // Now prepare the partial record
     partials[i].bid_prefix=strdup(bid_prefix);
@@ -335,176 +325,74 @@ int saw_piece(char *peer_prefix,int for_me,
     // Journal bundle, so body_length = version
     partials[i].body_length=version;
   }
+  partial_stream_set_length(&partials[i].manifest_stream,partials[i].manifest_length);
+  partial_stream_set_length(&partials[i].body_stream,partials[i].body_length);
 
   if ((bundle_number>-1)
-      &&(!partials[i].body_segments)) {
+      &&(!partial_stream_bytes_received(&partials[i].body_stream,-1))) {
     // This is a bundle that for which we already have a previous version, and
-    // for which we as yet have no body segments.  So fetch from Rhizome the content
-    // that we do have, and prepopulate the body segment.
-    fprintf(stderr,"%s:%d:My SID as hex is %s\n",__FILE__,__LINE__,my_sid_hex);
-    if (!prime_bundle_cache(bundle_number,my_sid_hex,servald_server,credential)) {
-      struct segment_list *s=calloc(1,sizeof(struct segment_list));
-      assert(s);
-      s->data=malloc(cached_body_len);
-      assert(s->data);
-      bcopy(cached_body,s->data,cached_body_len);
-      s->start_offset=0;
-      s->length=cached_body_len;
-      partials[i].body_segments=s;
-      if (debug_pieces)
-	printf("Preloaded %d bytes from old version of journal bundle.\n",
+    // for which we as yet have no body bytes.  So fetch from Rhizome the content
+    // that we do have, and prepopulate the body.
+    int cache_result=prime_bundle_cache(bundle_number,my_sid_hex,
+					servald_server,credential);
+    if (cache_result>0) {
+      // Still being fetched from servald, so ignore this piece, and try again
+      // when the next one arrives
+      LOG_DEBUG(LOG_PIECES,"Waiting for old version of journal bundle to be fetched, so ignoring current piece.");
+      return -1;
+    }
+    if ((!cache_result)
+	&&(partial_stream_add(&partials[i].body_stream,partials[i].body_length,
+			      0,cached_body_len,cached_body)>=0)) {
+      LOG_DEBUG(LOG_PIECES,"Preloaded %d bytes from old version of journal bundle.",
 		cached_body_len);
     } else {
-      if (debug_pieces)
-	printf("Failed to preload bytes from old version of journal bundle. XFER will likely fail due to far end thinking it can skip the bytes we already have, so ignoring current piece.\n");
+      LOG_WARN(LOG_PIECES,"Failed to preload bytes from old version of journal bundle. XFER will likely fail due to far end thinking it can skip the bytes we already have, so ignoring current piece.");
       return -1;
     }
   }
 
-  // Now we have the right partial, we need to look for the right segment to add this
-  // piece to, if any.
-  struct segment_list **s;
-  if (is_manifest_piece) s=&partials[i].manifest_segments;
-  else s=&partials[i].body_segments;
-
-  /*
-    The segment lists are maintained in reverse order, since pieces will generally
-    arrive in ascending address order.
-  */
-  int segment_start;
-  int segment_end;
-  while(1) {
-    if (*s) {
-      segment_start=(*s)->start_offset;
-      segment_end=segment_start+(*s)->length;
-    } else {
-      segment_start=-1; segment_end=-1;
-    }
-    
-    if ((!(*s))||(segment_end<piece_offset)) {
-      // Create a new segment before the current one
-      new_bytes_in_piece=piece_bytes;
-
-      if (debug_pieces) printf("Inserting piece [%lld..%lld) before [%d..%d)\n",
-		     piece_offset,piece_offset+piece_bytes,
-		     segment_start,segment_end);
-
-      struct segment_list *ns=calloc(1,sizeof(struct segment_list));
-      assert(ns);
-
-      // Link into the list
-      ns->next=*s;
-      if (*s) ns->prev=(*s)->prev; else ns->prev=NULL;
-      if (*s) (*s)->prev=ns;
-      *s=ns;
-
-      // Set start and ends and allocate and copy in piece data
-      ns->start_offset=piece_offset;
-      ns->length=piece_bytes;
-      ns->data=malloc(piece_bytes);
-      bcopy(piece,ns->data,piece_bytes);
-
-      // This is data that is new, and the next byte would also be new, so
-      // no need to tell the peer to change where they are sending from in the bundle.
-      next_byte_would_be_useful=1;
-      
-      break;
-    } else if ((segment_start<=piece_offset)&&(segment_end>=piece_end)) {
-      // Piece fits entirely within a current segment, i.e., is not new data
-      new_bytes_in_piece=0;
-      break;
-    } else if (piece_end<segment_start) {
-      // Piece ends before this segment starts, so proceed down the list further.
-      if (debug_pieces)
-	printf("Piece [%lld..%lld) comes before [%d..%d)\n",
-		piece_offset,piece_offset+piece_bytes,
-		segment_start,segment_end);
-      
-      s=&(*s)->next;
-    } else {
-      // Segment should abutt or overlap with new piece.
-      // Pieces can be different sizes, so it is possible to extend both directions
-      // at once.
-
-      // New piece and existing segment should overlap or adjoin.  Otherwise abort.
-      int piece_start=piece_offset;
-      assert( ((segment_start>=piece_start)&&(segment_start<=piece_end))
-	      ||((segment_end>=piece_start)&&(segment_end<=piece_end))
-	      );      
-      if (0)
-      {
-	message_buffer_length+=
-	  snprintf(&message_buffer[message_buffer_length],
-		   message_buffer_size-message_buffer_length,
-		   "Received %s",bid_prefix);
-	message_buffer_length+=
-	  snprintf(&message_buffer[message_buffer_length],
-		   message_buffer_size-message_buffer_length,
-		   "* version %lld %s segment [%d,%d)\n",
-		   version,
-		   is_manifest_piece?"manifest":"payload",
-		   piece_start,piece_start+piece_bytes);
-      }
-            
-      if (piece_start<segment_start) {
-	// Need to stick bytes on the start
-	int extra_bytes=segment_start-piece_start;
-	int new_length=(*s)->length+extra_bytes;
-	unsigned char *d=malloc(new_length);
-        assert(d);
-	bcopy(piece,d,extra_bytes);
-	bcopy((*s)->data,&d[extra_bytes],(*s)->length);
-	(*s)->start_offset=piece_start;
-	(*s)->length=new_length;
-	free((*s)->data); (*s)->data=d;
-	new_bytes_in_piece+=extra_bytes;
-      }
-      if (piece_end>segment_end) {
-	// Need to sick bytes on the end
-	int extra_bytes=piece_end-segment_end;
-	int new_length=(*s)->length+extra_bytes;
-	(*s)->data=realloc((*s)->data,new_length);
-        assert((*s)->data);
-	bcopy(&piece[piece_bytes-extra_bytes],&(*s)->data[(*s)->length],
-	      extra_bytes);
-	(*s)->length=new_length;
-	new_bytes_in_piece+=extra_bytes;
-
-	// We have extended beyond the end, so the next byte is most likely
-	// useful, unless it happens to extend to the start of the next segment.
-	// XXX - We are ignoring that case for now, as worst it will cause only
-	// one wasted packet.  But it would be nice to detect this situation.
-	next_byte_would_be_useful=1;
-      }
-      
-      break;
-    } 
+  // Now we have the right partial, copy the piece into place.
+  struct partial_stream *s;
+  int stream_length;
+  if (is_manifest_piece) {
+    s=&partials[i].manifest_stream;
+    stream_length=partials[i].manifest_length;
+  } else {
+    s=&partials[i].body_stream;
+    stream_length=partials[i].body_length;
+  }
+  new_bytes_in_piece=-1;
+  if (piece_offset+piece_bytes<=PARTIAL_MAX_STREAM_LENGTH)
+    new_bytes_in_piece=partial_stream_add(s,stream_length,piece_offset,piece_bytes,piece);
+  if (new_bytes_in_piece<0) {
+    LOG_DEBUG(LOG_PIECES,"Ignoring piece [%lld..%lld), as it is beyond the largest bundle we can receive.",
+	      piece_offset,piece_offset+piece_bytes);
+    return -1;
   }
+  LOG_DEBUG(LOG_PIECES,"Piece [%lld..%lld) contained %d new bytes",
+	    piece_offset,piece_offset+piece_bytes,new_bytes_in_piece);
+
+  // If this piece was new data, and we don't have the following byte either, then
+  // there is no need to tell the peer to change where they are sending from in the bundle.
+  if (new_bytes_in_piece&&!partial_stream_have_byte(s,piece_end))
+    next_byte_would_be_useful=1;
 
-  merge_segments(&partials[i].manifest_segments);
-  merge_segments(&partials[i].body_segments);
   partial_update_request_bitmap(&partials[i]);
-  fprintf(stderr,"(Piece was [%lld,%lld)\n",piece_offset,piece_offset+piece_bytes);
 
   partials[i].recent_bytes += piece_bytes;
+  if (new_bytes_in_piece>0) status_changed();
   
   // Check if we have the whole bundle now
-  // XXX - this breaks when we have nothing about the bundle, because then we think the length is zero, so we think we have it all, when really we have none.
-  if (partials[i].manifest_segments
-      &&partials[i].body_segments
-      &&(!partials[i].manifest_segments->next)
-      &&(!partials[i].body_segments->next)
-      &&(partials[i].manifest_segments->start_offset==0)
-      &&(partials[i].body_segments->start_offset==0)
-      &&(partials[i].manifest_segments->length
-	 ==partials[i].manifest_length)
-      &&(partials[i].body_segments->length
-	 ==partials[i].body_length))
+  // (A stream whose length we don't yet know is never complete)
+  if ((partials[i].manifest_length>0)
+      &&partial_stream_complete(&partials[i].manifest_stream,partials[i].manifest_length)
+      &&partial_stream_complete(&partials[i].body_stream,partials[i].body_length))
     {
-      // We have a single segment for body and manifest that span the complete
-      // size.
-      printf(">>> %s We have the entire bundle %s*/%lld now.\n",
-	     timestamp_str(),bid_prefix,version);
+      // We have every block of the body and manifest.
+      METRIC_INC(partials_completed);
+      LOG_INFO(LOG_BUNDLES,"We have the entire bundle %s*/%lld now.",
+	       bid_prefix,version);
 
       // First, reconstitute the manifest from the binary encoded format
       unsigned char manifest[1024];
@@ -513,18 +401,21 @@ int saw_piece(char *peer_prefix,int for_me,
       int insert_result=-999;
       
       if (!manifest_binary_to_text
-	  (partials[i].manifest_segments->data,
+	  (partials[i].manifest_stream.data,
 	   partials[i].manifest_length,
 	   manifest,&manifest_len)) {
 
 	// Display decompressed manifest
 	dump_bytes(stdout,"Decompressed Manifest",manifest,manifest_len);
 	
+	// The import queue takes over the body buffer, and holds on to it until
+	// servald has accepted the bundle.
 	insert_result=
-	  rhizome_update_bundle(manifest,manifest_len,
-				partials[i].body_segments->data,
-				partials[i].body_length,
-				servald_server,credential);
+	  rhizome_queue_import(manifest,manifest_len,
+			       partials[i].body_stream.data,
+			       partials[i].body_length,
+			       servald_server,credential);
+	partials[i].body_stream.data=NULL;
 
 	if (debug_bundlelog) {
 	  // Write details of bundle to a log file for monitoring
@@ -571,8 +462,7 @@ int saw_piece(char *peer_prefix,int for_me,
 	  (partials[i].bid_prefix,
 	   partials[i].bundle_version);
       } else {
-	printf(">>> %s Could not decompress binary manifest.  Not inserting\n",
-	       timestamp_str());
+	LOG_WARN(LOG_BUNDLES,"Could not decompress binary manifest.  Not inserting");
 	// This will cause us to try to receive the entire bundle again, not just the
 	// manifest.
 	// XXX - Decompress manifest as soon as we have it to catch this problem
@@ -581,16 +471,19 @@ int saw_piece(char *peer_prefix,int for_me,
       if (insert_result) {
 	// Failed to insert, so mark this bundle for deprioritisation, so that we
 	// don't just keep asking for it.
-	fprintf(stderr,"Failed to insert bundle %s*/%lld (result=%d)\n",
-		partials[i].bid_prefix,
-		partials[i].bundle_version,insert_result);
+	METRIC_INC(insert_failures);
+	LOG_WARN(LOG_BUNDLES,"Failed to insert bundle %s*/%lld (result=%d)",
+		 partials[i].bid_prefix,
+		 partials[i].bundle_version,insert_result);
 	dump_bytes(stdout,"manifest",manifest,manifest_len);
-	dump_bytes(stdout,"payload",
-		   partials[i].body_segments->data,
-		   partials[i].body_length);
+	// (the payload is gone if we tried to queue it for import)
+	if (partials[i].body_stream.data)
+	  dump_bytes(stdout,"payload",
+		     partials[i].body_stream.data,
+		     partials[i].body_length);
 
 	char bid[32*2+1];
-	if (!manifest_extract_bid(partials[i].manifest_segments->data,
+	if (!manifest_extract_bid(partials[i].manifest_stream.data,
 				  bid)) {
 #ifdef SYNC_BY_BAR
 	  int bundle=bid_to_peer_bundle_index(peer,bid);
@@ -602,15 +495,14 @@ int saw_piece(char *peer_prefix,int for_me,
 	// Insert succeeded, so clear any failure deprioritisation (although it
 	// shouldn't matter).
 	char bid[32*2+1];
-	if (!manifest_extract_bid(partials[i].manifest_segments->data,
+	if (!manifest_extract_bid(partials[i].manifest_stream.data,
 				  bid)) {
 #ifdef SYNC_BY_BAR
 	  int bundle=bid_to_peer_bundle_index(peer,bid);
 	  peer_records[peer]->insert_failures[bundle]=0;
 #endif
 	}
-	progress_log_bundle_receipt(partials[i].bid_prefix,
-				    partials[i].bundle_version);
+	// (it goes in the progress log once servald has imported it)
       }
 
       // Tell peer we have the whole thing now.
@@ -632,7 +524,7 @@ int saw_piece(char *peer_prefix,int for_me,
       else if (!next_byte_would_be_useful)
 	sync_schedule_progress_report(peer,i,0 /* send from first required byte */);
     } else {
-      fprintf(stderr,"Sending BITMAP\n");
+      LOG_DEBUG(LOG_BITMAP,"Sending BITMAP");
       sync_schedule_progress_report_bitmap(peer,i);
     }
   }
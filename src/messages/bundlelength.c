@@ -57,6 +57,7 @@ int announce_bundle_length(int mtu, unsigned char *msg,int *offset,
     msg[(*offset)++]=(length>>8)&0xff;
     msg[(*offset)++]=(length>>16)&0xff;
     msg[(*offset)++]=(length>>24)&0xff;
+    METRIC_TX_SECTION('L',1+8+8+4);
   }
   return 0;
 }
@@ -78,6 +79,8 @@ int saw_length(char *peer_prefix,char *bid_prefix,long long version,
 	if (partials[i].bundle_version==version)
 	  {
 	    partials[i].body_length=body_length;
+	    // Now that we know how big it is, we can allocate the whole body buffer
+	    partial_stream_set_length(&partials[i].body_stream,body_length);
 	    return 0;
 	  }
     }
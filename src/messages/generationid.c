@@ -50,6 +50,7 @@ int append_generationid(unsigned char *msg_out,int *offset)
   
   msg_out[(*offset)++]='G';
   for(int i=0;i<4;i++) msg_out[(*offset)++]=(my_instance_id>>(i*8))&0xff;
+  METRIC_TX_SECTION('G',5);
   return 0;
 }
 
@@ -84,6 +85,7 @@ int message_parser_47(struct peer_state *sender,char *sender_prefix,
       sender->instance_id=peer_instance_id;
       printf("Peer %s* has restarted -- discarding stale knowledge of its state.\n",sender->sid_prefix);
       peer_records[peer_index]=sender;
+      bundle_priorities_invalidate();
 #endif
     }
   }
@@ -69,6 +69,7 @@ int request_segment(int peer, char *bid_prefix, int bundle_length,
   msg_out[(*offset)++]=(seg_start>>0)&0xff;
   msg_out[(*offset)++]=(seg_start>>8)&0xff;
   msg_out[(*offset)++]=((seg_start>>16)&0x7f)|(is_manifest?0x80:0x00);
+  METRIC_TX_SECTION('R',(*offset)-start_offset);
 
   if (debug_pull) {
     printf("Requesting BID=%s @ %c%d (len=%d) from SID=%s*\n",
@@ -155,7 +156,7 @@ int message_parser_52(struct peer_state *sender,char *sender_prefix,
       for(int i=0;i<bundle_count;i++) {
 	if (!strncasecmp(bid_prefix,bundles[i].bid,16)) {
 	  if (debug_pull) printf("  -> found the bundle.\n");
-	  bundles[i].transmit_now=time(0)+TRANSMIT_NOW_TIMEOUT;
+	  bundles[i].transmit_now=now_ms/1000+TRANSMIT_NOW_TIMEOUT;
 	  if (debug_announce) {
 	    printf("*** Setting transmit_now flag on %s*\n",
 		   bundles[i].bid);
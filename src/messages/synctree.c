@@ -71,7 +71,8 @@ int sync_tree_send_message(int *offset,int mtu, unsigned char *msg_out)
   len+=used;
   // Record the length of the field
   msg[length_byte_offset]=len;
-  append_bytes(offset,mtu,msg_out,msg,len);
+  if (!append_bytes(offset,mtu,msg_out,msg,len))
+    METRIC_TX_SECTION('S',len);
 
   // Record in retransmit buffer
   // printf("Sending sync message (length now = $%02x, used %d)\n",*offset,used);
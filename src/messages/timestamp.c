@@ -52,12 +52,12 @@ int saw_timestamp(char *sender_prefix,int stratum, struct timeval *tv)
 
   if (tv->tv_usec>999999) { tv->tv_sec++; tv->tv_usec-=1000000; }
 
-  if (gettime_ms()>next_time_update_allowed_after) {
+  if (now_ms>next_time_update_allowed_after) {
     if ((stratum<(my_time_stratum>>8))) {
       // Found a lower-stratum time than our own, and we have enabled time
       // slave mode, so set system time.
-      // Then update our internal timers accordingly
       if (time_slave&&(!monitor_mode)) {
+	// (Our own timers run off the monotonic clock, so don't need adjusting)
 	struct timeval before,after;
 	gettimeofday(&before,NULL);
 	settimeofday(tv,NULL);
@@ -66,8 +66,6 @@ int saw_timestamp(char *sender_prefix,int stratum, struct timeval *tv)
 	  after.tv_sec*1000+(after.tv_usec/1000)
 	  -
 	  before.tv_sec*1000+(before.tv_usec/1000);
-	last_message_update_time+=delta;
-	congestion_update_time+=delta;
 
 	if (delta<-2000) {
 	  // Time went backwards: This can cause trouble for servald alarms.
@@ -77,7 +75,7 @@ int saw_timestamp(char *sender_prefix,int stratum, struct timeval *tv)
 	
 	// Don't touch time again for a little while
 	// (Updating time possibly several times per second might upset things)
-	next_time_update_allowed_after=gettime_ms()+20000;
+	next_time_update_allowed_after=now_ms+20000;
       }
       // By adding only one milli-strata, we effectively match the stratum that
       // updated us for the next 256 UHF packet transmissions. This should give
@@ -123,6 +121,7 @@ int append_timestamp(unsigned char *msg_out,int *offset)
     msg_out[(*offset)++]=(tv.tv_sec>>(i*8))&0xff;
   for(int i=0;i<3;i++)
     msg_out[(*offset)++]=(tv.tv_usec>>(i*8))&0xff;
+  METRIC_TX_SECTION('T',13);
   return 0;
 }
 
@@ -58,6 +58,8 @@ int _report_file(const char *filename,const char *file,
   return 0;
 }
 
+// The currently selected cache entry, which is what the rest of LBARD looks at
+// after calling prime_bundle_cache().  These just point into bundle_cache[].
 char *bid_of_cached_bundle=NULL;
 long long cached_version=0;
 int cached_manifest_len=0;
@@ -67,6 +69,229 @@ unsigned char *cached_manifest_encoded=NULL;
 int cached_body_len=0;
 unsigned char *cached_body=NULL;
 
+// We keep several recently used bundles in memory, so that when we are
+// alternating between peers who want different bundles, we don't have to keep
+// fetching them from servald.  Entries are evicted least recently used first,
+// both when we run out of entries, and when the total size would exceed the
+// byte budget (we have to still fit on a 32MB mesh extender).
+struct bundle_cache_entry {
+  char *bid_hex;
+  long long version;
+  unsigned char *manifest;
+  int manifest_len;
+  unsigned char *manifest_encoded;
+  int manifest_encoded_len;
+  unsigned char *body;
+  int body_len;
+  long long last_used;
+};
+
+#define BUNDLE_CACHE_MAX_ENTRIES 64
+struct bundle_cache_entry bundle_cache[BUNDLE_CACHE_MAX_ENTRIES];
+int bundle_cache_max_entries=8;
+long long bundle_cache_max_bytes=8*1024*1024;
+long long bundle_cache_bytes=0;
+long long bundle_cache_use_counter=0;
+
+int bundle_cache_hits=0;
+int bundle_cache_misses=0;
+int bundle_cache_evictions=0;
+
+static long long bundle_cache_entry_size(struct bundle_cache_entry *e)
+{
+  return e->manifest_len+e->manifest_encoded_len+e->body_len;
+}
+
+static void bundle_cache_select(struct bundle_cache_entry *e)
+{
+  e->last_used=++bundle_cache_use_counter;
+  bid_of_cached_bundle=e->bid_hex;
+  cached_version=e->version;
+  cached_manifest=e->manifest;
+  cached_manifest_len=e->manifest_len;
+  cached_manifest_encoded=e->manifest_encoded;
+  cached_manifest_encoded_len=e->manifest_encoded_len;
+  cached_body=e->body;
+  cached_body_len=e->body_len;
+}
+
+static void bundle_cache_deselect(void)
+{
+  bid_of_cached_bundle=NULL;
+  cached_version=0;
+  cached_manifest=NULL; cached_manifest_len=0;
+  cached_manifest_encoded=NULL; cached_manifest_encoded_len=0;
+  cached_body=NULL; cached_body_len=0;
+}
+
+static void bundle_cache_evict(int i)
+{
+  struct bundle_cache_entry *e=&bundle_cache[i];
+  if (!e->bid_hex) return;
+  if (bid_of_cached_bundle==e->bid_hex) bundle_cache_deselect();
+  bundle_cache_bytes-=bundle_cache_entry_size(e);
+  free(e->bid_hex);
+  free(e->manifest);
+  free(e->manifest_encoded);
+  free(e->body);
+  bzero(e,sizeof(struct bundle_cache_entry));
+}
+
+static int bundle_cache_lru(void)
+{
+  int lru=-1;
+  for(int i=0;i<BUNDLE_CACHE_MAX_ENTRIES;i++)
+    if (bundle_cache[i].bid_hex)
+      if ((lru==-1)||(bundle_cache[i].last_used<bundle_cache[lru].last_used))
+	lru=i;
+  return lru;
+}
+
+// Make room for an entry of the given size, and return the slot to put it in
+static int bundle_cache_make_room(long long size)
+{
+  int max_entries=bundle_cache_max_entries;
+  if (max_entries<1) max_entries=1;
+  if (max_entries>BUNDLE_CACHE_MAX_ENTRIES) max_entries=BUNDLE_CACHE_MAX_ENTRIES;
+
+  while(1) {
+    int used=0,free_slot=-1;
+    for(int i=0;i<BUNDLE_CACHE_MAX_ENTRIES;i++)
+      if (bundle_cache[i].bid_hex) used++;
+      else if (free_slot==-1) free_slot=i;
+    if ((used<max_entries)&&(bundle_cache_bytes+size<=bundle_cache_max_bytes))
+      return free_slot;
+    // A single bundle bigger than the budget still gets cached, on its own
+    if (!used) return free_slot;
+    bundle_cache_evict(bundle_cache_lru());
+    bundle_cache_evictions++;
+  }
+}
+
+int bundle_cache_report_json(FILE *f)
+{
+  int entries=0;
+  for(int i=0;i<BUNDLE_CACHE_MAX_ENTRIES;i++) if (bundle_cache[i].bid_hex) entries++;
+  fprintf(f,"\"bundle_cache\": { \"entries\": %d, \"max_entries\": %d,"
+	  " \"bytes\": %lld, \"max_bytes\": %lld,"
+	  " \"hits\": %d, \"misses\": %d, \"evictions\": %d }",
+	  entries,bundle_cache_max_entries,
+	  bundle_cache_bytes,bundle_cache_max_bytes,
+	  bundle_cache_hits,bundle_cache_misses,bundle_cache_evictions);
+  return 0;
+}
+
+/* Bundles that aren't in the cache are fetched from servald in the background,
+   one at a time, so that LBARD (and the radio) doesn't stop while servald finds
+   them for us.  While the fetch is under way, prime_bundle_cache() returns 1,
+   and the caller should try again a bit later.  If it is asked for a different
+   bundle while one is being fetched, it returns 2, and that one will be
+   fetched when the caller asks again after the first has arrived.
+*/
+struct bundle_cache_fetch {
+  char *bid_hex;
+  long long version;
+  int in_progress;
+  int failed;
+  unsigned char *manifest;
+  int manifest_len;
+  char *servald_server;
+  char *credential;
+};
+struct bundle_cache_fetch bundle_cache_fetch;
+
+static void bundle_cache_fetch_clear(void)
+{
+  free(bundle_cache_fetch.bid_hex);
+  free(bundle_cache_fetch.manifest);
+  bzero(&bundle_cache_fetch,sizeof(bundle_cache_fetch));
+}
+
+static void bundle_cache_fetch_failed(struct http_request *r)
+{
+  fprintf(stderr,"http request failed (%d). URLPATH:%s\n",r->response_code,r->path);
+  free(bundle_cache_fetch.manifest);
+  bundle_cache_fetch.manifest=NULL;
+  bundle_cache_fetch.in_progress=0;
+  bundle_cache_fetch.failed=1;
+}
+
+// Put a freshly fetched bundle into the cache (without selecting it)
+static void bundle_cache_insert(char *bid_hex,long long version,
+				unsigned char *manifest,int manifest_len,
+				unsigned char *body,int body_len)
+{
+  // Generate binary encoded manifest from plain text version
+  unsigned char *manifest_encoded=malloc(1024);
+  assert(manifest_encoded);
+  int manifest_encoded_len=0;
+  if (manifest_text_to_binary(manifest,manifest_len,
+			      manifest_encoded,
+			      &manifest_encoded_len)) {
+    // Failed to binary encode manifest, so just copy it
+    bcopy(manifest,manifest_encoded,manifest_len);
+    manifest_encoded_len = manifest_len;	
+  }        
+
+  long long size=manifest_len+manifest_encoded_len+body_len;
+  struct bundle_cache_entry *e=&bundle_cache[bundle_cache_make_room(size)];
+  e->bid_hex=strdup(bid_hex);
+  e->version=version;
+  e->manifest=manifest;
+  e->manifest_len=manifest_len;
+  e->manifest_encoded=manifest_encoded;
+  e->manifest_encoded_len=manifest_encoded_len;
+  e->body=body;
+  e->body_len=body_len;
+  e->last_used=++bundle_cache_use_counter;
+  bundle_cache_bytes+=size;
+}
+
+static void bundle_cache_body_fetched(struct http_request *r)
+{
+  if (r->response_code!=200) { bundle_cache_fetch_failed(r); return; }
+
+  if (1)
+    fprintf(stderr,"  body is %d bytes long. result_code=%d\n",
+	    r->body_len,r->response_code);
+
+  bundle_cache_insert(bundle_cache_fetch.bid_hex,bundle_cache_fetch.version,
+		      bundle_cache_fetch.manifest,bundle_cache_fetch.manifest_len,
+		      r->body,r->body_len);
+  // The cache owns them now
+  bundle_cache_fetch.manifest=NULL;
+  r->body=NULL;
+  bundle_cache_fetch_clear();
+}
+
+static void bundle_cache_manifest_fetched(struct http_request *r)
+{
+  if (r->response_code!=200) { bundle_cache_fetch_failed(r); return; }
+  
+  if (0) fprintf(stderr,"  manifest is %d bytes long.\n",r->body_len);
+
+  // Reject over-length manifests
+  if (r->body_len>1024) { bundle_cache_fetch_failed(r); return; }
+  bundle_cache_fetch.manifest=r->body;
+  bundle_cache_fetch.manifest_len=r->body_len;
+  r->body=NULL;
+
+  char path[8192];
+  snprintf(path,8192,"/restful/rhizome/%s/raw.bin",bundle_cache_fetch.bid_hex);
+  struct http_request *body=http_request_simple(bundle_cache_fetch.servald_server,
+						bundle_cache_fetch.credential,
+						"GET",path,5000);
+  if (!body) { bundle_cache_fetch_failed(r); return; }
+  // XXX - This transport only allows bundles upto 5MB!
+  // (and that is probably pushing it a bit for a mesh extender with only 32MB RAM
+  // for everything!)
+  body->max_len=5*1024*1024;
+  http_request_start(body,bundle_cache_body_fetched,NULL);
+}
+
+// Returns 0 if the bundle is now selected in the cache, 1 if it is being
+// fetched from servald, 2 if we are still busy fetching a different bundle,
+// or -1 if it couldn't be.
 int prime_bundle_cache(int bundle_number,char *sid_prefix_hex,
 		       char *servald_server, char *credential)
 {
@@ -79,133 +304,59 @@ int prime_bundle_cache(int bundle_number,char *sid_prefix_hex,
       exit(-1);
     }
   }
-  
-  if ((!bid_of_cached_bundle)
-      ||strcasecmp(bundles[bundle_number].bid_hex,bid_of_cached_bundle)
-      ||(cached_version!=bundles[bundle_number].version)
-      ) {
-    // Cache is invalid - release
-    if (bid_of_cached_bundle) {
-      free(bid_of_cached_bundle); bid_of_cached_bundle=NULL;
-      free(cached_manifest); cached_manifest=NULL;
-      free(cached_manifest_encoded); cached_manifest_encoded=NULL;
-      free(cached_body); cached_body=NULL;
-    }
 
-    // Load bundle into cache
-    char path[8192];
-    char filename[1024];
-    
-    snprintf(path,8192,"/restful/rhizome/%s.rhm",
-	     bundles[bundle_number].bid_hex);
-
-    long long t1=gettime_ms();
-
-    char pathbuf[1024];
-    snprintf(filename,1024,"%s/%d.%s.manifest",getcwd(pathbuf,1024),getpid(),
-	     sid_prefix_hex);
-      
-    unlink(filename);
-    FILE *f=fopen(filename,"w");
-    if (!f) {
-      fprintf(stderr,"could not open output file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
-    }
-    int result_code=http_get_simple(servald_server,
-				    credential,path,f,5000,NULL);
-    fclose(f);
-    if(result_code!=200) {
-      fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
-      return -1;
-    }
-    long long t2=gettime_ms();
-    f=fopen(filename,"r");
-    if (!f) {
-      fprintf(stderr,"ERROR: Could not open '%s' to read bundle manifest in prime_bundle_cache() call for bundle #%d\n",
-	      filename,bundle_number);
-      perror("fopen");
-      return -1;
-    }
-    if (cached_manifest) free(cached_manifest);
-    cached_manifest=malloc(8192);
-    assert(cached_manifest);
-    cached_manifest_len=fread(cached_manifest,1,8192,f);
-    cached_manifest=realloc(cached_manifest,cached_manifest_len);
-    assert(cached_manifest);
-    fclose(f);
-    unlink(filename);
-    if (0) fprintf(stderr,"  manifest is %d bytes long.\n",cached_manifest_len);
-
-    // Reject over-length manifests
-    if (cached_manifest_len>1024) return -1;
-    
-    // Generate binary encoded manifest from plain text version
-    if (cached_manifest_encoded) free(cached_manifest_encoded);
-    cached_manifest_encoded=malloc(1024);
-    assert(cached_manifest_encoded);
-    cached_manifest_encoded_len=0;
-    if (manifest_text_to_binary(cached_manifest,cached_manifest_len,
-				cached_manifest_encoded,
-				&cached_manifest_encoded_len)) {
-      // Failed to binary encode manifest, so just copy it
-      bcopy(cached_manifest,cached_manifest_encoded,cached_manifest_len);
-      cached_manifest_encoded_len = cached_manifest_len;	
-    }        
-    
-    snprintf(path,8192,"/restful/rhizome/%s/raw.bin",
-	     bundles[bundle_number].bid_hex);
-    snprintf(filename,1024,"%d.%s.raw",getpid(),sid_prefix_hex);
-    unlink(filename);
-    f=fopen(filename,"w");
-    if (!f) {
-      fprintf(stderr,"could not open output file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
-    }
-    result_code=http_get_simple(servald_server,
-				credential,path,f,5000,NULL);
-    fclose(f); f=NULL;
-    if(result_code!=200) {
-      fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
-      return -1;
-    }
-    long long t3=gettime_ms();
-
-    if (0)
-      fprintf(stderr,"  HTTP pre-fetching of next bundle to send took %lldms + %lldms\n",
-	      t2-t1,t3-t2);
-    
-    // XXX - This transport only allows bundles upto 5MB!
-    // (and that is probably pushing it a bit for a mesh extender with only 32MB RAM
-    // for everything!)
-    f=fopen(filename,"r");
-    if (!f) {
-      fprintf(stderr,"could read file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
+  // Already selected?
+  if (bid_of_cached_bundle
+      &&(!strcasecmp(bundles[bundle_number].bid_hex,bid_of_cached_bundle))
+      &&(cached_version==bundles[bundle_number].version)) {
+    bundle_cache_hits++;
+    return 0;
+  }
+
+  // Look for it in the cache, discarding any stale versions as we go.
+  for(int i=0;i<BUNDLE_CACHE_MAX_ENTRIES;i++) {
+    struct bundle_cache_entry *e=&bundle_cache[i];
+    if (e->bid_hex&&(!strcasecmp(bundles[bundle_number].bid_hex,e->bid_hex))) {
+      if (e->version==bundles[bundle_number].version) {
+	bundle_cache_hits++;
+	bundle_cache_select(e);
+	return 0;
+      }
+      bundle_cache_evict(i);
+      bundle_cache_evictions++;
     }
-    if (cached_body) free(cached_body);
-    cached_body=malloc(5*1024*1024);
-    assert(cached_body);
-    // XXX - Should check that we read all the bytes
-    cached_body_len=fread(cached_body,1,5*1024*1024,f);    
-    cached_body=realloc(cached_body,cached_body_len);
-    assert(cached_body);
-    fclose(f);
-    unlink(filename);
-    if (1)
-      fprintf(stderr,"  body is %d bytes long. result_code=%d\n",
-	      cached_body_len,result_code);
-
-    bid_of_cached_bundle=strdup(bundles[bundle_number].bid_hex);
-
-    cached_version=bundles[bundle_number].version;
-
-    if (0)
-      fprintf(stderr,"Cached manifest and body for %s\n",
-	      bundles[bundle_number].bid_hex);
   }
+
+  // Not cached, so we have to fetch it from servald
+  bundle_cache_deselect();
+
+  int this_bundle=bundle_cache_fetch.bid_hex
+    &&(!strcasecmp(bundles[bundle_number].bid_hex,bundle_cache_fetch.bid_hex))
+    &&(bundle_cache_fetch.version==bundles[bundle_number].version);
+  if (bundle_cache_fetch.in_progress) return this_bundle?1:2;
+  if (this_bundle&&bundle_cache_fetch.failed) {
+    // Report the failure, and then try again next time we are asked
+    bundle_cache_fetch_clear();
+    return -1;
+  }
+  bundle_cache_fetch_clear();
   
-  return 0;
+  bundle_cache_misses++;
+  fprintf(stderr,"Bundle cache miss: fetching %s*/%lld from servald\n",
+	  bundles[bundle_number].bid_hex,bundles[bundle_number].version);
+
+  char path[8192];
+  snprintf(path,8192,"/restful/rhizome/%s.rhm",
+	   bundles[bundle_number].bid_hex);
+  struct http_request *r=http_request_simple(servald_server,credential,
+					     "GET",path,5000);
+  if (!r) return -1;
+  r->max_len=8192;
+  bundle_cache_fetch.bid_hex=strdup(bundles[bundle_number].bid_hex);
+  bundle_cache_fetch.version=bundles[bundle_number].version;
+  bundle_cache_fetch.servald_server=servald_server;
+  bundle_cache_fetch.credential=credential;
+  bundle_cache_fetch.in_progress=1;
+  http_request_start(r,bundle_cache_manifest_fetched,NULL);
+  return 1;
 }
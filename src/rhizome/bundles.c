@@ -43,11 +43,120 @@ extern char *my_sid_hex;
 
 #include "sync.h"
 #include "lbard.h"
+#include "util.h"
 
 struct bundle_record bundles[MAX_BUNDLES];
 int bundle_count=0;
 int ignored_bundles=0;
 
+// Hash indexes over bundles[], so that registering or looking up a bundle
+// doesn't cost a linear search through several thousand bundles.
+// Chains are threaded through the _next arrays.  Entries hold bundle number + 1,
+// so that the all-zero initial state is a valid empty table.
+// BIDs and sync keys are already uniformly distributed, so we just use the
+// first two bytes as the hash.  This also means that any hex prefix of
+// at least 4 characters can be resolved via the BID index.
+#define BUNDLE_HASH_BITS 14
+#define BUNDLE_HASH_SIZE (1<<BUNDLE_HASH_BITS)
+#define BUNDLE_HASH(b) (((b)[0]|((b)[1]<<8))&(BUNDLE_HASH_SIZE-1))
+int bid_hash_heads[BUNDLE_HASH_SIZE];
+int bid_hash_next[MAX_BUNDLES];
+int sync_key_hash_heads[BUNDLE_HASH_SIZE];
+int sync_key_hash_next[MAX_BUNDLES];
+
+static void bid_hash_insert(int bundle_number)
+{
+  int h=BUNDLE_HASH(bundles[bundle_number].bid_bin);
+  bid_hash_next[bundle_number]=bid_hash_heads[h];
+  bid_hash_heads[h]=bundle_number+1;
+}
+
+static void sync_key_hash_insert(int bundle_number)
+{
+  int h=BUNDLE_HASH(bundles[bundle_number].sync_key.key);
+  sync_key_hash_next[bundle_number]=sync_key_hash_heads[h];
+  sync_key_hash_heads[h]=bundle_number+1;
+}
+
+static void sync_key_hash_remove(int bundle_number)
+{
+  int h=BUNDLE_HASH(bundles[bundle_number].sync_key.key);
+  int *link=&sync_key_hash_heads[h];
+  while(*link) {
+    if ((*link)==bundle_number+1) {
+      *link=sync_key_hash_next[bundle_number];
+      sync_key_hash_next[bundle_number]=0;
+      return;
+    }
+    link=&sync_key_hash_next[(*link)-1];
+  }
+}
+
+int lookup_bundle_by_bid_bin(unsigned char bid_bin[32])
+{
+  for(int i=bid_hash_heads[BUNDLE_HASH(bid_bin)];i;i=bid_hash_next[i-1])
+    if (!memcmp(bundles[i-1].bid_bin,bid_bin,32)) return i-1;
+  return -1;
+}
+
+int lookup_bundle_by_sync_key(uint8_t bundle_sync_key[KEY_LEN])
+{
+  for(int i=sync_key_hash_heads[BUNDLE_HASH(bundle_sync_key)];i;
+      i=sync_key_hash_next[i-1])
+    if (!memcmp(bundles[i-1].sync_key.key,bundle_sync_key,KEY_LEN)) return i-1;
+  return -1;
+}
+
+// Bundle numbers sorted by binary BID, so that variable length BID prefixes
+// (as used in pieces, acks, bitmaps etc) can be resolved by binary search.
+// Bundles never change BID once registered, so only new bundles need inserting.
+int bid_sorted[MAX_BUNDLES];
+
+// Return the first position in bid_sorted[] whose BID prefix of len bytes
+// is >= (or if upper is set, >) the supplied prefix
+static int bid_sorted_search(const unsigned char *prefix,int len,int upper)
+{
+  int lo=0,hi=bundle_count;
+  while(lo<hi) {
+    int mid=(lo+hi)/2;
+    int c=memcmp(bundles[bid_sorted[mid]].bid_bin,prefix,len);
+    if ((c<0)||(upper&&!c)) lo=mid+1; else hi=mid;
+  }
+  return lo;
+}
+
+static void bid_sorted_insert(int bundle_number)
+{
+  int pos=bid_sorted_search(bundles[bundle_number].bid_bin,32,0);
+  memmove(&bid_sorted[pos+1],&bid_sorted[pos],(bundle_count-pos)*sizeof(int));
+  bid_sorted[pos]=bundle_number;
+}
+
+// Find the bundles whose BID starts with the supplied binary prefix.
+// They occupy bid_sorted[*first .. *first+n-1], where n is the return value.
+// If n>1, then the prefix is ambiguous.
+int bundle_prefix_range(const unsigned char *prefix,int len,int *first)
+{
+  if (len>32) len=32;
+  if (len<0) len=0;
+  int start=bid_sorted_search(prefix,len,0);
+  int end=bid_sorted_search(prefix,len,1);
+  if (first) *first=start;
+  return end-start;
+}
+
+// Return the head of the BID hash chain that would contain bundles matching
+// the supplied hex prefix, or -1 if the prefix is too short (or not hex), in
+// which case the caller has to fall back to a linear search.
+static int bid_hash_chain_for_hex_prefix(char *bid_prefix)
+{
+  unsigned char prefix_bin[2];
+  for(int i=0;i<4;i++) if (!ishex(bid_prefix[i])) return -1;
+  prefix_bin[0]=(chartohexnybl(bid_prefix[0])<<4)|chartohexnybl(bid_prefix[1]);
+  prefix_bin[1]=(chartohexnybl(bid_prefix[2])<<4)|chartohexnybl(bid_prefix[3]);
+  return bid_hash_heads[BUNDLE_HASH(prefix_bin)];
+}
+
 int register_bundle(char *service,
 		    char *bid,
 		    char *version,
@@ -125,16 +234,14 @@ int register_bundle(char *service,
     }
   }
   
-  // XXX - Linear search through bundles!
-  // Use a hash table or something so that it doesn't cost O(n^2) with number
-  // of bundles.
-  int bundle_number=bundle_count;
-  for(i=0;i<bundle_count;i++) {
-    if (!strcmp(bundles[i].bid_hex,bid)) {
-      // Updating an existing bundle
-      bundle_number=i; break;
-    }
+  unsigned char bid_bin[32];
+  for(i=0;i<32;i++) {
+    char hex[3]={bid[i*2+0],bid[i*2+1],0};
+    bid_bin[i]=strtoll(hex,NULL,16);
   }
+  
+  int bundle_number=lookup_bundle_by_bid_bin(bid_bin);
+  if (bundle_number<0) bundle_number=bundle_count;
 
   if (bundle_number>=MAX_BUNDLES) return -1;
   
@@ -158,18 +265,18 @@ int register_bundle(char *service,
     free(bundles[bundle_number].recipient);
     bundles[bundle_number].recipient=NULL;
 
+    // Sync key will change with the version
+    sync_key_hash_remove(bundle_number);
+
     fprintf(stderr,">>> %s We have updated bundle %s/%lld\n",
 	    timestamp_str(),bid,versionll);
 
   } else {    
     // New bundle
     bundles[bundle_number].bid_hex=strdup(bid);
-    {
-      for(int i=0;i<32;i++) {
-	char hex[3]={bid[i*2+0],bid[i*2+1],0};
-	bundles[bundle_number].bid_bin[i]=strtoll(hex,NULL,16);
-      }
-    }
+    memcpy(bundles[bundle_number].bid_bin,bid_bin,32);
+    bid_hash_insert(bundle_number);
+    bid_sorted_insert(bundle_number);
     // Never announced
     bundles[bundle_number].last_offset_announced=0;
     bundles[bundle_number].last_version_of_manifest_announced=0;
@@ -197,11 +304,14 @@ int register_bundle(char *service,
   bundles[bundle_number].sender=strdup(sender);
   bundles[bundle_number].recipient=strdup(recipient);
   bundles[bundle_number].sync_key=bundle_sync_key;
+  sync_key_hash_insert(bundle_number);
+  bundle_priority_update(bundle_number);
   
   bundles[bundle_number].index=bundle_number;
   
-  // Add bundle to the sync tree 
-  sync_add_key(sync_state,&bundle_sync_key,&bundles[bundle_number]);
+  // Add bundle to the sync tree (or queue it to be, if we are reading a
+  // list of bundles)
+  sync_tree_add_bundle(bundle_number);
   if (debug_sync_keys) {
     char filename[1024];
     snprintf(filename,1024,"lbardkeys.%s.has",my_sid_hex);
@@ -239,6 +349,15 @@ int register_bundle(char *service,
 int we_have_this_bundle_or_newer(char *bid_prefix, long long version)
 {
   int i;
+  int prefix_len=strlen(bid_prefix);
+  int chain=bid_hash_chain_for_hex_prefix(bid_prefix);
+  if (chain>=0) {
+    for(i=chain;i;i=bid_hash_next[i-1])
+      if (!strncasecmp(bundles[i-1].bid_hex,bid_prefix,prefix_len))
+	if (bundles[i-1].version>=version) return 1;
+    return 0;
+  }
+  
   for(i=0;i<bundle_count;i++) {
     if (!strncasecmp(bundles[i].bid_hex,bid_prefix,strlen(bid_prefix))) {
       // We have this bundle, but do we have this version?
@@ -260,6 +379,19 @@ int we_have_this_bundle_or_newer(char *bid_prefix, long long version)
 char *bundle_recipient_if_known(char *bid_prefix)
 {
   int i;
+  int prefix_len=strlen(bid_prefix);
+  int chain=bid_hash_chain_for_hex_prefix(bid_prefix);
+  if (chain>=0) {
+    // Chains are not in bundle order, so pick the lowest numbered match,
+    // as the linear search would.
+    int best=-1;
+    for(i=chain;i;i=bid_hash_next[i-1])
+      if (!strncasecmp(bundles[i-1].bid_hex,bid_prefix,prefix_len))
+	if ((best==-1)||(i-1<best)) best=i-1;
+    if (best>=0) return bundles[best].recipient;
+    return NULL;
+  }
+  
   for(i=0;i<bundle_count;i++) {
     if (!strncasecmp(bundles[i].bid_hex,bid_prefix,strlen(bid_prefix))) {
       return bundles[i].recipient;
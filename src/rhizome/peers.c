@@ -57,6 +57,7 @@ int free_peer(struct peer_state *p)
 #endif
   sync_free_peer_state(sync_state, p);
   free(p);
+  status_changed();
   return 0;
 }
 
@@ -221,7 +222,7 @@ int random_active_peer()
   for(;peer<peer_count;peer++)
     {
       if (!peer_records[peer]) continue;
-      if ((time(0)-peer_records[peer]->last_message_time)>PEER_KEEPALIVE_INTERVAL) {
+      if ((now_ms/1000-peer_records[peer]->last_message_time)>PEER_KEEPALIVE_INTERVAL) {
 	continue;
       }
       the_peer=peer;
@@ -231,7 +232,7 @@ int random_active_peer()
     for(peer=0;(peer<=last_peer_requested)&&(peer<peer_count);peer++)
       {
 	if (!peer_records[peer]) continue;
-	if ((time(0)-peer_records[peer]->last_message_time)>PEER_KEEPALIVE_INTERVAL) {
+	if ((now_ms/1000-peer_records[peer]->last_message_time)>PEER_KEEPALIVE_INTERVAL) {
 	  continue;
 	}
 	the_peer=peer;
@@ -244,7 +245,7 @@ int random_active_peer()
   for(peer=0;(peer<peer_count);peer++)
     {
       if (!peer_records[peer]) continue;
-      if ((time(0)-peer_records[peer]->last_message_time)>PEER_KEEPALIVE_INTERVAL)
+      if ((now_ms/1000-peer_records[peer]->last_message_time)>PEER_KEEPALIVE_INTERVAL)
 	continue;
       snprintf(&active_peers[apl],1024-apl,"%d, ",peer);
       apl=strlen(active_peers);
@@ -265,7 +266,7 @@ int active_peer_count()
 {
   int count=0;
   for(int peer=0;peer<peer_count;peer++)
-    if ((time(0)-peer_records[peer]->last_message_time)<=PEER_KEEPALIVE_INTERVAL)
+    if ((now_ms/1000-peer_records[peer]->last_message_time)<=PEER_KEEPALIVE_INTERVAL)
       count++;
   return count;
 }
@@ -297,7 +298,7 @@ int request_wanted_content_from_peers(int *offset,int mtu, unsigned char *msg_ou
       // int most_complete_manifest_or_body=-1;
 
       // Don't request anything from a peer that we haven't heard from for a while
-      if ((time(0)-peer_records[peer]->last_message_time)>PEER_KEEPALIVE_INTERVAL)
+      if ((now_ms/1000-peer_records[peer]->last_message_time)>PEER_KEEPALIVE_INTERVAL)
 	continue;
 
       // If we got here, the peer is not currently sending us anything interesting.
@@ -470,6 +471,7 @@ int peer_queue_bundle_tx(struct peer_state *p,struct bundle_record *b, int prior
     */
     
     p->tx_queue_overflow=1;
+    METRIC_INC(tx_queue_overflows);
     return -1;
   }
 }
@@ -37,6 +37,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "sync.h"
 #include "lbard.h"
@@ -220,7 +221,7 @@ int calculate_stored_bundle_priority(int i,int versus)
 
 #ifdef SYNC_BY_BAR
   if (bundles[i].transmit_now)
-    if (bundles[i].transmit_now>=time(0)) {
+    if (bundles[i].transmit_now>=now_ms/1000) {
       this_bundle_priority+=BUNDLE_PRIORITY_TRANSMIT_NOW;
     }
 #endif
@@ -228,7 +229,7 @@ int calculate_stored_bundle_priority(int i,int versus)
   int num_peers_that_dont_have_it=0;
 #ifdef SYNC_BY_BAR
   int peer;
-  time_t peer_observation_time_cutoff=time(0)-PEER_KEEPALIVE_INTERVAL;
+  time_t peer_observation_time_cutoff=now_ms/1000-PEER_KEEPALIVE_INTERVAL;
   for(peer=0;peer<peer_count;peer++) {
     if (peer_records[peer]->last_message_time>=peer_observation_time_cutoff)
       if (!peer_has_this_bundle_or_newer(peer,
@@ -275,7 +276,7 @@ int calculate_stored_bundle_priority(int i,int versus)
   return this_bundle_priority;
 }
 
-int find_highest_priority_bundle()
+int find_highest_priority_bundle_linear()
 {
   long long this_bundle_priority=0;
   long long highest_bundle_priority=0;
@@ -307,6 +308,151 @@ int find_highest_priority_bundle()
   return highest_priority_bundle;
 }
 
+
+/* Re-calculating the priority of every bundle every time we build a packet is
+   far too expensive once there are thousands of bundles.  The only part of
+   the priority that changes from call to call is the less-recently-sent flag,
+   which depends only on last_announced_time.  So we cache the intrinsic
+   priority of each bundle, and only recalculate it when the bundle is
+   registered, or the set of peers changes.
+
+   The cached values are kept in a tournament tree (a max heap over ranges of
+   bundle numbers), so that find_highest_priority_bundle() can jump straight
+   to the next bundle that could possibly beat the current best one, while
+   still visiting bundles in the same order, and thus picking exactly the same
+   bundle as the linear scan in find_highest_priority_bundle_linear().
+
+   Note that last_priority is only updated for the bundles we visit.
+*/
+long long bundle_intrinsic_priorities[MAX_BUNDLES];
+long long *priority_tree=NULL;
+int priority_tree_leaves=0;
+int priority_tree_valid=0;
+
+static void priority_tree_set(int i,long long priority)
+{
+  int n=priority_tree_leaves+i;
+  priority_tree[n]=priority;
+  for(n=n>>1;n;n=n>>1) {
+    long long l=priority_tree[n*2];
+    long long r=priority_tree[n*2+1];
+    priority_tree[n]=(l>r)?l:r;
+  }
+}
+
+static long long bundle_intrinsic_priority(int i)
+{
+  return calculate_bundle_intrinsic_priority(bundles[i].bid_hex,
+					     bundles[i].length,
+					     bundles[i].version,
+					     bundles[i].service,
+					     bundles[i].recipient,
+					     0);
+}
+
+static void priority_tree_rebuild(void)
+{
+  if (!priority_tree) {
+    priority_tree_leaves=1;
+    while(priority_tree_leaves<MAX_BUNDLES) priority_tree_leaves=priority_tree_leaves<<1;
+    priority_tree=malloc(sizeof(long long)*priority_tree_leaves*2);
+    assert(priority_tree);
+  }
+  for(int i=0;i<priority_tree_leaves;i++) {
+    if (i<bundle_count) {
+      bundle_intrinsic_priorities[i]=bundle_intrinsic_priority(i);
+      priority_tree[priority_tree_leaves+i]=bundle_intrinsic_priorities[i];
+    } else
+      priority_tree[priority_tree_leaves+i]=LLONG_MIN;
+  }
+  for(int n=priority_tree_leaves-1;n;n--) {
+    long long l=priority_tree[n*2];
+    long long r=priority_tree[n*2+1];
+    priority_tree[n]=(l>r)?l:r;
+  }
+  priority_tree_valid=1;
+}
+
+// Something has changed that could affect the priority of any bundle,
+// e.g., a peer has arrived or been replaced.
+void bundle_priorities_invalidate(void)
+{
+  priority_tree_valid=0;
+  status_bundles_changed();
+}
+
+// Bundle i has been added or updated
+void bundle_priority_update(int i)
+{
+  status_bundles_changed();
+  if (!priority_tree_valid) return;
+  bundle_intrinsic_priorities[i]=bundle_intrinsic_priority(i);
+  priority_tree_set(i,bundle_intrinsic_priorities[i]);
+}
+
+// The priority of bundle i, without the less-recently-sent bonus, which
+// depends on the bundles it is compared with.  Unlike last_priority, this is
+// always up to date, so it is what the status pages show.
+long long bundle_priority(int i)
+{
+  if (!priority_tree_valid) priority_tree_rebuild();
+  return bundle_intrinsic_priorities[i];
+}
+
+// Find the first bundle number >=from with intrinsic priority > threshold,
+// or -1 if there is none.
+static int priority_tree_find(int node,int node_first,int node_count,
+			      int from,long long threshold)
+{
+  if (node_first+node_count<=from) return -1;
+  if (priority_tree[node]<=threshold) return -1;
+  if (node_count==1) return node_first;
+  int half=node_count>>1;
+  int r=priority_tree_find(node*2,node_first,half,from,threshold);
+  if (r>=0) return r;
+  return priority_tree_find(node*2+1,node_first+half,half,from,threshold);
+}
+
+int find_highest_priority_bundle()
+{
+#ifdef SYNC_BY_BAR
+  return find_highest_priority_bundle_linear();
+#else
+  if (debug_noprioritisation) return find_highest_priority_bundle_linear();
+  if (!bundle_count) return -1;
+  if (!priority_tree_valid) priority_tree_rebuild();
+
+  // The first bundle is always compared against itself, and so gets the
+  // less-recently-sent bonus.
+  int highest_priority_bundle=0;
+  long long highest_bundle_priority=bundle_intrinsic_priorities[0]
+    +BUNDLE_PRIORITY_SENT_LESS_RECENTLY;
+  bundles[0].last_priority=highest_bundle_priority;
+  bundles[0].num_peers_that_dont_have_it=0;
+  
+  int i=0;
+  // Only bundles that could beat the current best, even with the bonus, are
+  // worth looking at.
+  while((i=priority_tree_find(1,0,priority_tree_leaves,i+1,
+			      highest_bundle_priority
+			      -BUNDLE_PRIORITY_SENT_LESS_RECENTLY))>=0) {
+    if (i>=bundle_count) break;
+    long long this_bundle_priority=bundle_intrinsic_priorities[i];
+    long long time_delta=bundles[highest_priority_bundle].last_announced_time
+      -bundles[i].last_announced_time;
+    if (time_delta>=0LL) this_bundle_priority+=BUNDLE_PRIORITY_SENT_LESS_RECENTLY;
+    bundles[i].last_priority=this_bundle_priority;
+    bundles[i].num_peers_that_dont_have_it=0;
+    if (this_bundle_priority>highest_bundle_priority) {
+      highest_bundle_priority=this_bundle_priority;
+      highest_priority_bundle=i;
+    }
+  }
+  
+  return highest_priority_bundle;
+#endif
+}
+
 #ifdef SYNC_BY_BAR
 int bundle_bar_counter=0;
 int find_highest_priority_bar()
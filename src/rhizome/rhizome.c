@@ -99,21 +99,34 @@ int load_rhizome_db_line_bytes=0;
 long long load_rhizome_db_socket_timeout=0;
 long long load_rhizome_db_last_socket_open=0;
 
+static int load_rhizome_db_lines(char *servald_server,
+				 char *credential, char *token);
+
 int load_rhizome_db_async(char *servald_server,
 			  char *credential, char *token)
+{
+  // Add all the bundles we read this time to the sync tree together
+  sync_tree_bulk_start();
+  int r=load_rhizome_db_lines(servald_server,credential,token);
+  sync_tree_bulk_finish();
+  return r;
+}
+
+static int load_rhizome_db_lines(char *servald_server,
+				 char *credential, char *token)
 {
   // Make sure we have a socket, and that it isn't stale
-  if (load_rhizome_db_socket_timeout<gettime_ms()) {
+  if (load_rhizome_db_socket_timeout<now_ms) {
     if (load_rhizome_db_socket>=0) close(load_rhizome_db_socket);
     load_rhizome_db_socket=-1;
   }
   if (load_rhizome_db_socket<0) {
-    if (gettime_ms()>(load_rhizome_db_last_socket_open+5000)) {
-      load_rhizome_db_last_socket_open=gettime_ms();
+    if (now_ms>(load_rhizome_db_last_socket_open+5000)) {
+      load_rhizome_db_last_socket_open=now_ms;
       if (load_rhizome_db_async_start(servald_server,credential,token)<0)
 	return -1;
       else
-	load_rhizome_db_socket_timeout=gettime_ms()+5000;
+	load_rhizome_db_socket_timeout=now_ms+5000;
     } else return -1;
   }
   
@@ -157,7 +170,7 @@ int load_rhizome_db_async(char *servald_server,
 	} 
       }
       // Reset timeout
-      load_rhizome_db_socket_timeout=gettime_ms()+5000;
+      load_rhizome_db_socket_timeout=now_ms+5000;
       break;
     case 1: // end of connection, socket already closed
       load_rhizome_db_socket=-1;
@@ -181,70 +194,6 @@ int hex_byte_value(char *hexstring)
   return strtoll(hex,NULL,16);
 }
 
-int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
-			  unsigned char *body_data,int body_length,
-			  char *servald_server,char *credential)
-{
-  /* Push to rhizome.
-
-     We don't need to mark the associated bundle as needing immediate announcement,
-     as this will happen as a natural consequence of the Rhizome database being 
-     updated.  Similarly, if the insert fails for some reason, then the sender will
-     automatically keep trying to send it according to its regular rotation.
-   */
-
-  printf("CHECKPOINT: %s:%d %s()\n",__FILE__,__LINE__,__FUNCTION__);
-
-#ifdef NOT_DEFINED
-  char filename[1024];
-  snprintf(filename,1024,"%08lx.manifest",time(0));
-  printf(">>> %s Writing manifest to %s\n",timestamp_str(),filename);
-  FILE *f=fopen(filename,"w");
-  fwrite(manifest_data,manifest_length,1,f);
-  fclose(f);
-  snprintf(filename,1024,"%08lx.payload",time(0));
-  f=fopen(filename,"w");
-  fwrite(body_data,body_length,1,f);
-  fclose(f);
-#endif
-  
-  printf("Submitting rhizome bundle: manifest len=%d, body len=%d\n",
-	  manifest_length,body_length);
-
-  int result_code=http_post_bundle(servald_server,credential,
-				   "/rhizome/import",
-				   manifest_data,manifest_length,
-				   body_data,body_length,
-				   15000);  
-  
-  if(result_code<200||result_code>202) {
-    printf("POST bundle to rhizome failed: http result = %d\n",result_code);
-
-    if (debug_insert) {
-      char filename[1024];
-      snprintf(filename,1024,"/tmp/lbard.rejected.manifest");
-      FILE *f=fopen(filename,"w");
-      if (f) { fwrite(manifest_data,manifest_length,1,f); fclose(f); }
-      snprintf(filename,1024,"/tmp/lbard.rejected.body");
-      f=fopen(filename,"w");
-      if (f) { fwrite(body_data,body_length,1,f); fclose(f); }
-      snprintf(filename,1024,"/tmp/lbard.rejected.result");
-      f=fopen(filename,"w");
-      if (f) {
-	fprintf(f,"http result code = %d\n",result_code);
-	fclose(f);
-      }
-    }
-    return result_code;
-  }
-  else
-    printf("http result code = %d\n",result_code);
-    
-  
-  return 0;
-}
-
-
 int manifest_extract_bid(unsigned char *manifest_data,char *bid_hex)
 {
   // Find ID= at start of manifest and return the BID
@@ -0,0 +1,298 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015 Serval Project Inc.
+
+Import of bundles we have received into servald's Rhizome store.
+
+Posting a bundle to servald can take a long time for a big bundle, or if
+servald is busy, and we must not stop reading from the radio while that
+happens, or the radio's buffer will overflow and we will lose packets.  So
+completed bundles are put in a queue here, and imported in the background one
+at a time.  We hold on to each bundle until servald has accepted it, and if
+the import fails (e.g., because servald is restarting), we try again later,
+backing off each time.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+#define RHIZOME_IMPORT_MAX_QUEUE 16
+// Don't hold more than this many bytes of bundles waiting for import.  We
+// only post bodies of up to 5MB (see http_post_bundle_request()), so this is
+// room for two of the biggest, one with servald and one waiting behind it,
+// with 2MB left over for the small bundles that keep arriving meanwhile.
+// Added to the 8MB of bundle_cache_max_bytes, the bundles we hold in memory
+// stay under 20MB, whatever the radio brings in.
+#define RHIZOME_IMPORT_MAX_BYTES (12*1024*1024)
+#define RHIZOME_IMPORT_MAX_ATTEMPTS 6
+#define RHIZOME_IMPORT_FIRST_RETRY_MS 1000
+#define RHIZOME_IMPORT_MAX_RETRY_MS 60000
+#define RHIZOME_IMPORT_TIMEOUT_MS 15000
+
+struct rhizome_import {
+  unsigned char *manifest;
+  int manifest_length;
+  unsigned char *body;
+  int body_length;
+  char bid_hex[64+1];
+  long long version;
+
+  char *servald_server;
+  char *credential;
+
+  int attempts;
+  long long next_attempt;
+};
+
+struct rhizome_import *rhizome_imports[RHIZOME_IMPORT_MAX_QUEUE];
+int rhizome_import_count=0;
+long long rhizome_import_bytes=0;
+// The import that servald is working on, if any
+struct rhizome_import *rhizome_import_in_flight=NULL;
+int rhizome_import_timer=-1;
+
+int rhizome_imports_succeeded=0;
+int rhizome_imports_retried=0;
+int rhizome_imports_failed=0;
+
+static void rhizome_import_free(struct rhizome_import *import)
+{
+  rhizome_import_bytes-=import->manifest_length+import->body_length;
+  free(import->manifest);
+  free(import->body);
+  free(import);
+}
+
+static void rhizome_import_remove(struct rhizome_import *import)
+{
+  for(int i=0;i<rhizome_import_count;i++)
+    if (rhizome_imports[i]==import) {
+      for(;i<rhizome_import_count-1;i++) rhizome_imports[i]=rhizome_imports[i+1];
+      rhizome_import_count--;
+      break;
+    }
+  rhizome_import_free(import);
+}
+
+static void rhizome_import_save_rejected(struct rhizome_import *import,int result_code)
+{
+  char filename[1024];
+  snprintf(filename,1024,"/tmp/lbard.rejected.manifest");
+  FILE *f=fopen(filename,"w");
+  if (f) { fwrite(import->manifest,import->manifest_length,1,f); fclose(f); }
+  snprintf(filename,1024,"/tmp/lbard.rejected.body");
+  f=fopen(filename,"w");
+  if (f) { fwrite(import->body,import->body_length,1,f); fclose(f); }
+  snprintf(filename,1024,"/tmp/lbard.rejected.result");
+  f=fopen(filename,"w");
+  if (f) {
+    fprintf(f,"http result code = %d\n",result_code);
+    fclose(f);
+  }
+}
+
+static void rhizome_import_done(struct http_request *r)
+{
+  struct rhizome_import *import=r->context;
+  int result_code=r->response_code;
+  rhizome_import_in_flight=NULL;
+
+  if ((result_code>=200)&&(result_code<=202)) {
+    printf("http result code = %d\n",result_code);
+    rhizome_imports_succeeded++;
+    // Only now that servald has it do we count it as received
+    char bid_prefix[8*2+1];
+    snprintf(bid_prefix,sizeof(bid_prefix),"%s",import->bid_hex);
+    progress_log_bundle_receipt(bid_prefix,import->version);
+    rhizome_import_remove(import);
+  } else {
+    printf("POST bundle %s*/%lld to rhizome failed: http result = %d\n",
+	   import->bid_hex,import->version,result_code);
+    import->attempts++;
+
+    // servald has looked at it and said no, so there is no point asking again
+    int rejected=(result_code>=400)&&(result_code<500);
+    if (rejected||(import->attempts>=RHIZOME_IMPORT_MAX_ATTEMPTS)) {
+      fprintf(stderr,"Giving up on importing %s*/%lld after %d attempts\n",
+	      import->bid_hex,import->version,import->attempts);
+      if (debug_insert) rhizome_import_save_rejected(import,result_code);
+      rhizome_imports_failed++;
+      METRIC_INC(insert_failures);
+      rhizome_import_remove(import);
+    } else {
+      long long delay=RHIZOME_IMPORT_FIRST_RETRY_MS<<(import->attempts-1);
+      if (delay>RHIZOME_IMPORT_MAX_RETRY_MS) delay=RHIZOME_IMPORT_MAX_RETRY_MS;
+      // Add a bit of jitter, so that we don't keep hitting servald at the
+      // same moment as whatever else it is doing.
+      delay+=random()%(delay/4+1);
+      import->next_attempt=now_ms+delay;
+      rhizome_imports_retried++;
+    }
+  }
+
+  rhizome_import_service();
+}
+
+static void rhizome_import_timer_expired(void)
+{
+  rhizome_import_service();
+}
+
+// Start the next import that is due, if servald isn't already busy with one,
+// and arrange to be called again when the next one will be due.
+int rhizome_import_service(void)
+{
+  if (rhizome_import_timer==-1)
+    rhizome_import_timer=timer_register("import",rhizome_import_timer_expired);
+  if (rhizome_import_in_flight) return 0;
+
+  long long now=now_ms;
+  long long next_due=-1;
+  for(int i=0;i<rhizome_import_count;i++) {
+    struct rhizome_import *import=rhizome_imports[i];
+    if (import->next_attempt>now) {
+      if ((next_due==-1)||(import->next_attempt<next_due))
+	next_due=import->next_attempt;
+      continue;
+    }
+
+    printf("Submitting rhizome bundle: manifest len=%d, body len=%d%s\n",
+	   import->manifest_length,import->body_length,
+	   import->attempts?" (retrying)":"");
+    struct http_request *r=http_post_bundle_request(import->servald_server,
+						    import->credential,
+						    "/rhizome/import",
+						    import->manifest,
+						    import->manifest_length,
+						    import->body,import->body_length,
+						    RHIZOME_IMPORT_TIMEOUT_MS);
+    if (!r) {
+      fprintf(stderr,"Could not build import request for %s*/%lld\n",
+	      import->bid_hex,import->version);
+      rhizome_imports_failed++;
+      METRIC_INC(insert_failures);
+      rhizome_import_remove(import);
+      i--;
+      continue;
+    }
+    rhizome_import_in_flight=import;
+    http_request_start(r,rhizome_import_done,import);
+    // We'll be called again when it finishes
+    timer_cancel(rhizome_import_timer);
+    return 1;
+  }
+
+  if (next_due>=0) timer_schedule(rhizome_import_timer,next_due);
+  else timer_cancel(rhizome_import_timer);
+  return 0;
+}
+
+/* Queue a bundle for import.  The body must be a malloc()'d buffer, which the
+   import queue takes ownership of, so that we don't need to copy what might be
+   several MB: saw_piece() hands over the partial's buffer.  Returns 0 if the
+   bundle was queued, or -1 if it couldn't be, in which case the body is
+   freed.
+*/
+int rhizome_queue_import(unsigned char *manifest_data,int manifest_length,
+			 unsigned char *body,int body_length,
+			 char *servald_server,char *credential)
+{
+  if (!body) {
+    // Empty bundles don't have a body buffer
+    body=malloc(1);
+    assert(body);
+  }
+
+  if ((rhizome_import_count>=RHIZOME_IMPORT_MAX_QUEUE)
+      ||(rhizome_import_bytes+manifest_length+body_length>RHIZOME_IMPORT_MAX_BYTES)) {
+    fprintf(stderr,"Rhizome import queue is full (%d bundles, %lld bytes)\n",
+	    rhizome_import_count,rhizome_import_bytes);
+    free(body);
+    return -1;
+  }
+
+  struct rhizome_import *import=calloc(1,sizeof(struct rhizome_import));
+  assert(import);
+  import->manifest=malloc(manifest_length+1);
+  assert(import->manifest);
+  bcopy(manifest_data,import->manifest,manifest_length);
+  // (manifest_get_field() needs the manifest to be terminated)
+  import->manifest[manifest_length]=0;
+  import->manifest_length=manifest_length;
+  import->body=body;
+  import->body_length=body_length;
+  char field[1024];
+  if (!manifest_get_field(import->manifest,manifest_length,"id",field))
+    snprintf(import->bid_hex,sizeof(import->bid_hex),"%.64s",field);
+  if (!manifest_get_field(import->manifest,manifest_length,"version",field))
+    import->version=strtoll(field,NULL,10);
+  import->servald_server=servald_server;
+  import->credential=credential;
+  rhizome_import_bytes+=manifest_length+body_length;
+
+  // If we already have this version of the bundle waiting, then there is no
+  // need to import it twice.
+  for(int i=0;i<rhizome_import_count;i++)
+    if (import->bid_hex[0]
+	&&(!strcasecmp(rhizome_imports[i]->bid_hex,import->bid_hex))
+	&&(rhizome_imports[i]->version==import->version)) {
+      rhizome_import_free(import);
+      return 0;
+    }
+
+  rhizome_imports[rhizome_import_count++]=import;
+  rhizome_import_service();
+  return 0;
+}
+
+int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
+			  unsigned char *body_data,int body_length,
+			  char *servald_server,char *credential)
+{
+  /* Push to rhizome.
+
+     We don't need to mark the associated bundle as needing immediate announcement,
+     as this will happen as a natural consequence of the Rhizome database being
+     updated.  Similarly, if the insert fails for some reason, then the sender will
+     automatically keep trying to send it according to its regular rotation.
+   */
+  unsigned char *body=malloc(body_length+1);
+  assert(body);
+  bcopy(body_data,body,body_length);
+  return rhizome_queue_import(manifest_data,manifest_length,body,body_length,
+			      servald_server,credential);
+}
+
+int rhizome_import_pending(void)
+{
+  return rhizome_import_count;
+}
+
+int rhizome_import_report_json(FILE *f)
+{
+  fprintf(f,"\"rhizome_import\": { \"queued\": %d, \"bytes\": %lld,"
+	  " \"succeeded\": %d, \"retried\": %d, \"failed\": %d }",
+	  rhizome_import_count,rhizome_import_bytes,
+	  rhizome_imports_succeeded,rhizome_imports_retried,rhizome_imports_failed);
+  return 0;
+}
@@ -0,0 +1,133 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015 Serval Project Inc.
+
+Counters for monitoring LBARD in the field, served at /metrics in the
+Prometheus text format.  The counters themselves are in include/metrics.h,
+and are bumped where things happen.  A few things that were already counted
+for status.json (the bundle cache and rhizome imports) are reported from the
+counters they already had.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+struct metrics metrics;
+
+static const long long metrics_latency_bounds[METRICS_LATENCY_BUCKETS]=METRICS_LATENCY_BOUNDS;
+
+// Record how long a request to servald took, from when it was made
+void metrics_observe_servald_latency(long long ms,int ok)
+{
+  if (ok) metrics.servald_requests_ok++; else metrics.servald_requests_failed++;
+  if (ms<0) ms=0;
+  metrics.servald_latency_sum_ms+=ms;
+  for(int i=0;i<METRICS_LATENCY_BUCKETS;i++)
+    if (ms<=metrics_latency_bounds[i]) {
+      metrics.servald_latency_buckets[i]++;
+      break;
+    }
+}
+
+static void metrics_counter(FILE *f,char *name,char *help,unsigned long long value)
+{
+  fprintf(f,"# HELP %s %s\n# TYPE %s counter\n%s %llu\n",name,help,name,name,value);
+}
+
+int metrics_report(FILE *f)
+{
+  metrics_counter(f,"lbard_packets_sent_total","Packets sent by the radio",
+		  metrics.packets_sent);
+  metrics_counter(f,"lbard_packet_bytes_sent_total",
+		  "Bytes of packets sent by the radio, including FEC",
+		  metrics.packet_bytes_sent);
+  metrics_counter(f,"lbard_packets_received_total",
+		  "Packets received that passed FEC",metrics.packets_received);
+  metrics_counter(f,"lbard_packets_rejected_total",
+		  "Packets received that failed FEC",metrics.packets_rejected);
+  metrics_counter(f,"lbard_rs_corrected_symbols_total",
+		  "Symbols corrected by Reed-Solomon in received packets",
+		  metrics.rs_corrected_symbols);
+
+  fprintf(f,"# HELP lbard_tx_message_bytes_total Bytes sent, by message type\n"
+	  "# TYPE lbard_tx_message_bytes_total counter\n");
+  for(int i=0;i<256;i++)
+    if (metrics.tx_bytes_by_type[i]) {
+      if (i>' '&&i<0x7f&&i!='"'&&i!='\\')
+	fprintf(f,"lbard_tx_message_bytes_total{type=\"%c\"} %llu\n",
+		i,metrics.tx_bytes_by_type[i]);
+      else
+	fprintf(f,"lbard_tx_message_bytes_total{type=\"0x%02x\"} %llu\n",
+		i,metrics.tx_bytes_by_type[i]);
+    }
+
+  metrics_counter(f,"lbard_bundle_cache_hits_total",
+		  "Bundles found in the bundle cache",bundle_cache_hits);
+  metrics_counter(f,"lbard_bundle_cache_misses_total",
+		  "Bundles that had to be fetched from servald",bundle_cache_misses);
+
+  fprintf(f,"# HELP lbard_servald_request_duration_ms Time taken by requests to servald\n"
+	  "# TYPE lbard_servald_request_duration_ms histogram\n");
+  unsigned long long cumulative=0;
+  for(int i=0;i<METRICS_LATENCY_BUCKETS;i++) {
+    cumulative+=metrics.servald_latency_buckets[i];
+    fprintf(f,"lbard_servald_request_duration_ms_bucket{le=\"%lld\"} %llu\n",
+	    metrics_latency_bounds[i],cumulative);
+  }
+  unsigned long long count=metrics.servald_requests_ok+metrics.servald_requests_failed;
+  fprintf(f,"lbard_servald_request_duration_ms_bucket{le=\"+Inf\"} %llu\n",count);
+  fprintf(f,"lbard_servald_request_duration_ms_sum %llu\n",metrics.servald_latency_sum_ms);
+  fprintf(f,"lbard_servald_request_duration_ms_count %llu\n",count);
+  metrics_counter(f,"lbard_servald_request_failures_total",
+		  "Requests to servald that got no answer",
+		  metrics.servald_requests_failed);
+
+  metrics_counter(f,"lbard_partials_completed_total",
+		  "Bundles we have received all of",metrics.partials_completed);
+  metrics_counter(f,"lbard_insert_failures_total",
+		  "Received bundles that could not be imported into rhizome",
+		  metrics.insert_failures);
+  metrics_counter(f,"lbard_tx_queue_overflows_total",
+		  "Bundles that didn't fit in a peer's TX queue",
+		  metrics.tx_queue_overflows);
+  metrics_counter(f,"lbard_tx_queue_overflow_resyncs_total",
+		  "Sync restarts after a peer's TX queue overflowed",
+		  metrics.tx_queue_overflow_resyncs);
+  return 0;
+}
+
+int http_report_metrics(struct httpd_connection *c)
+{
+  char *data=NULL;
+  size_t len=0;
+  FILE *f=open_memstream(&data,&len);
+  if (!f) {
+    char *m="HTTP/1.0 500 Couldn't report metrics\nServer: Serval LBARD\n\n";
+    http_respond(c,m,strlen(m));
+    return -1;
+  }
+  metrics_report(f);
+  fclose(f);
+  http_send_buffer(c,data,len,"text/plain; version=0.0.4");
+  free(data);
+  return 0;
+}
@@ -47,40 +47,27 @@ int message_buffer_length=0;
 
 
 int generate_segment_progress_string(int stream_length,
-				     struct segment_list *s, char *progress)
+				     struct partial_stream *s, char *progress)
 {
   // Apply some sanity when dealing with manifests where we don't know the length yet.
   if (stream_length<1) stream_length=1024;
 
   int bin;
   
-  for(bin=0;bin<10;bin++) progress[bin]=' ';
-  
-
-  
-  while(s) {
-    int bin;
-
-    for(bin=0;bin<10;bin++) {
-      int start_of_bin=stream_length*bin/10;
-      int end_of_bin=stream_length*(bin+1)/10-1;
-      if ((s->start_offset<=start_of_bin)
-	  &&((s->start_offset+s->length-1)>=end_of_bin))
-	{
-	  progress[bin]='#';
-	}
-      else if ((s->start_offset>=start_of_bin)
-	       &&((s->start_offset+s->length-1)<end_of_bin)) {
-	switch(progress[bin]) {
-	case ' ': progress[bin]='.'; break;
-	case '.': progress[bin]=':'; break;
-	case ':': progress[bin]='+'; break;
-	case '#': break;
-	default: progress[bin]='?'; break;
-	}
-      }
-    }
-    s=s->next;
+  for(bin=0;bin<10;bin++) {
+    int start_of_bin=stream_length*bin/10;
+    int end_of_bin=stream_length*(bin+1)/10-1;
+    int first_block=start_of_bin/64;
+    int last_block=end_of_bin/64;
+    int blocks=last_block-first_block+1;
+    int have=0;
+    for(int block=first_block;block<=last_block;block++)
+      if (partial_stream_have_block(s,block)) have++;
+    if (have==blocks) progress[bin]='#';
+    else if (have*3>=blocks*2) progress[bin]='+';
+    else if (have*3>=blocks) progress[bin]=':';
+    else if (have) progress[bin]='.';
+    else progress[bin]=' ';
   }
   return 0;
 }
@@ -95,23 +82,16 @@ int generate_progress_string(struct partial_bundle *partial,
   // Draw up template
   snprintf(progress,80,"M          /B           ");
   
-  generate_segment_progress_string(partial->manifest_length,partial->manifest_segments,
+  generate_segment_progress_string(partial->manifest_length,&partial->manifest_stream,
 				   &progress[1]);
-  generate_segment_progress_string(partial->body_length,partial->body_segments,
+  generate_segment_progress_string(partial->body_length,&partial->body_stream,
 				   &progress[13]);
 
 
-  int manifest_bytes =0,body_bytes=0;
-  struct segment_list *s=partial->manifest_segments;
-  while(s) {
-    manifest_bytes+=s->length;
-    s=s->next;
-  }
-  s=partial->body_segments;
-  while(s) {
-    body_bytes+=s->length;
-    s=s->next;
-  }
+  int manifest_bytes=partial_stream_bytes_received(&partial->manifest_stream,
+						   partial->manifest_length);
+  int body_bytes=partial_stream_bytes_received(&partial->body_stream,
+					       partial->body_length);
 
   if (partial->recent_bytes)
     snprintf(&progress[24],54," %d/%d, %d/%d  [%d since last report]",
@@ -236,7 +216,7 @@ int progress_log_bundle_receipt(char *bid_prefix, long long version)
     received_bundles[i]=received_bundles[i-1];
 
   // Record newly received bundle
-  received_bundles[0].rx_time=gettime_ms();
+  received_bundles[0].rx_time=now_ms;
   received_bundles[0].version=version;
   received_bundles[0].bid_prefix_hex=strdup(bid_prefix);
   received_bundles[0].reportedP=0;
@@ -257,7 +237,7 @@ int progress_report_bundle_receipts(FILE *f)
       fprintf(f,"Received %s*/%-16lld @ T%lldms %s\n",
 	      received_bundles[i].bid_prefix_hex,
 	      received_bundles[i].version,
-	      received_bundles[i].rx_time-gettime_ms(),
+	      received_bundles[i].rx_time-now_ms,
 	      received_bundles[i].reportedP?"":"<fresh>");
       received_bundles[i].reportedP=1;
     }
@@ -38,6 +38,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <assert.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "sync.h"
 #include "lbard.h"
@@ -52,25 +53,82 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define STATUS_FILE_WITH_NAMES_AND_BUNDLES "/tmp/lbard_status_bn.html"
 #define STATUS_FILE_WITH_BUNDLES "/tmp/lbard_status_b.html"
 
-struct b {
-  int order;
-  long long priority;
-};
+/*
+  The status pages used to be written out to files in /tmp every few seconds,
+  whether or not anyone was looking at them, sorting and rendering the whole
+  bundle table four times over each time.  With 10k bundles that was the
+  biggest thing we did all the time, and on a mesh extender the files live in
+  flash.
+
+  Now they are rendered in memory when the httpd is asked for them, and the
+  render is kept until something it shows changes (status_changed()), or it
+  gets too old.  Even if things are changing all the time, we don't render a
+  page more than once every STATUS_RERENDER_INTERVAL ms.  The sorted bundle
+  table is kept separately, since it only changes when the bundles do
+  (status_bundles_changed()), and while we are importing lots of bundles it
+  is only rendered every STATUS_BUNDLE_TABLE_RERENDER_INTERVAL ms.  The table
+  of peers is kept separately too, since status_dump() replaces the RX
+  statistics it shows every few seconds (status_peers_generation), and the
+  pieces are only put back together when one of them has changed.
+
+  The old files can still be written every so often (statusfiles=<seconds>)
+  for anything that scrapes them.
+*/
+#define STATUS_RERENDER_INTERVAL 1000
+#define STATUS_PAGE_MAX_AGE 10000
+// Bundle priorities only change along with the bundles and peers, but while
+// we are importing lots of bundles we only re-sort the table now and then.
+#define STATUS_BUNDLE_TABLE_RERENDER_INTERVAL 10000
+#define STATUS_BUNDLE_TABLE_MAX_AGE 30000
+
+// One for each combination of RESOLVE_SIDS and SHOW_BUNDLE_STORE, plus JSON
+struct status_page status_pages[STATUS_PAGE_JSON+1];
+// The HTML pages below the peer table
+struct status_page status_page_bodies[STATUS_PAGE_JSON];
+struct status_page status_peer_table;
+struct status_page status_bundle_table;
+
+unsigned int status_generation=1;
+unsigned int status_peers_generation=1;
+unsigned int status_bundles_generation=1;
 
-char *msgs[1024];
-long long msg_times[1024];
-int msg_count=0;
+int status_file_interval=0;
+long long status_files_written=0;
+
+void status_changed(void)
+{
+  status_generation++;
+}
+
+void status_bundles_changed(void)
+{
+  status_bundles_generation++;
+  status_generation++;
+}
+
+// Recently announced material, as a ring, so that logging it doesn't malloc()
+#define STATUS_LOG_ENTRIES 256
+#define STATUS_LOG_LENGTH 128
+char status_log_msgs[STATUS_LOG_ENTRIES][STATUS_LOG_LENGTH];
+long long status_log_times[STATUS_LOG_ENTRIES];
+unsigned int status_log_count=0;
 
 int status_log(char *msg)
 {
-  if (msg_count<1024) {
-    msgs[msg_count]=strdup(msg);
-    msg_times[msg_count++]=gettime_ms();
-    return 0;
-  }
-  return -1;
+  int slot=status_log_count%STATUS_LOG_ENTRIES;
+  strncpy(status_log_msgs[slot],msg,STATUS_LOG_LENGTH-1);
+  status_log_msgs[slot][STATUS_LOG_LENGTH-1]=0;
+  status_log_times[slot]=now_ms;
+  status_log_count++;
+  status_changed();
+  return 0;
 }
 
+struct b {
+  int order;
+  long long priority;
+};
+
 int compare_b(const void *a,const void *b)
 {
   const struct b *aa=a;
@@ -81,20 +139,357 @@ int compare_b(const void *a,const void *b)
   return 0;
 }
 
+// Keep the EEPROM information in memory, and only read it again if the file
+// changes.
+char *eeprom_text=NULL;
+int eeprom_text_len=0;
+time_t eeprom_text_mtime=0;
+off_t eeprom_text_size=-1;
+
+static void status_refresh_eeprom(void)
+{
+  struct stat st;
+  if (stat("/tmp/eeprom.data",&st)) {
+    free(eeprom_text); eeprom_text=NULL; eeprom_text_len=0;
+    eeprom_text_size=-1;
+    return;
+  }
+  if (eeprom_text&&(st.st_mtime==eeprom_text_mtime)&&(st.st_size==eeprom_text_size))
+    return;
+  eeprom_text_mtime=st.st_mtime;
+  eeprom_text_size=st.st_size;
+  if (!eeprom_text) eeprom_text=malloc(16384);
+  assert(eeprom_text);
+  eeprom_text_len=0;
+  FILE *e=fopen("/tmp/eeprom.data","r");
+  if (e) {
+    int bytes=fread(eeprom_text,1,16384,e);
+    if (bytes>0) eeprom_text_len=bytes;
+    fclose(e);
+  }
+}
+
+static int status_render_bundle_table(FILE *f,int flags)
+{
+  struct b *order=malloc(sizeof(struct b)*(bundle_count?bundle_count:1));
+  assert(order);
+  int i,n;
+
+  for (i=0;i<bundle_count;i++) {
+    order[i].order=i;
+    order[i].priority=bundle_priority(i);
+  }
+  qsort(order,bundle_count,sizeof(struct b),compare_b);
+
+  fprintf(f,"<h2>Bundles in local store</h2>\n<table border=1 padding=2 spacing=2><tr><th>Bundle #</th><th>BID Prefix</th><th>Service</th><th>Bundle version</th><th>Bundle length</th><th>Priority</th><th># peers who don't have this bundle</th></tr>\n");
+  for (n=0;n<bundle_count;n++) {
+    i=order[n].order;
+    fprintf(f,"<tr><td>#%d</td><td>%s</td><td>%s</td><td>%lld</td><td>%lld</td><td>0x%08llx (%lld)</td><td>%d</td></tr>\n",
+	    i,
+	    bundles[i].bid_hex,
+	    bundles[i].service,
+	    bundles[i].version,
+	    bundles[i].length,
+	    order[n].priority,order[n].priority,
+	    bundles[i].num_peers_that_dont_have_it);
+  }
+  fprintf(f,"</table>\n");
+  free(order);
+  return 0;
+}
+
+typedef int (*status_renderer)(FILE *f,int flags);
+
+// Render into page, replacing whatever was there
+static int status_page_render(struct status_page *page,status_renderer render,
+			      int flags,unsigned int generation)
+{
+  char *data=NULL;
+  size_t len=0;
+  FILE *f=open_memstream(&data,&len);
+  if (!f) {
+    perror("open_memstream() for status page");
+    return -1;
+  }
+  render(f,flags);
+  fclose(f);
+  free(page->data);
+  page->data=data;
+  page->len=len;
+  page->generation=generation;
+  page->rendered=now_ms;
+  return 0;
+}
+
+static int status_page_fresh(struct status_page *page,unsigned int generation,
+			     long long min_age,long long max_age)
+{
+  if (!page->data) return 0;
+  long long age=now_ms-page->rendered;
+  if (age<0) return 0;
+  if (age<min_age) return 1;
+  return (page->generation==generation)&&(age<max_age);
+}
+
 long long status_dump_epoch=0;
+
+static int status_render_peer_table(FILE *f,int flags)
+{
+  int i;
+
+
+  // Show peer reachability with indication of activity
+  fprintf(f,"<h2>Mesh Extenders Reachable via Radio</h2>\n<table border=1 padding=2 spacing=2><tr><th>Mesh Extender ID</th><th>Performance</th><th>Sending</th></tr>\n");
+  for (i=0;i<peer_count;i++) {
+    long long age=(now_ms/1000-peer_records[i]->last_message_time);
+    if (age>30) continue;
+    float mean_rssi=-1;
+    if (peer_records[i]->status_rssi_counter)
+      mean_rssi=peer_records[i]->status_rssi_accumulator*1.0/peer_records[i]->status_rssi_counter;
+    int missed_packets=peer_records[i]->status_missed_packet_count;
+    int received_packets=peer_records[i]->status_rssi_counter;
+    float percent_received=0;
+    if (received_packets+missed_packets) {
+      percent_received=received_packets*100.0/(received_packets+missed_packets);
+    }
+    char *colour="#00ff00";
+    if (percent_received<10) colour="#ff4f00";
+    else if (percent_received<50) colour="#ffff00";
+    else if (percent_received<80) colour="#c0c0c0";
+
+    fprintf(f,"<tr><td>%s*</td><td bgcolor=\"%s\">%lld sec, %d/%d received (%2.1f%% loss), mean RSSI = %.0f</td><td>",
+	    peer_records[i]->sid_prefix,colour,
+	    age,received_packets,received_packets+missed_packets,100-percent_received,mean_rssi);
+    if (peer_records[i]->tx_bundle!=-1) {
+      char bid[10];
+      int j;
+      for(j=0;j<8;j++) bid[j]=bundles[peer_records[i]->tx_bundle].bid_hex[j];
+      bid[8]='*'; bid[9]=0;
+      fprintf(f,"%s/%lld (from M=%d/P=%d)",
+	      bid,bundles[peer_records[i]->tx_bundle].version,
+	      peer_records[i]->tx_bundle_manifest_offset_hard_lower_bound,
+	      peer_records[i]->tx_bundle_body_offset_hard_lower_bound);
+    }
+    fprintf(f,"</td></tr>\n");
+  }
+  fprintf(f,"</table>\n");
+  return 0;
+}
+
+static int status_render_html(FILE *f,int flags)
+{
+  int i;
+
+  // Show current transfer progress bars
+  fprintf(f,"<h2>Current Bundles being received</h2>\n");
+  fprintf(f,"<pre>\n");
+  show_progress(f,1);
+  fprintf(f,"</pre>\n");
+
+  // And EEPROM data (from /tmp/eeprom.data)
+  status_refresh_eeprom();
+  if (eeprom_text) {
+    fprintf(f,"<h2>EEPROM Radio information</h2>\n<pre>\n");
+    if (eeprom_text_len) fwrite(eeprom_text,eeprom_text_len,1,f);
+    fprintf(f,"</pre>\n");
+  }
+
+  if (flags&SHOW_BUNDLE_STORE) {
+    if (!status_page_fresh(&status_bundle_table,status_bundles_generation,
+			   STATUS_BUNDLE_TABLE_RERENDER_INTERVAL,
+			   STATUS_BUNDLE_TABLE_MAX_AGE))
+      status_page_render(&status_bundle_table,status_render_bundle_table,0,
+			 status_bundles_generation);
+    if (status_bundle_table.data)
+      fwrite(status_bundle_table.data,status_bundle_table.len,1,f);
+
+#ifdef SYNC_BY_BAR
+    fprintf(f,"<h2>Bundles held by peers</h2>\n<table border=1 padding=2 spacing=2><tr><th>Peer</th><th>Bundle prefix</th><th>Bundle version</th></tr>\n");
+
+    for(int peer=0;peer<peer_count;peer++) {
+      // Don't show timed out peers
+      if ((now_ms/1000-peer_records[peer]->last_message_time)>PEER_KEEPALIVE_INTERVAL)
+	continue;
+
+      char *peer_prefix=peer_records[peer]->sid_prefix;
+      for(i=0;i<peer_records[peer]->bundle_count;i++) {
+	if (peer_records[peer]->partials[i].bid_prefix) {
+	  // Here is a bundle in flight
+	  char *bid_prefix=peer_records[peer]->bid_prefixes[i];
+	  long long version=peer_records[peer]->versions[i];
+	  fprintf(f,"<tr><td>%s*</td><td>%s*</td><td>%-18lld</td></tr>\n",
+		  peer_prefix?peer_prefix:"<no peer prefix>",
+		  bid_prefix?bid_prefix:"<no bid prefix>",version);
+	}
+      }
+    }
+    fprintf(f,"</table>\n");
+#endif
+
+    fprintf(f,"<h2>Bundles in flight</h2>\n<table border=1 padding=2 spacing=2><tr><th>Bundle prefix</th><th>Bundle version</th><th>Progress<th></tr>\n");
+
+    for(i=0;i<MAX_BUNDLES_IN_FLIGHT;i++) {
+      if (partials[i].bid_prefix) {
+	// Here is a bundle in flight
+	char *bid_prefix=partials[i].bid_prefix;
+	long long version=partials[i].bundle_version;
+	char progress_string[80];
+	generate_progress_string(&partials[i],
+				 progress_string,sizeof(progress_string));
+	fprintf(f,"<tr><td>%s*</td><td>%-18lld</td><td>[%s]</td></tr>\n",
+		bid_prefix,version,
+		progress_string);
+      }
+    }
+    fprintf(f,"</table>\n");
+
+    fprintf(f,"<h2>Announced material</h2>\n<table border=1 padding=2 spacing=2><tr><th>Time</th><th>Announced content</th></tr>\n");
+    unsigned int first=0;
+    if (status_log_count>STATUS_LOG_ENTRIES) first=status_log_count-STATUS_LOG_ENTRIES;
+    for(unsigned int n=first;n<status_log_count;n++) {
+      int slot=n%STATUS_LOG_ENTRIES;
+      fprintf(f,"<tr><td>T-%lldms</td><td>%s</td></tr>\n",
+	      now_ms-status_log_times[slot],status_log_msgs[slot]);
+    }
+    fprintf(f,"</table>\n");
+  }
+
+  fprintf(f,"</body>\n");
+  return 0;
+}
+
+// Put the header, the peer table and the rest of the page together
+static int status_render_html_page(FILE *f,int flags)
+{
+  if (status_dump_epoch==0) status_dump_epoch=now_ms;
+
+  fprintf(f,
+	  "<html>\n<head>\n<title>Mesh Extender Packet Radio Link Status</title>\n"
+	  "<meta http-equiv=\"refresh\" content=\"2\" />\n</head>\n<body>\n"
+	  "<script>\n"
+	  "var seconds_since_load = 0;\n"
+	  "setInterval(function() { seconds_since_load++; document.getElementById('time_since_load').innerHTML = seconds_since_load; }, 1000);\n"
+	  "</script>\n"
+	  "<body><h1>LBARD Status</h1>\nLBARD status dump produced @ T=%lldms (fetched <span id=time_since_load>0</span> seconds ago)\n<p>\n",
+	  now_ms-status_dump_epoch);
+
+  fprintf(f,"<p>LBARD Version commit:%s branch:%s [MD5: %s] @ %s\n<p>\n",
+	  GIT_VERSION_STRING,GIT_BRANCH,VERSION_STRING,BUILD_DATE);
+
+  if (status_peer_table.data)
+    fwrite(status_peer_table.data,status_peer_table.len,1,f);
+  fwrite(status_page_bodies[flags].data,status_page_bodies[flags].len,1,f);
+  return 0;
+}
+
+static int status_render_json(FILE *f,int flags)
+{
+  // List peers
+  fprintf(f,"{\n\"neighbours\": [\n     ");
+
+  int i;
+  int count=0;
+  for (i=0;i<peer_count;i++) {
+    long long age=(now_ms/1000-peer_records[i]->last_message_time);
+    if (age<20) {
+      if (count) fprintf(f,",");
+      fprintf(f,"{ \"id\": \"%s\", \"time-since-last\": %lld }\n",
+	      peer_records[i]->sid_prefix,age);
+      count++;
+    }
+  }
+  fprintf(f,"   ],\n\n\n");
+
+  // Show current transfer progress bars
+  fprintf(f,"\n\"transfers\": [\n     ");
+  show_progress_json(f,1);
+  fprintf(f,"   ],\n\n");
+
+  bundle_cache_report_json(f);
+  fprintf(f,",\n");
+  http_client_report_json(f);
+  fprintf(f,",\n");
+  rhizome_import_report_json(f);
+  fprintf(f,"\n}\n\n");
+  return 0;
+}
+
+// Returns the current rendering of one of the status pages (flags as for
+// http_report_network_status(), or STATUS_PAGE_JSON), or NULL if we can't.
+struct status_page *status_page_get(int page)
+{
+  struct status_page *p=&status_pages[page];
+  if (page==STATUS_PAGE_JSON) {
+    if (status_page_fresh(p,status_generation,
+			  STATUS_RERENDER_INTERVAL,STATUS_PAGE_MAX_AGE)) return p;
+    if (status_page_render(p,status_render_json,0,status_generation)) return NULL;
+    return p;
+  }
+
+  struct status_page *body=&status_page_bodies[page];
+  if (!status_page_fresh(body,status_generation,
+			 STATUS_RERENDER_INTERVAL,STATUS_PAGE_MAX_AGE))
+    if (status_page_render(body,status_render_html,page,status_generation))
+      return NULL;
+  if (!status_page_fresh(&status_peer_table,status_peers_generation,
+			 STATUS_RERENDER_INTERVAL,STATUS_PAGE_MAX_AGE))
+    if (status_page_render(&status_peer_table,status_render_peer_table,0,
+			   status_peers_generation))
+      return NULL;
+  // Only put it back together if one of the pieces is newer
+  if (p->data&&(p->rendered>=body->rendered)
+      &&(p->rendered>=status_peer_table.rendered)) return p;
+  if (status_page_render(p,status_render_html_page,page,status_generation))
+    return NULL;
+  return p;
+}
+
+// Write the status pages to the files we used to keep them in
+int status_export_files(void)
+{
+  for(int fn=0;fn<=3;fn++) {
+    char *fname=STATUS_FILE;
+    switch(fn)
+      {
+      case RESOLVE_SIDS: fname=STATUS_FILE_WITH_NAMES;
+	break;
+      case RESOLVE_SIDS+SHOW_BUNDLE_STORE: fname=STATUS_FILE_WITH_NAMES_AND_BUNDLES;
+	break;
+      case SHOW_BUNDLE_STORE: fname=STATUS_FILE_WITH_BUNDLES;
+	break;
+      }
+    struct status_page *page=status_page_get(fn);
+    if (!page) return -1;
+    FILE *f=fopen(fname,"w");
+    if (!f) {
+      perror("fopen() on STATUS_FILE for write");
+      return -1;
+    }
+    fwrite(page->data,page->len,1,f);
+    fclose(f);
+  }
+  status_files_written=now_ms;
+  return 0;
+}
+
 time_t last_peer_log=0;
 
+/*
+  Called every few seconds.  Closes the window over which the RX statistics for
+  each peer are counted, and records them in the bundle log, if we are keeping
+  one.  The status pages themselves are only rendered when they are asked for.
+*/
 int status_dump()
 {
-  int fn;
+  int i;
 
   if (last_peer_log>time(0)) last_peer_log=time(0);
-  
+
   // Periodically record list of peers in bundle log, if we are maintaining one
   FILE *bundlelogfile=NULL;
   if (debug_bundlelog) {
     if ((time(0)-last_peer_log)>=300) {
-      last_peer_log=time(0);	
+      last_peer_log=time(0);
       bundlelogfile=fopen(bundlelog_filename,"a");
       if (bundlelogfile) {
 	fprintf(bundlelogfile,"%lld:T+%lldms:PEERREPORT:%s",
@@ -104,268 +499,71 @@ int status_dump()
     }
   }
 
-  if (status_dump_epoch==0) status_dump_epoch=gettime_ms();  
-  
-  for(fn=0;fn<=3;fn++)
-    {
-      FILE *f=NULL;
-      char *fname=STATUS_FILE;
-      switch(fn)
-	{
-	case RESOLVE_SIDS: fname=STATUS_FILE_WITH_NAMES;
-	  break;
-	case RESOLVE_SIDS+SHOW_BUNDLE_STORE: fname=STATUS_FILE_WITH_NAMES_AND_BUNDLES;
-	  break;
-	case SHOW_BUNDLE_STORE: fname=STATUS_FILE_WITH_BUNDLES;
-	  break;
-	}
-      f=fopen(fname,"w");
-      if (!f) {
-	perror("fopen() on STATUS_FILE for write");
-	return -1;
-      }
-
-      fprintf(f,
-	      "<html>\n<head>\n<title>Mesh Extender Packet Radio Link Status</title>\n"
-	      "<meta http-equiv=\"refresh\" content=\"2\" />\n</head>\n<body>\n"
-	      "<script>\n"
-	      "var seconds_since_load = 0;\n"
-	      "setInterval(function() { seconds_since_load++; document.getElementById('time_since_load').innerHTML = seconds_since_load; }, 1000);\n"
-	      "</script>\n"
-	      "<body><h1>LBARD Status</h1>\nLBARD status dump produced @ T=%lldms (fetched <span id=time_since_load>0</span> seconds ago)\n<p>\n",
-	      gettime_ms()-status_dump_epoch);
-
-      fprintf(f,"<p>LBARD Version commit:%s branch:%s [MD5: %s] @ %s\n<p>\n",
-	      GIT_VERSION_STRING,GIT_BRANCH,VERSION_STRING,BUILD_DATE);    
-  
-      struct b order[bundle_count];
-      int i,n;
-      
-      for (i=0;i<bundle_count;i++) {
-	order[i].order=i;
-	order[i].priority=bundles[i].last_priority;
-      }
-      qsort(order,bundle_count,sizeof(struct b),compare_b);
-      
-      // Show peer reachability with indication of activity
-      fprintf(f,"<h2>Mesh Extenders Reachable via Radio</h2>\n<table border=1 padding=2 spacing=2><tr><th>Mesh Extender ID</th><th>Performance</th><th>Sending</th></tr>\n");
-      for (i=0;i<peer_count;i++) {
-	long long age=(time(0)-peer_records[i]->last_message_time);
-	float mean_rssi=-1;
-	if (peer_records[i]->rssi_counter) mean_rssi=peer_records[i]->rssi_accumulator*1.0/peer_records[i]->rssi_counter;
-	int missed_packets=peer_records[i]->missed_packet_count;
-	int received_packets=peer_records[i]->rssi_counter;
-	float percent_received=0;
-	if (received_packets+missed_packets) {
-	  percent_received=received_packets*100.0/(received_packets+missed_packets);
-	}
-	char *colour="#00ff00";
-	if (percent_received<10) colour="#ff4f00";
-	else if (percent_received<50) colour="#ffff00";
-	else if (percent_received<80) colour="#c0c0c0";
-	
-	if (age<=30) {
-	  time_t now=time(0);
-	  fprintf(f,"<tr><td>%s*</td><td bgcolor=\"%s\">%lld sec, %d/%d received (%2.1f%% loss), mean RSSI = %.0f</td><td>",
-		  peer_records[i]->sid_prefix,colour,
-		  age,received_packets,received_packets+missed_packets,100-percent_received,mean_rssi);
-	  if (bundlelogfile) {
-	    fprintf(stderr,"Writing PEERSTATUS line...\n");
-	    fprintf(bundlelogfile,"%lld:T+%lldms:PEERSTATUS:%s*:%lld:%d/%d:%.0f:%s",
-		    (long long)now,
-		    (long long)(gettime_ms()-start_time),		  
-		    peer_records[i]->sid_prefix,
-		    age,received_packets,received_packets+missed_packets,mean_rssi,
-		    ctime(&now));
-	    fprintf(stderr,"Wrote PEERSTATUS line.\n");
-	  }
-	  
-	  if (peer_records[i]->tx_bundle!=-1) {
-	    char bid[10];
-	    int j;
-	    for(j=0;j<8;j++) bid[j]=bundles[peer_records[i]->tx_bundle].bid_hex[j];
-	    bid[8]='*'; bid[9]=0;
-	    fprintf(f,"%s/%lld (from M=%d/P=%d)",
-		    bid,bundles[peer_records[i]->tx_bundle].version,
-		    peer_records[i]->tx_bundle_manifest_offset_hard_lower_bound,
-		    peer_records[i]->tx_bundle_body_offset_hard_lower_bound);
-	    if (bundlelogfile&&(fn==0))
-	      fprintf(bundlelogfile,"%lld:T+%lldms:PEERXFER:%s*:%s/%lld (from M=%d/P=%d):%s",
-		      (long long)now,
-		      (long long)(gettime_ms()-start_time),		  
-		      peer_records[i]->sid_prefix,
-		      bid,bundles[peer_records[i]->tx_bundle].version,
-		      peer_records[i]->tx_bundle_manifest_offset_hard_lower_bound,
-		      peer_records[i]->tx_bundle_body_offset_hard_lower_bound,
-		      ctime(&now));	    
-	  }
-	  fprintf(f,"</td></tr>\n");
-	}
-
-	if (fn==3) {
-	  // Reset packet RX stats for next round
-	  peer_records[i]->missed_packet_count=0;
-	  peer_records[i]->rssi_counter=0;
-	  peer_records[i]->rssi_accumulator=0;
-	}
-      }
-      fprintf(f,"</table>\n");
-      if (bundlelogfile&&(fn==3)) fclose(bundlelogfile);
-      
-      // Show current transfer progress bars
-      fprintf(f,"<h2>Current Bundles being received</h2>\n");
-      fprintf(f,"<pre>\n");
-      show_progress(f,1);
-      fprintf(f,"</pre>\n");
-      
-      // And EEPROM data (copy from /tmp/eeprom.data)
-      {
-	char buffer[16384];
-	FILE *e=fopen("/tmp/eeprom.data","r");
-	if (e) {
-	  fprintf(f,"<h2>EEPROM Radio information</h2>\n<pre>\n");
-	  int bytes=fread(buffer,1,16384,e);
-	  if (bytes>0) fwrite(buffer,bytes,1,f);
-	  fclose(e);
-	  fprintf(f,"</pre>\n");
-	}
-      }
+  for (i=0;i<peer_count;i++) {
+    struct peer_state *p=peer_records[i];
+    long long age=(now_ms/1000-p->last_message_time);
+    int missed_packets=p->missed_packet_count;
+    int received_packets=p->rssi_counter;
+    float mean_rssi=-1;
+    if (received_packets) mean_rssi=p->rssi_accumulator*1.0/received_packets;
 
-      if (fn&SHOW_BUNDLE_STORE) {
-	fprintf(f,"<h2>Bundles in local store</h2>\n<table border=1 padding=2 spacing=2><tr><th>Bundle #</th><th>BID Prefix</th><th>Service</th><th>Bundle version</th><th>Bundle length</th><th>Last calculated priority</th><th># peers who don't have this bundle</th></tr>\n");
-	for (n=0;n<bundle_count;n++) {
-	  i=order[n].order;
-	  fprintf(f,"<tr><td>#%d</td><td>%s</td><td>%s</td><td>%lld</td><td>%lld</td><td>0x%08llx (%lld)</td><td>%d</td></tr>\n",
-		  i,
-		  bundles[i].bid_hex,
-		  bundles[i].service,
-		  bundles[i].version,
-		  bundles[i].length,
-		  bundles[i].last_priority,bundles[i].last_priority,
-		  bundles[i].num_peers_that_dont_have_it);
-	}
-	fprintf(f,"</table>\n");
-	fflush(f);
-	
-#ifdef SYNC_BY_BAR
-	fprintf(f,"<h2>Bundles held by peers</h2>\n<table border=1 padding=2 spacing=2><tr><th>Peer</th><th>Bundle prefix</th><th>Bundle version</th></tr>\n");
-
-	for(peer=0;peer<peer_count;peer++) {
-	  // Don't show timed out peers
-	  if ((time(0)-peer_records[peer]->last_message_time)>PEER_KEEPALIVE_INTERVAL)
-	    continue;
-	  
-	  char *peer_prefix=peer_records[peer]->sid_prefix;
-	  for(i=0;i<peer_records[peer]->bundle_count;i++) {
-	    if (peer_records[peer]->partials[i].bid_prefix) {
-	      // Here is a bundle in flight
-	      char *bid_prefix=peer_records[peer]->bid_prefixes[i];
-	      long long version=peer_records[peer]->versions[i];
-	      fprintf(f,"<tr><td>%s*</td><td>%s*</td><td>%-18lld</td></tr>\n",
-		      peer_prefix?peer_prefix:"<no peer prefix>",
-		      bid_prefix?bid_prefix:"<no bid prefix>",version);
-	    }
-	  }
-	}
-	fprintf(f,"</table>\n");
-	fflush(f);
-#endif
+    if (bundlelogfile&&(age<=30)) {
+      time_t now=time(0);
+      fprintf(bundlelogfile,"%lld:T+%lldms:PEERSTATUS:%s*:%lld:%d/%d:%.0f:%s",
+	      (long long)now,
+	      (long long)(gettime_ms()-start_time),
+	      p->sid_prefix,
+	      age,received_packets,received_packets+missed_packets,mean_rssi,
+	      ctime(&now));
+      if (p->tx_bundle!=-1)
+	fprintf(bundlelogfile,"%lld:T+%lldms:PEERXFER:%s*:%.8s*/%lld (from M=%d/P=%d):%s",
+		(long long)now,
+		(long long)(gettime_ms()-start_time),
+		p->sid_prefix,
+		bundles[p->tx_bundle].bid_hex,bundles[p->tx_bundle].version,
+		p->tx_bundle_manifest_offset_hard_lower_bound,
+		p->tx_bundle_body_offset_hard_lower_bound,
+		ctime(&now));
+    }
 
-	fprintf(f,"<h2>Bundles in flight</h2>\n<table border=1 padding=2 spacing=2><tr><th>Bundle prefix</th><th>Bundle version</th><th>Progress<th></tr>\n");
-	
-	for(i=0;i<MAX_BUNDLES_IN_FLIGHT;i++) {
-	  if (partials[i].bid_prefix) {
-	    // Here is a bundle in flight
-	    char *bid_prefix=partials[i].bid_prefix;
-	    long long version=partials[i].bundle_version;
-	    char progress_string[80];
-	    generate_progress_string(&partials[i],
-				     progress_string,sizeof(progress_string));
-	    fprintf(f,"<tr><td>%s*</td><td>%-18lld</td><td>[%s]</td></tr>\n",
-		    bid_prefix,version,
-		    progress_string);
-	  }
-	}
-	fprintf(f,"</table>\n");
-	fflush(f);
-	
-	fprintf(f,"<h2>Announced material</h2>\n<table border=1 padding=2 spacing=2><tr><th>Time</th><th>Announced content</th></tr>\n");
-	long long now=gettime_ms();
-	for(i=0;i<msg_count;i++) {
-	  fprintf(f,"<tr><td>T-%lldms</td><td>%s</td></tr>\n",
-		  now-msg_times[i],msgs[i]);
-	  free(msgs[i]); msgs[i]=NULL;
-	}
-	fprintf(f,"</table>\n");
-      }
+    // The status pages show the round just finished
+    p->status_missed_packet_count=missed_packets;
+    p->status_rssi_counter=received_packets;
+    p->status_rssi_accumulator=p->rssi_accumulator;
+    // Reset packet RX stats for next round
+    p->missed_packet_count=0;
+    p->rssi_counter=0;
+    p->rssi_accumulator=0;
+  }
+  if (bundlelogfile) fclose(bundlelogfile);
+  if (peer_count) status_peers_generation++;
 
-      msg_count=0;
-      
-      fprintf(f,"</body>\n");
-      
-      fclose(f);
-    }
+  if (status_file_interval>0)
+    if ((now_ms-status_files_written)>=status_file_interval*1000LL
+	||(now_ms<status_files_written))
+      status_export_files();
 
   return 0;
 }
 
-int http_report_network_status(int socket,int flags)
+int http_report_network_status(struct httpd_connection *c,int flags)
 {
-  if (socket!=-1)
-    {
-      switch(flags) {
-      case RESOLVE_SIDS:
-	return http_send_file(socket,STATUS_FILE_WITH_NAMES,"text/html");
-      case RESOLVE_SIDS|SHOW_BUNDLE_STORE:
-	return http_send_file(socket,STATUS_FILE_WITH_NAMES_AND_BUNDLES,"text/html");
-      case SHOW_BUNDLE_STORE:
-	return http_send_file(socket,STATUS_FILE_WITH_BUNDLES,"text/html");
-      default:
-	return http_send_file(socket,STATUS_FILE,"text/html");
-      }
-    }
-  else return 0;
+  struct status_page *page=status_page_get(flags&(RESOLVE_SIDS|SHOW_BUNDLE_STORE));
+  if (!page) {
+    char *m="HTTP/1.0 500 Couldn't render status\nServer: Serval LBARD\n\nCould not render status page";
+    http_respond(c,m,strlen(m));
+    return -1;
+  }
+  return http_send_buffer(c,page->data,page->len,"text/html");
 }
 
-time_t last_json_network_status_call=0;
-int http_report_network_status_json(int socket)
+int http_report_network_status_json(struct httpd_connection *c)
 {
-  if (((time(0)-last_json_network_status_call)>1)||
-      ((time(0)-last_json_network_status_call)<0))
-    {
-      last_json_network_status_call=time(0);
-      FILE *f=fopen("/tmp/networkstatus.json","w");
-      if (!f) {
-	char *m="HTTP/1.0 500 Couldn't create temporary file\nServer: Serval LBARD\n\nCould not create temporariy file";
-	write_all(socket,m,strlen(m));
-	
-	return -1;
-      }
-
-      // List peers
-      fprintf(f,"{\n\"neighbours\": [\n     ");
-      
-      int i;
-      int count=0;
-      for (i=0;i<peer_count;i++) {
-	long long age=(time(0)-peer_records[i]->last_message_time);
-	if (age<20) {
-	  if (count) fprintf(f,",");
-	  fprintf(f,"{ \"id\": \"%s\", \"time-since-last\": %lld }\n",
-		  peer_records[i]->sid_prefix,age);
-	  count++;
-	}
-      }
-      fprintf(f,"   ],\n\n\n");
-      
-      
-      // Show current transfer progress bars
-      fprintf(f,"\n\"transfers\": [\n     ");
-      show_progress_json(f,1);
-      fprintf(f,"   ]\n}\n\n");      
-      
-      fclose(f);
-    }
-  return http_send_file(socket,"/tmp/networkstatus.json","application/json");
+  struct status_page *page=status_page_get(STATUS_PAGE_JSON);
+  if (!page) {
+    char *m="HTTP/1.0 500 Couldn't render status\nServer: Serval LBARD\n\nCould not render status";
+    http_respond(c,m,strlen(m));
+    return -1;
+  }
+  return http_send_buffer(c,page->data,page->len,"application/json");
 }
-
@@ -143,6 +143,15 @@ int sync_tree_receive_message(struct peer_state *p,unsigned char *msg)
   return 0;
 }
 
+// Start sending the manifest of the bundle in the cache from a random point
+static void sync_pick_manifest_offset(struct peer_state *p)
+{
+  p->tx_bundle_manifest_offset_pending=0;
+  if (cached_manifest_encoded_len
+      &&!(option_flags&FLAG_NO_RANDOMIZE_START_OFFSET))
+    p->tx_bundle_manifest_offset=(random()%cached_manifest_encoded_len)&0xffffff80;
+}
+
 int sync_announce_bundle_piece(int peer,int *offset,int mtu,
 			       unsigned char *msg,
 			       char *sid_prefix_hex,
@@ -153,8 +162,15 @@ int sync_announce_bundle_piece(int peer,int *offset,int mtu,
     fprintf(stderr,"HARDLOWER: Announcing a piece of bundle #%d\n",bundle_number);
   if (bundle_number<0) return -1;
   
-  if (prime_bundle_cache(bundle_number,
-			 sid_prefix_hex,servald_server,credential)) {
+  int cache_result=prime_bundle_cache(bundle_number,
+				     sid_prefix_hex,servald_server,credential);
+  if (cache_result>0) {
+    // Still being fetched from servald, so we'll send something else for now
+    if (debug_ack)
+      fprintf(stderr,"HARDLOWER: Waiting for bundle to be fetched into the cache.\n");
+    return -1;
+  }
+  if (cache_result) {
     peer_records[peer]->tx_cache_errors++;
     if (peer_records[peer]->tx_cache_errors>MAX_CACHE_ERRORS)
       {
@@ -167,6 +183,9 @@ int sync_announce_bundle_piece(int peer,int *offset,int mtu,
   else
     peer_records[peer]->tx_cache_errors=0;
 
+  if (peer_records[peer]->tx_bundle_manifest_offset_pending)
+    sync_pick_manifest_offset(peer_records[peer]);
+
   // Update send point based on the bundle progress bitmap for this peer, if we
   // have one.
   if (!(option_flags&FLAG_NO_BITMAP_PROGRESS)) peer_update_send_point(peer);
@@ -315,6 +334,8 @@ int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
 	      report_queue_peers[report_queue_length]->sid_prefix);
       report_queue_length++;
     } else {
+      METRIC_TX_SECTION(report_queue[report_queue_length][0],
+			report_lengths[report_queue_length]);
       fprintf(stderr,">>> %s Flushing %d byte report from queue, %d remaining.\n",
 	      timestamp_str(),
 	      report_lengths[report_queue_length],
@@ -364,8 +385,56 @@ int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
 
 int sync_tree_populate_with_our_bundles()
 {
+  sync_tree_bulk_start();
   for(int i=0;i<bundle_count;i++)
-    sync_add_key(sync_state,&bundles[i].sync_key,&bundles[i]);
+    sync_tree_add_bundle(i);
+  return sync_tree_bulk_finish();
+}
+
+/* While we are reading a list of bundles from servald, which at startup can
+   be many thousands, we collect their keys here, and then add them to the sync
+   tree in one go, rather than one at a time. */
+int sync_tree_bulk_depth=0;
+int sync_tree_bulk_count=0;
+int sync_tree_bulk_max=0;
+sync_key_t *sync_tree_bulk_keys=NULL;
+void **sync_tree_bulk_contexts=NULL;
+
+int sync_tree_bulk_start(void)
+{
+  sync_tree_bulk_depth++;
+  return 0;
+}
+
+int sync_tree_bulk_finish(void)
+{
+  if (sync_tree_bulk_depth<1) return -1;
+  if (--sync_tree_bulk_depth) return 0;
+  if (sync_tree_bulk_count) {
+    sync_add_keys(sync_state,sync_tree_bulk_keys,sync_tree_bulk_contexts,
+		  sync_tree_bulk_count);
+    sync_tree_bulk_count=0;
+  }
+  return 0;
+}
+
+int sync_tree_add_bundle(int bundle_number)
+{
+  if (!sync_tree_bulk_depth) {
+    sync_add_key(sync_state,&bundles[bundle_number].sync_key,&bundles[bundle_number]);
+    return 0;
+  }
+  if (sync_tree_bulk_count>=sync_tree_bulk_max) {
+    sync_tree_bulk_max=sync_tree_bulk_max?sync_tree_bulk_max*2:1024;
+    sync_tree_bulk_keys=realloc(sync_tree_bulk_keys,
+				sync_tree_bulk_max*sizeof(sync_key_t));
+    sync_tree_bulk_contexts=realloc(sync_tree_bulk_contexts,
+				    sync_tree_bulk_max*sizeof(void *));
+    assert(sync_tree_bulk_keys&&sync_tree_bulk_contexts);
+  }
+  sync_tree_bulk_keys[sync_tree_bulk_count]=bundles[bundle_number].sync_key;
+  sync_tree_bulk_contexts[sync_tree_bulk_count]=&bundles[bundle_number];
+  sync_tree_bulk_count++;
   return 0;
 }
 
@@ -430,21 +499,28 @@ int sync_tell_peer_we_have_the_bundle_of_this_partial(int peer, int partial)
 }
 
 
+// These all use the sorted BID index maintained by register_bundle(), so that
+// we don't have to walk the whole bundle list for every piece, ack or bitmap
+// that we receive.  Where more than one bundle matches, they pick the same
+// bundle that a linear walk of bundles[] would.
+
 int lookup_bundle_by_prefix(const unsigned char *prefix,int len)
 {
   if (len>8) len=8;
   
   int best_bundle=-1;
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<len;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==len) {
-      if ((best_bundle==-1)||(bundles[bundle].version>bundles[best_bundle].version))
-	best_bundle=bundle;      
-    }
+  int first;
+  int n=bundle_prefix_range(prefix,len,&first);
+  if ((n>1)&&debug_bundles)
+    printf(">>> %s BID prefix %02X%02X%02X%02X* is ambiguous (%d bundles match)\n",
+	   timestamp_str(),prefix[0],prefix[1],prefix[2],prefix[3],n);
+  for(int i=first;i<first+n;i++) {
+    int bundle=bid_sorted[i];
+    if ((best_bundle==-1)
+	||(bundles[bundle].version>bundles[best_bundle].version)
+	||((bundles[bundle].version==bundles[best_bundle].version)
+	   &&(bundle<best_bundle)))
+      best_bundle=bundle;      
   }
   if (0)
     printf("  %02X%02X%02X%02x* is bundle #%d of %d\n",
@@ -455,36 +531,32 @@ int lookup_bundle_by_prefix(const unsigned char *prefix,int len)
 
 int lookup_bundle_by_prefix_bin_and_version_exact(unsigned char *prefix, long long version)
 {
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version==version)
-	return bundle;
-    }
+  int best_bundle=-1;
+  int first;
+  int n=bundle_prefix_range(prefix,8,&first);
+  for(int i=first;i<first+n;i++) {
+    int bundle=bid_sorted[i];
+    if (bundles[bundle].version==version)
+      if ((best_bundle==-1)||(bundle<best_bundle))
+	best_bundle=bundle;
   }
-  return -1;
+  return best_bundle;
 }
 
 // Returns newest bundle version of relevance
 int lookup_bundle_by_prefix_bin_and_version_or_newer(unsigned char *prefix, long long version)
 {
   int best_bundle=-1;
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version>=version) {
-	if ((best_bundle==-1)||(bundles[bundle].version>bundles[best_bundle].version))
-	  best_bundle=bundle;
-      }
-      
+  int first;
+  int n=bundle_prefix_range(prefix,8,&first);
+  for(int i=first;i<first+n;i++) {
+    int bundle=bid_sorted[i];
+    if (bundles[bundle].version>=version) {
+      if ((best_bundle==-1)
+	  ||(bundles[bundle].version>bundles[best_bundle].version)
+	  ||((bundles[bundle].version==bundles[best_bundle].version)
+	     &&(bundle<best_bundle)))
+	best_bundle=bundle;
     }
   }
   return best_bundle;
@@ -492,18 +564,16 @@ int lookup_bundle_by_prefix_bin_and_version_or_newer(unsigned char *prefix, long
 
 int lookup_bundle_by_prefix_bin_and_version_or_older(unsigned char *prefix, long long version)
 {
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version<=version)
-	return bundle;
-    }
+  int best_bundle=-1;
+  int first;
+  int n=bundle_prefix_range(prefix,8,&first);
+  for(int i=first;i<first+n;i++) {
+    int bundle=bid_sorted[i];
+    if (bundles[bundle].version<=version)
+      if ((best_bundle==-1)||(bundle<best_bundle))
+	best_bundle=bundle;
   }
-  return -1;
+  return best_bundle;
 }
 
 
@@ -551,6 +621,7 @@ int sync_queue_bundle(struct peer_state *p,int bundle)
 	p->tx_bundle=bundle;
 	p->tx_bundle_body_offset=peer_records[i]->tx_bundle_body_offset;
 	p->tx_bundle_manifest_offset=peer_records[i]->tx_bundle_manifest_offset;
+	p->tx_bundle_manifest_offset_pending=peer_records[i]->tx_bundle_manifest_offset_pending;
 	p->tx_bundle_priority=priority;
 	fprintf(stderr,"Beginning transmission from same offset as for another peer (m=%d, b= %d)\n",
 		p->tx_bundle_manifest_offset,p->tx_bundle_body_offset);
@@ -573,11 +644,14 @@ int sync_queue_bundle(struct peer_state *p,int bundle)
       p->tx_bundle_body_offset=0;
     // ... but start from the beginning if it will take only one packet
     if (bundles[bundle].length<150) p->tx_bundle_body_offset=0;
-    prime_bundle_cache(bundle,p->sid_prefix,servald_server,credential);
-    if (cached_manifest_encoded_len)
-      p->tx_bundle_manifest_offset=(random()%cached_manifest_encoded_len)&0xffffff80;
-    if (option_flags&FLAG_NO_RANDOMIZE_START_OFFSET)
-      p->tx_bundle_manifest_offset=0;
+    // If the manifest is still being fetched, we don't know how long it is,
+    // so start from the beginning, and pick a random point once it arrives.
+    p->tx_bundle_manifest_offset=0;
+    p->tx_bundle_manifest_offset_pending=0;
+    if (!prime_bundle_cache(bundle,p->sid_prefix,servald_server,credential))
+      sync_pick_manifest_offset(p);
+    else
+      p->tx_bundle_manifest_offset_pending=1;
     p->tx_bundle_priority=priority;
     fprintf(stderr,"Beginning transmission from random offset (m=%d, p=%d), flags=%d\n",
 	    p->tx_bundle_manifest_offset,p->tx_bundle_body_offset,
@@ -602,6 +676,7 @@ int sync_dequeue_bundle(struct peer_state *p,int bundle)
       p->tx_bundle=p->tx_queue_bundles[0];
       p->tx_bundle_priority=p->tx_queue_priorities[0];
       p->tx_bundle_manifest_offset=0;
+      p->tx_bundle_manifest_offset_pending=0;
       p->tx_bundle_body_offset=0;      
       p->tx_bundle_manifest_offset_hard_lower_bound=0;
       p->tx_bundle_body_offset_hard_lower_bound=0;
@@ -627,6 +702,7 @@ int sync_dequeue_bundle(struct peer_state *p,int bundle)
 	   the instance ID we have recorded for this peer, so that we
 	   force a re-sync.
 	*/
+	METRIC_INC(tx_queue_overflow_resyncs);
 	p->instance_id=0xffffffff;
 	my_instance_id=0;
 	while(my_instance_id==0)
@@ -764,10 +840,10 @@ int sync_remember_recently_received_bundle(char *bid_prefix, long long version)
     if (!strcasecmp(bid_prefix,recent_bundles[i].bid_prefix)) {
       if (version>=recent_bundles[i].bundle_version)
 	recent_bundles[i].bundle_version=version;
-      recent_bundles[i].timeout=time(0)+RECENT_BUNDLE_TIMEOUT;
+      recent_bundles[i].timeout=now_ms/1000+RECENT_BUNDLE_TIMEOUT;
       return 0;
     } else {
-      if (recent_bundles[i].timeout<time(0)) first_timed_out=i;
+      if (recent_bundles[i].timeout<now_ms/1000) first_timed_out=i;
     }
   if (recent_bundle_count>=MAX_RECENT_BUNDLES) {
     if (first_timed_out==-1) i=random()%MAX_RECENT_BUNDLES;
@@ -780,7 +856,7 @@ int sync_remember_recently_received_bundle(char *bid_prefix, long long version)
 
   recent_bundles[i].bid_prefix=strdup(bid_prefix);
   recent_bundles[i].bundle_version=version;
-  recent_bundles[i].timeout=time(0)+RECENT_BUNDLE_TIMEOUT;
+  recent_bundles[i].timeout=now_ms/1000+RECENT_BUNDLE_TIMEOUT;
 
   fprintf(stderr,"recent_bundle_count now %d\n",recent_bundle_count);
   return 0;
@@ -792,7 +868,7 @@ int sync_is_bundle_recently_received(char *bid_prefix, long long version)
     
     if (!strcasecmp(bid_prefix,recent_bundles[i].bid_prefix)) {
       if (version<=recent_bundles[i].bundle_version)
-	if (recent_bundles[i].timeout>=time(0)) {
+	if (recent_bundles[i].timeout>=now_ms/1000) {
 	  printf("Ignoring %s*/%lld because we recently received %s*/%lld\n",
 		 bid_prefix,version,
 		 recent_bundles[i].bid_prefix,
@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 #include "sync.h"
+#include "log.h"
 
 
 
@@ -29,8 +30,8 @@ static void *allocate(size_t length){
 
 #define KEY_LEN_BITS (KEY_LEN<<3)
 
-// Note PREFIX_STEP_BITS >1 hasn't been tested yet
-#define NODE_CHILDREN (1<<PREFIX_STEP_BITS)
+// Each branch of the tree splits on the next step_bits bits of the key
+#define NODE_CHILDREN(S) (1<<(S)->step_bits)
 #define INTERESTING_COUNT 16
 
 typedef struct {
@@ -43,6 +44,22 @@ typedef struct {
 #define MESSAGE_FROM_KEY(K) {.key=*K, .prefix_len=KEY_LEN_BITS}
 #define MESSAGE_BYTES (KEY_LEN +2)
 
+/*
+  Nodes using a stride other than 1 bit start each message with an extra
+  record, [step_bits][SYNC_STRIDE_RECORD][KEY_LEN bytes of zero].  Older nodes
+  only understand 1 bit strides, and will reject any message starting with
+  this record, as prefix_len is out of range.  When we hear from a peer using
+  a smaller stride than ours, we drop down to it, so that the slowest peer sets
+  the pace for everyone.
+*/
+#define SYNC_STRIDE_RECORD 0xFF
+
+// With a stride of more than 1 bit, a branch can be missing children, so we
+// can be told about a node of theirs that we have none of the keys of.  We
+// answer with a blank node covering the same keys, so that they send us all
+// of them, and keep a few of these answers waiting here.
+#define MAX_BLANK_REPLIES 8
+
 // definitions for how we track the state of a set of keys
 
 #define NOT_SENT 0
@@ -50,14 +67,54 @@ typedef struct {
 #define QUEUED 2
 #define DONT_SEND 3
 
+/*
+  Tree nodes are allocated from slabs belonging to the sync state, and refer to
+  each other by 32-bit index rather than by pointer.  With many peers, each
+  with a tree of thousands of keys, this saves millions of small mallocs (and
+  the fragmentation that goes with them on uClibc), makes each node smaller,
+  and lets us throw away a whole peer tree without calling free() at all.
+
+  Leaves and branches come from separate pools, as only branches need room for
+  1<<step_bits child refs, which they keep right after the node itself, so
+  that walking down the tree only touches one item per level.  The top bit of
+  a ref says which pool it belongs to.  A tree of n keys has n leaves, and in
+  a binary tree n-1 branches, so this takes 72 rather than 80 bytes per key.
+
+  Index 0 is never handed out, so that it can stand for NULL.  Slabs never
+  move, so a pointer to a node (or to a link inside one) stays valid while
+  other nodes are allocated.  Free items are chained together through their
+  first 4 bytes.
+*/
+typedef uint32_t node_ref;
+#define NO_NODE 0
+#define BRANCH_REF 0x80000000
+#define SLAB_BITS 10
+#define SLAB_ITEMS (1<<SLAB_BITS)
+
+struct pool{
+  uint8_t **slabs;
+  unsigned slab_count;
+  unsigned slab_max;
+  size_t item_size;
+  uint32_t next;
+  uint32_t free_items;
+  unsigned used;
+};
+
+#define POOL_ITEM(P,I) ((void *)((P)->slabs[(I)>>SLAB_BITS]+((I)&(SLAB_ITEMS-1))*(P)->item_size))
+#define NODE(S,R) ((struct node *)(((R)&BRANCH_REF) ? \
+				   POOL_ITEM(&(S)->branches,(R)&~BRANCH_REF) : \
+				   POOL_ITEM(&(S)->leaves,(R))))
+// only valid for branch nodes
+#define CHILDREN(S,N) ((node_ref *)((N)+1))
+
 struct node{
-  struct node *transmit_next;
-  struct node *transmit_prev;
+  node_ref transmit_next;
+  node_ref transmit_prev;
+  void *context;
   key_message_t message;
   uint8_t send_state;
   uint8_t sent_count;
-  void *context;
-  struct node *children[NODE_CHILDREN];
 };
 
 struct sync_peer_state{
@@ -65,7 +122,9 @@ struct sync_peer_state{
   void *peer_context;
   unsigned send_count;
   unsigned recv_count;
-  struct node *root;
+  // the stride this peer last told us it is using
+  uint8_t step_bits;
+  node_ref root;
 };
 
 struct sync_state{
@@ -81,10 +140,86 @@ struct sync_state{
   unsigned received_uninteresting;
   unsigned progress;
   struct sync_peer_state *peers;
-  struct node *root;
-  struct node *transmit_ptr;
+  node_ref root;
+  node_ref transmit_ptr;
+
+  // The stride all of our trees are using, and the one we would use if all
+  // of our peers could
+  uint8_t step_bits;
+  uint8_t wanted_step_bits;
+  
+  key_message_t blank_replies[MAX_BLANK_REPLIES];
+  unsigned blank_reply_count;
+
+  // shared by our tree and every peer tree
+  struct pool leaves;
+  struct pool branches;
 };
 
+static void pool_init(struct pool *pool, size_t item_size)
+{
+  bzero(pool, sizeof(struct pool));
+  pool->item_size = item_size;
+  pool->next = 1;
+}
+
+static void pool_free(struct pool *pool)
+{
+  for (unsigned i=0;i<pool->slab_count;i++)
+    free(pool->slabs[i]);
+  free(pool->slabs);
+}
+
+static uint32_t pool_alloc(struct pool *pool)
+{
+  uint32_t i = pool->free_items;
+  if (i){
+    pool->free_items = *(uint32_t *)POOL_ITEM(pool, i);
+  }else{
+    if (pool->next >= pool->slab_count*SLAB_ITEMS){
+      if (pool->slab_count >= pool->slab_max){
+	pool->slab_max = pool->slab_max ? pool->slab_max*2 : 16;
+	pool->slabs = realloc(pool->slabs, pool->slab_max*sizeof(uint8_t *));
+	assert(pool->slabs);
+      }
+      pool->slabs[pool->slab_count++] = allocate(SLAB_ITEMS*pool->item_size);
+    }
+    i = pool->next++;
+    assert(i && !(i&BRANCH_REF));
+  }
+  bzero(POOL_ITEM(pool, i), pool->item_size);
+  pool->used++;
+  return i;
+}
+
+static void pool_release(struct pool *pool, uint32_t i)
+{
+  *(uint32_t *)POOL_ITEM(pool, i) = pool->free_items;
+  pool->free_items = i;
+  pool->used--;
+}
+
+static void node_pools_init(struct sync_state *state)
+{
+  pool_init(&state->leaves, sizeof(struct node));
+  pool_init(&state->branches, sizeof(struct node)+(sizeof(node_ref)<<state->step_bits));
+}
+
+static node_ref node_alloc(struct sync_state *state, uint8_t branch)
+{
+  if (branch)
+    return pool_alloc(&state->branches)|BRANCH_REF;
+  return pool_alloc(&state->leaves);
+}
+
+static void node_release(struct sync_state *state, node_ref ref)
+{
+  if (ref&BRANCH_REF)
+    pool_release(&state->branches, ref&~BRANCH_REF);
+  else
+    pool_release(&state->leaves, ref);
+}
+
 
 
 // XOR the source key into the destination key
@@ -117,7 +252,10 @@ static void sync_xor(const sync_key_t *src_key, key_message_t *dest_key)
 static uint8_t sync_get_bits(uint8_t offset, uint8_t len, const sync_key_t *key)
 {
   assert(len <= 8);
-  assert(offset+len < KEY_LEN_BITS);
+  // (there are no more bits once we have walked the whole key)
+  if (offset >= KEY_LEN_BITS)
+    return 0;
+  assert(offset+len <= KEY_LEN_BITS);
   unsigned start_byte = (offset>>3);
   uint16_t context = key->key[start_byte] <<8;
   if (start_byte+1 < KEY_LEN)
@@ -155,164 +293,172 @@ static int cmp_message(const key_message_t *first, const key_message_t *second)
 }
 
 // XOR all existing children of *node, into this destination key.
-static void xor_children(struct node *node, key_message_t *dest)
+static void xor_children(const struct sync_state *state, const struct node *node, key_message_t *dest)
 {
   unsigned i;
   if (node->message.prefix_len == KEY_LEN_BITS){
     sync_xor(&node->message.key, dest);
   }else{
-    for (i=0;i<NODE_CHILDREN;i++){
-      if (node->children[i])
-	xor_children(node->children[i], dest);
+    for (i=0;i<NODE_CHILDREN(state);i++){
+      if (CHILDREN(state, node)[i])
+	xor_children(state, NODE(state, CHILDREN(state, node)[i]), dest);
     }
   }
 }
 
 // Add a new key into the state tree, XOR'ing the key into each parent node
-static struct node *add_key(struct node **root, const sync_key_t *key, void *context, uint8_t stored)
+static node_ref add_key(struct sync_state *state, node_ref *root, const sync_key_t *key, void *context, uint8_t stored)
 {
   uint8_t prefix_len = 0;
-  struct node **node = root;
+  node_ref *node = root;
   uint8_t min_prefix_len = prefix_len;
   while(*node){
-    uint8_t child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, key);
+    struct node *n = NODE(state, *node);
+    uint8_t child_index = sync_get_bits(prefix_len, state->step_bits, key);
     
-    if ((*node)->message.prefix_len == prefix_len){
-      sync_xor_node((*node), key);
+    if (n->message.prefix_len == prefix_len){
+      sync_xor_node(n, key);
       
-      if ((*node)->send_state == SENT)
-	(*node)->send_state = NOT_SENT;
-      if ((*node)->send_state == QUEUED && (*node)->sent_count>0)
-	(*node)->send_state = DONT_SEND;
+      if (n->send_state == SENT)
+	n->send_state = NOT_SENT;
+      if (n->send_state == QUEUED && n->sent_count>0)
+	n->send_state = DONT_SEND;
 	
       // reset the send counter
-      (*node)->sent_count=0;
-      prefix_len += PREFIX_STEP_BITS;
+      n->sent_count=0;
+      prefix_len += state->step_bits;
       min_prefix_len = prefix_len;
-      node = &(*node)->children[child_index];
+      node = &CHILDREN(state, n)[child_index];
       if (!*node)
 	break;
       continue;
     }
     
     // this node represents a range of prefix bits
-    uint8_t node_child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &(*node)->message.key);
+    uint8_t node_child_index = sync_get_bits(prefix_len, state->step_bits, &n->message.key);
     
     // if the prefix matches the key, keep searching.
     if (child_index == node_child_index){
-      prefix_len += PREFIX_STEP_BITS;
+      prefix_len += state->step_bits;
       continue;
     }
     
     // if there is a mismatch in the range of prefix bits, we need to create a new node to represent the new range.
-    struct node *parent = allocate(sizeof(struct node));
+    node_ref parent_ref = node_alloc(state, 1);
+    struct node *parent = NODE(state, parent_ref);
     parent->message.min_prefix_len = min_prefix_len;
     parent->message.prefix_len = prefix_len;
     parent->message.stored = stored;
-    parent->children[node_child_index] = *node;
+    CHILDREN(state, parent)[node_child_index] = *node;
     
-    min_prefix_len = prefix_len + PREFIX_STEP_BITS;
-    assert(min_prefix_len <= (*node)->message.prefix_len);
+    min_prefix_len = prefix_len + state->step_bits;
+    assert(min_prefix_len <= n->message.prefix_len);
     
-    (*node)->message.min_prefix_len = min_prefix_len;
+    n->message.min_prefix_len = min_prefix_len;
     
     // xor all the existing children of this node, we can't assume the prefix bits are right in the existing node.
     // we might be able to speed this up by using the prefix bits of the passed in key
-    xor_children(parent, &parent->message);
+    xor_children(state, parent, &parent->message);
     
-    *node = parent;
+    *node = parent_ref;
   }
   // create final leaf node
-  *node = allocate(sizeof(struct node));
-  (*node)->message.key = *key;
-  (*node)->message.min_prefix_len = min_prefix_len;
-  (*node)->message.prefix_len = KEY_LEN_BITS;
-  (*node)->message.stored = stored;
-  (*node)->context = context;
-  return (*node);
+  node_ref leaf_ref = node_alloc(state, 0);
+  struct node *leaf = NODE(state, leaf_ref);
+  leaf->message.key = *key;
+  leaf->message.min_prefix_len = min_prefix_len;
+  leaf->message.prefix_len = KEY_LEN_BITS;
+  leaf->message.stored = stored;
+  leaf->context = context;
+  *node = leaf_ref;
+  return leaf_ref;
 }
 
-// Recursively free the memory used by this tree
-static void free_node(struct sync_state *state, struct node *node)
+// Recursively return the nodes of this tree to the pool
+static void free_node(struct sync_state *state, node_ref ref)
 {
-  if (!node)
+  if (!ref)
     return;
   
-  for (unsigned i=0;i<NODE_CHILDREN;i++)
-    free_node(state, node->children[i]);
+  struct node *node = NODE(state, ref);
+  if (ref&BRANCH_REF){
+    for (unsigned i=0;i<NODE_CHILDREN(state);i++)
+      free_node(state, CHILDREN(state, node)[i]);
+  }
   
   if (node->transmit_next){
-    assert(state);
     assert(node->transmit_prev);
     
-    if (node->transmit_next == node){
-      assert(node->transmit_prev==node);
-      state->transmit_ptr = NULL;
+    if (node->transmit_next == ref){
+      assert(node->transmit_prev==ref);
+      state->transmit_ptr = NO_NODE;
     }else{
-      if (state->transmit_ptr == node)
+      if (state->transmit_ptr == ref)
 	state->transmit_ptr = node->transmit_prev;
-      node->transmit_next->transmit_prev = node->transmit_prev;
-      node->transmit_prev->transmit_next = node->transmit_next;
+      NODE(state, node->transmit_next)->transmit_prev = node->transmit_prev;
+      NODE(state, node->transmit_prev)->transmit_next = node->transmit_next;
     }
   }
   
-  free(node);
+  node_release(state, ref);
 }
 
-static void remove_key(struct sync_state *state, struct node **root, const sync_key_t *key)
+static void remove_key(struct sync_state *state, node_ref *root, const sync_key_t *key)
 {
   uint8_t prefix_len = 0;
-  struct node **node = root;
-  struct node **parent = NULL;
+  node_ref *node = root;
+  node_ref *parent = NULL;
   
-  while((*node)->message.prefix_len != KEY_LEN_BITS){
-    uint8_t child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, key);
+  while(NODE(state, *node)->message.prefix_len != KEY_LEN_BITS){
+    struct node *n = NODE(state, *node);
+    uint8_t child_index = sync_get_bits(prefix_len, state->step_bits, key);
     
     // this node represents a range of prefix bits
-    if (prefix_len < (*node)->message.prefix_len){
-      uint8_t node_child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &(*node)->message.key);
+    if (prefix_len < n->message.prefix_len){
+      uint8_t node_child_index = sync_get_bits(prefix_len, state->step_bits, &n->message.key);
       assert(child_index == node_child_index);
-      prefix_len += PREFIX_STEP_BITS;
+      prefix_len += state->step_bits;
       continue;
     }
     
-    sync_xor_node((*node), key);
-    if ((*node)->send_state == SENT)
-      (*node)->send_state = NOT_SENT;
-    if ((*node)->send_state == QUEUED && (*node)->sent_count>0)
-      (*node)->send_state = DONT_SEND;
+    sync_xor_node(n, key);
+    if (n->send_state == SENT)
+      n->send_state = NOT_SENT;
+    if (n->send_state == QUEUED && n->sent_count>0)
+      n->send_state = DONT_SEND;
       
     // reset the send counter
-    (*node)->sent_count=0;
+    n->sent_count=0;
     
     parent = node;
-    node = &(*node)->children[child_index];
+    node = &CHILDREN(state, n)[child_index];
     assert(*node);
-    prefix_len += PREFIX_STEP_BITS;
+    prefix_len += state->step_bits;
   }
   
-  free_node(state, (*node));
-  *node = NULL;
+  free_node(state, *node);
+  *node = NO_NODE;
   
   if (!parent)
     return;
   
   node = NULL;
   // If *parent has <= 1 child now, we need to remove *parent as well
-  for (unsigned i=0;i<NODE_CHILDREN;i++){
-    if ((*parent)->children[i]){
+  struct node *p = NODE(state, *parent);
+  for (unsigned i=0;i<NODE_CHILDREN(state);i++){
+    if (CHILDREN(state, p)[i]){
       if (node)
 	return;
-      node = &(*parent)->children[i];
+      node = &CHILDREN(state, p)[i];
     }
   }
   assert(node);
 
-  struct node *c = *node;
+  node_ref c = *node;
 
-  // remove child ptr so it isn't free'd
-  *node = NULL;
-  c->message.min_prefix_len = (*parent)->message.min_prefix_len;
+  // remove child ref so it isn't free'd
+  *node = NO_NODE;
+  NODE(state, c)->message.min_prefix_len = p->message.min_prefix_len;
   
   free_node(state, *parent);
   
@@ -320,10 +466,11 @@ static void remove_key(struct sync_state *state, struct node **root, const sync_
 }
 
 // find the node which matches this key, or NULL
-static const struct node * find_message(const struct node *node, const key_message_t *message)
+static struct node * find_message(const struct sync_state *state, node_ref ref, const key_message_t *message)
 {
-  if (!node)
+  if (!ref)
     return NULL;
+  struct node *node = NODE(state, ref);
   uint8_t prefix_len = node->message.prefix_len;
   
   while(1){
@@ -332,26 +479,26 @@ static const struct node * find_message(const struct node *node, const key_messa
     if (node->message.prefix_len == KEY_LEN_BITS)
       return NULL;
     
-    uint8_t child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &message->key);
+    uint8_t child_index = sync_get_bits(prefix_len, state->step_bits, &message->key);
     
     if (prefix_len < node->message.prefix_len){
       // TODO optimise this case by comparing all possible prefix bits in one hit
-      uint8_t node_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &node->message.key);
+      uint8_t node_index = sync_get_bits(prefix_len, state->step_bits, &node->message.key);
       if (node_index != child_index)
 	return NULL;
     }else{
-      node = node->children[child_index];
-      if (!node)
+      if (!CHILDREN(state, node)[child_index])
 	return NULL;
+      node = NODE(state, CHILDREN(state, node)[child_index]);
     }
-    prefix_len+=PREFIX_STEP_BITS;
+    prefix_len+=state->step_bits;
   }
 }
 
 int sync_key_exists(const struct sync_state *state, const sync_key_t *key)
 {
   key_message_t message = MESSAGE_FROM_KEY(key);
-  return find_message(state->root, &message) ? 1:0;
+  return find_message(state, state->root, &message) ? 1:0;
 }
 
 int sync_has_transmit_queued(const struct sync_state *state)
@@ -359,23 +506,33 @@ int sync_has_transmit_queued(const struct sync_state *state)
   return state->transmit_ptr?1:0;
 }
 
-// returns NULL if the node already exists
-static struct node * add_key_if_missing(struct node **root, const key_message_t *message, uint8_t stored)
+unsigned sync_nodes_in_use(const struct sync_state *state)
+{
+  return state->leaves.used + state->branches.used;
+}
+
+unsigned sync_branches_in_use(const struct sync_state *state)
+{
+  return state->branches.used;
+}
+
+// returns NO_NODE if the node already exists
+static node_ref add_key_if_missing(struct sync_state *state, node_ref *root, const key_message_t *message, uint8_t stored)
 {
   assert(message->prefix_len == KEY_LEN_BITS);
-  if (find_message(*root, message)!=NULL)
-    return NULL;
-  return add_key(root, &message->key, NULL, stored);
+  if (find_message(state, *root, message)!=NULL)
+    return NO_NODE;
+  return add_key(state, root, &message->key, NULL, stored);
 }
 
 void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context)
 {
 
-  printf("sync_add_key() insterting %02X%02X*\n",
-	 ((unsigned char *)key)[0],((unsigned char *)key)[1]);
+  LOG_DEBUG(LOG_SYNC,"sync_add_key() inserting %02X%02X*",
+	    ((unsigned char *)key)[0],((unsigned char *)key)[1]);
   
   key_message_t message = MESSAGE_FROM_KEY(key);
-  struct node *node = (struct node *)find_message(state->root, &message);
+  struct node *node = find_message(state, state->root, &message);
   if (node){
     node->message.stored = 1;
     node->context = context;
@@ -384,11 +541,11 @@ void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context
   
   state->key_count++;
   state->progress=0;
-  add_key(&state->root, key, context, 1);
+  add_key(state, &state->root, key, context, 1);
   
   struct sync_peer_state *peer_state = state->peers;
   while(peer_state){
-    if (find_message(peer_state->root, &message)){
+    if (find_message(state, peer_state->root, &message)){
       remove_key(state, &peer_state->root, key);
       peer_state->recv_count--;
     }
@@ -396,6 +553,278 @@ void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context
   }
 }
 
+static int valid_step_bits(uint8_t step_bits)
+{
+  return step_bits==1 || step_bits==2 || step_bits==4 || step_bits==8;
+}
+
+struct saved_key{
+  sync_key_t key;
+  void *context;
+};
+
+static void save_leaf_nodes(struct sync_state *state, node_ref ref, struct saved_key *keys, unsigned *count)
+{
+  if (!ref)
+    return;
+  struct node *node = NODE(state, ref);
+  if (node->message.prefix_len == KEY_LEN_BITS){
+    keys[*count].key = node->message.key;
+    keys[*count].context = node->context;
+    (*count)++;
+    return;
+  }
+  for (unsigned i=0;i<NODE_CHILDREN(state);i++)
+    save_leaf_nodes(state, CHILDREN(state, node)[i], keys, count);
+}
+
+// Build a tree from keys, which must be sorted and distinct, and share their
+// first min_prefix_len bits.  The XOR of all of the keys is returned in xor_out,
+// so that each summary node is computed once, from the bottom up.
+static node_ref build_tree(struct sync_state *state, const struct saved_key *keys, unsigned count, uint8_t min_prefix_len, sync_key_t *xor_out)
+{
+  if (count==1){
+    node_ref ref = node_alloc(state, 0);
+    struct node *leaf = NODE(state, ref);
+    leaf->message.key = keys[0].key;
+    leaf->message.min_prefix_len = min_prefix_len;
+    leaf->message.prefix_len = KEY_LEN_BITS;
+    leaf->message.stored = 1;
+    leaf->context = keys[0].context;
+    *xor_out = keys[0].key;
+    return ref;
+  }
+  
+  // (as they are sorted, the first and last keys differ first)
+  uint8_t prefix_len = min_prefix_len;
+  while(sync_get_bits(prefix_len, state->step_bits, &keys[0].key) == sync_get_bits(prefix_len, state->step_bits, &keys[count-1].key))
+    prefix_len += state->step_bits;
+  assert(prefix_len < KEY_LEN_BITS);
+  
+  node_ref ref = node_alloc(state, 1);
+  sync_key_t acc;
+  bzero(&acc, sizeof acc);
+  unsigned start=0;
+  while(start<count){
+    uint8_t child_index = sync_get_bits(prefix_len, state->step_bits, &keys[start].key);
+    unsigned end=start+1;
+    while(end<count && sync_get_bits(prefix_len, state->step_bits, &keys[end].key)==child_index)
+      end++;
+    sync_key_t child_xor;
+    node_ref child = build_tree(state, &keys[start], end-start, prefix_len + state->step_bits, &child_xor);
+    CHILDREN(state, NODE(state, ref))[child_index] = child;
+    for (unsigned i=0;i<KEY_LEN;i++)
+      acc.key[i] ^= child_xor.key[i];
+    start=end;
+  }
+  
+  // the summary is the common prefix, followed by the XOR of the rest of the keys
+  struct node *node = NODE(state, ref);
+  node->message.min_prefix_len = min_prefix_len;
+  node->message.prefix_len = prefix_len;
+  node->message.stored = 1;
+  node->message.key = acc;
+  unsigned i=0;
+  for(;i<(prefix_len>>3);i++)
+    node->message.key.key[i] = keys[0].key.key[i];
+  if (prefix_len&7){
+    uint8_t mask = (0xFF00>>(prefix_len&7)) & 0xFF;
+    node->message.key.key[i] = (mask & keys[0].key.key[i]) | (~mask & acc.key[i]);
+  }
+  *xor_out = acc;
+  return ref;
+}
+
+// Rebuild our tree with a different stride.
+// What we had learnt about each peer's tree is thrown away, they will tell us again.
+static void change_step_bits(struct sync_state *state, uint8_t step_bits)
+{
+  struct saved_key *keys = allocate(sizeof(struct saved_key)*(state->key_count+1));
+  unsigned count=0;
+  save_leaf_nodes(state, state->root, keys, &count);
+  assert(count <= state->key_count);
+  
+  pool_free(&state->leaves);
+  pool_free(&state->branches);
+  state->step_bits = step_bits;
+  node_pools_init(state);
+  state->root = NO_NODE;
+  state->transmit_ptr = NO_NODE;
+  state->blank_reply_count = 0;
+  state->progress = 0;
+  
+  struct sync_peer_state *peer_state = state->peers;
+  while(peer_state){
+    peer_state->root = NO_NODE;
+    peer_state->send_count = 0;
+    peer_state->recv_count = 0;
+    peer_state = peer_state->next;
+  }
+  
+  sync_key_t all;
+  if (count)
+    state->root = build_tree(state, keys, count, 0, &all);
+  free(keys);
+}
+
+// Use the biggest stride that we and all of our peers want
+static void negotiate_step_bits(struct sync_state *state)
+{
+  uint8_t step_bits = state->wanted_step_bits;
+  struct sync_peer_state *peer_state = state->peers;
+  while(peer_state){
+    if (peer_state->step_bits && peer_state->step_bits < step_bits)
+      step_bits = peer_state->step_bits;
+    peer_state = peer_state->next;
+  }
+  if (step_bits != state->step_bits)
+    change_step_bits(state, step_bits);
+}
+
+int sync_set_step_bits(struct sync_state *state, uint8_t step_bits)
+{
+  if (!valid_step_bits(step_bits))
+    return -1;
+  state->wanted_step_bits = step_bits;
+  negotiate_step_bits(state);
+  return 0;
+}
+
+uint8_t sync_step_bits(const struct sync_state *state)
+{
+  return state->step_bits;
+}
+
+static int cmp_saved_key(const void *a, const void *b)
+{
+  return memcmp(&((const struct saved_key *)a)->key, &((const struct saved_key *)b)->key, KEY_LEN);
+}
+
+// Do the first prefix_len bits of these keys match?
+static int same_prefix(const sync_key_t *a, const sync_key_t *b, uint8_t prefix_len)
+{
+  unsigned bytes = prefix_len>>3;
+  if (bytes && memcmp(a, b, bytes))
+    return 0;
+  if (prefix_len&7){
+    uint8_t mask = (0xFF00>>(prefix_len&7)) & 0xFF;
+    if ((a->key[bytes] ^ b->key[bytes]) & mask)
+      return 0;
+  }
+  return 1;
+}
+
+// Find which of the sorted keys are in this peer tree, only visiting the parts of
+// the tree that could hold them
+static void peer_tree_matches(struct sync_state *state, node_ref ref, const struct saved_key *keys, unsigned count, sync_key_t *found, unsigned *found_count)
+{
+  if (!ref || !count)
+    return;
+  struct node *node = NODE(state, ref);
+  if (node->message.prefix_len == KEY_LEN_BITS){
+    struct saved_key leaf = {.key = node->message.key};
+    if (bsearch(&leaf, keys, count, sizeof(struct saved_key), cmp_saved_key))
+      found[(*found_count)++] = node->message.key;
+    return;
+  }
+  
+  uint8_t prefix_len = node->message.prefix_len;
+  unsigned start=0;
+  while(start<count){
+    if (!same_prefix(&keys[start].key, &node->message.key, prefix_len)){
+      start++;
+      continue;
+    }
+    uint8_t child_index = sync_get_bits(prefix_len, state->step_bits, &keys[start].key);
+    unsigned end=start+1;
+    while(end<count && same_prefix(&keys[end].key, &node->message.key, prefix_len)
+      && sync_get_bits(prefix_len, state->step_bits, &keys[end].key)==child_index)
+      end++;
+    peer_tree_matches(state, CHILDREN(state, node)[child_index], &keys[start], end-start, found, found_count);
+    start=end;
+  }
+}
+
+void sync_add_keys(struct sync_state *state, const sync_key_t *keys, void * const *contexts, unsigned count)
+{
+  if (!count)
+    return;
+  
+  struct saved_key *new_keys = allocate(sizeof(struct saved_key)*count);
+  for (unsigned i=0;i<count;i++){
+    new_keys[i].key = keys[i];
+    new_keys[i].context = contexts ? contexts[i] : NULL;
+  }
+  qsort(new_keys, count, sizeof(struct saved_key), cmp_saved_key);
+  
+  // Drop duplicates (the last context wins, as with sync_add_key()),
+  // and keys we already have, just updating their context
+  unsigned new_count=0;
+  for (unsigned i=0;i<count;i++){
+    if (i+1<count && cmp_saved_key(&new_keys[i], &new_keys[i+1])==0)
+      continue;
+    key_message_t message = MESSAGE_FROM_KEY(&new_keys[i].key);
+    struct node *node = find_message(state, state->root, &message);
+    if (node){
+      node->message.stored = 1;
+      node->context = new_keys[i].context;
+      continue;
+    }
+    new_keys[new_count++] = new_keys[i];
+  }
+  
+  LOG_INFO(LOG_SYNC,"sync_add_keys() inserting %u new keys (of %u) into a tree of %u",
+	   new_count, count, state->key_count);
+  if (!new_count){
+    free(new_keys);
+    return;
+  }
+  
+  if (new_count*8 < state->key_count){
+    // Only a few new keys, so just add them into the tree
+    for (unsigned i=0;i<new_count;i++)
+      add_key(state, &state->root, &new_keys[i].key, new_keys[i].context, 1);
+  }else{
+    // Merge our existing keys with the new ones, and build a whole new tree
+    // (any of our nodes that were queued would have been out of date anyway)
+    unsigned total = state->key_count + new_count;
+    struct saved_key *all = allocate(sizeof(struct saved_key)*total);
+    unsigned old_count=0;
+    save_leaf_nodes(state, state->root, all, &old_count);
+    assert(old_count <= state->key_count);
+    memmove(&all[total-old_count], all, sizeof(struct saved_key)*old_count);
+    unsigned o=total-old_count, n=0, out=0;
+    while(n<new_count || o<total){
+      if (o>=total || (n<new_count && cmp_saved_key(&new_keys[n], &all[o])<0))
+	all[out++] = new_keys[n++];
+      else
+	all[out++] = all[o++];
+    }
+    
+    free_node(state, state->root);
+    sync_key_t all_xor;
+    state->root = build_tree(state, all, out, 0, &all_xor);
+    free(all);
+  }
+  state->key_count += new_count;
+  state->progress=0;
+  
+  // Forget that any peer told us about the keys we now have
+  sync_key_t *found = allocate(sizeof(sync_key_t)*new_count);
+  struct sync_peer_state *peer_state = state->peers;
+  while(peer_state){
+    unsigned found_count=0;
+    peer_tree_matches(state, peer_state->root, new_keys, new_count, found, &found_count);
+    for (unsigned i=0;i<found_count;i++){
+      remove_key(state, &peer_state->root, &found[i]);
+      peer_state->recv_count--;
+    }
+    peer_state = peer_state->next;
+  }
+  free(found);
+  free(new_keys);
+}
+
 void sync_free_peer_state(struct sync_state *state, void *peer_context){
   struct sync_peer_state **peer_state = &state->peers;
   while(*peer_state){
@@ -404,6 +833,8 @@ void sync_free_peer_state(struct sync_state *state, void *peer_context){
       free_node(state, free_peer->root);
       *peer_state = free_peer->next;
       free(free_peer);
+      // we might be able to use a bigger stride now that they have gone
+      negotiate_step_bits(state);
       return;
     }
     peer_state= &(*peer_state)->next;
@@ -416,29 +847,23 @@ struct sync_state* sync_alloc_state(void *context, peer_has has, peer_does_not_h
   state->has = has;
   state->has_not = has_not;
   state->now_has = now_has;
+  state->step_bits = state->wanted_step_bits = PREFIX_STEP_BITS;
+  node_pools_init(state);
   return state;
 }
 
 // clear all memory used by this state
 void sync_free_state(struct sync_state *state){
-  while(state->transmit_ptr){
-    struct node *p = state->transmit_ptr;
-    state->transmit_ptr = state->transmit_ptr->transmit_next;
-    p->transmit_next=NULL;
-    p->transmit_prev=NULL;
-  }
-  
-  free_node(NULL, state->root);
-    
+  // Every node lives in the slabs, so there is no need to walk the trees
   while(state->peers){
     struct sync_peer_state *peer_state = state->peers;
-    
-    free_node(NULL, peer_state->root);
-    
     state->peers = peer_state->next;
     free(peer_state);
   }
   
+  pool_free(&state->leaves);
+  pool_free(&state->branches);
+  
   free(state);
 }
 
@@ -462,10 +887,31 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
   state->sent_messages++;
   state->progress++;
   
-  struct node *tail = state->transmit_ptr;
+  if (state->step_bits!=1){
+    // no point telling them our stride if we can't also tell them something else
+    if (len < MESSAGE_BYTES*2)
+      return 0;
+    bzero(buff, MESSAGE_BYTES);
+    buff[0] = state->step_bits;
+    buff[1] = SYNC_STRIDE_RECORD;
+    offset+=MESSAGE_BYTES;
+  }
+  size_t header_len = offset;
+  
+  unsigned blanks=0;
+  while(blanks < state->blank_reply_count && offset + MESSAGE_BYTES<=len){
+    copy_message(&buff[offset], &state->blank_replies[blanks++]);
+    offset+=MESSAGE_BYTES;
+    state->sent_record_count++;
+  }
+  state->blank_reply_count-=blanks;
+  memmove(state->blank_replies, &state->blank_replies[blanks], state->blank_reply_count*sizeof(key_message_t));
+  
+  node_ref tail = state->transmit_ptr;
   
   while(tail && offset + MESSAGE_BYTES<=len){
-    struct node *head = tail->transmit_next;
+    node_ref head_ref = NODE(state, tail)->transmit_next;
+    struct node *head = NODE(state, head_ref);
     assert(head->transmit_prev == tail);
     
     if (head->send_state == QUEUED){
@@ -479,34 +925,34 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
     
     if (head->send_state == QUEUED){
       // advance tail pointer
-      tail = head;
+      tail = head_ref;
     }else{
-      struct node *next = head->transmit_next;
-      head->transmit_next = NULL;
-      head->transmit_prev = NULL;
+      node_ref next = head->transmit_next;
+      head->transmit_next = NO_NODE;
+      head->transmit_prev = NO_NODE;
       
-      if (head == tail || next == head){
+      if (head_ref == tail || next == head_ref){
 	// transmit loop is now empty
-	tail = NULL;
+	tail = NO_NODE;
 	break;
       }else{
 	// remove from the transmit loop
-	tail->transmit_next = next;
-	next->transmit_prev = tail;
+	NODE(state, tail)->transmit_next = next;
+	NODE(state, next)->transmit_prev = tail;
       }
     }
     
     // stop if we just sent everything in the loop once.
-    if (head == state->transmit_ptr)
+    if (head_ref == state->transmit_ptr)
       break;
   }
   
   state->transmit_ptr = tail;
   
   // If we don't have anything else to send, always send our root tree node
-  if(offset + MESSAGE_BYTES<=len && offset==0){
+  if(offset + MESSAGE_BYTES<=len && offset==header_len){
     state->sent_root++;
-    copy_message(&buff[offset], state->root ? &state->root->message : NULL);
+    copy_message(&buff[offset], state->root ? &NODE(state, state->root)->message : NULL);
     offset+=MESSAGE_BYTES;
     state->sent_record_count++;
   }
@@ -517,8 +963,9 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
 
 // Add a tree node into our transmission queue
 // the node can be added to the head or tail of the list.
-static void queue_node(struct sync_state *state, struct node *node, uint8_t head)
+static void queue_node(struct sync_state *state, node_ref ref, uint8_t head)
 {
+  struct node *node = NODE(state, ref);
   node->send_state = QUEUED;
   if (node->transmit_next)
     return;
@@ -528,25 +975,26 @@ static void queue_node(struct sync_state *state, struct node *node, uint8_t head
   
   // insert this node into the transmit loop
   if (!state->transmit_ptr){
-    state->transmit_ptr = node;
-    node->transmit_next = node;
-    node->transmit_prev = node;
+    state->transmit_ptr = ref;
+    node->transmit_next = ref;
+    node->transmit_prev = ref;
   }else{
-    node->transmit_next = state->transmit_ptr->transmit_next;
+    struct node *ptr = NODE(state, state->transmit_ptr);
+    node->transmit_next = ptr->transmit_next;
     node->transmit_prev = state->transmit_ptr;
     
-    node->transmit_next->transmit_prev = node;
-    node->transmit_prev->transmit_next = node;
+    NODE(state, node->transmit_next)->transmit_prev = ref;
+    ptr->transmit_next = ref;
     
     // advance past this node to transmit it last
     if (!head)
-      state->transmit_ptr = node;
+      state->transmit_ptr = ref;
   }
 }
 
 static unsigned peer_is_missing(struct sync_state *state, struct sync_peer_state *peer, const struct node *node, uint8_t allow_remove)
 {
-  const struct node *peer_node = find_message(peer->root, &node->message);
+  const struct node *peer_node = find_message(state, peer->root, &node->message);
   if (peer_node){
     if (peer_node->message.stored && allow_remove){
       // peer has now received this key?
@@ -559,7 +1007,7 @@ static unsigned peer_is_missing(struct sync_state *state, struct sync_peer_state
     return 0;
   }
   
-  add_key(&peer->root, &node->message.key, node->context, 1);
+  add_key(state, &peer->root, &node->message.key, node->context, 1);
   peer->send_count ++;
   state->progress=0;
   if (state->has_not)
@@ -571,15 +1019,16 @@ static unsigned peer_is_missing(struct sync_state *state, struct sync_peer_state
 // optionally ignoring a single child of this node.
 static void peer_missing_leaf_nodes(
     struct sync_state *state, struct sync_peer_state *peer, 
-    struct node *node, unsigned except, uint8_t allow_remove)
+    node_ref ref, unsigned except, uint8_t allow_remove)
 {
+  struct node *node = NODE(state, ref);
   if (node->message.prefix_len == KEY_LEN_BITS){
     if (peer_is_missing(state, peer, node, allow_remove))
-      queue_node(state, node, 1);
+      queue_node(state, ref, 1);
   }else{
-    for (unsigned i=0;i<NODE_CHILDREN;i++){
-      if (i!=except && node->children[i])
-	peer_missing_leaf_nodes(state, peer, node->children[i], NODE_CHILDREN, allow_remove);
+    for (unsigned i=0;i<NODE_CHILDREN(state);i++){
+      if (i!=except && CHILDREN(state, node)[i])
+	peer_missing_leaf_nodes(state, peer, CHILDREN(state, node)[i], NODE_CHILDREN(state), allow_remove);
     }
   }
 }
@@ -589,7 +1038,7 @@ static void peer_add_key(struct sync_state *state, struct sync_peer_state *peer_
   if (message->prefix_len != KEY_LEN_BITS || !message->stored)
     return;
     
-  struct node *node = add_key_if_missing(&peer_state->root, message, 0);
+  node_ref node = add_key_if_missing(state, &peer_state->root, message, 0);
   
   if (node){
     //Yay, they told us something we didn't know.
@@ -606,16 +1055,17 @@ static void peer_add_key(struct sync_state *state, struct sync_peer_state *peer_
 static void de_queue(struct node *node){
   if (node->send_state == QUEUED)
     node->send_state = DONT_SEND;
-  for (unsigned i=0;i<NODE_CHILDREN;i++)
-    if (node->children[i])
-      de_queue(node->children[i]);
+  for (unsigned i=0;i<NODE_CHILDREN(state);i++)
+    if (CHILDREN(state, node)[i])
+      de_queue(CHILDREN(state, node)[i]);
 }
 */
 
-static unsigned peer_has_received_all(struct sync_state *state, struct sync_peer_state *peer_state, struct node *peer_node)
+static unsigned peer_has_received_all(struct sync_state *state, struct sync_peer_state *peer_state, node_ref peer_ref)
 {
-  if (!peer_node)
+  if (!peer_ref)
     return 0;
+  struct node *peer_node = NODE(state, peer_ref);
   unsigned ret=0;
   if (peer_node->message.prefix_len == KEY_LEN_BITS){
     if (peer_node->message.stored){
@@ -626,10 +1076,10 @@ static unsigned peer_has_received_all(struct sync_state *state, struct sync_peer
       ret=1;
     }
   }else{
-    // duplicate the child pointers, as removing an immediate child key *will* also free this peer node.
-    struct node *children[NODE_CHILDREN];
-    memcpy(children, peer_node->children, sizeof(children));
-    for (unsigned i=0;i<NODE_CHILDREN;i++)
+    // duplicate the child refs, as removing an immediate child key *will* also free this peer node.
+    node_ref children[NODE_CHILDREN(state)];
+    memcpy(children, CHILDREN(state, peer_node), sizeof(children));
+    for (unsigned i=0;i<NODE_CHILDREN(state);i++)
       ret+=peer_has_received_all(state, peer_state, children[i]);
   }
   return ret;
@@ -638,13 +1088,14 @@ static unsigned peer_has_received_all(struct sync_state *state, struct sync_peer
 // add information about keys sent to this peer,
 // remove information about keys received from this peer
 // (both operations are XOR's)
-// returns a struct node if this message is an exact match
-static struct node * remove_differences(struct sync_peer_state *peer_state, key_message_t *message)
+// returns the node if this message is an exact match
+static node_ref remove_differences(struct sync_state *state, struct sync_peer_state *peer_state, key_message_t *message)
 {
   if (!peer_state->root || !message->stored)
-    return NULL;
+    return NO_NODE;
   
-  struct node *peer_node = peer_state->root;
+  node_ref peer_ref = peer_state->root;
+  struct node *peer_node = NODE(state, peer_ref);
   uint8_t prefix_len = 0;
   
   while(prefix_len < message->prefix_len){
@@ -653,22 +1104,23 @@ static struct node * remove_differences(struct sync_peer_state *peer_state, key_
       if (cmp_message(message, &peer_node->message)==0)
 	break;
       if (message->prefix_len == KEY_LEN_BITS)
-	return NULL;
+	return NO_NODE;
     }
     
-    uint8_t child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &message->key);
+    uint8_t child_index = sync_get_bits(prefix_len, state->step_bits, &message->key);
     
     if (prefix_len < peer_node->message.prefix_len){
       // TODO optimise this case by comparing all possible prefix bits in one hit
-      uint8_t node_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &peer_node->message.key);
+      uint8_t node_index = sync_get_bits(prefix_len, state->step_bits, &peer_node->message.key);
       if (node_index != child_index)
-	return NULL; // no match
+	return NO_NODE; // no match
     }else{
-      peer_node = peer_node->children[child_index];
-      if (!peer_node)
-	return NULL;
+      peer_ref = CHILDREN(state, peer_node)[child_index];
+      if (!peer_ref)
+	return NO_NODE;
+      peer_node = NODE(state, peer_ref);
     }
-    prefix_len+=PREFIX_STEP_BITS;
+    prefix_len+=state->step_bits;
   }
   
   if (message->prefix_len < KEY_LEN_BITS){
@@ -677,10 +1129,33 @@ static struct node * remove_differences(struct sync_peer_state *peer_state, key_
       sync_xor(&peer_node->message.key, message);
     }else{
       // we need to xor all children so we can get the prefix bits right.
-      xor_children(peer_node, message);
+      xor_children(state, peer_node, message);
     }
   }
-  return peer_node;
+  return peer_ref;
+}
+
+// Queue a node with the same prefix as message, but no keys under it.
+// They will see that we don't know any of their keys below that prefix (see is_blank in recv_key)
+static void queue_blank_reply(struct sync_state *state, const key_message_t *message, uint8_t min_prefix_len)
+{
+  key_message_t blank;
+  bzero(&blank, sizeof blank);
+  blank.prefix_len = message->prefix_len;
+  blank.min_prefix_len = min_prefix_len;
+  sync_xor(&message->key, &blank);
+  // (sync_xor copied the prefix, but also the rest of the key)
+  unsigned i=blank.prefix_len>>3;
+  if (blank.prefix_len&7)
+    blank.key.key[i++] &= (0xFF00>>(blank.prefix_len&7)) & 0xFF;
+  for (;i<KEY_LEN;i++)
+    blank.key.key[i]=0;
+  
+  for (i=0;i<state->blank_reply_count;i++)
+    if (memcmp(&state->blank_replies[i], &blank, sizeof blank)==0)
+      return;
+  if (state->blank_reply_count < MAX_BLANK_REPLIES)
+    state->blank_replies[state->blank_reply_count++] = blank;
 }
 
 // Proccess one incoming tree record.
@@ -689,6 +1164,9 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
   // sanity check on two header bytes.
   if (message->min_prefix_len > message->prefix_len || message->prefix_len > (KEY_LEN_BITS + 1))
     return -1;
+  // every branch is a whole number of strides from the root
+  if (message->prefix_len < KEY_LEN_BITS && message->prefix_len % state->step_bits)
+    return -1;
   
   state->received_record_count++;
   /* Possible outcomes;
@@ -717,15 +1195,16 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
 
   if (message->prefix_len == KEY_LEN_BITS+1) {
     // peer has no node of their own, they don't have anything that we have.
-    peer_missing_leaf_nodes(state, peer_state, state->root, NODE_CHILDREN, 0);
+    peer_missing_leaf_nodes(state, peer_state, state->root, NODE_CHILDREN(state), 0);
     return 0;
   }
   
   key_message_t peer_message = *message;
   
   // first, remove information from peer_message that we have already learnt about this peer
-  struct node *peer_node = remove_differences(peer_state, &peer_message);
-  struct node *node = state->root;
+  node_ref peer_ref = remove_differences(state, peer_state, &peer_message);
+  node_ref our_ref = state->root;
+  struct node *node = NODE(state, our_ref);
   uint8_t prefix_len = 0;
   uint8_t is_blank = 1;
   for (unsigned i=(peer_message.prefix_len>>3)+1;i<KEY_LEN && is_blank;i++)
@@ -741,7 +1220,7 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
       
       if (message->stored){
 	// we can mark any keys they need as being received
-	if (peer_has_received_all(state, peer_state, peer_node)==0)
+	if (peer_has_received_all(state, peer_state, peer_ref)==0)
 	  state->received_uninteresting++;
       }else{
 	// peer is ACK'ing that they need to know this key, which we have
@@ -762,10 +1241,10 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
     if (peer_message.prefix_len <= prefix_len){
       if (is_blank){
 	// This peer doesn't know any of the children of this node
-	peer_missing_leaf_nodes(state, peer_state, node, NODE_CHILDREN, 1);
+	peer_missing_leaf_nodes(state, peer_state, our_ref, NODE_CHILDREN(state), 1);
       }else if (node->message.prefix_len > peer_message.prefix_len){
 	// reply with our matching node
-	queue_node(state, node, 1);
+	queue_node(state, our_ref, 1);
       }else{
 	// compare their node to our tree, test if we can easily detect a part of our tree they don't know
 	// Note, this only works if there are an odd number of different leaf nodes
@@ -776,62 +1255,68 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
 	sync_xor(&node->message.key, &test_message);
 	
 	// if we can explain the difference based on a matching node, queue all leaf nodes
-	struct node *test_node = node;
+	node_ref test_ref = our_ref;
 	uint8_t test_prefix = prefix_len;
-	while(test_node) {
+	while(test_ref) {
+	  struct node *test_node = NODE(state, test_ref);
 	  if (cmp_message(&test_message, &test_node->message)==0){
 	    // This peer doesn't know any of the children of this node
-	    peer_missing_leaf_nodes(state, peer_state, test_node, NODE_CHILDREN, 1);
+	    peer_missing_leaf_nodes(state, peer_state, test_ref, NODE_CHILDREN(state), 1);
 	    return 0;
 	  }
 	  if (test_node->message.prefix_len == KEY_LEN_BITS)
 	    break;
-	  uint8_t child_index = sync_get_bits(test_prefix, PREFIX_STEP_BITS, &test_message.key);
+	  uint8_t child_index = sync_get_bits(test_prefix, state->step_bits, &test_message.key);
 	  if (test_prefix<test_node->message.prefix_len){
 	    // TODO optimise this case by comparing all possible prefix bits in one hit
-	    uint8_t node_index = sync_get_bits(test_prefix, PREFIX_STEP_BITS, &test_node->message.key);
+	    uint8_t node_index = sync_get_bits(test_prefix, state->step_bits, &test_node->message.key);
 	    if (node_index != child_index)
 	      break; // no match
 	  }else{
-	    test_node = test_node->children[child_index];
+	    test_ref = CHILDREN(state, test_node)[child_index];
 	  }
-	  test_prefix+=PREFIX_STEP_BITS;
+	  test_prefix+=state->step_bits;
 	}
 	
 	// queue the transmission of all child nodes of this node
-	for (unsigned i=0;i<NODE_CHILDREN;i++){
-	  if (node->children[i])
-	    queue_node(state, node->children[i], 0);
+	for (unsigned i=0;i<NODE_CHILDREN(state);i++){
+	  if (CHILDREN(state, node)[i])
+	    queue_node(state, CHILDREN(state, node)[i], 0);
 	}
+	// In a binary tree, they can work out which children they are missing
+	// from the min_prefix_len of the ones they have.  With a wider stride they
+	// can't, so follow up with this node, so they can compare it again.
+	if (state->step_bits!=1)
+	  queue_node(state, our_ref, 0);
       }
       return 0;
     }
     
     // which branch of the tree should we look at next
-    uint8_t key_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &peer_message.key);
+    uint8_t key_index = sync_get_bits(prefix_len, state->step_bits, &peer_message.key);
   
     // if our node represents a large range of the keyspace, find the first prefix bit that differs
     while (prefix_len < node->message.prefix_len && prefix_len < peer_message.prefix_len){
       // check the next step bits
-      uint8_t existing_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &node->message.key);
+      uint8_t existing_index = sync_get_bits(prefix_len, state->step_bits, &node->message.key);
       if (key_index != existing_index){
 	// If the prefix of our node differs from theirs, they don't have any of these keys
 	// send them all
 	if (prefix_len >= peer_message.min_prefix_len && peer_message.stored){
-	  peer_missing_leaf_nodes(state, peer_state, node, NODE_CHILDREN, 0);
+	  peer_missing_leaf_nodes(state, peer_state, our_ref, NODE_CHILDREN(state), 0);
 	  
 	  if (peer_message.prefix_len != KEY_LEN_BITS)
 	    // and after they have added all these missing keys, they need to know 
 	    // this summary node so they can be reminded to send this key or it's children again.
-	    queue_node(state, node, 0);
+	    queue_node(state, our_ref, 0);
 	}
 	
 	if (peer_message.prefix_len == KEY_LEN_BITS)
 	  peer_add_key(state, peer_state, &peer_message);
 	return 0;
       }
-      prefix_len += PREFIX_STEP_BITS;
-      key_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &peer_message.key);
+      prefix_len += state->step_bits;
+      key_index = sync_get_bits(prefix_len, state->step_bits, &peer_message.key);
     }
     
     if (message->prefix_len <= prefix_len)
@@ -842,18 +1327,21 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
     if (peer_message.min_prefix_len <= node->message.prefix_len && peer_message.stored){
       // send all keys to the other party, except for the child @key_index
       // they don't have any of these siblings
-      peer_missing_leaf_nodes(state, peer_state, node, key_index, 0);
+      peer_missing_leaf_nodes(state, peer_state, our_ref, key_index, 0);
     }
     
     // look at the next node in our graph
-    if (!node->children[key_index]){
+    if (!CHILDREN(state, node)[key_index]){
       // we know nothing about this key
       if (peer_message.prefix_len == KEY_LEN_BITS){
 	peer_add_key(state, peer_state, &peer_message);
+      }else if (peer_message.stored){
+	// we don't have any of the keys below their node
+	queue_blank_reply(state, &peer_message, prefix_len + state->step_bits);
       }else{
 	// hopefully the other party will tell us something,
 	// and we won't get stuck in a loop talking about the same node.
-	queue_node(state, node, 0);
+	queue_node(state, our_ref, 0);
       }
       return 0;
     }
@@ -863,8 +1351,9 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
     //if (node->sent_count>0 && node->send_state == QUEUED)
     //  node->send_state = SENT;
     
-    node = node->children[key_index];
-    prefix_len += PREFIX_STEP_BITS;
+    our_ref = CHILDREN(state, node)[key_index];
+    node = NODE(state, our_ref);
+    prefix_len += state->step_bits;
   }
 }
 
@@ -888,6 +1377,22 @@ int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_
   size_t offset=0;
   if (len%MESSAGE_BYTES)
     return -1;
+  
+  uint8_t step_bits = 1;
+  if (len>=MESSAGE_BYTES && buff[1]==SYNC_STRIDE_RECORD){
+    step_bits = buff[0];
+    if (!valid_step_bits(step_bits))
+      return -1;
+    offset+=MESSAGE_BYTES;
+  }
+  if (peer_state->step_bits != step_bits){
+    peer_state->step_bits = step_bits;
+    negotiate_step_bits(state);
+  }
+  // They will come down to our stride once they hear from us
+  if (step_bits != state->step_bits)
+    return 0;
+  
   while(offset + MESSAGE_BYTES<=len){
     const uint8_t *p = &buff[offset];
     key_message_t message;
@@ -0,0 +1,196 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015 Serval Project Inc.
+
+Timer queue for the main loop.  Rather than checking every so often whether
+it is time to do each of the periodic jobs (sending our next message, writing
+the status files etc), each job registers a timer, and the main loop sleeps in
+poll() until either there is input for it, or the next timer is due.
+
+There are only ever a handful of timers, so a simple array is all we need.
+
+When we are being run under fakecsmaradio in virtual clock mode, we also follow
+its clock here, and tell it when we are waiting for our next timer, so that it
+can skip ahead to then if nothing else is happening.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "virtualclock.h"
+
+#define MAX_TIMERS 16
+
+struct timer {
+  char *name;
+  timer_function function;
+  // When the timer is next due, or -1 if it isn't scheduled
+  long long due;
+};
+
+struct timer timers[MAX_TIMERS];
+int timer_count=0;
+
+int timer_register(char *name,timer_function function)
+{
+  assert(timer_count<MAX_TIMERS);
+  timers[timer_count].name=name;
+  timers[timer_count].function=function;
+  timers[timer_count].due=-1;
+  return timer_count++;
+}
+
+int timer_schedule(int timer,long long due)
+{
+  if (timer<0||timer>=timer_count) return -1;
+  timers[timer].due=due;
+  return 0;
+}
+
+int timer_cancel(int timer)
+{
+  return timer_schedule(timer,-1);
+}
+
+// Returns the time at which the next timer is due, or -1 if there are none.
+long long timer_next_due(void)
+{
+  long long next=-1;
+  for(int i=0;i<timer_count;i++)
+    if (timers[i].due>=0)
+      if (next<0||timers[i].due<next) next=timers[i].due;
+  return next;
+}
+
+// Run all timers that have come due.  Each timer is unscheduled before it is
+// called, so it must reschedule itself if it should keep running.
+int timers_run(void)
+{
+  int count=0;
+  long long now=now_ms;
+  for(int i=0;i<timer_count;i++) {
+    if ((timers[i].due>=0)&&(timers[i].due<=now)) {
+      timers[i].due=-1;
+      timers[i].function();
+      count++;
+    }
+  }
+  return count;
+}
+
+struct virtual_clock *virtual_clock=NULL;
+struct virtual_clock_node *virtual_clock_node=NULL;
+// The signal mask to use while we are waiting, i.e., with SIGUSR1 unblocked
+sigset_t virtual_clock_sigmask;
+
+static void virtual_clock_wakeup(int signal)
+{
+  // Nothing to do: we just need poll() to return
+}
+
+// Follow the virtual clock of the fakecsmaradio that serial_port belongs to
+int virtual_clock_attach(char *filename,char *serial_port)
+{
+  int fd=open(filename,O_RDWR);
+  if (fd<0) {
+    perror("Opening virtual clock");
+    return -1;
+  }
+  struct virtual_clock *c=mmap(NULL,sizeof(struct virtual_clock),
+			       PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (c==MAP_FAILED) {
+    perror("Mapping virtual clock");
+    return -1;
+  }
+  for(int i=0;i<c->node_count&&i<VIRTUAL_CLOCK_MAX_NODES;i++)
+    if (!strcmp(c->nodes[i].tty,serial_port)) {
+      virtual_clock=c;
+      virtual_clock_node=&c->nodes[i];
+      virtual_clock_node->idle=0;
+      virtual_clock_node->pid=getpid();
+      __sync_add_and_fetch(&c->busy,1);
+
+      // fakecsmaradio tells us when it moves the clock to when we want to
+      // wake up.  We only let that interrupt us while we are waiting, so
+      // that there is no race between working out how long to wait, and
+      // starting to.
+      sigset_t block;
+      sigemptyset(&block);
+      sigaddset(&block,SIGUSR1);
+      sigprocmask(SIG_BLOCK,&block,&virtual_clock_sigmask);
+      sigdelset(&virtual_clock_sigmask,SIGUSR1);
+      struct sigaction sa;
+      memset(&sa,0,sizeof(sa));
+      sa.sa_handler=virtual_clock_wakeup;
+      sigaction(SIGUSR1,&sa,NULL);
+
+      virtual_clock_node->attached=1;
+      virtual_clock_offset=&c->offset;
+      fprintf(stderr,"Following virtual clock in '%s' (currently %+lldms)\n",
+	      filename,c->offset);
+      return 0;
+    }
+  fprintf(stderr,"%s is not one of the radios in virtual clock '%s'\n",
+	  serial_port,filename);
+  munmap(c,sizeof(struct virtual_clock));
+  return -1;
+}
+
+// Sleep in poll() until there is input, or timeout ms have passed.
+int timers_poll(struct pollfd *fds,int nfds,int timeout)
+{
+  if (!virtual_clock_node) return poll(fds,nfds,timeout);
+
+  long long wake_time=gettime_ms()+timeout;
+  int r;
+  virtual_clock_node->wake_time=wake_time;
+  __sync_synchronize();
+  virtual_clock_node->idle=1;
+  // If we were the last one with anything to do, then fakecsmaradio can skip
+  // ahead now
+  if ((!__sync_sub_and_fetch(&virtual_clock->busy,1))&&virtual_clock->pid)
+    kill(virtual_clock->pid,SIGUSR1);
+  while(1) {
+    long long remaining=wake_time-gettime_ms();
+    if (remaining<0) remaining=0;
+    struct timespec ts;
+    ts.tv_sec=remaining/1000;
+    ts.tv_nsec=(remaining%1000)*1000000;
+    r=ppoll(fds,nfds,&ts,&virtual_clock_sigmask);
+    if ((r<0)&&(errno==EINTR)) r=0;
+    if (r) break;
+    if (gettime_ms()>=wake_time) break;
+  }
+  __sync_add_and_fetch(&virtual_clock->busy,1);
+  virtual_clock_node->idle=0;
+  __sync_synchronize();
+  virtual_clock_node->wakeups++;
+  return r;
+}
@@ -39,6 +39,13 @@ void sleep_ms(int milliseconds) // cross-platform sleep function
 }
 
 
+// If we are following fakecsmaradio's virtual clock, then this is how far it
+// is ahead of the wall clock (see virtual_clock_attach())
+volatile long long *virtual_clock_offset=NULL;
+// Added to the wall clock only, so that clocksteptest can pretend
+// that a time master has just set it
+long long wall_clock_step_ms=0;
+
 // From os.c in serval-dna
 long long gettime_us()
 {
@@ -48,7 +55,9 @@ long long gettime_us()
     return -1;
   if (nowtv.tv_sec < 0 || nowtv.tv_usec < 0 || nowtv.tv_usec >= 1000000)
     return -1;
-  return nowtv.tv_sec * 1000000LL + nowtv.tv_usec;
+  long long offset=wall_clock_step_ms;
+  if (virtual_clock_offset) offset+=*virtual_clock_offset;
+  return nowtv.tv_sec * 1000000LL + nowtv.tv_usec + offset*1000LL;
 }
 
 // From os.c in serval-dna
@@ -60,7 +69,39 @@ long long gettime_ms()
     return -1;
   if (nowtv.tv_sec < 0 || nowtv.tv_usec < 0 || nowtv.tv_usec >= 1000000)
     return -1;
-  return nowtv.tv_sec * 1000LL + nowtv.tv_usec / 1000;
+  long long offset=wall_clock_step_ms;
+  if (virtual_clock_offset) offset+=*virtual_clock_offset;
+  return nowtv.tv_sec * 1000LL + nowtv.tv_usec / 1000 + offset;
+}
+
+/*
+  The wall clock above is for showing people what time it is, and for telling
+  other nodes.  It jumps whenever we are a time slave and a time master sets
+  it, so everything that measures how long it has been since something
+  happened (peer expiry, congestion control, the timers in timers.c etc) uses
+  CLOCK_MONOTONIC instead.
+
+  Rather than asking the kernel again every time, the main loop samples it once
+  each time around with clock_update(), and everything just looks at now_ms.
+  (Monotonic time starts at some arbitrary point, so it should only ever be
+  compared with other monotonic times, never shown or sent.)
+*/
+long long now_ms=0;
+
+long long monotime_ms()
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC,&ts)) return -1;
+  // Follow fakecsmaradio's virtual clock as it skips ahead
+  if (virtual_clock_offset)
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 + *virtual_clock_offset;
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long clock_update()
+{
+  now_ms=monotime_ms();
+  return now_ms;
 }
 
 int chartohex(int c)
@@ -130,44 +171,63 @@ int ascii64_encode(unsigned char *in, char *out, int in_len, int radio_type)
 {
   // ASCII-64 is use by HF ALE radio links. It is just ASCII codes 0x20 - 0x5f
   // On Barrett, nothing is escaped.
-  // On Codan, spaces must be escaped
+  // On Codan, spaces (and so backslashes) must be escaped on the command line,
+  // but the radio doesn't send the escapes over the air.
 
+  // 3 bytes are encoded using 4 characters.  A final 1 or 2 bytes take 2 or 3
+  // characters, so the decoder can tell how many bytes there were.
   int out_ofs=0;
   int i,j;
   for(i=0;i<in_len;i+=3) {
-    // Encode 3 bytes using 4
+    int b0=in[i+0];
+    int b1=(i+1<in_len)?in[i+1]:0;
+    int b2=(i+2<in_len)?in[i+2]:0;
     unsigned char ob[4];
-    ob[0]=0x20+(in[i+0]&0x3f);
-    ob[1]=0x20+((in[i+0]&0xc0)>>6)+((in[i+1]&0x0f)<<2);
-    ob[2]=0x20+((in[i+1]&0xf0)>>4)+((in[i+2]&0x03)<<4);
-    ob[3]=0x20+((in[i+2]&0xfc)>>2);
+    ob[0]=0x20+(b0&0x3f);
+    ob[1]=0x20+((b0&0xc0)>>6)+((b1&0x0f)<<2);
+    ob[2]=0x20+((b1&0xf0)>>4)+((b2&0x03)<<4);
+    ob[3]=0x20+((b2&0xfc)>>2);
+    int chars=4;
+    if (in_len-i==1) chars=2;
+    if (in_len-i==2) chars=3;
 
     // XXX - Character escaping policy should be set in radio driver
     // not in here!
-    for(j=0;j<4;j++) {
-      if ((ob[j]==' ')&&(radio_type==RADIOTYPE_HFCODAN)) {
+    for(j=0;j<chars;j++) {
+      if (((ob[j]==' ')||(ob[j]=='\\'))&&(radio_type==RADIOTYPE_HFCODAN)) {
 	out[out_ofs++]='\\';
       }
       out[out_ofs++]=ob[j];
     }
   }
   out[out_ofs]=0;
-  return 0;
+  return out_ofs;
 }
 
+// Returns the number of bytes written to out, or -1 if in is not valid ASCII-64.
+// (in must be as received over the air, i.e., without any escapes)
 int ascii64_decode(char *in, unsigned char *out, int out_len,int radio_type)
 {
-  int i;
+  int i,j;
   int out_ofs=0;
-  for(i=0;in[i];i+=4) {
+  int in_len=strlen(in);
+  if ((in_len&3)==1) return -1;
+  for(i=0;i<in_len;i+=4) {
+    int v[4]={0,0,0,0};
+    int chars=in_len-i; if (chars>4) chars=4;
+    for(j=0;j<chars;j++) {
+      if ((in[i+j]<0x20)||(in[i+j]>0x5f)) return -1;
+      v[j]=in[i+j]-0x20;
+    }
     unsigned char ob[3];
-    ob[0]=(in[i+0]-0x20)&0x3f;
-    ob[0]|=(((in[i+1]-0x20)&0x03)<<6);
-    ob[1]=(((in[i+1]-0x20)&0x3c)>>2);
-    ob[1]|=(((in[i+2]-0x20)&0x0f)<<4);
-    ob[2]=(((in[i+2]-0x20)&0x30)>>4);
-    ob[2]|=(((in[i+3]-0x20)&0x3f)<<2);
-    out_ofs+=3;
+    ob[0]=v[0]|((v[1]&0x03)<<6);
+    ob[1]=((v[1]&0x3c)>>2)|((v[2]&0x0f)<<4);
+    ob[2]=((v[2]&0x30)>>4)|(v[3]<<2);
+    // 2 characters make 1 byte, 3 make 2, and 4 make 3
+    for(j=0;j<chars-1;j++) {
+      if (out_ofs>=out_len) return -1;
+      out[out_ofs++]=ob[j];
+    }
   }
 
   return out_ofs;
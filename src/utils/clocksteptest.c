@@ -0,0 +1,115 @@
+/*
+  Wall clock step test.
+
+  Steps the wall clock back and forth, as a time master would, while the
+  monotonic clock carries on steadily, and checks that peers expire, the
+  congestion control adjusts, and timers fire when they should.
+
+  usage: clocksteptest
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "util.h"
+#include "radios.h"
+#include "testutil.h"
+
+static int timer_fired=0;
+
+static void clockstep_timer(void)
+{
+  timer_fired++;
+}
+
+static int expect(char *what,long long step,int got,int expected)
+{
+  if (got==expected) return 0;
+  printf("ERROR: %s after stepping the wall clock by %+llds: got %d, expected %d\n",
+	 what,step/1000,got,expected);
+  return 1;
+}
+
+int main(int argc,char **argv)
+{
+  // An hour either way, then as far as a node without a real time clock might
+  // get set when it first hears a time master
+  long long steps[]={0,-3600000LL,3600000LL,-40*86400000LL,40*86400000LL,0};
+  int step_count=sizeof(steps)/sizeof(steps[0]);
+  int errors=0;
+
+  clock_update();
+  sync_setup();
+  // timestamp_str() needs a SID to show
+  my_sid_hex="BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C";
+
+  struct peer_state *p=calloc(1,sizeof(struct peer_state));
+  assert(p);
+  p->sid_prefix="be0c4be0c4be0c4b";
+  peer_records[0]=p;
+  peer_count=1;
+  int timer=timer_register("clockstep",clockstep_timer);
+
+  quiet();
+  for(int i=0;i<step_count;i++) {
+    long long step=steps[i];
+    wall_clock_step_ms=step;
+
+    // Peer expiry: we hear from a peer, and then nothing
+    p->last_message_time=now_ms/1000;
+    now_ms+=(PEER_KEEPALIVE_INTERVAL-1)*1000;
+    errors+=expect("active peers before keepalive interval",step,active_peer_count(),1);
+    now_ms+=2000;
+    errors+=expect("active peers after keepalive interval",step,active_peer_count(),0);
+
+    // Retransmission and the like: a timer a second from now
+    timer_fired=0;
+    timer_schedule(timer,now_ms+1000);
+    now_ms+=999;
+    timers_run();
+    errors+=expect("timer fired early",step,timer_fired,0);
+    now_ms+=2;
+    timers_run();
+    errors+=expect("timer fired",step,timer_fired,1);
+
+    // We ignore pieces of a bundle we just received for 4 minutes
+    char bid[17];
+    random_hex(bid,8);
+    sync_remember_recently_received_bundle(bid,1);
+    now_ms+=4*60*1000-1000;
+    errors+=expect("bundle recently received",step,
+		   sync_is_bundle_recently_received(bid,1),1);
+    now_ms+=2000;
+    errors+=expect("bundle still recently received",step,
+		   sync_is_bundle_recently_received(bid,1),0);
+
+    // Congestion control looks at the channel every 4 seconds
+    p->last_message_time=now_ms/1000;
+    message_update_interval=500;
+    radio_transmissions_seen=100;
+    congestion_update_time=now_ms+4000;
+    now_ms+=3999;
+    rfd900_serviceloop(-1);
+    errors+=expect("congestion control before 4 seconds",step,message_update_interval,500);
+    now_ms+=2;
+    rfd900_serviceloop(-1);
+    errors+=expect("congestion control slowed down after 4 seconds",step,
+		   message_update_interval>500,1);
+  }
+  unquiet();
+
+  timer_cancel(timer);
+  peer_records[0]=NULL;
+  peer_count=0;
+  free(p);
+  if (errors) {
+    printf("FAIL: %d errors\n",errors);
+    return 1;
+  }
+  printf("PASS: protocol timers ignored %d wall clock steps\n",step_count);
+  return 0;
+}
@@ -0,0 +1,188 @@
+/*
+  Cross-check and benchmark for the table driven Reed-Solomon code.
+
+  Encodes random packets of random lengths with both encode_rs_8() and
+  encode_rs_8_fast(), adds 0 to 16 symbol errors (and sometimes erasures,
+  and sometimes more errors than can be corrected), and checks that
+  decode_rs_8_fast() does exactly what decode_rs_8() does, for each
+  implementation this CPU supports.  Then measures the throughput of each,
+  unless only asked to check them (as make check does).
+
+  usage: fectest [packets to check per implementation] [check]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "fec-3.0.1/fixed.h"
+#include "rs_fast.h"
+
+void encode_rs_8(data_t *data, data_t *parity,int pad);
+int decode_rs_8(data_t *data, int *eras_pos, int no_eras, int pad);
+
+static long long gettime_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*1000000LL+tv.tv_usec;
+}
+
+// Corrupt count distinct symbols of the len byte word
+static void add_errors(data_t *word,int len,int count,int *positions)
+{
+  for(int e=0;e<count;e++) {
+    int pos,dup;
+    do {
+      pos=random()%len;
+      dup=0;
+      for(int k=0;k<e;k++) if (positions[k]==pos) dup=1;
+    } while(dup);
+    positions[e]=pos;
+    word[pos]^=1+random()%255;
+  }
+}
+
+static int cross_check(int mode,int count)
+{
+  int errors=0;
+  int corrected=0,failed=0;
+  for(int n=0;n<count;n++) {
+    data_t word[NN],ref[NN],fast[NN];
+    int pad=random()%(NN-NROOTS);
+    int len=NN-pad;
+    for(int i=0;i<len-NROOTS;i++) word[i]=random();
+    // Some all-zero and all-ones packets too
+    if (n%1000==1) memset(word,0,len-NROOTS);
+    if (n%1000==2) memset(word,0xff,len-NROOTS);
+
+    data_t parity[NROOTS];
+    encode_rs_8(word,&word[len-NROOTS],pad);
+    encode_rs_8_fast(word,parity,pad);
+    if (memcmp(parity,&word[len-NROOTS],NROOTS)) {
+      if (errors<10) printf("ERROR: %s: parity differs for packet #%d (pad=%d)\n",
+			    rs_fast_mode_name(mode),n,pad);
+      errors++;
+    }
+
+    // Up to 16 errors, then every now and then some erasures in place of
+    // some of the errors, or more errors than we can correct
+    int error_count=n%17;
+    int eras_count=0;
+    if (!(n%5)) eras_count=random()%(NROOTS-2*error_count+1);
+    if (!(n%7)) error_count=17+random()%8;
+    if (error_count+eras_count>len) eras_count=len-error_count;
+    int positions[NN];
+    memcpy(ref,word,len);
+    add_errors(ref,len,error_count+eras_count,positions);
+    memcpy(fast,ref,len);
+
+    int ref_eras[NN],fast_eras[NN];
+    for(int i=0;i<eras_count;i++)
+      ref_eras[i]=fast_eras[i]=pad+positions[error_count+i];
+    int r1=decode_rs_8(ref,eras_count?ref_eras:NULL,eras_count,pad);
+    int r2=decode_rs_8_fast(fast,eras_count?fast_eras:NULL,eras_count,pad);
+    int bad=0;
+    if (r1!=r2) bad=1;
+    else if (memcmp(ref,fast,len)) bad=2;
+    else if (eras_count&&r1>0&&memcmp(ref_eras,fast_eras,sizeof(int)*r1)) bad=3;
+    if (bad) {
+      if (errors<10)
+	printf("ERROR: %s: packet #%d (pad=%d, %d errors, %d erasures): %s (returned %d, expected %d)\n",
+	       rs_fast_mode_name(mode),n,pad,error_count,eras_count,
+	       bad==1?"different result":bad==2?"different data":"different erasure positions",
+	       r2,r1);
+      errors++;
+    }
+    if (r1>=0&&!memcmp(ref,word,len-NROOTS)) corrected++; else failed++;
+  }
+  printf("%-9s %d packets: %d decoded correctly, %d uncorrectable, %d differences\n",
+	 rs_fast_mode_name(mode),count,corrected,failed,errors);
+  return errors;
+}
+
+#define BENCH_PACKETS 4096
+
+// Packets per second of encoding, and of decoding clean packets, and
+// packets with 8 errors
+static void benchmark(char *name,int fast,data_t (*packets)[NN],data_t (*received)[NN],
+		      double rates[3])
+{
+  data_t work[NN];
+  long long start,elapsed;
+  int sink=0;
+  int rounds=fast?20:2;
+
+  start=gettime_us();
+  for(int r=0;r<rounds;r++)
+    for(int n=0;n<BENCH_PACKETS;n++) {
+      if (fast) encode_rs_8_fast(packets[n],work,0);
+      else encode_rs_8(packets[n],work,0);
+      sink+=work[0];
+    }
+  elapsed=gettime_us()-start;
+  rates[0]=rounds*BENCH_PACKETS*1000000.0/(elapsed?elapsed:1);
+
+  for(int k=1;k<3;k++) {
+    data_t (*source)[NN]=(k==1)?packets:received;
+    // Fewer rounds with errors, as correcting them takes much longer
+    int rounds_here=(k==1)?rounds:1;
+    start=gettime_us();
+    for(int r=0;r<rounds_here;r++)
+      for(int n=0;n<BENCH_PACKETS;n++) {
+	memcpy(work,source[n],NN);
+	if (fast) sink+=decode_rs_8_fast(work,NULL,0,0);
+	else sink+=decode_rs_8(work,NULL,0,0);
+      }
+    elapsed=gettime_us()-start;
+    rates[k]=rounds_here*BENCH_PACKETS*1000000.0/(elapsed?elapsed:1);
+  }
+  printf("%-9s %10.0f %16.0f %16.0f   (%d)\n",name,rates[0],rates[1],rates[2],sink&1);
+}
+
+// Throughput of fec-3.0.1 and each implementation this CPU supports
+static void throughput(void)
+{
+  static data_t packets[BENCH_PACKETS][NN],received[BENCH_PACKETS][NN];
+  for(int n=0;n<BENCH_PACKETS;n++) {
+    int positions[8];
+    for(int i=0;i<NN-NROOTS;i++) packets[n][i]=random();
+    encode_rs_8(packets[n],&packets[n][NN-NROOTS],0);
+    memcpy(received[n],packets[n],NN);
+    add_errors(received[n],NN,8,positions);
+  }
+  printf("\npackets/sec  encode  decode (clean)  decode (8 errors)\n");
+  double ref[3],rates[3];
+  benchmark("fec-3.0.1",0,packets,received,ref);
+  for(int mode=RS_MODE_PORT;mode<RS_MODES;mode++) {
+    if (rs_fast_set_mode(mode)) continue;
+    benchmark(rs_fast_mode_name(mode),1,packets,received,rates);
+  }
+  rs_fast_set_mode(RS_MODE_AUTO);
+  printf("using %s\n",rs_fast_mode_name(rs_fast_get_mode()));
+}
+
+int main(int argc,char **argv)
+{
+  int count=20000;
+  if (argc>1) count=atoi(argv[1]);
+  int check_only=(argc>2)&&!strcmp(argv[2],"check");
+  srandom(1);
+
+  int errors=0;
+  int modes=0;
+  for(int mode=RS_MODE_PORT;mode<RS_MODES;mode++) {
+    if (rs_fast_set_mode(mode)) continue;
+    errors+=cross_check(mode,count);
+    modes++;
+  }
+  if (!check_only) throughput();
+
+  if (errors) {
+    printf("FAIL: %d differences\n",errors);
+    return 1;
+  }
+  printf("PASS: %d implementations give identical results to fec-3.0.1\n",modes);
+  return 0;
+}
@@ -0,0 +1,136 @@
+/*
+  ASCII-64 and HF fragment test.
+
+  Random round trips through ascii64_encode() and ascii64_decode(), with and
+  without the Codan escapes, then random packets cut into hex and ASCII-64
+  fragments, which must fit in an ALE message and decode again.  Hex
+  fragments must still be readable by LBARDs from before ASCII-64.
+  (lbard benchmark hfencoding measures the airtime each one takes.)
+
+  usage: hfencodingtest [round trips]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "util.h"
+#include "radios.h"
+#include "hf.h"
+
+static int round_trips(int count)
+{
+  int errors=0;
+  unsigned char in[256],out[256];
+  char encoded[1024],codan[1024],unescaped[1024];
+
+  for(int n=0;n<count;n++) {
+    int len=n%(HF_FRAGMENT_BYTES_ASCII64+1);
+    for(int i=0;i<len;i++) in[i]=random();
+    if (n%100==1) memset(in,0,len);
+    int chars=ascii64_encode(in,encoded,len,RADIOTYPE_HFBARRETT);
+    int bytes=ascii64_decode(encoded,out,sizeof(out),RADIOTYPE_HFBARRETT);
+    if ((chars!=(len*4+2)/3)||(bytes!=len)||memcmp(in,out,len)) {
+      if (errors<10) printf("ERROR: %d bytes encoded as %d characters, decoded as %d bytes\n",
+			    len,chars,bytes);
+      errors++;
+    }
+    // Codan escapes are only for the command line
+    ascii64_encode(in,codan,len,RADIOTYPE_HFCODAN);
+    int j=0;
+    for(int i=0;codan[i];i++) {
+      if (codan[i]=='\\') i++;
+      unescaped[j++]=codan[i];
+    }
+    unescaped[j]=0;
+    if (strcmp(unescaped,encoded)) {
+      if (errors<10) printf("ERROR: Codan escaped '%s' as '%s'\n",encoded,codan);
+      errors++;
+    }
+  }
+  // Too short to be anything, or not in the character set
+  if (ascii64_decode("A",out,sizeof(out),RADIOTYPE_HFBARRETT)!=-1
+      ||ascii64_decode("AB`D",out,sizeof(out),RADIOTYPE_HFBARRETT)!=-1
+      ||ascii64_decode("ABCDEFGH",out,5,RADIOTYPE_HFBARRETT)!=-1) {
+    printf("ERROR: ascii64_decode() accepted invalid input\n");
+    errors++;
+  }
+  return errors;
+}
+
+// Send a packet over HF using hex or ASCII-64 fragments, and check that it
+// decodes again
+static int fragment_trip(unsigned char *packet,int length,int ascii64)
+{
+  int errors=0;
+  unsigned char decoded[256];
+  char fragment[1024];
+  hf_peer_ascii64=ascii64;
+  if (hf_tx_start(packet,length)) {
+    printf("ERROR: could not send a packet of %d bytes\n",length);
+    return 1;
+  }
+  int end=0;
+  while(hf_tx.offset<hf_tx.len) {
+    hf_tx_fragment(fragment,'0');
+    int len=strlen(fragment);
+    if (len>90) {
+      printf("ERROR: %d character fragment is too long for ALE\n",len);
+      errors++;
+    }
+    end=hf_fragment_decode(fragment,decoded,sizeof(decoded),NULL);
+    if (!ascii64) {
+      // An LBARD from before ASCII-64 must still be able to read it
+      unsigned char old[256];
+      int start=(fragment[1]-'0')*43;
+      int old_end=start;
+      for(int i=3;i<len;i+=2)
+	if (ishex(fragment[i+0])&&ishex(fragment[i+1]))
+	  old[old_end++]=(chartohexnybl(fragment[i+0])<<4)+chartohexnybl(fragment[i+1]);
+      if ((old_end!=end)||memcmp(&old[start],&decoded[start],end-start)) {
+	printf("ERROR: old LBARDs would not read hex fragment '%s'\n",fragment);
+	errors++;
+      }
+    }
+    hf_tx.offset+=hf_tx.fragment_bytes;
+  }
+  hf_tx.state=HF_TX_IDLE;
+  hf_peer_ascii64=0;
+  if ((end!=length)||memcmp(decoded,packet,length)) {
+    printf("ERROR: %d byte packet did not survive %s fragmentation\n",
+	   length,ascii64?"ASCII-64":"hex");
+    errors++;
+  }
+  return errors;
+}
+
+int main(int argc,char **argv)
+{
+  int count=10000;
+  if (argc>1) count=atoi(argv[1]);
+
+  clock_update();
+  int errors=round_trips(count);
+
+  // Packets of every size from a bare header up to a full LINK_MTU packet and
+  // its RS parity, filled with random bytes, or with 0s now and then
+  unsigned char packet[256];
+  int packets=0;
+  for(int len=1;len<=LINK_MTU+32;len++)
+    for(int k=0;k<4;k++) {
+      for(int i=0;i<len;i++) packet[i]=k?random():0;
+      errors+=fragment_trip(packet,len,0);
+      errors+=fragment_trip(packet,len,1);
+      packets++;
+    }
+
+  if (errors) {
+    printf("FAIL: %d errors\n",errors);
+    return 1;
+  }
+  printf("PASS: %d ASCII-64 round trips, %d packets sent as hex and ASCII-64 fragments\n",
+	 count,packets);
+  return 0;
+}
@@ -0,0 +1,273 @@
+/*
+  HF fragment reassembly test.
+
+  Packets from 3 stations, in hex and ASCII-64, interleaved, with fragments
+  dropped, duplicated, garbled, cut short and swapped with their neighbours.
+  Every packet that comes out must be exactly the one that went in, no packet
+  may come out twice, and every packet that arrived with all of its pieces
+  intact must come out.  Also compares how many are recovered with putting
+  each packet together in a single buffer, as we used to.
+  (lbard benchmark hfreassembly measures how fast it goes.)
+
+  usage: hfreassemblytest [packets]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "util.h"
+#include "radios.h"
+#include "hf.h"
+#include "rs_fast.h"
+#include "testutil.h"
+
+// ALE 2G sends 3 characters per 392ms word, and each AMD message also has
+// TO and TIS address words.
+#define ALE_WORD_MS 392
+#define ALE_ADDRESS_WORDS 2
+
+// What the Codan radio does to the amd command before sending it
+static void codan_unescape(char *text)
+{
+  int o=0;
+  for(char *c=text;*c;c++) {
+    if ((*c=='\\')&&c[1]) c++;
+    text[o++]=*c;
+  }
+  text[o]=0;
+}
+
+struct fragment {
+  char sender[8];
+  char text[128];
+  int packet;
+  // Arrived whole and ungarbled
+  int clean;
+};
+
+#define SENDERS 3
+static unsigned char (*sent_packets)[256];
+static int sent_count;
+static int *sent_lengths;
+static int *delivered;
+static int wrong=0;
+static int came_out_short=0;
+static int with_erasures=0;
+
+// Stands in for saw_packet(), and checks that what comes out is what went in.
+// (The packet number is in the first 4 bytes)
+static int packet_handler(unsigned char *packet,int len,int *erasures,int erasure_count)
+{
+  // (saw_packet() only believes up to 7 errors on top of the erasures)
+  int rs_error_count=rs_decode_packet(packet,len,erasures,erasure_count);
+  if ((rs_error_count<0)||(rs_error_count>=8)) return -1;
+  int n=packet[0]|(packet[1]<<8)|(packet[2]<<16)|(packet[3]<<24);
+  // (the parity bytes don't get corrected, so only check the data)
+  if ((n<0)||(n>=sent_count)||(len>sent_lengths[n])
+      ||memcmp(packet,sent_packets[n],len-32)) {
+    wrong++;
+    return -1;
+  }
+  // We must never guess the length of a packet whose last piece is missing
+  if (len<sent_lengths[n]) came_out_short++;
+  delivered[n]++;
+  if (erasure_count) with_erasures++;
+  return 0;
+}
+
+int main(int argc,char **argv)
+{
+  int count=2000;
+  if (argc>1) count=atoi(argv[1]);
+  clock_update();
+
+  int errors=0;
+  int dropped=0,duplicated=0,garbled=0,truncated=0,reordered=0;
+  int seq[SENDERS]={0,0,0};
+
+  sent_count=count;
+  sent_packets=malloc(count*256);
+  sent_lengths=calloc(count,sizeof(int));
+  delivered=calloc(count,sizeof(int));
+  int *clean_pieces=calloc(count,sizeof(int));
+  int *pieces=calloc(count,sizeof(int));
+  int max_fragments=count*6*2+16;
+  struct fragment *stream=calloc(max_fragments,sizeof(struct fragment));
+  struct fragment *queues[SENDERS];
+  int queued[SENDERS]={0,0,0},taken[SENDERS]={0,0,0};
+  for(int s=0;s<SENDERS;s++) {
+    queues[s]=calloc(max_fragments,sizeof(struct fragment));
+    assert(queues[s]);
+  }
+  assert(sent_packets&&sent_lengths&&delivered);
+  assert(clean_pieces&&pieces&&stream);
+  int sent_fragments=0;
+  // (one packet per turn, so the old way can spot the last piece)
+  hf_batch_limit=1;
+
+  // Make the packets, RS encoded as radio_send_message() does, and cut them
+  // into fragments, each sender's in order.
+  for(int n=0;n<count;n++) {
+    unsigned char *p=sent_packets[n];
+    int len=40+random()%(200+32-40+1);
+    for(int i=0;i<len-32;i++) p[i]=random();
+    for(int i=0;i<4;i++) p[i]=n>>(i*8);
+    encode_rs_8_fast(p,&p[len-32],223-(len-32));
+    sent_lengths[n]=len;
+
+    int s=random()%SENDERS;
+    hf_peer_ascii64=random()&1;
+    hf_message_sequence_number=seq[s]++;
+    if (hf_tx_start(p,len)) { errors++; continue; }
+    pieces[n]=hf_tx.pieces;
+    while(hf_tx.offset<hf_tx.len) {
+      struct fragment *f=&queues[s][queued[s]++];
+      snprintf(f->sender,sizeof(f->sender),"%d",s+1);
+      // The last station has a Barrett radio.  The Codan radios take the
+      // escapes out again before sending.
+      int codan=(s<SENDERS-1);
+      radio_set_type(codan?RADIOTYPE_HFCODAN:RADIOTYPE_HFBARRETT);
+      hf_tx_fragment(f->text,codan?'0':'A');
+      if (codan) codan_unescape(f->text);
+      f->packet=n;
+      f->clean=1;
+      hf_tx.offset+=hf_tx.fragment_bytes;
+      sent_fragments++;
+    }
+    hf_tx.state=HF_TX_IDLE;
+  }
+  hf_peer_ascii64=0;
+
+  // Stations take turns to send a packet, but sometimes two are at it at
+  // once, and we hear their fragments alternately.  Then mess things up.
+  int fragments=0;
+  int turn[2]={0,0};
+  for(int total=0;total<sent_fragments;) {
+    int both=(random()%100<20)?2:1;
+    for(int k=0;k<both;k++)
+      do { turn[k]=random()%SENDERS; }
+      while(taken[turn[k]]==queued[turn[k]]);
+    int packet[2]={queues[turn[0]][taken[turn[0]]].packet,-1};
+    if ((both==2)&&(turn[1]!=turn[0])&&(taken[turn[1]]<queued[turn[1]]))
+      packet[1]=queues[turn[1]][taken[turn[1]]].packet;
+    for(int more=1;more;) {
+      more=0;
+      for(int k=0;k<2;k++) {
+	int s=turn[k];
+	if ((packet[k]<0)||(taken[s]==queued[s])||(queues[s][taken[s]].packet!=packet[k]))
+	  continue;
+	more=1;
+	struct fragment f=queues[s][taken[s]++];
+	total++;
+	int r=random()%100;
+	if (r<5) { dropped++; continue; }
+	int len=strlen(f.text);
+	if (r<15) {
+	  for(int i=0;i<1+random()%3;i++) f.text[3+random()%(len-3)]='~';
+	  f.clean=0; garbled++;
+	} else if (r<18) {
+	  f.text[4+random()%(len-4)]=0;
+	  f.clean=0; truncated++;
+	}
+	stream[fragments++]=f;
+	// (the shuffle below moves duplicates along a bit)
+	if (random()%100<10) { stream[fragments++]=f; duplicated++; }
+      }
+    }
+  }
+  for(int i=0;i<fragments-1;i++)
+    if (random()%100<10) {
+      int j=i+1+random()%3;
+      if (j>=fragments) j=fragments-1;
+      struct fragment t=stream[i]; stream[i]=stream[j]; stream[j]=t;
+      reordered++;
+    }
+  for(int i=0;i<fragments;i++)
+    if (stream[i].clean) clean_pieces[stream[i].packet]|=1<<(stream[i].text[1]-'0');
+
+  // The old way: one buffer, and decode when the last piece turns up
+  unsigned char buffer[256];
+  int old_recovered=0;
+  int *old_delivered=calloc(count,sizeof(int));
+  assert(old_delivered);
+  for(int i=0;i<fragments;i++) {
+    int end=hf_fragment_decode(stream[i].text,buffer,sizeof(buffer),NULL);
+    if (end<0) continue;
+    if (stream[i].text[1]!=stream[i].text[2]-1) continue;
+    unsigned char copy[256];
+    memcpy(copy,buffer,end);
+    if (rs_decode_packet(copy,end,NULL,0)<0) continue;
+    int n=stream[i].packet;
+    if ((end==sent_lengths[n])&&(!memcmp(copy,sent_packets[n],end-32))
+	&&(!old_delivered[n]++))
+      old_recovered++;
+  }
+
+  // And now the real thing, with the time passing as each fragment is sent
+  hf_packet_handler=packet_handler;
+  bzero(hf_reassembly,sizeof(hf_reassembly));
+  quiet();
+  for(int i=0;i<fragments;i++) {
+    int len=strlen(stream[i].text);
+    now_ms+=((len+2)/3+ALE_ADDRESS_WORDS)*ALE_WORD_MS;
+    hf_reassembly_add(stream[i].sender,stream[i].text);
+  }
+  now_ms+=HF_REASSEMBLY_TIMEOUT_MS;
+  hf_reassembly_expire();
+  unquiet();
+
+  int recovered=0,twice=0,clean_complete=0,clean_lost=0;
+  for(int n=0;n<count;n++) {
+    if (delivered[n]) recovered++;
+    if (delivered[n]>1) twice++;
+    int complete=(clean_pieces[n]==(1<<pieces[n])-1);
+    if (complete) {
+      clean_complete++;
+      if (!delivered[n]) clean_lost++;
+    }
+  }
+
+  printf("%d packets in %d fragments: %d dropped, %d duplicated, %d garbled, %d cut short, %d swapped\n",
+	 count,sent_fragments,dropped,duplicated,garbled,truncated,reordered);
+  printf("  %d packets arrived with every piece intact at least once\n",clean_complete);
+  printf("  single buffer:   %5d recovered (%.1f%%)\n",old_recovered,old_recovered*100.0/count);
+  printf("  per sequence:    %5d recovered (%.1f%%), %d using erasures\n",
+	 recovered,recovered*100.0/count,with_erasures);
+
+  if (came_out_short) {
+    printf("ERROR: %d packets came out short, having lost their last piece\n",
+	   came_out_short);
+    errors++;
+  }
+  if (wrong) {
+    printf("ERROR: %d packets were passed up wrong\n",wrong);
+    errors++;
+  }
+  if (twice) {
+    printf("ERROR: %d packets were passed up more than once\n",twice);
+    errors++;
+  }
+  if (clean_lost) {
+    printf("ERROR: %d packets that arrived intact were not recovered\n",clean_lost);
+    errors++;
+  }
+  if (recovered<=old_recovered) {
+    printf("ERROR: no better than a single buffer\n");
+    errors++;
+  }
+  for(int s=0;s<SENDERS;s++) free(queues[s]);
+  free(stream); free(clean_pieces); free(pieces); free(old_delivered);
+  free(sent_packets); free(sent_lengths); free(delivered);
+  if (errors) {
+    printf("FAIL: %d errors\n",errors);
+    return 1;
+  }
+  printf("PASS: fragments reassembled despite loss, duplication and reordering\n");
+  return 0;
+}
+
@@ -0,0 +1,91 @@
+/*
+  /metrics report test.
+
+  Builds packets full of length announcements, and feeds the servald
+  latency histogram some requests, then checks that the report served at
+  /metrics adds up.  (lbard benchmark metrics measures what the counters
+  cost.)
+
+  usage: metricstest
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "metrics.h"
+
+int main(int argc,char **argv)
+{
+  unsigned char msg[256];
+  unsigned char bid[8]={1,2,3,4,5,6,7,8};
+  int errors=0;
+
+  clock_update();
+  bzero(&metrics,sizeof(metrics));
+
+  // A few packets, each with as many announcements as will fit
+  int announcements=0;
+  for(int i=0;i<10;i++) {
+    int offset=0,last=-1;
+    while(offset!=last) {
+      last=offset;
+      announce_bundle_length(200,msg,&offset,bid,1500000000000LL+i,1024);
+      if (offset!=last) announcements++;
+    }
+  }
+  // (each announcement is a 21 byte section)
+  if (metrics.tx_bytes_by_type['L']!=announcements*21LL) {
+    printf("ERROR: counted %llu bytes of L sections, expected %lld\n",
+	   metrics.tx_bytes_by_type['L'],announcements*21LL);
+    errors++;
+  }
+
+  // Requests to servald of 3, 7, 7, 20000ms, and one that failed after 40ms
+  metrics_observe_servald_latency(3,1);
+  metrics_observe_servald_latency(7,1);
+  metrics_observe_servald_latency(7,1);
+  metrics_observe_servald_latency(20000,1);
+  metrics_observe_servald_latency(40,0);
+  METRIC_TX_SECTION(0x01,5);
+
+  char *report=NULL;
+  size_t len=0;
+  FILE *f=open_memstream(&report,&len);
+  assert(f);
+  metrics_report(f);
+  fclose(f);
+  char expected[128];
+  char *lines[]={
+    "lbard_servald_request_duration_ms_bucket{le=\"5\"} 1\n",
+    "lbard_servald_request_duration_ms_bucket{le=\"10\"} 3\n",
+    "lbard_servald_request_duration_ms_bucket{le=\"50\"} 4\n",
+    "lbard_servald_request_duration_ms_bucket{le=\"10000\"} 4\n",
+    "lbard_servald_request_duration_ms_bucket{le=\"+Inf\"} 5\n",
+    "lbard_servald_request_duration_ms_sum 20057\n",
+    "lbard_servald_request_failures_total 1\n",
+    "lbard_tx_message_bytes_total{type=\"0x01\"} 5\n",
+    expected,
+    NULL
+  };
+  snprintf(expected,sizeof(expected),"lbard_tx_message_bytes_total{type=\"L\"} %llu\n",
+	   metrics.tx_bytes_by_type['L']);
+  for(int i=0;lines[i];i++)
+    if (!strstr(report,lines[i])) {
+      printf("ERROR: report is missing: %s",lines[i]);
+      errors++;
+    }
+  free(report);
+
+  if (errors) {
+    printf("FAIL: %d errors\n",errors);
+    return 1;
+  }
+  printf("PASS: %d announcements and 5 servald requests add up in the report\n",
+	 announcements);
+  return 0;
+}
@@ -0,0 +1,113 @@
+/*
+  Bundle priority test.
+
+  Makes up a store of bundles of different sizes, services and recipients,
+  then has peers arrive, bundles change (including the one we would send
+  next) and get announced, and checks after each change that the priority
+  tree picks the same bundle to send next as a linear scan of all of them
+  does.
+  (lbard benchmark priority measures how much faster it is.)
+
+  usage: prioritytest [bundles]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "util.h"
+#include "testutil.h"
+
+#define ROUNDS 1000
+
+int main(int argc,char **argv)
+{
+  char *services[]={"MeshMS1","MeshMS2","meshmb","file","MeshMS2",NULL};
+  char hex[65];
+  int count=2000;
+  if (argc>1) count=atoi(argv[1]);
+  if (count>MAX_BUNDLES) count=MAX_BUNDLES;
+  if (count<1) count=1;
+  int mismatches=0;
+
+  srandom(1);
+  clock_update();
+
+  // A pool of recipients, some of whom will be peers
+  char *recipients[64];
+  for(int i=0;i<64;i++) {
+    random_hex(hex,32);
+    recipients[i]=strdup(hex);
+  }
+
+  for(int i=0;i<count;i++) {
+    memset(&bundles[i],0,sizeof(struct bundle_record));
+    random_hex(hex,32);
+    bundles[i].bid_hex=strdup(hex);
+    bundles[i].service=services[random()%5];
+    bundles[i].recipient=(random()&3)?recipients[random()%64]:"";
+    bundles[i].length=1+(random()%(1<<(random()%24)));
+    bundles[i].version=random();
+    bundles[i].last_announced_time=random()%100;
+    bundles[i].index=i;
+  }
+  bundle_count=count;
+  peer_count=0;
+  bundle_priorities_invalidate();
+
+  for(int round=0;round<ROUNDS;round++) {
+    char *what;
+    int b;
+    switch(random()%8) {
+    case 0:
+      {
+	what="a peer arrived";
+	struct peer_state *p=calloc(1,sizeof(struct peer_state));
+	assert(p);
+	p->sid_prefix=strndup(recipients[random()%64],16);
+	if (peer_count<MAX_PEERS) peer_records[peer_count++]=p;
+	else peer_records[random()%peer_count]=p;
+	bundle_priorities_invalidate();
+      }
+      break;
+    case 1: case 2:
+      what="a bundle changed";
+      b=random()%count;
+      bundles[b].length=1+(random()%(1<<(random()%24)));
+      bundles[b].service=services[random()%5];
+      bundle_priority_update(b);
+      break;
+    case 3:
+      // (which the tree has to notice, or it would keep choosing it)
+      what="the bundle we would send next changed";
+      b=find_highest_priority_bundle();
+      bundles[b].length=1<<23;
+      bundles[b].service="file";
+      bundle_priority_update(b);
+      break;
+    default:
+      what="bundles were announced";
+      for(int j=0;j<10;j++)
+	bundles[random()%count].last_announced_time=100+round;
+    }
+
+    int linear=find_highest_priority_bundle_linear();
+    int tree=find_highest_priority_bundle();
+    if (linear!=tree) {
+      printf("ERROR: round %d, after %s: linear scan chose bundle #%d, priority tree chose #%d\n",
+	     round,what,linear,tree);
+      mismatches++;
+    }
+  }
+
+  if (mismatches) {
+    printf("FAIL: %d of %d selections differ\n",mismatches,ROUNDS);
+    return 1;
+  }
+  printf("PASS: the priority tree chose the same as a linear scan %d times, with %d bundles and %d peers\n",
+	 ROUNDS,count,peer_count);
+  return 0;
+}
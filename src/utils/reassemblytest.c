@@ -0,0 +1,171 @@
+/*
+  Bundle body reassembly test.
+
+  Cuts a body up as a sender would, into 64 byte aligned pieces of a few
+  blocks each, adds some unaligned pieces (as sent with
+  FLAG_NO_BITMAP_PROGRESS) and duplicates, and feeds them to a partial
+  bundle in order, in reverse and shuffled, only telling it the length when
+  the last piece arrives.  Then sends it one block at a time, in order, with
+  the length known from the start (as from the manifest).  Checks that every piece is accepted, that it never
+  claims a byte or the whole body before it has them, and that the body
+  comes out exactly as it went in.
+  (lbard benchmark reassembly measures how fast it goes.)
+
+  usage: reassemblytest [body length]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+struct piece {
+  int offset;
+  int bytes;
+};
+
+static int reassemble(unsigned char *body,int length,struct piece *pieces,int piece_count,
+		      int length_known,char *order)
+{
+  int errors=0;
+  unsigned char *covered=calloc(length,1);
+  assert(covered);
+  int covered_bytes=0;
+  int first_uncovered=0;
+
+  struct partial_bundle p;
+  bzero(&p,sizeof(p));
+  p.manifest_length=-1;
+  p.body_length=-1;
+  if (length_known) {
+    p.body_length=length;
+    partial_stream_set_length(&p.body_stream,length);
+  }
+
+  for(int i=0;i<piece_count&&errors<10;i++) {
+    struct piece *pc=&pieces[i];
+    int end=pc->offset+pc->bytes;
+    if (end==length&&!length_known) {
+      // The end piece tells us the length
+      p.body_length=length;
+      partial_stream_set_length(&p.body_stream,length);
+    }
+    if (partial_stream_add(&p.body_stream,p.body_length,pc->offset,pc->bytes,
+			   &body[pc->offset])<0) {
+      printf("ERROR: %s, piece #%d [%d,%d) was refused\n",order,i,pc->offset,end);
+      errors++;
+    }
+    partial_update_request_bitmap(&p);
+    int isFirst;
+    partial_find_missing_byte(&p.body_stream,p.body_length,&isFirst);
+
+    for(int j=pc->offset;j<end;j++)
+      if (!covered[j]) { covered[j]=1; covered_bytes++; }
+
+    // It may forget part blocks, but must never claim bytes it hasn't had
+    int from=pc->offset-PARTIAL_BLOCK_SIZE;
+    int to=end+PARTIAL_BLOCK_SIZE;
+    if (from<0) from=0;
+    if (to>length) to=length;
+    for(int j=from;j<to;j++)
+      if (partial_stream_have_byte(&p.body_stream,j)&&!covered[j]) {
+	printf("ERROR: %s, piece #%d: thinks it has byte %d\n",order,i,j);
+	errors++;
+	break;
+      }
+    while(first_uncovered<length&&covered[first_uncovered]) first_uncovered++;
+    int first_missing=partial_stream_first_missing_byte(&p.body_stream,p.body_length);
+    if (first_missing>first_uncovered) {
+      printf("ERROR: %s, piece #%d: thinks it has everything before byte %d, but is missing %d\n",
+	     order,i,first_missing,first_uncovered);
+      errors++;
+    }
+    if (partial_stream_complete(&p.body_stream,p.body_length)
+	&&(covered_bytes<length)) {
+      printf("ERROR: %s, piece #%d: thinks the body is complete with %d of %d bytes\n",
+	     order,i,covered_bytes,length);
+      errors++;
+    }
+  }
+
+  if (!partial_stream_complete(&p.body_stream,p.body_length)) {
+    printf("ERROR: %s, body not complete after all pieces\n",order);
+    errors++;
+  } else if (memcmp(p.body_stream.data,body,length)) {
+    printf("ERROR: %s, reassembled body differs\n",order);
+    errors++;
+  }
+  partial_stream_free(&p.body_stream);
+  free(covered);
+  return errors;
+}
+
+int main(int argc,char **argv)
+{
+  int length=1024*1024+37;
+  if (argc>1) length=atoi(argv[1]);
+  if (length>PARTIAL_MAX_STREAM_LENGTH) length=PARTIAL_MAX_STREAM_LENGTH;
+  if (length<1) length=1;
+  srandom(1);
+
+  unsigned char *body=malloc(length);
+  assert(body);
+  for(int i=0;i<length;i++) body[i]=random();
+
+  int max_pieces=length/64*2+16;
+  struct piece *pieces=malloc(sizeof(struct piece)*max_pieces);
+  assert(pieces);
+  int piece_count=0;
+  for(int offset=0;offset<length;) {
+    int bytes=64*(1+random()%3);
+    if (offset+bytes>length) bytes=length-offset;
+    pieces[piece_count].offset=offset;
+    pieces[piece_count++].bytes=bytes;
+    offset+=bytes;
+  }
+  int unique=piece_count;
+  for(int i=0;i<unique/10;i++) {
+    int offset=random()%length;
+    int bytes=1+random()%200;
+    if (offset+bytes>length) bytes=length-offset;
+    pieces[piece_count].offset=offset;
+    pieces[piece_count++].bytes=bytes;
+  }
+  int with_extras=piece_count;
+  for(int i=0;i<unique/4&&piece_count<max_pieces;i++)
+    pieces[piece_count++]=pieces[random()%with_extras];
+
+  int errors=0;
+  // (the aligned pieces come first, in order)
+  errors+=reassemble(body,length,pieces,piece_count,0,"in order");
+  for(int i=0;i<piece_count/2;i++) {
+    struct piece t=pieces[i]; pieces[i]=pieces[piece_count-1-i]; pieces[piece_count-1-i]=t;
+  }
+  errors+=reassemble(body,length,pieces,piece_count,0,"reversed");
+  for(int i=piece_count-1;i>0;i--) {
+    int j=random()%(i+1);
+    struct piece t=pieces[i]; pieces[i]=pieces[j]; pieces[j]=t;
+  }
+  errors+=reassemble(body,length,pieces,piece_count,0,"shuffled");
+
+  // (so that the last block is the only one missing at the end)
+  int blocks=0;
+  for(int offset=0;offset<length;offset+=PARTIAL_BLOCK_SIZE) {
+    pieces[blocks].offset=offset;
+    pieces[blocks++].bytes=(length-offset)<PARTIAL_BLOCK_SIZE?length-offset:PARTIAL_BLOCK_SIZE;
+  }
+  errors+=reassemble(body,length,pieces,blocks,1,"one block at a time");
+
+  free(pieces); free(body);
+  if (errors) {
+    printf("FAIL: %d errors\n",errors);
+    return 1;
+  }
+  printf("PASS: %d byte body reassembled from %d pieces in order, reversed and shuffled, and a block at a time\n",
+	 length,piece_count);
+  return 0;
+}
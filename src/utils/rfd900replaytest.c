@@ -0,0 +1,238 @@
+/*
+  Replay test for the RFD900 serial frame scanner.
+
+  Feeds synthetic serial byte streams (garbage, reports, CSMA envelopes,
+  frames split across reads and frames back-to-back) through
+  rfd900_receive_bytes(), and checks that the packets, RSSI and temperature
+  reports that come out are identical to those of the original shift-buffer
+  implementation, which is reproduced below as the reference.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+int rfd900_receive_bytes(unsigned char *bytes,int count);
+extern int radio_temperature;
+extern int last_rx_rssi;
+
+// Stubs for the rest of LBARD that the driver refers to
+int debug_gpio=0;
+int debug_radio=0;
+int debug_radio_tx=0;
+char message_buffer[16384];
+int message_buffer_size=16384;
+int message_buffer_length=0;
+char *my_sid_hex="0000";
+char *prefix="0000";
+char *servald_server="";
+char *credential="";
+int radio_silence_count=0;
+int radio_transmissions_byus=0;
+int radio_transmissions_seen=0;
+int serial_errors=0;
+int txfreq=-1;
+int txpower=-1;
+int active_peer_count(void) { return 0; }
+int eeprom_read(int fd) { return 0; }
+int radio_set_type(int t) { return 0; }
+int serial_setup_port_with_speed(int fd,int speed) { return 0; }
+long long gettime_ms() { return 0; }
+long long now_ms=0;
+ssize_t write_all(int fd, const void *buf, size_t len) { return len; }
+int dump_bytes(FILE *f,char *msg, unsigned char *bytes, int length) { return 0; }
+
+// Log of what each implementation reported
+#define MAX_EVENTS 100000
+struct event {
+  int type; // 'P' for packet
+  int len;
+  int rssi;
+  int temperature;
+  unsigned char packet[256];
+};
+
+struct event actual[MAX_EVENTS];
+int actual_count=0;
+struct event expected[MAX_EVENTS];
+int expected_count=0;
+
+int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
+	       char *my_sid_hex,char *prefix,
+	       char *servald_server,char *credential)
+{
+  if (actual_count>=MAX_EVENTS) return -1;
+  struct event *e=&actual[actual_count++];
+  e->type='P';
+  e->len=packet_bytes;
+  e->rssi=rssi;
+  e->temperature=radio_temperature;
+  memcpy(e->packet,packet_data,packet_bytes);
+  return 0;
+}
+
+// The original implementation, reporting into expected[] instead of acting
+#define REF_BUFFER_SIZE (64+255)
+unsigned char ref_buffer[REF_BUFFER_SIZE];
+int ref_temperature=-1;
+int ref_rssi=-1;
+int ref_transmissions_seen=0;
+
+void reference_receive_bytes(unsigned char *bytes,int count)
+{
+  for(int i=0;i<count;i++) {
+    bcopy(&ref_buffer[1],&ref_buffer[0],REF_BUFFER_SIZE-1);
+    ref_buffer[REF_BUFFER_SIZE-1]=bytes[i];
+
+#define REPORT_LENGTH (4+4+2+6+2+4)
+    int template[REPORT_LENGTH]={
+      0xf0, 0x9f, 0x93, 0xa5,
+      -1,-1,-1,-1,
+      0xc2,0xb0,
+      -1,-1,-1,-1,-1,-1,
+      -1,-1,
+      0xf0,0x9f,0x93,0xa4};
+    int isReport=1;
+    for(int j=0;j<REPORT_LENGTH;j++)
+      if (template[j]!=-1)
+	if (ref_buffer[REF_BUFFER_SIZE-REPORT_LENGTH+j]!=template[j])
+	  { isReport=0; break; }
+    if (isReport) {
+      char tempstring[5]={ref_buffer[REF_BUFFER_SIZE-REPORT_LENGTH+4+0],
+			  ref_buffer[REF_BUFFER_SIZE-REPORT_LENGTH+4+1],
+			  ref_buffer[REF_BUFFER_SIZE-REPORT_LENGTH+4+2],
+			  ref_buffer[REF_BUFFER_SIZE-REPORT_LENGTH+4+3],
+			  0};
+      ref_temperature=atoi(tempstring);
+    } else if ((ref_buffer[REF_BUFFER_SIZE-1]==0xdd)
+	       &&(ref_buffer[REF_BUFFER_SIZE-8]==0xec)
+	       &&(ref_buffer[REF_BUFFER_SIZE-9]==0xce)) {
+      // Old-style report: nothing but GPIO debug output
+    } else if ((ref_buffer[REF_BUFFER_SIZE-1]==0x55)
+	       &&(ref_buffer[REF_BUFFER_SIZE-8]==0x55)
+	       &&(ref_buffer[REF_BUFFER_SIZE-9]==0xaa)) {
+      int packet_bytes=ref_buffer[REF_BUFFER_SIZE-4];
+      ref_temperature=ref_buffer[REF_BUFFER_SIZE-5];
+      ref_rssi=ref_buffer[REF_BUFFER_SIZE-7];
+      ref_transmissions_seen++;
+      if (packet_bytes&&(expected_count<MAX_EVENTS)) {
+	struct event *e=&expected[expected_count++];
+	e->type='P';
+	e->len=packet_bytes;
+	e->rssi=ref_rssi;
+	e->temperature=ref_temperature;
+	memcpy(e->packet,&ref_buffer[REF_BUFFER_SIZE-9-packet_bytes],packet_bytes);
+      }
+    }
+  }
+}
+
+// Stream generation
+unsigned char stream[1024*1024];
+int stream_len=0;
+
+void append_byte(int b) { if (stream_len<sizeof(stream)) stream[stream_len++]=b; }
+
+void append_garbage(int n)
+{
+  // Bias the garbage towards the bytes that matter to the scanner
+  int interesting[]={0x55,0xaa,0xdd,0xce,0xec,0xf0,0x9f,0x93,0xa4,0xa5,0xc2,0xb0};
+  for(int i=0;i<n;i++)
+    if (random()&1) append_byte(interesting[random()%12]);
+    else append_byte(random());
+}
+
+void append_envelope(int len)
+{
+  for(int i=0;i<len;i++) append_byte(random());
+  append_byte(0xaa); append_byte(0x55);
+  append_byte(random()&0xff);  // RSSI
+  append_byte(random()&0xff);  // remote RSSI?
+  append_byte(20+random()%40); // temperature
+  append_byte(len);
+  append_byte(random());       // buffer space
+  append_byte(random());
+  append_byte(0x55);
+}
+
+void append_report(void)
+{
+  char temp[8];
+  snprintf(temp,8,"%+04d",(int)(random()%120)-40);
+  append_byte(0xf0); append_byte(0x9f); append_byte(0x93); append_byte(0xa5);
+  for(int i=0;i<4;i++) append_byte(temp[i]);
+  append_byte(0xc2); append_byte(0xb0);
+  for(int i=0;i<6;i++) append_byte("01Xx"[random()%4]);
+  append_byte('9'); append_byte('1');
+  append_byte(0xf0); append_byte(0x9f); append_byte(0x93); append_byte(0xa4);
+}
+
+void append_old_report(void)
+{
+  append_byte(0xce); append_byte(0xec);
+  for(int i=0;i<6;i++) append_byte(random());
+  append_byte(0xdd);
+}
+
+int main(int argc,char **argv)
+{
+  int seed=argc>1?atoi(argv[1]):1;
+  srandom(seed);
+
+  // The driver reports temperatures etc on stdout, which we don't need to see
+  if (!freopen("/dev/null","w",stdout)) perror("freopen");
+
+  // Build a long stream of frames, back-to-back or separated by garbage
+  while(stream_len<(sizeof(stream)-1024)) {
+    switch(random()%6) {
+    case 0: append_garbage(random()%600); break;
+    case 1: append_report(); break;
+    case 2: append_old_report(); break;
+    default: append_envelope(random()%256); break;
+    }
+  }
+
+  // Feed it to both implementations in random sized pieces, so that frames get
+  // split across reads in every possible way, checking the state as we go.
+  int failures=0;
+  int offset=0;
+  while(offset<stream_len) {
+    int n=1+(random()%((random()&1)?8:512));
+    if (offset+n>stream_len) n=stream_len-offset;
+    reference_receive_bytes(&stream[offset],n);
+    rfd900_receive_bytes(&stream[offset],n);
+    offset+=n;
+    if ((ref_temperature!=radio_temperature)
+	||(ref_rssi!=last_rx_rssi)
+	||(ref_transmissions_seen!=radio_transmissions_seen)
+	||(expected_count!=actual_count)) {
+      fprintf(stderr,"FAIL: state differs at offset %d: temperature %d vs %d,"
+	      " rssi %d vs %d, envelopes %d vs %d, packets %d vs %d\n",
+	      offset,ref_temperature,radio_temperature,ref_rssi,last_rx_rssi,
+	      ref_transmissions_seen,radio_transmissions_seen,
+	      expected_count,actual_count);
+      failures++;
+      break;
+    }
+  }
+
+  for(int i=0;i<expected_count&&i<actual_count;i++) {
+    if ((expected[i].len!=actual[i].len)
+	||(expected[i].rssi!=actual[i].rssi)
+	||(expected[i].temperature!=actual[i].temperature)
+	||memcmp(expected[i].packet,actual[i].packet,expected[i].len)) {
+      fprintf(stderr,"FAIL: packet #%d differs\n",i);
+      failures++;
+    }
+  }
+
+  fprintf(stderr,"%s: %d bytes replayed, %d packets, %d envelopes, %d failures\n",
+	 failures?"FAIL":"PASS",stream_len,actual_count,radio_transmissions_seen,
+	 failures);
+  return failures?1:0;
+}
@@ -0,0 +1,170 @@
+/*
+  Status page test.
+
+  With a store full of bundles and two peers, checks that the status pages
+  are not rendered while nobody asks for them, that /bn lists every bundle
+  with its current priority and every peer, that a page fetched again soon
+  after is reused, that a new window of RX statistics shows up without the
+  rest of the page being rendered again, and that a change to the bundles
+  does render it again.
+  (lbard benchmark status measures the CPU and system calls they cost.)
+
+  usage: statustest [bundles]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "util.h"
+#include "testutil.h"
+
+// /bn, with the bundle store and resolved SIDs (see status_dump.c)
+#define BUNDLES_PAGE 3
+
+// How many bundles the page lists, and how many of them with a priority
+// other than the one the priority tree has for them now
+static int bundle_rows(char *page,int *stale)
+{
+  int rows=0;
+  *stale=0;
+  for(char *s=page;s&&(s=strstr(s,"<tr><td>#"));s++) {
+    int bundle;
+    long long priority;
+    if ((sscanf(s,"<tr><td>#%d</td>",&bundle)!=1)||(bundle<0)||(bundle>=bundle_count))
+      continue;
+    char *p=strstr(s,"<td>0x");
+    if (!p||(sscanf(p,"<td>0x%*x (%lld)",&priority)!=1)
+	||(priority!=bundle_priority(bundle)))
+      (*stale)++;
+    rows++;
+  }
+  return rows;
+}
+
+int main(int argc,char **argv)
+{
+  char bid[65],filehash[129],version[32];
+  int count=2000;
+  if (argc>1) count=atoi(argv[1]);
+  if (count>MAX_BUNDLES) count=MAX_BUNDLES;
+  int errors=0;
+
+  clock_update();
+  sync_setup();
+  my_sid_hex="BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C4BE0C";
+  quiet();
+  for(int i=0;i<count;i++) {
+    random_hex(bid,32);
+    random_hex(filehash,64);
+    snprintf(version,32,"%lld",1500000000000LL+i);
+    register_bundle("MeshMS2",bid,version,"","0",1024,filehash,"","");
+  }
+  unquiet();
+
+  struct peer_state *p[2];
+  for(int i=0;i<2;i++) {
+    p[i]=calloc(1,sizeof(struct peer_state));
+    assert(p[i]);
+    p[i]->sid_prefix=i?"be0c4be0c4be0c4b":"0123456789abcdef";
+    p[i]->tx_bundle=-1;
+    peer_records[i]=p[i];
+  }
+  peer_count=2;
+
+  // A minute of the main loop, with packets arriving and bundles changing,
+  // but nobody fetching the pages
+  status_file_interval=0;
+  for(int tick=0;tick<600;tick++) {
+    now_ms+=100;
+    for(int i=0;i<peer_count;i++) {
+      p[i]->last_message_time=now_ms/1000;
+      p[i]->rssi_accumulator+=60;
+      p[i]->rssi_counter++;
+    }
+    status_log("Announcing 01234567* version 1500000000000 payload segment [0,128)");
+    status_bundles_changed();
+    if (!(tick%30)) status_dump();
+  }
+  for(int i=0;i<STATUS_PAGE_JSON;i++)
+    if (status_page_bodies[i].data) {
+      printf("ERROR: status page %d was rendered with nobody looking\n",i);
+      errors++;
+    }
+
+  // Check what we would serve
+  struct status_page *page=status_page_get(BUNDLES_PAGE);
+  int stale;
+  int rows=bundle_rows(page?page->data:NULL,&stale);
+  if (rows!=bundle_count) {
+    printf("ERROR: /bn page lists %d bundles, expected %d\n",rows,bundle_count);
+    errors++;
+  }
+  if (stale) {
+    printf("ERROR: /bn page shows the wrong priority for %d bundles\n",stale);
+    errors++;
+  }
+  if (!page||!strstr(page->data,"be0c4be0c4be0c4b*")) {
+    printf("ERROR: /bn page doesn't list our peers\n");
+    errors++;
+  }
+  if (page!=status_page_get(BUNDLES_PAGE)||page->rendered!=now_ms) {
+    // (it was rendered just now, so it should be reused)
+    printf("ERROR: /bn page was rendered again straight away\n");
+    errors++;
+  }
+
+  // A new window of RX statistics shows up straight away, without the rest
+  // of the page being rendered again
+  now_ms+=2000;
+  p[0]->rssi_counter=7; p[0]->rssi_accumulator=7*60;
+  status_dump();
+  page=status_page_get(BUNDLES_PAGE);
+  if (!page||!strstr(page->data,"7/7 received")) {
+    printf("ERROR: /bn page doesn't show the latest RX statistics\n");
+    errors++;
+  }
+  if (status_page_bodies[BUNDLES_PAGE].rendered==now_ms) {
+    printf("ERROR: /bn page was rendered again for new RX statistics\n");
+    errors++;
+  }
+
+  // Nothing has changed, so a fetch a few seconds later is served as it was
+  now_ms+=3000;
+  long long rendered=status_page_bodies[BUNDLES_PAGE].rendered;
+  status_page_get(BUNDLES_PAGE);
+  if (status_page_bodies[BUNDLES_PAGE].rendered!=rendered) {
+    printf("ERROR: /bn page was rendered again with nothing changed\n");
+    errors++;
+  }
+
+  // But a new bundle means it has to be rendered again
+  quiet();
+  random_hex(bid,32);
+  random_hex(filehash,64);
+  register_bundle("MeshMS2",bid,"1600000000000","","0",1024,filehash,"","");
+  unquiet();
+  now_ms+=30000;
+  page=status_page_get(BUNDLES_PAGE);
+  if (status_page_bodies[BUNDLES_PAGE].rendered!=now_ms) {
+    printf("ERROR: /bn page was not rendered again after a bundle arrived\n");
+    errors++;
+  }
+  rows=bundle_rows(page?page->data:NULL,&stale);
+  if ((rows!=bundle_count)||stale) {
+    printf("ERROR: /bn page lists %d of %d bundles after one arrived, %d with the wrong priority\n",
+	   rows,bundle_count,stale);
+    errors++;
+  }
+
+  if (errors) {
+    printf("FAIL: %d errors\n",errors);
+    return 1;
+  }
+  printf("PASS: status pages of %d bundles are only rendered when asked for, and kept up to date\n",
+	 bundle_count);
+  return 0;
+}
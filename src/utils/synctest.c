@@ -0,0 +1,288 @@
+/*
+  Sync tree test.
+
+  Builds our tree and a peer's tree at each stride, and checks that every key
+  is found, that the tree has one leaf per key and a sensible number of
+  branches for the stride, and that forgetting the peer gives back all of its
+  nodes.  Checks that adding keys all at once with sync_add_keys(), at
+  startup or later on, builds the same tree as adding them one at a time.
+  Then has pairs of nodes with the same or different strides sync with each
+  other until each knows all of the other's keys, using the smaller of their
+  strides.
+  (lbard benchmark sync, syncstride and bulkload measure how fast, and how
+  many messages and bytes it takes.)
+
+  usage: synctest [keys]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "sync.h"
+#include "testutil.h"
+
+#define STRIDE_RECORD 0xFF
+
+static void random_key(sync_key_t *key)
+{
+  for(int j=0;j<KEY_LEN;j++) key->key[j]=random();
+}
+
+// Tell the sync tree about a peer, using the given stride, that has all of
+// the given keys
+static void peer_learns(struct sync_state *state,void *peer,uint8_t step_bits,
+			sync_key_t *keys,int count)
+{
+  uint8_t msg[10*20];
+  int len=0;
+  for(int i=0;i<count;i++) {
+    if (!len&&(step_bits!=1)) {
+      memset(msg,0,10);
+      msg[0]=step_bits;
+      msg[1]=STRIDE_RECORD;
+      len=10;
+    }
+    msg[len+0]=0x80; // stored, min_prefix_len=0
+    msg[len+1]=KEY_LEN*8;
+    memcpy(&msg[len+2],keys[i].key,KEY_LEN);
+    len+=2+KEY_LEN;
+    if ((len==sizeof(msg))||(i==count-1)) {
+      sync_recv_message(state,peer,msg,len);
+      len=0;
+    }
+  }
+}
+
+// A tree of n keys has n leaves.  Each branch has at least 2 of its
+// 1<<step_bits children, so there are between (n-1)/((1<<step_bits)-1) and
+// n-1 branches.
+static int check_nodes(char *what,struct sync_state *state,uint8_t step_bits,
+		       unsigned keys)
+{
+  unsigned branches=sync_branches_in_use(state);
+  unsigned leaves=sync_nodes_in_use(state)-branches;
+  unsigned fan_out=(1<<step_bits)-1;
+  unsigned min_branches=(keys-1+fan_out-1)/fan_out;
+  if ((leaves==keys)&&(branches>=min_branches)&&(branches<=keys-1)) return 0;
+  printf("ERROR: %s at stride %d: %u keys in %u leaves and %u branches\n",
+	 what,step_bits,keys,leaves,branches);
+  return 1;
+}
+
+static int tree_test(int count,uint8_t step_bits)
+{
+  int errors=0;
+  sync_key_t *keys=calloc(count,sizeof(sync_key_t));
+  sync_key_t *theirs=calloc(count,sizeof(sync_key_t));
+  for(int i=0;i<count;i++) { random_key(&keys[i]); random_key(&theirs[i]); }
+
+  struct sync_state *state=sync_alloc_state(NULL,NULL,NULL,NULL);
+  if (sync_set_step_bits(state,step_bits)||(sync_step_bits(state)!=step_bits)) {
+    printf("ERROR: could not use a stride of %d\n",step_bits);
+    errors++;
+  }
+  quiet();
+  for(int i=0;i<count;i++)
+    sync_add_key(state,&keys[i],NULL);
+  unquiet();
+  for(int i=0;i<count;i++)
+    if (!sync_key_exists(state,&keys[i])) {
+      printf("ERROR: key %d missing from the tree at stride %d\n",i,step_bits);
+      errors++;
+      break;
+    }
+  errors+=check_nodes("our tree",state,step_bits,count);
+
+  // A peer with none of our keys, that is just as happy with our stride
+  unsigned ours=sync_nodes_in_use(state);
+  quiet();
+  peer_learns(state,(void *)1,step_bits,theirs,count);
+  unquiet();
+  if (sync_step_bits(state)!=step_bits) {
+    printf("ERROR: stride changed from %d to %d\n",step_bits,sync_step_bits(state));
+    errors++;
+  }
+  if (sync_nodes_in_use(state)<ours+count) {
+    printf("ERROR: %u of the peer's %d keys are in its tree at stride %d\n",
+	   sync_nodes_in_use(state)-ours,count,step_bits);
+    errors++;
+  }
+  sync_free_peer_state(state,(void *)1);
+  if (sync_nodes_in_use(state)!=ours) {
+    printf("ERROR: %u nodes still in use after forgetting the peer, expected %u\n",
+	   sync_nodes_in_use(state),ours);
+    errors++;
+  }
+
+  uint8_t msg[256];
+  if (!sync_build_message(state,msg,sizeof(msg))) {
+    printf("ERROR: nothing to send at stride %d\n",step_bits);
+    errors++;
+  }
+  sync_free_state(state);
+  free(keys);
+  free(theirs);
+  return errors;
+}
+
+#define BULK_PEERS 10
+
+// Our keys, added after the first already of them, either one at a time or
+// all at once, to a tree that has heard from some peers who have a few of
+// our keys and some of their own
+static struct sync_state *bulkload(sync_key_t *keys,int count,int already,int bulk,
+				   sync_key_t *theirs,int their_count,uint8_t step_bits)
+{
+  struct sync_state *state=sync_alloc_state(NULL,NULL,NULL,NULL);
+  sync_set_step_bits(state,step_bits);
+  quiet();
+  for(int p=0;p<BULK_PEERS;p++)
+    peer_learns(state,(void *)(intptr_t)(p+1),step_bits,
+		&theirs[p*their_count],their_count);
+  for(int i=0;i<already;i++)
+    sync_add_key(state,&keys[i],NULL);
+  if (bulk) sync_add_keys(state,&keys[already],NULL,count-already);
+  else
+    for(int i=already;i<count;i++)
+      sync_add_key(state,&keys[i],NULL);
+  unquiet();
+  return state;
+}
+
+static int bulkload_test(int count,uint8_t step_bits)
+{
+  int errors=0;
+  sync_key_t *keys=calloc(count,sizeof(sync_key_t));
+  for(int i=0;i<count;i++) random_key(&keys[i]);
+  // Each peer has told us about some of our keys, and some of its own
+  int their_count=count/100<100?count/100:100;
+  if (their_count<2) their_count=2;
+  sync_key_t *theirs=calloc(BULK_PEERS*their_count,sizeof(sync_key_t));
+  for(int i=0;i<BULK_PEERS*their_count;i++)
+    if (i%2) theirs[i]=keys[random()%count];
+    else random_key(&theirs[i]);
+
+  // At startup, with half of them already there, which rebuilds the tree,
+  // and with 10% more, which adds them to the tree
+  int already[]={0,count/2,count*10/11};
+  for(int c=0;c<3;c++) {
+    struct sync_state *one=bulkload(keys,count,already[c],0,theirs,their_count,step_bits);
+    struct sync_state *bulk=bulkload(keys,count,already[c],1,theirs,their_count,step_bits);
+    for(int i=0;i<count;i++)
+      if (!sync_key_exists(bulk,&keys[i])) {
+	printf("ERROR: sync_add_keys() lost key %d of %d, after %d, at stride %d\n",
+	       i,count,already[c],step_bits);
+	errors++;
+	break;
+      }
+    if ((sync_nodes_in_use(one)!=sync_nodes_in_use(bulk))
+	||(sync_branches_in_use(one)!=sync_branches_in_use(bulk))) {
+      printf("ERROR: at stride %d, after %d keys, sync_add_key() used %u nodes (%u branches), sync_add_keys() %u (%u)\n",
+	     step_bits,already[c],sync_nodes_in_use(one),sync_branches_in_use(one),
+	     sync_nodes_in_use(bulk),sync_branches_in_use(bulk));
+      errors++;
+    }
+    // The same tree sends the same messages
+    for(int m=0;m<20;m++) {
+      uint8_t one_msg[200],bulk_msg[200];
+      size_t one_len=sync_build_message(one,one_msg,sizeof(one_msg));
+      size_t bulk_len=sync_build_message(bulk,bulk_msg,sizeof(bulk_msg));
+      if ((one_len!=bulk_len)||memcmp(one_msg,bulk_msg,one_len)) {
+	printf("ERROR: at stride %d, after %d keys, sync_add_keys() built a different tree to sync_add_key() (message %d)\n",
+	       step_bits,already[c],m);
+	errors++;
+	break;
+      }
+    }
+    sync_free_state(one);
+    sync_free_state(bulk);
+  }
+  free(keys);
+  free(theirs);
+  return errors;
+}
+
+static void count_key(void *context,void *peer_context,const sync_key_t *key)
+{
+  (*(int *)context)++;
+}
+
+// Two nodes that share count keys, plus 0.5% more each that the other
+// doesn't have, take turns sending each other sync messages until each has
+// heard of all of the other's keys.
+static int convergence_test(int count,uint8_t a_bits,uint8_t b_bits)
+{
+  int unique=count/200;
+  if (unique<1) unique=1;
+  int a_learnt=0,b_learnt=0;
+  struct sync_state *a=sync_alloc_state(&a_learnt,count_key,NULL,NULL);
+  struct sync_state *b=sync_alloc_state(&b_learnt,count_key,NULL,NULL);
+  sync_set_step_bits(a,a_bits);
+  sync_set_step_bits(b,b_bits);
+
+  quiet();
+  sync_key_t key;
+  for(int i=0;i<count+unique*2;i++) {
+    random_key(&key);
+    if (i>=count+unique) sync_add_key(b,&key,NULL);
+    else if (i>=count) sync_add_key(a,&key,NULL);
+    else { sync_add_key(a,&key,NULL); sync_add_key(b,&key,NULL); }
+  }
+  int messages=0;
+  uint8_t msg[200];
+  while((a_learnt<unique||b_learnt<unique)&&messages<100000) {
+    size_t len=sync_build_message(a,msg,sizeof(msg));
+    sync_recv_message(b,(void *)1,msg,len);
+    len=sync_build_message(b,msg,sizeof(msg));
+    sync_recv_message(a,(void *)2,msg,len);
+    messages+=2;
+  }
+  unquiet();
+
+  int errors=0;
+  uint8_t expected=a_bits<b_bits?a_bits:b_bits;
+  if ((a_learnt!=unique)||(b_learnt!=unique)) {
+    printf("ERROR: stride %d/%d: learnt %d and %d of %d new keys after %d messages\n",
+	   a_bits,b_bits,a_learnt,b_learnt,unique,messages);
+    errors++;
+  }
+  if ((sync_step_bits(a)!=expected)||(sync_step_bits(b)!=expected)) {
+    printf("ERROR: stride %d/%d: using strides %d and %d, expected %d\n",
+	   a_bits,b_bits,sync_step_bits(a),sync_step_bits(b),expected);
+    errors++;
+  }
+  sync_free_state(a);
+  sync_free_state(b);
+  return errors;
+}
+
+int main(int argc,char **argv)
+{
+  int count=10000;
+  if (argc>1) count=atoi(argv[1]);
+  if (count<2) count=2;
+  int errors=0;
+
+  uint8_t strides[]={1,2,4,8};
+  for(int i=0;i<sizeof(strides);i++) {
+    errors+=tree_test(count,strides[i]);
+    errors+=bulkload_test(count,strides[i]);
+  }
+
+  uint8_t pairs[][2]={{1,1},{2,2},{4,4},{8,8},
+		      // mixed: they must both end up using the smaller stride
+		      {4,1},{8,2},{1,8}};
+  int pair_count=sizeof(pairs)/sizeof(pairs[0]);
+  for(int i=0;i<pair_count;i++)
+    errors+=convergence_test(count,pairs[i][0],pairs[i][1]);
+
+  if (errors) {
+    printf("FAIL: %d errors in the sync tree\n",errors);
+    return 1;
+  }
+  printf("PASS: trees of %d keys at strides 1, 2, 4 and 8, bulk loaded or not, and %d pairs of nodes converge\n",
+	 count,pair_count);
+  return 0;
+}
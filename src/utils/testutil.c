@@ -0,0 +1,46 @@
+/*
+  Helpers for the tests that link against the rest of LBARD, and for lbard
+  benchmark: silencing stdout and stderr, so that what LBARD prints doesn't
+  bury their results, and making up random BIDs and hashes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "util.h"
+#include "testutil.h"
+
+static int saved_stdout=-1;
+static int saved_stderr=-1;
+
+void quiet(void)
+{
+  fflush(stdout); fflush(stderr);
+  int devnull=open("/dev/null",O_WRONLY);
+  saved_stdout=dup(1);
+  saved_stderr=dup(2);
+  dup2(devnull,1);
+  dup2(devnull,2);
+  close(devnull);
+}
+
+void unquiet(void)
+{
+  fflush(stdout); fflush(stderr);
+  dup2(saved_stdout,1);
+  dup2(saved_stderr,2);
+  close(saved_stdout);
+  close(saved_stderr);
+}
+
+void random_hex(char *out,int bytes)
+{
+  for(int i=0;i<bytes;i++) {
+    int v=random()&0xff;
+    out[i*2+0]=hextochar(v>>4);
+    out[i*2+1]=hextochar(v&0xf);
+  }
+  out[bytes*2]=0;
+}
@@ -0,0 +1,12 @@
+#ifndef __TESTUTIL_H
+#define __TESTUTIL_H
+
+// Send stdout and stderr to /dev/null while chatty code under test runs,
+// then put them back
+void quiet(void);
+void unquiet(void);
+
+// bytes random bytes, as a NUL terminated hex string (out needs 2*bytes+1)
+void random_hex(char *out,int bytes);
+
+#endif
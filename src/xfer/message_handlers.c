@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "sync.h"
+#include "lbard.h"
+#include "hf.h"
+#include "radios.h"
+#include "message_handlers.h"
+
+message_handler message_handlers[257]={
+NULL, // 00
+NULL, // 01
+NULL, // 02
+NULL, // 03
+NULL, // 04
+NULL, // 05
+NULL, // 06
+NULL, // 07
+NULL, // 08
+NULL, // 09
+NULL, // 0A
+NULL, // 0B
+NULL, // 0C
+NULL, // 0D
+NULL, // 0E
+NULL, // 0F
+NULL, // 10
+NULL, // 11
+NULL, // 12
+NULL, // 13
+NULL, // 14
+NULL, // 15
+NULL, // 16
+NULL, // 17
+NULL, // 18
+NULL, // 19
+NULL, // 1A
+NULL, // 1B
+NULL, // 1C
+NULL, // 1D
+NULL, // 1E
+NULL, // 1F
+NULL, // 20
+NULL, // 21
+NULL, // 22
+NULL, // 23
+NULL, // 24
+NULL, // 25
+NULL, // 26
+NULL, // 27
+NULL, // 28
+NULL, // 29
+NULL, // 2A
+NULL, // 2B
+NULL, // 2C
+NULL, // 2D
+NULL, // 2E
+NULL, // 2F
+NULL, // 30
+NULL, // 31
+NULL, // 32
+NULL, // 33
+NULL, // 34
+NULL, // 35
+NULL, // 36
+NULL, // 37
+NULL, // 38
+NULL, // 39
+NULL, // 3A
+NULL, // 3B
+NULL, // 3C
+NULL, // 3D
+NULL, // 3E
+NULL, // 3F
+NULL, // 40
+message_parser_41, // 41
+message_parser_42, // 42
+NULL, // 43
+NULL, // 44
+NULL, // 45
+message_parser_46, // 46
+message_parser_47, // 47
+NULL, // 48
+NULL, // 49
+NULL, // 4A
+NULL, // 4B
+message_parser_4C, // 4C
+message_parser_4D, // 4D
+NULL, // 4E
+NULL, // 4F
+message_parser_50, // 50
+message_parser_51, // 51
+message_parser_52, // 52
+message_parser_53, // 53
+message_parser_54, // 54
+NULL, // 55
+NULL, // 56
+NULL, // 57
+NULL, // 58
+NULL, // 59
+NULL, // 5A
+NULL, // 5B
+NULL, // 5C
+NULL, // 5D
+NULL, // 5E
+NULL, // 5F
+NULL, // 60
+message_parser_61, // 61
+NULL, // 62
+NULL, // 63
+NULL, // 64
+NULL, // 65
+message_parser_66, // 66
+NULL, // 67
+NULL, // 68
+NULL, // 69
+NULL, // 6A
+NULL, // 6B
+NULL, // 6C
+NULL, // 6D
+NULL, // 6E
+NULL, // 6F
+message_parser_70, // 70
+message_parser_71, // 71
+NULL, // 72
+NULL, // 73
+NULL, // 74
+NULL, // 75
+NULL, // 76
+NULL, // 77
+NULL, // 78
+NULL, // 79
+NULL, // 7A
+NULL, // 7B
+NULL, // 7C
+NULL, // 7D
+NULL, // 7E
+NULL, // 7F
+NULL, // 80
+NULL, // 81
+NULL, // 82
+NULL, // 83
+NULL, // 84
+NULL, // 85
+NULL, // 86
+NULL, // 87
+NULL, // 88
+NULL, // 89
+NULL, // 8A
+NULL, // 8B
+NULL, // 8C
+NULL, // 8D
+NULL, // 8E
+NULL, // 8F
+NULL, // 90
+NULL, // 91
+NULL, // 92
+NULL, // 93
+NULL, // 94
+NULL, // 95
+NULL, // 96
+NULL, // 97
+NULL, // 98
+NULL, // 99
+NULL, // 9A
+NULL, // 9B
+NULL, // 9C
+NULL, // 9D
+NULL, // 9E
+NULL, // 9F
+NULL, // A0
+NULL, // A1
+NULL, // A2
+NULL, // A3
+NULL, // A4
+NULL, // A5
+NULL, // A6
+NULL, // A7
+NULL, // A8
+NULL, // A9
+NULL, // AA
+NULL, // AB
+NULL, // AC
+NULL, // AD
+NULL, // AE
+NULL, // AF
+NULL, // B0
+NULL, // B1
+NULL, // B2
+NULL, // B3
+NULL, // B4
+NULL, // B5
+NULL, // B6
+NULL, // B7
+NULL, // B8
+NULL, // B9
+NULL, // BA
+NULL, // BB
+NULL, // BC
+NULL, // BD
+NULL, // BE
+NULL, // BF
+NULL, // C0
+NULL, // C1
+NULL, // C2
+NULL, // C3
+NULL, // C4
+NULL, // C5
+NULL, // C6
+NULL, // C7
+NULL, // C8
+NULL, // C9
+NULL, // CA
+NULL, // CB
+NULL, // CC
+NULL, // CD
+NULL, // CE
+NULL, // CF
+NULL, // D0
+NULL, // D1
+NULL, // D2
+NULL, // D3
+NULL, // D4
+NULL, // D5
+NULL, // D6
+NULL, // D7
+NULL, // D8
+NULL, // D9
+NULL, // DA
+NULL, // DB
+NULL, // DC
+NULL, // DD
+NULL, // DE
+NULL, // DF
+NULL, // E0
+NULL, // E1
+NULL, // E2
+NULL, // E3
+NULL, // E4
+NULL, // E5
+NULL, // E6
+NULL, // E7
+NULL, // E8
+NULL, // E9
+NULL, // EA
+NULL, // EB
+NULL, // EC
+NULL, // ED
+NULL, // EE
+NULL, // EF
+NULL, // F0
+NULL, // F1
+NULL, // F2
+NULL, // F3
+NULL, // F4
+NULL, // F5
+NULL, // F6
+NULL, // F7
+NULL, // F8
+NULL, // F9
+NULL, // FA
+NULL, // FB
+NULL, // FC
+NULL, // FD
+NULL, // FE
+NULL, // FF
+NULL};
@@ -47,7 +47,7 @@ int partial_recent_sender_report(struct partial_bundle *p)
 	  p->bid_prefix[0],p->bid_prefix[1],p->bid_prefix[2],p->bid_prefix[3],
 	  p->bundle_version);
   int i;
-  time_t t=time(0);
+  time_t t=now_ms/1000;
   for(i=0;i<MAX_RECENT_SENDERS;i++)
     if ((t-p->senders.r[i].last_time)<10)
       fprintf(stderr,"  #%02d : %02X%02X* (T-%d sec)\n",
@@ -67,7 +67,7 @@ int partial_update_recent_senders(struct partial_bundle *p,char *sender_prefix_h
 
   int free_slot=random()%MAX_RECENT_SENDERS;
   int index=0;
-  time_t t = time(0);
+  time_t t = now_ms/1000;
   for(index=0;index<MAX_RECENT_SENDERS;index++)
     {
       if ((sender_prefix_bin[0]==p->senders.r[index].sid_prefix[0])
@@ -81,7 +81,7 @@ int partial_update_recent_senders(struct partial_bundle *p,char *sender_prefix_h
   // Update record
   p->senders.r[index].sid_prefix[0]=sender_prefix_bin[0];
   p->senders.r[index].sid_prefix[1]=sender_prefix_bin[1];
-  p->senders.r[index].last_time=time(0);
+  p->senders.r[index].last_time=t;
 
   partial_recent_sender_report(p);
   
@@ -90,35 +90,234 @@ int partial_update_recent_senders(struct partial_bundle *p,char *sender_prefix_h
 
 int clear_partial(struct partial_bundle *p)
 {
-  while(p->manifest_segments) {
-    struct segment_list *s=p->manifest_segments;
-    p->manifest_segments=s->next;
-    if (s->data) free(s->data); s->data=NULL;
-    free(s);
-    s=NULL;
-  }
-  while(p->body_segments) {
-    struct segment_list *s=p->body_segments;
-    p->body_segments=s->next;
-    if (s->data) free(s->data); s->data=NULL;
-    free(s);
-    s=NULL;
-  }
+  partial_stream_free(&p->manifest_stream);
+  partial_stream_free(&p->body_stream);
 
   bzero(p,sizeof(struct partial_bundle));
+  status_changed();
   return -1;
 }
 
-int dump_segment_list(struct segment_list *s)
+/*
+  Flat buffer + bitmap reassembly of manifests and payloads.
+
+  We used to keep a descending linked list of received segments, merging them
+  as they grew together.  That is fine for in-order reception, but a big bundle
+  arriving from several senders in a jumbled order ends up with thousands of
+  segments, and every piece then walks (and realloc()s) its way through them.
+  Now each piece is simply copied into place, and the 64 byte block bitmap that
+  the request bitmaps are expressed in anyway tells us what we have.
+*/
+
+static int partial_stream_blocks(int length)
 {
-  if (!s) return 0;
-  while(s) {
-    fprintf(stderr,"    [%d,%d)\n",s->start_offset,s->start_offset+s->length);
-    s=s->next;
+  return (length+PARTIAL_BLOCK_SIZE-1)/PARTIAL_BLOCK_SIZE;
+}
+
+static int partial_stream_reserve(struct partial_stream *s,int bytes,int exact)
+{
+  if (bytes<=s->alloc) return 0;
+  if (bytes>PARTIAL_MAX_STREAM_LENGTH) return -1;
+
+  // When we don't yet know how long the stream is, grow geometrically so that
+  // a bundle arriving in order doesn't get copied over and over.
+  int new_alloc=bytes;
+  if (!exact) {
+    new_alloc=s->alloc*2;
+    if (new_alloc<4096) new_alloc=4096;
+    while (new_alloc<bytes) new_alloc*=2;
+    if (new_alloc>PARTIAL_MAX_STREAM_LENGTH) new_alloc=PARTIAL_MAX_STREAM_LENGTH;
+  }
+  // Keep the bitmap a whole number of 64 bit words, so that we can skip over
+  // it quickly in partial_find_missing_byte()
+  new_alloc=(new_alloc+PARTIAL_BLOCK_SIZE*64-1)&~(PARTIAL_BLOCK_SIZE*64-1);
+
+  int old_bitmap_bytes=partial_stream_blocks(s->alloc)/8;
+  int new_bitmap_bytes=partial_stream_blocks(new_alloc)/8;
+  s->data=realloc(s->data,new_alloc);
+  assert(s->data);
+  s->received=realloc(s->received,new_bitmap_bytes);
+  assert(s->received);
+  bzero(&s->received[old_bitmap_bytes],new_bitmap_bytes-old_bitmap_bytes);
+  s->alloc=new_alloc;
+  return 0;
+}
+
+void partial_stream_free(struct partial_stream *s)
+{
+  if (s->data) free(s->data);
+  if (s->received) free(s->received);
+  bzero(s,sizeof(struct partial_stream));
+}
+
+int partial_stream_have_block(struct partial_stream *s,int block)
+{
+  if (block<0||block>=partial_stream_blocks(s->alloc)) return 0;
+  return (s->received[block>>3]>>(block&7))&1;
+}
+
+static int partial_stream_find_fringe(struct partial_stream *s,int block)
+{
+  for(int i=0;i<s->fringe_count;i++)
+    if (s->fringe[i].block==block) return i;
+  return -1;
+}
+
+static void partial_stream_drop_fringe(struct partial_stream *s,int f)
+{
+  s->fringe_count--;
+  for(int i=f;i<s->fringe_count;i++) s->fringe[i]=s->fringe[i+1];
+}
+
+static void partial_stream_mark_block(struct partial_stream *s,int block)
+{
+  s->received[block>>3]|=1<<(block&7);
+  s->blocks_received++;
+  while(partial_stream_have_block(s,s->first_missing_block))
+    s->first_missing_block++;
+}
+
+// Number of bytes of the block that exist, given what we know about the length
+static int partial_stream_block_bytes(int block,int length)
+{
+  if (length<0) return PARTIAL_BLOCK_SIZE;
+  int bytes=length-block*PARTIAL_BLOCK_SIZE;
+  if (bytes>PARTIAL_BLOCK_SIZE) bytes=PARTIAL_BLOCK_SIZE;
+  if (bytes<0) bytes=0;
+  return bytes;
+}
+
+static unsigned long long partial_stream_block_mask(int bytes)
+{
+  if (bytes>=64) return ~0ULL;
+  return (1ULL<<bytes)-1;
+}
+
+int partial_stream_set_length(struct partial_stream *s,int length)
+{
+  if (length<0) return -1;
+  if (partial_stream_reserve(s,length,1)) return -1;
+
+  // Now that we know where the end is, a partly received last block might in
+  // fact be complete.
+  if (length%PARTIAL_BLOCK_SIZE) {
+    int block=length/PARTIAL_BLOCK_SIZE;
+    int f=partial_stream_find_fringe(s,block);
+    if (f>=0) {
+      unsigned long long want=partial_stream_block_mask(length%PARTIAL_BLOCK_SIZE);
+      if ((s->fringe[f].mask&want)==want) {
+	partial_stream_drop_fringe(s,f);
+	partial_stream_mark_block(s,block);
+      }
+    }
   }
   return 0;
 }
 
+/*
+  Copy a received piece into place.  Returns the number of bytes in the piece that
+  we didn't already have, or -1 if the piece can't be accepted.
+*/
+int partial_stream_add(struct partial_stream *s,int length,
+		       int offset,int bytes,unsigned char *data)
+{
+  if (offset<0||bytes<0) return -1;
+  int end=offset+bytes;
+  if (partial_stream_reserve(s,end,0)) return -1;
+  if (!bytes) return 0;
+
+  bcopy(data,&s->data[offset],bytes);
+
+  int new_bytes=0;
+  int last_block=(end-1)/PARTIAL_BLOCK_SIZE;
+  for(int block=offset/PARTIAL_BLOCK_SIZE;block<=last_block;block++) {
+    if (partial_stream_have_block(s,block)) continue;
+    int block_start=block*PARTIAL_BLOCK_SIZE;
+    int block_bytes=partial_stream_block_bytes(block,length);
+    if (!block_bytes) continue;  // beyond the end of the stream
+    int f=s->fringe_count?partial_stream_find_fringe(s,block):-1;
+    unsigned long long had=(f>=0)?s->fringe[f].mask:0;
+
+    // Work out which bytes of this block the piece covers
+    int from=offset>block_start?offset-block_start:0;
+    int to=end<(block_start+block_bytes)?end-block_start:block_bytes;
+    unsigned long long got=partial_stream_block_mask(to)&~partial_stream_block_mask(from);
+    unsigned long long want=partial_stream_block_mask(block_bytes);
+
+    new_bytes+=__builtin_popcountll(got&~had);
+    if (((had|got)&want)==want) {
+      if (f>=0) partial_stream_drop_fringe(s,f);
+      partial_stream_mark_block(s,block);
+    } else if (f>=0) {
+      s->fringe[f].mask|=got;
+    } else {
+      // Forget the oldest part-block if the fringe is full.  We will just end up
+      // asking for it again.
+      if (s->fringe_count==PARTIAL_MAX_FRINGE) partial_stream_drop_fringe(s,0);
+      s->fringe[s->fringe_count].block=block;
+      s->fringe[s->fringe_count].mask=got;
+      s->fringe_count++;
+    }
+  }
+  return new_bytes;
+}
+
+int partial_stream_have_byte(struct partial_stream *s,int offset)
+{
+  if (offset<0) return 0;
+  int block=offset/PARTIAL_BLOCK_SIZE;
+  if (partial_stream_have_block(s,block)) return 1;
+  int f=partial_stream_find_fringe(s,block);
+  if (f<0) return 0;
+  return (s->fringe[f].mask>>(offset%PARTIAL_BLOCK_SIZE))&1;
+}
+
+int partial_stream_complete(struct partial_stream *s,int length)
+{
+  if (length<0) return 0;
+  return s->first_missing_block>=partial_stream_blocks(length);
+}
+
+int partial_stream_first_missing_byte(struct partial_stream *s,int length)
+{
+  int offset=s->first_missing_block*PARTIAL_BLOCK_SIZE;
+  int f=partial_stream_find_fringe(s,s->first_missing_block);
+  if (f>=0) offset+=__builtin_ctzll(~s->fringe[f].mask);
+  if (length>=0&&offset>length) offset=length;
+  return offset;
+}
+
+int partial_stream_bytes_received(struct partial_stream *s,int length)
+{
+  int bytes=s->blocks_received*PARTIAL_BLOCK_SIZE;
+  for(int i=0;i<s->fringe_count;i++)
+    bytes+=__builtin_popcountll(s->fringe[i].mask);
+  // The last block is probably short
+  if (length>=0&&bytes>length) bytes=length;
+  return bytes;
+}
+
+int dump_partial_stream(struct partial_stream *s,int length)
+{
+  // Show the runs of complete blocks, plus any part blocks
+  int blocks=partial_stream_blocks(s->alloc);
+  int run_start=-1;
+  for(int block=0;block<=blocks;block++) {
+    int have=(block<blocks)&&partial_stream_have_block(s,block);
+    if (have&&run_start<0) run_start=block;
+    if ((!have)&&run_start>=0) {
+      int run_end=block*PARTIAL_BLOCK_SIZE;
+      if (length>=0&&run_end>length) run_end=length;
+      fprintf(stderr,"    [%d,%d)\n",run_start*PARTIAL_BLOCK_SIZE,run_end);
+      run_start=-1;
+    }
+  }
+  for(int i=0;i<s->fringe_count;i++)
+    fprintf(stderr,"    part of block #%d (%016llx)\n",
+	    s->fringe[i].block,s->fringe[i].mask);
+  return 0;
+}
+
 int dump_partial(struct partial_bundle *p)
 {
   printf(">>> %s Progress receiving BID=%s* version %lld: "
@@ -141,56 +340,18 @@ int dump_partial(struct partial_bundle *p)
 
   if (0) {
     fprintf(stderr,"  Manifest pieces received:\n");
-    dump_segment_list(p->manifest_segments);
+    dump_partial_stream(&p->manifest_stream,p->manifest_length);
     fprintf(stderr,"  Body pieces received:\n");
-    dump_segment_list(p->body_segments);
+    dump_partial_stream(&p->body_stream,p->body_length);
     fprintf(stderr,"  Request bitmap: start=%d, bits=\n    ",
 	    p->request_bitmap_start);
   }
   return 0;
 }
 
-int merge_segments(struct segment_list **s)
-{
-  if (!s) return -1;
-  if (!(*s)) return -1;
-
-  // Segments are sorted in descending order
-  while((*s)&&(*s)->next) {
-    struct segment_list *me=*s;
-    struct segment_list *next=(*s)->next;
-    if (me->start_offset<=(next->start_offset+next->length)) {
-      // Merge this piece onto the end of the next piece
-      if (debug_pieces)
-	printf("Merging [%d..%d) and [%d..%d)\n",
-		me->start_offset,me->start_offset+me->length,
-		next->start_offset,next->start_offset+next->length);
-      int extra_bytes
-	=(me->start_offset+me->length)-(next->start_offset+next->length);
-      int new_length=next->length+extra_bytes;
-      next->data=realloc(next->data,new_length);
-      assert(next->data);
-      bcopy(&me->data[me->length-extra_bytes],&next->data[next->length],
-	    extra_bytes);
-      next->length=new_length;
-
-      // Excise redundant segment from list
-      *s=next;
-      next->prev=me->prev;
-      if (me->prev) me->prev->next=next;
-
-      // Free redundant segment.
-      free(me->data); me->data=NULL;
-      free(me); me=NULL;
-    } else 
-      s=&(*s)->next;
-  }
-  return 0;
-}
-
-/* Find the first byte missing in the following segment list.
+/* Find the first byte missing in the received stream.
    Basically this boils down to being either byte 0, or the
-   first byte after the first segment. 
+   first byte after the first run of received blocks.
 
    However, we actually want to randomise the byte we ask for,
    so that if a peer is sending to multiple peers, that we can
@@ -200,26 +361,47 @@ int merge_segments(struct segment_list **s)
    to one of our partial pieces.  However, we need to take care to
    not make the sender think that we have it all.
 */
-int partial_find_missing_byte(struct segment_list *s,int *isFirstMissingByte)
+int partial_find_missing_byte(struct partial_stream *s,int length,
+			      int *isFirstMissingByte)
 {
   int add_zero=1;
 
-  // We limit ourselves to the first 16 gaps, so that we can tend to complete
+  // We limit ourselves to 16 gaps, so that we can tend to complete
   // reception of earlier parts of a bundle before proceeding to later parts.
   // This reduces the complexity of the job of receiving, by tending to reduce
   // the number of segments of received material at any point in time.
   int candidates[16];
   int candidate_count=0;
-  
-  // Walk the segment list. Adjacent segments should be merged,
-  // so the offset following each segment is a valid candidate,
-  // except if a candidate is the end of the file.
-  while(s) {
-    if (!s->start_offset) add_zero=0;
-    if (candidate_count<16)
-      candidates[candidate_count++]=s->start_offset+s->length;
-    s=s->next;
+
+  // Walk the bitmap down from the top, noting the end of each run of received
+  // blocks, which gives us the same descending list the segment list used to.
+  // The blocks before the first missing one are all present, so we need only look
+  // at one byte of the bitmap below that.
+  int blocks=partial_stream_blocks(s->alloc);
+  int bottom=(s->first_missing_block>>3)-1;
+  if (bottom<0) bottom=0;
+  int above=0;
+  for(int i=blocks/8-1;i>=bottom&&candidate_count<16;i--) {
+    // Skip over whole words and bytes of the bitmap that don't change state
+    if (!((i+1)&7)&&i>=7) {
+      unsigned long long word;
+      memcpy(&word,&s->received[i-7],8);
+      if (word==(above?~0ULL:0ULL)) { i-=7; continue; }
+    }
+    if (s->received[i]==(above?0xff:0x00)) continue;
+    for(int bit=7;bit>=0&&candidate_count<16;bit--) {
+      int have=(s->received[i]>>bit)&1;
+      if (have&&!above) {
+	int end=(i*8+bit+1)*PARTIAL_BLOCK_SIZE;
+	if (length>=0&&end>length) end=length;
+	candidates[candidate_count++]=end;
+      }
+      above=have;
+    }
   }
+
+  // (A part block at the start doesn't count: we would ask for it from 0 anyway)
+  if (partial_stream_have_block(s,0)) add_zero=0;
   if ((candidate_count<16)&&(add_zero)) candidates[candidate_count++]=0;
   
   // The values should be in descending order. Don't ask for highest value,
@@ -240,4 +422,3 @@ int partial_find_missing_byte(struct segment_list *s,int *isFirstMissingByte)
 
   return candidates[selection]&0xffffffc0;
 }
-
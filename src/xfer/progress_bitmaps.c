@@ -61,48 +61,25 @@ int dump_progress_bitmap(FILE *f, unsigned char *b,int blocks)
 
   The bitmap is based on the absolute first hole in the stream that we are missing.
 
-  The segment list is arranged in reverse order, so we start by getting the last
-  piece in the segment list. If it starts at 0, then our starting point is the end
-  of the first segment. If not, then our starting point is 0. We then mark the bitmap
-  as requiring all pieces.  Then the segment list is retraversed, and any 64 byte
-  region that we have in its entirety is marked as already held.
+  The received block bitmap of the partial already tells us this directly: the
+  starting point is the first byte we are missing, and each bit of the request
+  bitmap is simply the corresponding 64 byte block of the received bitmap.
 */
 int partial_update_request_bitmap(struct partial_bundle *p)
 {
   // Get starting point
-  int starting_position=0;
+  int starting_position=partial_stream_first_missing_byte(&p->body_stream,
+							  p->body_length);
   // 32*8*64= 16KiB of data, enough for several seconds, even with 16 senders.
   unsigned char bitmap[32];
   bzero(&bitmap[0],32);
-  struct segment_list *l=p->body_segments;
-  while(l&&l->next) l=l->next;
-  if (l) {
-    if (!l->start_offset) starting_position=l->length;
-  }
-
-  l=p->body_segments;
-  while(l) {
-    if ((l->start_offset>=starting_position)
-	&&(l->start_offset<=(starting_position+32*8*64))) {
-      int start=l->start_offset;
-      int length=l->length;
-      // Ignore any first partial 
-      if (start&63) {
-	int trim=64-(start&63);
-	start+=trim;
-	length-=trim;
-      }
-      // Work out first block number
-      int block=(start-starting_position)>>6; //  divide by 64
-      // Then mark as received all those we already have
-      while (length>=64&&(block<32*8)) {
-	bitmap[block>>3]|=(1<<(block&7));
-	block++; length-=64;
-      }
-    }
 
-    l=l->next;
-  }
+  // Any first partial block is ignored, so the first bit is the first 64 byte
+  // block that starts at or after the starting point.
+  int first_block=(starting_position+63)>>6;
+  for(int block=0;block<32*8;block++)
+    if (partial_stream_have_block(&p->body_stream,first_block+block))
+      bitmap[block>>3]|=(1<<(block&7));
 
   // Save request bitmap
   p->request_bitmap_start=starting_position;
@@ -112,69 +89,24 @@ int partial_update_request_bitmap(struct partial_bundle *p)
   unsigned char manifest_bitmap[2];
   bzero(&manifest_bitmap[0],2);
 
-  l=p->manifest_segments;
-  while(l&&l->next) l=l->next;
-  if (l) {
-    if (!l->start_offset) starting_position=l->length;
-  }
-
-  l=p->manifest_segments;
-  while(l) {
-    if ((l->start_offset>=0)
-	&&(l->start_offset<=1024)) {
-      int start=l->start_offset;
-      int length=l->length;
+  for(int block=0;block<16;block++)
+    if (partial_stream_have_block(&p->manifest_stream,block)) {
+      if (debug_bitmap) printf("    marking block #%d as received.\n",block);
+      manifest_bitmap[block>>3]|=(1<<(block&7));
+    }
 
+  // Once we have the end of the manifest, mark everything after it as received, too,
+  // so that the sender doesn't think we are still waiting for it.
+  if (p->manifest_length>0) {
+    int block=(p->manifest_length-1)/64;
+    if (block<16&&partial_stream_have_block(&p->manifest_stream,block)) {
       if (debug_bitmap)
-	printf("  manifest_bitmap: applying segment [%d,%d)\n",start,start+length);
-      
-      // If the segment covers the last part of the manifest, but isn't a multiple of 64
-      // bytes, then we still need to mark the last piece as received.
-      if ((p->manifest_length!=-1)
-	  &&((start+length)==p->manifest_length)
-	  &&(p->manifest_length&0x3f))
-	{
-	  int block=(start+length)/64;
-	  if (block>=0&&block<16) {
-	    if (debug_bitmap)
-	      printf(">>> BITMAP marking manifest from end-piece #%d onwards as received\n",block);
-	    while(block<16) {
-	      manifest_bitmap[block>>3]|=(1<<(block&7));
-	      block++;
-	    }
-	  }
-	}				        
-
-      // Ignore any first partial block, as we have no way to keep track of those in the bitmap.
-      if (start&63) {
-	int trim=64-(start&63);
-	start+=trim;
-	length-=trim;
-      }
-      // Work out first block number
-      int block=start>>6; //  divide by 64
-
-      // Then mark as received all those we already have
-      while (length>=64&&(block<16)) {
-	if (debug_bitmap) printf("    marking block #%d as received.\n",block);
+	printf(">>> BITMAP marking manifest from end-piece #%d onwards as received\n",block);
+      while(block<16) {
 	manifest_bitmap[block>>3]|=(1<<(block&7));
-	block++; length-=64;
-      }
-
-      // Mark last piece of manifest as sent for case where manifest
-      // is not a multiple of 64 bytes long
-      if (p->manifest_length>0) {
-	if (start+length==p->manifest_length) {
-	  block=p->manifest_length/64;
-	  while(block<16) {
-	    manifest_bitmap[block>>3]|=(1<<(block&7));
-	    block++;
-	  }
-	}
+	block++;
       }
     }
-
-    l=l->next;
   }
   memcpy(p->request_manifest_bitmap,manifest_bitmap,2);
   
@@ -226,7 +158,8 @@ int dump_peer_tx_bitmap(int peer)
 	   peer_records[peer]->tx_bundle_manifest_offset,
 	   peer_records[peer]->request_bitmap_offset);
   // Keep all bitmaps in line, by padding front with - characters where the bitmap starts later
-  for(int i=0;i<peer_records[peer]->request_bitmap_offset;i+=64) printf("-");
+  if (debug_bitmap)
+    for(int i=0;i<peer_records[peer]->request_bitmap_offset;i+=64) printf("-");
   int max_block=256;
   if (peer_records[peer]->tx_bundle>-1) {    
     max_block=(bundles[peer_records[peer]->tx_bundle].length-peer_records[peer]->request_bitmap_offset);
@@ -336,11 +269,11 @@ int peer_update_request_bitmaps_due_to_transmitted_piece(int bundle_number,
 							 int bytes)
 {
   if (!is_manifest)
-    printf(">>> %s Saw body piece [%d,%d) of bundle #%d\n",
-	   timestamp_str(),start_offset,start_offset+bytes,bundle_number);
+    LOG_DEBUG(LOG_BITMAP,"Saw body piece [%d,%d) of bundle #%d",
+	      start_offset,start_offset+bytes,bundle_number);
   else
-    printf(">>> %s Saw manifest piece [%d,%d) of bundle #%d\n",
-	   timestamp_str(),start_offset,start_offset+bytes,bundle_number);
+    LOG_DEBUG(LOG_BITMAP,"Saw manifest piece [%d,%d) of bundle #%d",
+	      start_offset,start_offset+bytes,bundle_number);
   
   for(int i=0;i<MAX_PEERS;i++)
     {
@@ -359,11 +292,10 @@ int peer_update_request_bitmaps_due_to_transmitted_piece(int bundle_number,
 	   )
 	  )
 	{
-	  if (debug_bitmap)
-	    printf(">>> %s BITMAP: Resetting progress bitmap for peer #%d(%s*): tx_bundle=%d, bundle_number=%d, request_bitmap_bundle=%d\n",
-		   timestamp_str(),i,peer_records[i]->sid_prefix,
-		   peer_records[i]->tx_bundle,bundle_number,
-		   peer_records[i]->request_bitmap_bundle);
+	  LOG_DEBUG(LOG_BITMAP,"Resetting progress bitmap for peer #%d(%s*): tx_bundle=%d, bundle_number=%d, request_bitmap_bundle=%d",
+		    i,peer_records[i]->sid_prefix,
+		    peer_records[i]->tx_bundle,bundle_number,
+		    peer_records[i]->request_bitmap_bundle);
 
 	  if (is_manifest) {
 	    // Manifest progress is easier to update, as the bitmap is a fixed 16 bits
@@ -406,39 +338,33 @@ int peer_update_request_bitmaps_due_to_transmitted_piece(int bundle_number,
 		int bit=offset/64;
 		if (bit>=0)
 		  while((bytes_remaining>=64)&&(bit<(32*8*64))) {
-		    if (debug_bitmap)
-		      printf(">>> %s Marking [%d,%d) sent to peer #%d(%s*) due to transmitted piece.\n",
-			     timestamp_str(),block_offset,block_offset+64,i,peer_records[i]->sid_prefix);
+		    LOG_DEBUG(LOG_BITMAP,"Marking [%d,%d) sent to peer #%d(%s*) due to transmitted piece.",
+			      block_offset,block_offset+64,i,peer_records[i]->sid_prefix);
 		    if (!(peer_records[i]->request_bitmap[bit>>3]&(1<<(bit&7))))
 		      {
-			if (debug_bitmap)
-			  printf(">>> %s BITMAP: Setting bit %d due to transmitted piece.\n",
-				 timestamp_str(),bit);
+			LOG_DEBUG(LOG_BITMAP,"Setting bit %d due to transmitted piece.",bit);
 		      }
 		    else
-		      if (debug_bitmap)
-			printf(">>> %s BITMAP: Bit %d already set!\n",timestamp_str(),bit);
+		      LOG_DEBUG(LOG_BITMAP,"Bit %d already set!",bit);
 		    
 		    peer_records[i]->request_bitmap[bit>>3]|=(1<<(bit&7));
 		    bit++; bytes_remaining-=64; block_offset+=64;
 		  }
 	      } else {
-	      if (debug_bitmap)
-		printf(">>> %s NOT Marking [%d,%d) sent (start_offset<bitmap offset).\n",
-		       timestamp_str(),start_offset,start_offset+bytes);
+	      LOG_DEBUG(LOG_BITMAP,"NOT Marking [%d,%d) sent (start_offset<bitmap offset).",
+			start_offset,start_offset+bytes);
 	    }
 	  } else {
 	    if (peer_records[i]) {
-	      if (debug_bitmap) printf(">>> %s NOT Marking [%d,%d) sent to peer #%d(%s*) (no matching bitmap: %d vs %d).\n",
-			    timestamp_str(),start_offset,start_offset+bytes,
-			    i,peer_records[i]->sid_prefix,
-			    peer_records[i]->request_bitmap_bundle,bundle_number);
+	      LOG_DEBUG(LOG_BITMAP,"NOT Marking [%d,%d) sent to peer #%d(%s*) (no matching bitmap: %d vs %d).",
+			start_offset,start_offset+bytes,
+			i,peer_records[i]->sid_prefix,
+			peer_records[i]->request_bitmap_bundle,bundle_number);
 	      if (peer_records[i]->tx_bundle==bundle_number)
-		if (debug_bitmap) printf(">>> %s ... but I should care about marking it, because it matches the bundle I am sending.\n",timestamp_str());
+		LOG_DEBUG(LOG_BITMAP,"... but I should care about marking it, because it matches the bundle I am sending.");
 	      if (peer_records[i]->tx_bundle==-1)
 		// In fact, if we see someone sending a bundle to someone, and we don't yet know if we can send it yet, we should probably start on a speculative basis
-		if (debug_bitmap)
-		  printf(">>> %s ... but I could care about marking it, because I am not sending a bundle to them yet.\n",timestamp_str());
+		LOG_DEBUG(LOG_BITMAP,"... but I could care about marking it, because I am not sending a bundle to them yet.");
 	    }
 	  }
 	}
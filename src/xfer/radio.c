@@ -37,8 +37,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "golay.h"
 #include "fec-3.0.1/fixed.h"
-void encode_rs_8(data_t *data, data_t *parity,int pad);
-int decode_rs_8(data_t *data, int *eras_pos, int no_eras, int pad);
+#include "rs_fast.h"
 #define FEC_LENGTH 32
 #define FEC_MAX_BYTES 223
 
@@ -120,7 +119,7 @@ int radio_send_message(int serialfd, unsigned char *buffer,int length)
 	    __FUNCTION__,length,FEC_MAX_BYTES);
     return -1;
   }
-  encode_rs_8(buffer,parity,FEC_MAX_BYTES-length);
+  encode_rs_8_fast(buffer,parity,FEC_MAX_BYTES-length);
   
   // Then, the packet body
   bcopy(buffer,&out[offset],length);
@@ -142,6 +141,8 @@ int radio_send_message(int serialfd, unsigned char *buffer,int length)
 
   // Don't forget to count our own transmissions
   radio_transmissions_byus++;
+  METRIC_INC(packets_sent);
+  METRIC_ADD(packet_bytes_sent,offset);
 
   return 0;
 }
@@ -180,10 +181,49 @@ int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
 	       char *my_sid_hex,char *prefix,
 	       char *servald_server,char *credential)
 {
-  if (debug_radio) dump_bytes(stdout,"packet before decode_rs",packet_data,packet_bytes);
+  return saw_packet_with_erasures(packet_data,packet_bytes,rssi,NULL,0,
+				  my_sid_hex,prefix,servald_server,credential);
+}
+
+// RS decode a received packet (body then parity) in place.  erasures[] lists
+// the bytes we know are missing, so that the decoder can spend the parity on
+// filling them in.  Returns the number of other bytes it corrected, or -1 if
+// the packet can't be trusted.
+int rs_decode_packet(unsigned char *packet_data,int packet_bytes,
+		     int *erasures,int erasure_count)
+{
+  int eras_pos[FEC_LENGTH];
+  
+  if (packet_bytes<=FEC_LENGTH||packet_bytes>FEC_MAX_BYTES+FEC_LENGTH) return -1;
+  if (erasure_count>RS_MAX_ERASURES) return -1;
+  // The decoder counts positions from the start of the (padded) RS block
+  int pad=FEC_MAX_BYTES-packet_bytes+FEC_LENGTH;
+  for(int i=0;i<erasure_count;i++) eras_pos[i]=erasures[i]+pad;
   
-  int rs_error_count = decode_rs_8(packet_data,NULL,0,
-				   FEC_MAX_BYTES-packet_bytes+FEC_LENGTH);
+  int rs_error_count = decode_rs_8_fast(packet_data,eras_pos,erasure_count,pad);
+  if (rs_error_count<0) return -1;
+  // An error in the padding means this isn't really a packet this long, e.g.,
+  // one with the end cut off, which otherwise looks like a shifted codeword.
+  for(int i=0;i<rs_error_count;i++) if (eras_pos[i]<pad) return -1;
+  // The erasures don't count against the errors we are prepared to believe,
+  // but together they must leave some parity spare, else any old rubbish
+  // would decode.
+  rs_error_count-=erasure_count;
+  if (erasure_count&&(2*rs_error_count+erasure_count>RS_MAX_ERASURES)) return -1;
+  return rs_error_count;
+}
+
+// As saw_packet(), but we also know which bytes of the packet are missing
+// (e.g., from HF fragments that never arrived).
+int saw_packet_with_erasures(unsigned char *packet_data,int packet_bytes,int rssi,
+			     int *erasures,int erasure_count,
+			     char *my_sid_hex,char *prefix,
+			     char *servald_server,char *credential)
+{
+  if (debug_radio) dump_bytes(stdout,"packet before decode_rs",packet_data,packet_bytes);
+
+  int rs_error_count = rs_decode_packet(packet_data,packet_bytes,
+					erasures,erasure_count);
   
   if (debug_radio) dump_bytes(stdout,"received packet",packet_data,packet_bytes);
 
@@ -197,6 +237,8 @@ int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
   }
   
   if (rs_error_count>=0&&rs_error_count<8) {
+    METRIC_INC(packets_received);
+    METRIC_ADD(rs_corrected_symbols,rs_error_count);
     if (0) printf("CHECKPOINT: %s:%d %s() error counts = %d for packet of %d bytes.\n",
 		  __FILE__,__LINE__,__FUNCTION__,
 		  rs_error_count,packet_bytes);
@@ -225,6 +267,7 @@ int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
       }
     return 0;
   } else {
+    METRIC_INC(packets_rejected);
     if (debug_radio) {
       if (message_buffer_length) message_buffer_length--; // chop NL
       message_buffer_length+=
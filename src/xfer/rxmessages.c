@@ -96,6 +96,9 @@ int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
       free_peer(peer_records[peer_index]);
       peer_records[peer_index]=p;
     }
+    // Bundles addressed to this peer now deserve higher priority
+    bundle_priorities_invalidate();
+    status_changed();
   }
   
   // Update time stamp and most recent message from peer
@@ -105,7 +108,7 @@ int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
     // something more profound has happened.
     p->missed_packet_count+=msg_number-p->last_message_number-1;
   }
-  p->last_message_time=time(0);
+  p->last_message_time=now_ms/1000;
   if (!is_retransmission) p->last_message_number=msg_number;
 
   // Update RSSI log for this sender